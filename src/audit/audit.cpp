@@ -1,5 +1,6 @@
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <string>
@@ -18,6 +19,11 @@ namespace hpfs::audit
 {
     constexpr int FILE_PERMS = 0644;
 
+    // Zero bytes used to pad log records upto the block data boundary.
+    constexpr uint8_t PADDING_BYTES[BLOCK_SIZE] = {};
+
+    std::atomic<uint64_t> log_removal_count = 0;
+
     int audit_logger::create(std::optional<audit_logger> &logger, const LOG_MODE mode, std::string_view log_file_path)
     {
         logger.emplace(mode, log_file_path);
@@ -36,6 +42,39 @@ namespace hpfs::audit
     }
 
     int audit_logger::init()
+    {
+        if (open_log_file() == -1)
+            return -1;
+
+        // Log compaction may replace the log file while we wait for the session lock. In that case the session lock
+        // is held on a file which is no longer the log file. So we start over with the new log file.
+        while (mode != LOG_MODE::MERGE && mode != LOG_MODE::PRINT && is_log_file_replaced())
+        {
+            release_lock(session_lock);
+            close(fd);
+            if (open_log_file() == -1)
+                return -1;
+        }
+
+        if (init_log_header() == -1)
+        {
+            release_lock(session_lock);
+            close(fd);
+            return -1;
+        }
+
+        LOG_DEBUG << "Initialized log file. first:" << header.first_record
+                  << " last:" << header.last_record
+                  << " lastchk:" << header.last_checkpoint;
+        initialized = true;
+        return 0;
+    }
+
+    /**
+     * Opens the log file and acquires the session lock relevant to the log mode.
+     * @return 0 on success. -1 on error.
+     */
+    int audit_logger::open_log_file()
     {
         // Open or create the log file.
         const int res = open(hpfs::ctx.log_file_path.c_str(), O_CREAT | O_RDWR, FILE_PERMS);
@@ -74,20 +113,19 @@ namespace hpfs::audit
             return -1;
         }
 
-        if (init_log_header() == -1)
-        {
-            release_lock(session_lock);
-            close(fd);
-            return -1;
-        }
-
-        LOG_DEBUG << "Initialized log file. first:" << header.first_record
-                  << " last:" << header.last_record
-                  << " lastchk:" << header.last_checkpoint;
-        initialized = true;
         return 0;
     }
 
+    /**
+     * Checks whether the opened log file is no longer at the log file path.
+     */
+    bool audit_logger::is_log_file_replaced()
+    {
+        struct stat fd_st, path_st;
+        return fstat(fd, &fd_st) == 0 && stat(hpfs::ctx.log_file_path.c_str(), &path_st) == 0 &&
+               (fd_st.st_dev != path_st.st_dev || fd_st.st_ino != path_st.st_ino);
+    }
+
     int audit_logger::get_fd()
     {
         return fd;
@@ -171,19 +209,21 @@ namespace hpfs::audit
                   << " last_chk:" << std::to_string(header.last_checkpoint)
                   << " eof:" << std::to_string(eof) << "\n";
 
-        off_t log_offset = 0;
+        log_cursor cursor;
         uint64_t total_records = 0;
 
-        do
+        while (true)
         {
             log_record record;
-            if (read_log_at(log_offset, log_offset, record) == -1)
+            std::vector<uint8_t> payload;
+            const int res = read_log_next(cursor, record, payload);
+            if (res == -1)
             {
                 std::cerr << errno << ": Error occured when reading log.\n";
                 return;
             }
 
-            if (log_offset == -1) // No log record was read. We are at end of log.
+            if (res == 0) // No log record was read. We are at end of log.
                 break;
 
             total_records++;
@@ -197,24 +237,23 @@ namespace hpfs::audit
                       << ", root_hash: " << record.root_hash
                       << ", total_size: " << record.size
                       << "\n";
-
-        } while (log_offset > 0);
+        }
 
         std::cout << "Total records: " << std::to_string(total_records) << "\n";
     }
 
-    int audit_logger::set_lock(struct flock &lock, const LOCK_TYPE type)
+    int audit_logger::set_lock(struct flock &lock, const LOCK_TYPE type, const bool wait)
     {
         if (type == LOCK_TYPE::SESSION_LOCK)
-            return util::set_lock(fd, lock, false, 0, 1); // Read lock first byte.
+            return util::set_lock(fd, lock, false, 0, 1, wait); // Read lock first byte.
         else if (type == LOCK_TYPE::UPDATE_LOCK)
-            return util::set_lock(fd, lock, true, 1, 1); // Write lock second byte.
+            return util::set_lock(fd, lock, true, 1, 1, wait); // Write lock second byte.
         else if (type == LOCK_TYPE::MERGE_LOCK)
-            return util::set_lock(fd, lock, true, 0, 2); // Write lock inclusive of both bytes above.
+            return util::set_lock(fd, lock, true, 0, 2, wait); // Write lock inclusive of both bytes above.
         else if (type == LOCK_TYPE::SYNC_WRITE_LOCK)
-            return util::set_lock(fd, lock, true, 0, 2); // Sync write lock inclusive of both bytes above.
+            return util::set_lock(fd, lock, true, 0, 2, wait); // Sync write lock inclusive of both bytes above.
         else if (type == LOCK_TYPE::SYNC_READ_LOCK)
-            return util::set_lock(fd, lock, false, 0, 1); // Sync read lock first byte.
+            return util::set_lock(fd, lock, false, 0, 1, wait); // Sync read lock first byte.
 
         return -1;
     }
@@ -244,95 +283,13 @@ namespace hpfs::audit
             return -1;
         }
 
+        uncommitted_records = 0;
         LOG_DEBUG << "Header updated. first:" << header.first_record
                   << " last:" << header.last_record
                   << " lastchk:" << header.last_checkpoint;
         return 0;
     }
 
-    /**
-     * Append the new log record at the end of the log file
-     * @return Returns the offset at the start of the new log record. 0 if error.
-    */
-    off_t audit_logger::append_log(log_record_header &rh, std::string_view vpath, const FS_OPERATION operation, const iovec *payload_buf,
-                                   const iovec *data_bufs, const int data_buf_count)
-    {
-        rh = {};
-        rh.timestamp = util::epoch();
-        rh.operation = operation;
-        rh.vpath_len = vpath.length();
-        rh.payload_len = payload_buf ? payload_buf->iov_len : 0;
-        rh.block_data_len = 0;
-
-        // Calculate total block data length.
-        if (data_bufs != NULL && data_buf_count > 0)
-        {
-            for (int i = 0; i < data_buf_count; i++)
-            {
-                iovec block_buf = data_bufs[i];
-                rh.block_data_len += block_buf.iov_len;
-            }
-        }
-
-        const log_record_metrics lm = get_metrics(rh);
-
-        // Log record buffer collection that will be written to the file.
-        std::vector<iovec> record_bufs;
-        record_bufs.push_back({&rh, sizeof(rh)});                      // Header
-        record_bufs.push_back({(void *)vpath.data(), vpath.length()}); // Vpath
-
-        if (payload_buf)
-            record_bufs.push_back(*payload_buf);
-
-        // Append log record at current end of file.
-        if (ftruncate(fd, eof + lm.total_size) == -1 || // Extend the file size to fit entire record.
-            pwritev(fd, record_bufs.data(), record_bufs.size(), eof) == -1)
-        {
-            LOG_ERROR << errno << ": Error appending log record.";
-            return 0;
-        }
-
-        // Append block data bufs.
-        // Block data must start at the next clean block after log header data and payload.
-        if (write_data_bufs(data_bufs, data_buf_count, (eof + lm.block_data_offset)) == -1)
-        {
-            LOG_ERROR << errno << ": Error when overwriting data buffers at " << (eof + lm.block_data_offset);
-            return 0;
-        }
-
-        // Update log file header.
-        if (header.first_record == 0)
-            header.first_record = eof;
-        header.last_record = eof;
-
-        flock header_lock;
-        if (set_lock(header_lock, LOCK_TYPE::UPDATE_LOCK) == -1 ||
-            commit_header() == -1 ||
-            release_lock(header_lock) == -1)
-        {
-            LOG_ERROR << errno << ": Error updating header during append log.";
-            return 0;
-        }
-
-        // Saving the starting offset of the log record.
-        const off_t log_rec_start_offset = eof;
-        // Calculate new end of file.
-        eof += lm.total_size;
-
-        LOG_DEBUG << "Appended log record."
-                  << " ts:" << std::to_string(rh.timestamp)
-                  << ", op:" << std::to_string(rh.operation)
-                  << ", " << vpath
-                  << ", payload_len: " << std::to_string(rh.payload_len)
-                  << ", blkdata_len: " << std::to_string(rh.block_data_len);
-
-        if (!last_op)
-            last_op = fs_operation_summary{};
-        last_op->update(vpath, rh, payload_buf);
-
-        return log_rec_start_offset;
-    }
-
     /**
      * Overwrite the provided buffers for operation payload and data buffers of the last log record
      * @param payload_write_offset Offset to write payload buffer relative to log record offset.
@@ -382,6 +339,170 @@ namespace hpfs::audit
         return 0;
     }
 
+    /**
+     * Writes a contiguous log record made of the specified buffers at the specified offset using as few
+     * pwritev calls as possible. Null buffers indicate null bytes which are not physically written.
+     * @param record_bufs Record buffers in the order they should appear in the log file.
+     * @param begin_offset Log file offset to write the record at.
+     * @param total_size Total size of the record. The log file is extended to include the full record.
+     * @return 0 on success. -1 on error.
+     */
+    int audit_logger::write_record_bufs(const std::vector<iovec> &record_bufs, const off_t begin_offset, const size_t total_size)
+    {
+        off_t write_offset = begin_offset; // Log file offset of the next buffer.
+        off_t written_upto = begin_offset; // End offset of the physically written bytes.
+        size_t run_start = 0;              // Index of the first buffer of the current contiguous run.
+
+        for (size_t i = 0; i <= record_bufs.size(); i++)
+        {
+            if (i < record_bufs.size() && record_bufs[i].iov_base)
+                continue;
+
+            // A null buffer or the end of list terminates the current run. Write the run with pwritev.
+            while (run_start < i)
+            {
+                const int iov_count = MIN(i - run_start, (size_t)IOV_MAX);
+                if (pwritev(fd, record_bufs.data() + run_start, iov_count, write_offset) == -1)
+                    return -1;
+
+                for (int j = 0; j < iov_count; j++)
+                    write_offset += record_bufs[run_start + j].iov_len;
+                run_start += iov_count;
+                written_upto = write_offset;
+            }
+
+            // Null bytes are skipped. They will read as zeros once the file is extended.
+            if (i < record_bufs.size())
+            {
+                write_offset += record_bufs[i].iov_len;
+                run_start = i + 1;
+            }
+        }
+
+        // If the record tail was not physically written, extend the file size to include the entire record.
+        const off_t record_end = begin_offset + total_size;
+        if (written_upto < record_end && ftruncate(fd, record_end) == -1)
+        {
+            LOG_ERROR << errno << ": Error in extending log file size.";
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /**
+     * Appends a batch of log records with a single sequential write and a single header commit.
+     * @param entries Log records to append. Populated with the written header and the offset of each record.
+     * @param defer_commit Whether the header commit may be deferred within the commit batch limits.
+     * @return 0 on success. -1 on error.
+     */
+    int audit_logger::append_logs(std::vector<log_append_entry> &entries, const bool defer_commit)
+    {
+        if (entries.empty())
+            return 0;
+
+        std::vector<iovec> record_bufs;
+        off_t record_offset = eof;
+
+        for (log_append_entry &entry : entries)
+        {
+            log_record_header &rh = entry.rh;
+            rh = {};
+            rh.timestamp = util::epoch();
+            rh.operation = entry.operation;
+            rh.vpath_len = entry.vpath.length();
+            rh.payload_len = entry.payload_buf.iov_len;
+            rh.root_hash = entry.root_hash;
+            for (const iovec &data_buf : entry.data_bufs)
+                rh.block_data_len += data_buf.iov_len;
+
+            const log_record_metrics lm = get_metrics(rh);
+
+            record_bufs.push_back({&rh, sizeof(rh)});                                  // Header
+            record_bufs.push_back({(void *)entry.vpath.data(), entry.vpath.length()}); // Vpath
+            if (rh.payload_len > 0)
+                record_bufs.push_back(entry.payload_buf);
+
+            // Every record must end at a clean block. So we pad the gap after the payload.
+            const off_t payload_end_offset = lm.payload_offset + rh.payload_len;
+            const size_t padding_len = BLOCK_END(payload_end_offset) - payload_end_offset;
+            if (padding_len > 0)
+                record_bufs.push_back({(void *)PADDING_BYTES, padding_len});
+
+            // Block data bufs.
+            record_bufs.insert(record_bufs.end(), entry.data_bufs.begin(), entry.data_bufs.end());
+
+            entry.offset = record_offset;
+            record_offset += lm.total_size;
+        }
+
+        if (write_record_bufs(record_bufs, eof, record_offset - eof) == -1)
+        {
+            LOG_ERROR << errno << ": Error appending log record batch at " << eof;
+            return -1;
+        }
+
+        // Update log file header.
+        if (header.first_record == 0)
+            header.first_record = entries.front().offset;
+        header.last_record = entries.back().offset;
+        eof = record_offset;
+
+        if (commit_appended_header(entries.size()) == -1 || (!defer_commit && flush_header() == -1))
+        {
+            LOG_ERROR << errno << ": Error updating header during batch append log.";
+            return -1;
+        }
+
+        LOG_DEBUG << "Appended " << entries.size() << " log records.";
+
+        const log_append_entry &last_entry = entries.back();
+        if (!last_op)
+            last_op = fs_operation_summary{};
+        last_op->update(last_entry.vpath, last_entry.rh, last_entry.payload_buf.iov_len > 0 ? &last_entry.payload_buf : NULL);
+
+        return 0;
+    }
+
+    /**
+     * Commits the header after log record appends. With a commit batch size greater than 1 the header commit is
+     * deferred until the batch is full or the commit window has elapsed. Deferred commits of an idle writer are
+     * flushed by the owner of the logger with flush_header().
+     * @param record_count No. of log records appended since the last call.
+     * @return 0 on success. -1 on error.
+     */
+    int audit_logger::commit_appended_header(const size_t record_count)
+    {
+        if (uncommitted_records == 0)
+            batch_start = util::epoch();
+        uncommitted_records += record_count;
+
+        const bool batch_full = uncommitted_records >= MAX(ctx.log_commit_batch, 1);
+        const bool window_elapsed = (util::epoch() - batch_start) >= ctx.log_commit_window;
+        if (!batch_full && !window_elapsed)
+            return 0;
+
+        return flush_header();
+    }
+
+    /**
+     * Commits any header updates which have been deferred by batched commits.
+     * @return 0 on success. -1 on error.
+     */
+    int audit_logger::flush_header()
+    {
+        if (uncommitted_records == 0)
+            return 0;
+
+        flock header_lock;
+        if (set_lock(header_lock, LOCK_TYPE::UPDATE_LOCK) == -1 ||
+            commit_header() == -1 ||
+            release_lock(header_lock) == -1)
+            return -1;
+
+        return 0;
+    }
+
     /**
      * Writes the specified data buf segments and the specified offset at the log file.
      * @return 0 on success. -1 on error.
@@ -475,14 +596,94 @@ namespace hpfs::audit
     }
 
     /**
-     * Reads the log record indicated by the offset as a buffer if a record exists at that offset.
+     * Reads the log record at the cursor position and advances the cursor to the next log record.
+     * Log file is read in windows of the cursor window size and block data of the records are skipped. A window refill
+     * never reads beyond the block data offset of the record being read, so the block data are not read ahead.
+     * @param cursor Log cursor. Starts with the first record if the cursor offset is 0.
+     * @param record Contains the log record if read successful.
+     * @param payload Contains the payload of the log record if read successful.
+     * @return 1 if a log record was read. 0 if there are no more log records. -1 on error.
+     */
+    int audit_logger::read_log_next(log_cursor &cursor, log_record &record, std::vector<uint8_t> &payload)
+    {
+        if (cursor.offset == -1 || header.first_record == 0 || cursor.offset > header.last_record)
+        {
+            cursor.offset = -1;
+            return 0;
+        }
+
+        const off_t read_offset = cursor.offset == 0 ? header.first_record : cursor.offset;
+
+        log_record_header rh;
+        if (fill_log_cursor_window(cursor, read_offset, sizeof(rh), eof) == -1)
+            return -1;
+        memcpy(&rh, cursor.window.data() + (read_offset - cursor.window_offset), sizeof(rh));
+
+        // Make sure the vpath and the payload are in the window as well. If the window needs to be refilled
+        // it stops at the block data. Next record is read with a new window from the end of the block data.
+        const log_record_metrics lm = get_metrics(rh);
+        const off_t window_end = rh.block_data_len == 0 ? eof : (read_offset + lm.block_data_offset);
+        if (fill_log_cursor_window(cursor, read_offset, lm.payload_offset + rh.payload_len, window_end) == -1)
+            return -1;
+        const uint8_t *record_ptr = cursor.window.data() + (read_offset - cursor.window_offset);
+
+        record.offset = read_offset;
+        record.size = lm.total_size;
+        record.timestamp = rh.timestamp;
+        record.operation = rh.operation;
+        record.payload_len = rh.payload_len;
+        record.payload_offset = record.offset + lm.payload_offset;
+        record.block_data_len = rh.block_data_len;
+        record.block_data_offset = rh.block_data_len == 0 ? 0 : (record.offset + lm.block_data_offset);
+        record.root_hash = rh.root_hash;
+        record.vpath.assign((char *)record_ptr + lm.vpath_offset, rh.vpath_len);
+        payload.assign(record_ptr + lm.payload_offset, record_ptr + lm.payload_offset + rh.payload_len);
+
+        cursor.offset = (record.offset + record.size == eof) ? -1 : (record.offset + record.size);
+        return 1;
+    }
+
+    /**
+     * Makes sure the cursor window contains the specified log file range. Window is refilled starting from the
+     * range offset if the range is not already in the window.
+     * @param end_offset Log file offset the read-ahead must not go beyond.
+     * @return 0 on success. -1 on error.
+     */
+    int audit_logger::fill_log_cursor_window(log_cursor &cursor, const off_t offset, const size_t len, const off_t end_offset)
+    {
+        if (offset >= cursor.window_offset && (offset + len) <= (cursor.window_offset + cursor.window_len))
+            return 0;
+
+        // Read-ahead grows with each refill. We don't read ahead beyond the end offset.
+        const size_t read_ahead = MIN(cursor.window_size, MAX(LOG_CURSOR_MIN_READ_AHEAD, cursor.window_len * 2));
+        const size_t available_len = offset < end_offset ? (end_offset - offset) : 0;
+        const size_t read_len = MAX(len, MIN(read_ahead, available_len));
+        if (cursor.window.size() < read_len)
+            cursor.window.resize(read_len);
+
+        const ssize_t res = pread(fd, cursor.window.data(), read_len, offset);
+        if (res < (ssize_t)len)
+        {
+            LOG_ERROR << errno << ": Error reading log file window at " << offset;
+            cursor.window_len = 0;
+            return -1;
+        }
+
+        cursor.window_offset = offset;
+        cursor.window_len = res;
+        return 0;
+    }
+
+    /**
+     * Reads the log file locations of the log record indicated by the offset if a record exists at that offset.
+     * The record data itself is not read so the caller can read it directly from the log file.
      * @param offset Log record offset to be read. If 0 current first record will be read.
      * @param next_offset Indicates the offset of next log record if read succesful or -1 if
      *                    no record available at 'offset'. If the record is the last record then next_offset is 0.
-     * @param buf Contains the log record buffer if read successful.
+     * @param extent Contains the log record locations if read successful.
      * @return 0 on successful read or no record available. -1 on error.
      */
-    int audit_logger::read_log_record_buf_at(const off_t offset, off_t &next_offset, std::string &buf)
+    int audit_logger::read_log_record_extent_at(const off_t offset, off_t &next_offset, log_record_extent &extent)
     {
         if (header.first_record == 0 || offset > header.last_record)
         {
@@ -502,39 +703,10 @@ namespace hpfs::audit
 
         const log_record_metrics lm = get_metrics(rh);
 
-        buf.resize(lm.unpadded_size);
-        memcpy(buf.data(), &rh, sizeof(rh));
-        size_t buf_offset = sizeof(rh);
-
-        // Reading the vpath.
-        if (pread(fd, buf.data() + buf_offset, rh.vpath_len, read_offset + lm.vpath_offset) < rh.vpath_len)
-        {
-            LOG_ERROR << errno << ": Error reading log record vpath from log file.";
-            return -1;
-        }
-        buf_offset += rh.vpath_len;
-
-        // Reading the payload.
-        if (rh.payload_len > 0)
-        {
-            if (pread(fd, buf.data() + buf_offset, rh.payload_len, read_offset + lm.payload_offset) < rh.payload_len)
-            {
-                LOG_ERROR << errno << ": Error reading log record payload from log file.";
-                return -1;
-            }
-            buf_offset += rh.payload_len;
-        }
-
-        // Reading the block data.
-        if (rh.block_data_len > 0)
-        {
-            if (pread(fd, buf.data() + buf_offset, rh.block_data_len, read_offset + lm.block_data_offset) < rh.block_data_len)
-            {
-                LOG_ERROR << errno << ": Error reading log record block data from log file.";
-                return -1;
-            }
-            buf_offset += rh.block_data_len;
-        }
+        extent.meta_offset = read_offset;
+        extent.meta_len = sizeof(rh) + rh.vpath_len + rh.payload_len;
+        extent.block_data_offset = read_offset + lm.block_data_offset;
+        extent.block_data_len = rh.block_data_len;
 
         next_offset = read_offset + lm.total_size;
         // If there's no more log records next offset is 0.
@@ -559,18 +731,26 @@ namespace hpfs::audit
         return 0;
     }
 
-    int audit_logger::purge_log(const log_record &record)
+    /**
+     * Purges a run of log records from the front of the log and updates the header once for the run.
+     * @param begin_offset Begin offset of the first log record of the run. This must be the first record of the log.
+     * @param end_offset End offset of the last log record of the run. (Offset of the record following the run)
+     * @return 0 on success. -1 on error.
+     */
+    int audit_logger::purge_logs(const off_t begin_offset, const off_t end_offset)
     {
-        LOG_DEBUG << "Purging log record... [ts:" << record.timestamp << " path:" << record.vpath << " op:" << record.operation << "]";
+        LOG_DEBUG << "Purging log records... [" << begin_offset << " - " << end_offset << "]";
+
+        log_removal_count++;
 
         if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-                      record.offset, record.size) == -1)
+                      begin_offset, end_offset - begin_offset) == -1)
         {
-            LOG_ERROR << errno << ": fallocate error in purging log record.";
+            LOG_ERROR << errno << ": fallocate error in purging log records.";
             return -1;
         }
 
-        if (record.offset == header.last_record) // This was the last remaining record
+        if (end_offset > header.last_record) // The last remaining record was purged.
         {
             header.first_record = 0;
             header.last_record = 0;
@@ -579,7 +759,7 @@ namespace hpfs::audit
         else
         {
             // Shift the first record offset forward.
-            header.first_record = record.offset + record.size;
+            header.first_record = end_offset;
         }
 
         if (commit_header() == -1)
@@ -588,11 +768,138 @@ namespace hpfs::audit
             return -1;
         }
 
-        LOG_DEBUG << "Purge record complete.";
+        LOG_DEBUG << "Purge records complete.";
 
         return 0;
     }
 
+    /**
+     * Removes the purged space at the front of the log file so the log file does not keep growing with holes.
+     * Remaining log records are moved to the start of the log data area and the header offsets are rewritten to match.
+     * Records are written to a new log file which then replaces the log file. The log file is never modified in place
+     * since its header and records would not agree with each other if we crash midway.
+     * Must be called while holding the merge lock.
+     * @param min_size Minimum purged size worth compacting the log file with remaining records.
+     * @return No. of bytes removed from the log file. -1 on error.
+     */
+    off_t audit_logger::compact_log(const size_t min_size)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+        {
+            LOG_ERROR << errno << ": Error in stat of log file.";
+            return -1;
+        }
+
+        const off_t data_offset = BLOCK_END(version::VERSION_BYTES_LEN + sizeof(header));
+        const off_t live_offset = header.first_record == 0 ? st.st_size : header.first_record;
+        const off_t purged_size = live_offset - data_offset;
+        if (purged_size <= 0 || (header.first_record > 0 && (size_t)purged_size < min_size))
+            return 0;
+
+        LOG_DEBUG << "Compacting log... [" << data_offset << " - " << live_offset << "]";
+
+        // No records left. So the purged space is simply dropped.
+        if (header.first_record == 0)
+        {
+            log_removal_count++;
+            if (ftruncate(fd, data_offset) == -1)
+            {
+                LOG_ERROR << errno << ": Error truncating log file at offset: " << data_offset;
+                return -1;
+            }
+
+            eof = data_offset;
+            return purged_size;
+        }
+
+        const log_header purged_header = header;
+        header.first_record -= purged_size;
+        header.last_record -= purged_size;
+        if (header.last_checkpoint > 0)
+            header.last_checkpoint = MAX(header.last_checkpoint, live_offset) - purged_size;
+
+        if (rewrite_log_file(live_offset, st.st_size) == -1)
+        {
+            LOG_ERROR << errno << ": Error in compacting log file.";
+            header = purged_header;
+            return -1;
+        }
+
+        eof = st.st_size - purged_size;
+        LOG_DEBUG << "Compaction complete. " << purged_size << " bytes removed.";
+        return purged_size;
+    }
+
+    /**
+     * Writes the in-memory header and the log records from the given offset onwards to a new log file and replaces the
+     * log file with it. The logger continues with the new log file. New log file is synced before and after the rename.
+     * So after a crash we either have the old log file or the complete new one.
+     * @param live_offset Offset of the first log record to keep.
+     * @param file_size Size of the current log file.
+     * @return 0 on success. -1 on error.
+     */
+    int audit_logger::rewrite_log_file(const off_t live_offset, const off_t file_size)
+    {
+        const std::string new_file_path = hpfs::ctx.log_file_path + ".compact";
+        const int new_fd = open(new_file_path.c_str(), O_CREAT | O_TRUNC | O_RDWR, FILE_PERMS);
+        if (new_fd == -1)
+        {
+            LOG_ERROR << errno << ": Error creating compacted log file.";
+            return -1;
+        }
+
+        const int old_fd = fd;
+        fd = new_fd;
+
+        // New log file gets locked before it replaces the log file. So sessions which open the new log file wait until
+        // the lock held on the old log file is released.
+        flock new_lock;
+        bool success = set_lock(new_lock, LOCK_TYPE::MERGE_LOCK, false) != -1 &&
+                       pwrite(fd, version::HP_VERSION_BYTES, version::VERSION_BYTES_LEN, 0) == version::VERSION_BYTES_LEN &&
+                       commit_header() != -1;
+
+        // Only the data extents are copied so the holes within the log records remain holes in the new log file.
+        const off_t shift = live_offset - header.first_record;
+        loff_t read_offset = live_offset;
+        while (success && read_offset < file_size)
+        {
+            const off_t data_start = lseek(old_fd, read_offset, SEEK_DATA);
+            if (data_start == -1)
+            {
+                success = (errno == ENXIO); // No more data until the end of file.
+                break;
+            }
+
+            const off_t data_end = MIN(file_size, lseek(old_fd, data_start, SEEK_HOLE));
+            read_offset = data_start;
+            loff_t write_offset = data_start - shift;
+            while (success && read_offset < data_end)
+                success = copy_file_range(old_fd, &read_offset, fd, &write_offset, data_end - read_offset, 0) > 0;
+        }
+
+        if (!success || ftruncate(fd, file_size - shift) == -1 || fsync(fd) == -1 ||
+            rename(new_file_path.c_str(), hpfs::ctx.log_file_path.c_str()) == -1)
+        {
+            LOG_ERROR << errno << ": Error writing compacted log file.";
+            close(fd);
+            unlink(new_file_path.c_str());
+            fd = old_fd;
+            return -1;
+        }
+
+        // Persist the rename. The new log file is already in place. So a failure here is not reverted.
+        const int dir_fd = open(util::get_parent_path(hpfs::ctx.log_file_path).c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir_fd == -1 || fsync(dir_fd) == -1)
+            LOG_ERROR << errno << ": Error syncing log file dir after compaction.";
+        if (dir_fd != -1)
+            close(dir_fd);
+
+        // This releases the locks held on the old log file as well.
+        close(old_fd);
+        return 0;
+    }
+
     int audit_logger::update_log_record_hash(const off_t log_rec_start_offset, const hmap::hasher::h32 root_hash, log_record_header &rh)
     {
         if (header.first_record == 0 || log_rec_start_offset > header.last_record)
@@ -664,6 +971,7 @@ namespace hpfs::audit
             return 0;
         }
 
+        log_removal_count++;
         if (ftruncate(fd, truncate_offset) == -1) // Truncate the file.
         {
             LOG_ERROR << errno << ": Error truncating log file at offset: " << truncate_offset;
@@ -725,6 +1033,9 @@ namespace hpfs::audit
                 }
             }
 
+            // Commit any deferred header updates.
+            flush_header();
+
             if (mode == LOG_MODE::RW ||
                 mode == LOG_MODE::RO)
                 release_lock(session_lock);
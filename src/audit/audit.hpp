@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <vector>
 #include <optional>
+#include <atomic>
 #include "../hpfs.hpp"
 #include "../hmap/hasher.hpp"
 
@@ -44,6 +45,10 @@ namespace hpfs::audit
         SYNC_READ_LOCK   // Used by LOG_SYNC_READ session to acquire non exclusive read access to the log.
     };
 
+    // No. of times log records were removed in place (purge, truncation) by this process. Lets the log readers which
+    // don't hold a log lock detect that the log file locations they have collected may no longer hold those records.
+    extern std::atomic<uint64_t> log_removal_count;
+
     struct log_header
     {
         // Begin offset of the first log record. 0 indicates there are no records.
@@ -81,6 +86,28 @@ namespace hpfs::audit
         hmap::hasher::h32 root_hash = hmap::hasher::h32_empty;
     };
 
+    // A log record to be appended with a batch append.
+    struct log_append_entry
+    {
+        std::string_view vpath;
+        FS_OPERATION operation = FS_OPERATION::MKDIR;
+        iovec payload_buf = {NULL, 0};
+        std::vector<iovec> data_bufs; // Block data segments. Null segments indicate null bytes.
+        hmap::hasher::h32 root_hash = hmap::hasher::h32_empty; // Root hash to be written with the record.
+
+        log_record_header rh; // Header of the appended record.
+        off_t offset = 0;     // Offset of the appended record.
+    };
+
+    // Log file locations of the parts of a log record without the block alignment padding.
+    struct log_record_extent
+    {
+        off_t meta_offset = 0; // Offset of the record header. Vpath and payload follow the header contiguously.
+        size_t meta_len = 0;   // Total length of the header, vpath and payload.
+        off_t block_data_offset = 0;
+        size_t block_data_len = 0;
+    };
+
     struct log_record_metrics
     {
         off_t vpath_offset;          // Offset of the stored vpath relative to log record begin offset.
@@ -90,6 +117,24 @@ namespace hpfs::audit
         size_t unpadded_size = 0;    // Total unpadded size of the record exluding block alignment padding bytes.
     };
 
+    // Default max size of the read-ahead window of a log cursor.
+    constexpr size_t LOG_CURSOR_WINDOW_SIZE = 1024 * 1024; // 1MB
+
+    // Initial read-ahead size of a log cursor. Doubled on each refill upto the window size so short scans
+    // (eg. picking up a single new record) do not read a full window.
+    constexpr size_t LOG_CURSOR_MIN_READ_AHEAD = 16 * 1024; // 16KB
+
+    // Sequential log reading position along with a read-ahead window of the log file. Record headers, vpaths and
+    // payloads are served from the window so a sequential scan only reads the log once per window.
+    struct log_cursor
+    {
+        off_t offset = 0;                            // Offset of the next record to read. 0 means first record. -1 means end of log.
+        size_t window_size = LOG_CURSOR_WINDOW_SIZE; // Max no. of bytes to read ahead whenever the window needs to be refilled.
+        off_t window_offset = 0;                     // Log file offset of the first window byte.
+        size_t window_len = 0;                       // No. of valid bytes in the window.
+        std::vector<uint8_t> window;
+    };
+
     struct op_write_payload_header
     {
         size_t size = 0;  // Original write buffer size.
@@ -146,9 +191,17 @@ namespace hpfs::audit
         struct log_header header = {};               // The log file header loaded into memory.
         struct flock session_lock = {};              // Session lock placed on the log file.
         std::optional<fs_operation_summary> last_op; // Keeps track of the last-performed operation during this session to aid optimizations.
+        size_t uncommitted_records = 0;              // No. of appended records whose header update has been deferred.
+        int64_t batch_start = 0;                     // Timestamp of the first appended record of the current commit batch.
 
         int init();
+        int open_log_file();
+        bool is_log_file_replaced();
         int write_data_bufs(const iovec *data_bufs, const int data_buf_count, const off_t begin_offset);
+        int write_record_bufs(const std::vector<iovec> &record_bufs, const off_t begin_offset, const size_t total_size);
+        int commit_appended_header(const size_t record_count);
+        int fill_log_cursor_window(log_cursor &cursor, const off_t offset, const size_t len, const off_t end_offset);
+        int rewrite_log_file(const off_t live_offset, const off_t file_size);
 
     public:
         int init_log_header();
@@ -157,16 +210,18 @@ namespace hpfs::audit
         int get_fd();
         const log_header &get_header();
         void print_log();
-        int set_lock(struct flock &lock, const LOCK_TYPE type);
+        int set_lock(struct flock &lock, const LOCK_TYPE type, const bool wait = true);
         int release_lock(struct flock &lock);
         int read_header();
         int commit_header();
-        off_t append_log(log_record_header &log_record, std::string_view vpath, const FS_OPERATION operation, const iovec *payload_buf = NULL,
-                         const iovec *data_bufs = NULL, const int data_buf_count = 0);
+        int flush_header();
+        int append_logs(std::vector<log_append_entry> &entries, const bool defer_commit = false);
         int read_log_at(const off_t offset, off_t &next_offset, log_record &record);
-        int read_log_record_buf_at(const off_t offset, off_t &next_offset, std::string &buf);
+        int read_log_next(log_cursor &cursor, log_record &record, std::vector<uint8_t> &payload);
+        int read_log_record_extent_at(const off_t offset, off_t &next_offset, log_record_extent &extent);
         int read_payload(std::vector<uint8_t> &payload, const log_record &record);
-        int purge_log(const log_record &record);
+        int purge_logs(const off_t begin_offset, const off_t end_offset);
+        off_t compact_log(const size_t min_size);
         int update_log_record_hash(const off_t log_rec_start_offset, const hmap::hasher::h32 root_hash, log_record_header &rh);
         int overwrite_last_log_record_bytes(const off_t payload_write_offset, const off_t data_write_offset,
                                             const iovec *payload_buf, const iovec *data_bufs, const int data_buf_count,
@@ -1,8 +1,12 @@
 
+#include <sys/mman.h>
+#include <algorithm>
+#include <limits>
 #include "logger_index.hpp"
 #include "../tracelog.hpp"
 #include "../util.hpp"
 #include "../version.hpp"
+#include "../merger.hpp"
 
 /**
  * Log index file keeps offset and the root_hash of log records.
@@ -22,8 +26,11 @@ namespace hpfs::audit::logger_index
     constexpr const char *INDEX_WRITE_QUERY_FULLSTOP = "/::hpfs.index.write.";
     constexpr const int INDEX_WRITE_QUERY_FULLSTOP_LEN = 20;
 
-    // Max read log size for one call. Set to 4MB.
-    constexpr uint64_t MAX_LOG_READ_SIZE = 4 * 1024 * 1024;
+    // Address range reserved for the index file memory map. Enough for ~1.7 billion seq numbers.
+    constexpr size_t INDEX_MMAP_RESERVE_SIZE = 64UL * 1024 * 1024 * 1024; // 64GB
+
+    // Size of a single index entry [offset][root hash].
+    constexpr size_t INDEX_ENTRY_SIZE = sizeof(uint64_t) + sizeof(hmap::hasher::h32);
 
     index_context index_ctx;
 
@@ -74,12 +81,22 @@ namespace hpfs::audit::logger_index
             return -1;
         }
         index_ctx.eof = st.st_size;
+
+        if (map_index_file() == -1)
+        {
+            close(index_ctx.fd);
+            index_ctx.fd = -1;
+            return -1;
+        }
+
         index_ctx.initialized = true;
         return 0;
     }
 
     void deinit()
     {
+        unmap_index_file();
+
         if (index_ctx.fd != -1)
         {
             close(index_ctx.fd);
@@ -102,6 +119,8 @@ namespace hpfs::audit::logger_index
             return -1;
         }
 
+        std::scoped_lock lock(index_ctx.write_mutex);
+
         std::optional<audit::audit_logger> logger;
 
         // First initialize the logger.
@@ -120,6 +139,9 @@ namespace hpfs::audit::logger_index
         const size_t missing_count = seq_no - last_seq_no - 1;
         struct iovec iov_vec[(missing_count + 1) * 2];
 
+        // Missing seq nos get the offset and root hash of the previous index entry, same as in append_log_records.
+        // They need their own offset buffer since offset_be is overwritten with the current log record's offset.
+        uint8_t prev_offset_be[8];
         uint8_t offset_be[8];
         off_t next_offset;
         log_record log_record;
@@ -142,13 +164,13 @@ namespace hpfs::audit::logger_index
             else if (get_last_index_data(prev_offset, prev_root_hash) == -1)
                 return -1;
 
-            util::uint64_to_bytes(offset_be, prev_offset);
+            util::uint64_to_bytes(prev_offset_be, prev_offset);
 
             // Populate missing data
             for (int i = 0; i < missing_count; i++)
             {
-                iov_vec[i * 2].iov_base = offset_be;
-                iov_vec[i * 2].iov_len = sizeof(offset_be);
+                iov_vec[i * 2].iov_base = prev_offset_be;
+                iov_vec[i * 2].iov_len = sizeof(prev_offset_be);
 
                 iov_vec[(i * 2) + 1].iov_base = &(prev_root_hash);
                 iov_vec[(i * 2) + 1].iov_len = sizeof(prev_root_hash);
@@ -198,12 +220,14 @@ namespace hpfs::audit::logger_index
         }
 
         // Read from the end of the file.
-        if (pread(index_ctx.fd, &root_hash, sizeof(root_hash), index_ctx.eof - sizeof(root_hash)) < sizeof(root_hash))
+        const uint8_t *data = get_index_data(index_ctx.eof - sizeof(root_hash), sizeof(root_hash));
+        if (data == NULL)
         {
-            LOG_ERROR << errno << ": Error when reading index file.";
+            LOG_ERROR << "Error when reading index file.";
             return -1;
         }
 
+        memcpy(&root_hash, data, sizeof(root_hash));
         return 0;
     }
 
@@ -269,10 +293,10 @@ namespace hpfs::audit::logger_index
         }
 
         // Reading the offset value as big endian by calculating the offset position from the sequence number.
-        uint8_t be_offset[8];
-        if (pread(index_ctx.fd, &be_offset, sizeof(be_offset), index_offset) < sizeof(be_offset))
+        const uint8_t *be_offset = get_index_data(index_offset, sizeof(uint64_t));
+        if (be_offset == NULL)
         {
-            LOG_ERROR << errno << ": Error reading log index file. " << seq_no;
+            LOG_ERROR << "Error reading log index file. " << seq_no;
             return -1;
         }
 
@@ -281,6 +305,56 @@ namespace hpfs::audit::logger_index
         return 0;
     }
 
+    /**
+     * Finds the first seq no after the given seq no which has a different log offset. Log offsets in the index never
+     * decrease with the seq no, so a run of equal offsets is skipped with an exponential search followed by a binary search
+     * instead of reading each seq no of the run.
+     * @param seq_no Seq no whose log offset is equal to the given offset. Set to the found seq no.
+     * @param offset Log offset of the given seq no. Set to the log offset of the found seq no (0 if it's beyond the index).
+     * @return Returns -1 on error otherwise 0.
+     */
+    int read_next_distinct_offset(uint64_t &seq_no, off_t &offset)
+    {
+        const uint64_t last_seq_no = get_last_seq_no();
+        const uint8_t *data = get_index_data(version::VERSION_BYTES_LEN, index_ctx.eof - version::VERSION_BYTES_LEN);
+        if (data == NULL)
+        {
+            LOG_ERROR << "Error reading log index file. " << seq_no;
+            return -1;
+        }
+
+        // Offsets are compared in their raw big endian form since we are only looking for a change.
+        uint64_t target;
+        util::uint64_to_bytes((uint8_t *)&target, offset);
+        const auto is_distinct = [&](const uint64_t seq) {
+            uint64_t raw;
+            memcpy(&raw, data + ((seq - 1) * INDEX_ENTRY_SIZE), sizeof(raw));
+            return raw != target;
+        };
+
+        // Invariant: 'low' has the target offset. 'high' is beyond the index or has a distinct offset.
+        uint64_t low = seq_no, high = seq_no + 1;
+        for (uint64_t step = 1; high <= last_seq_no && !is_distinct(high); step <<= 1)
+        {
+            low = high;
+            high = low + step;
+        }
+        high = MIN(high, last_seq_no + 1);
+
+        while (high - low > 1)
+        {
+            const uint64_t mid = low + ((high - low) / 2);
+            if (is_distinct(mid))
+                high = mid;
+            else
+                low = mid;
+        }
+
+        seq_no = high;
+        offset = high > last_seq_no ? 0 : util::uint64_from_bytes(data + ((high - 1) * INDEX_ENTRY_SIZE));
+        return 0;
+    }
+
     /**
      * Read the hash of a given position.
      * @param hash Hash at the given position.
@@ -307,24 +381,27 @@ namespace hpfs::audit::logger_index
             return -1;
 
         // Reading the hash value.
-        if (pread(index_ctx.fd, &hash, sizeof(hmap::hasher::h32), index_offset + sizeof(hmap::hasher::h32)) < sizeof(hmap::hasher::h32))
+        const uint8_t *data = get_index_data(index_offset + sizeof(hmap::hasher::h32), sizeof(hmap::hasher::h32));
+        if (data == NULL)
         {
-            LOG_ERROR << errno << ": Error reading log index file. " << seq_no;
+            LOG_ERROR << "Error reading log index file. " << seq_no;
             return -1;
         }
 
+        memcpy(&hash, data, sizeof(hmap::hasher::h32));
         return 0;
     }
 
     /**
-     * Reading the log records withing min and max seq_no range and populate them along with the seq_no.
-     * @param buf Buffer to populate logs. Layout [00000000][log record][00000000][log record]....[seq_no1][log record][00000000][log record]....
+     * Collects the log records within min and max seq_no range along with the seq_no into a read stream. Only the log file
+     * locations of the records are collected. The record data are read from the log file when the stream is read.
+     * @param stream Stream to populate. Layout [max_seq_no][00000000][log record][00000000][log record]....[seq_no1][log record][00000000][log record]....
      * @param min_seq_no Minimum seq_no to start scanning. If 0 start from the first record of the log.
      * @param max_seq_no Maximum seq_no to stop scanning. If 0 give the records until the end.
-     * @param max_size Max buffer size to read. If 0 buffer size is unlimited.
+     * @param max_size Max response size. If 0 response size is unlimited.
      * @return Returns 0 on success, -1 on error.
     */
-    int read_log_records(std::string &buf, const uint64_t min_seq_no, const uint64_t max_seq_no, const uint64_t max_size)
+    int read_log_records(log_read_stream &stream, const uint64_t min_seq_no, const uint64_t max_seq_no, const uint64_t max_size)
     {
         // If logger isn't initialized show error.
         if (!index_ctx.initialized)
@@ -343,14 +420,14 @@ namespace hpfs::audit::logger_index
             return -1;
         }
 
+        // First initialize the logger. The log records are not removed while its lock is held.
         std::optional<audit::audit_logger> logger;
-
-        // First initialize the logger.
         if (audit::audit_logger::create(logger, audit::LOG_MODE::LOG_SYNC_READ, ctx.log_file_path) == -1)
         {
             LOG_ERROR << "Error initializing log.";
             return -1;
         }
+        stream.removal_count = audit::log_removal_count;
 
         off_t current_offset, max_offset;
 
@@ -378,74 +455,150 @@ namespace hpfs::audit::logger_index
         else
             next_seq_no_offset = current_offset;
 
-        // Tempory buffer to keep the intermidiate records bitween seq_no log records.
-        // To ensure endpoint of the main buf is a seq_no log record.
-        std::string record_buf;
-
         // Reserving space for response header [resonding_max_seq_no].
-        buf.resize(sizeof(uint64_t));
+        stream.header_buf.resize(sizeof(uint64_t));
+        stream.segments.push_back(read_segment{0, sizeof(uint64_t), -1, 0});
+        stream.size = sizeof(uint64_t);
+
+        // Tempory segments to keep the intermidiate records bitween seq_no log records.
+        // To ensure endpoint of the stream is a seq_no log record.
+        std::vector<read_segment> pending_segments;
+        size_t pending_size = 0;
+
+        const auto add_pending_segment = [&](const off_t log_offset, const size_t buf_offset, const size_t len) {
+            pending_segments.push_back(read_segment{stream.size + pending_size, len, log_offset, buf_offset});
+            pending_size += len;
+        };
+
+        const auto commit_pending_segments = [&]() {
+            stream.segments.insert(stream.segments.end(), pending_segments.begin(), pending_segments.end());
+            stream.size += pending_size;
+            pending_segments.clear();
+            pending_size = 0;
+        };
 
         // Loop until the max_offset
         while (max_offset == 0 || current_offset <= max_offset)
         {
-            record_buf.resize(record_buf.length() + sizeof(seq_no));
             // If we reached to a seq_no log record
             const bool is_seq_no_log = (next_seq_no_offset == current_offset);
-            // If this is a seq_no log append seq_no to the buf and read the next seq_no record's offset.
+            // If this is a seq_no log prefix the record with seq_no and read the next seq_no record's offset.
             // otherwise it's 0.
+            const uint64_t seq_no_prefix = is_seq_no_log ? seq_no : 0;
+            add_pending_segment(-1, stream.header_buf.size(), sizeof(seq_no_prefix));
+            stream.header_buf.append((char *)&seq_no_prefix, sizeof(seq_no_prefix));
+
             if (is_seq_no_log)
             {
-                memcpy(record_buf.data() + record_buf.length() - sizeof(seq_no), &seq_no, sizeof(seq_no));
-                // Loop seq_no and get log offset from index until we receive a different log offset.
-                // So, while loop will end with seq_no of the next log record.
-                while (next_seq_no_offset != 0 && next_seq_no_offset == current_offset)
-                {
-                    if (read_offset(next_seq_no_offset, ++seq_no) == -1)
-                        return -1;
-                }
+                // Skip the seq_nos with the same log offset until we reach a different log offset.
+                // So, seq_no will be set to the seq_no of the next log record.
+                if (next_seq_no_offset != 0 && read_next_distinct_offset(seq_no, next_seq_no_offset) == -1)
+                    return -1;
             }
-            else
-                memset(record_buf.data() + record_buf.length() - sizeof(seq_no), 0, sizeof(seq_no));
 
-            // Read the log record buf at current offset.
+            // Read the log record locations at current offset.
             // After reading current_offset would be next records offset.
-            std::string log_record;
-            if (logger->read_log_record_buf_at(current_offset, current_offset, log_record) == -1)
+            log_record_extent extent;
+            if (logger->read_log_record_extent_at(current_offset, current_offset, extent) == -1)
                 return -1;
-            record_buf.append(log_record);
-            log_record.clear();
+            add_pending_segment(extent.meta_offset, 0, extent.meta_len);
+            if (extent.block_data_len > 0)
+                add_pending_segment(extent.block_data_offset, 0, extent.block_data_len);
 
-            // If reached the max_size limit break from the loop before adding the temp buffer to main and return the collected buffer.
-            if (max_size != 0 && (buf.length() + record_buf.length()) > (max_size - sizeof(uint64_t)))
+            // If reached the max_size limit break from the loop before adding the pending segments and return the collected.
+            if (max_size != 0 && (stream.size + pending_size) > (max_size - sizeof(uint64_t)))
                 break;
 
-            // If the current log record is a seq_no log record, Append collected to the main buffer and clean the temp buffer.
-            // Buffer layout - [00000000][log record][00000000][log record]....[seq_no1][log record][00000000][log record]...
-            if (is_seq_no_log)
-            {
-                buf.append(record_buf);
-                record_buf.resize(0);
-            }
+            // If the current log record is a seq_no log record, add the pending segments to the stream.
+            // If we reached to the eof of the log file, it means requested max is beyond our log (Ex: max_seq_no = 0).
+            // So we add all the records up until to the end of our log.
+            if (is_seq_no_log || current_offset == 0)
+                commit_pending_segments();
 
-            // If we reached to the eof of the log file, break from the loop and return collected.
             if (current_offset == 0)
-            {
-                // If we reach this point, it means requested max is beyond our log (Ex: max_seq_no = 0).
-                // So we append collected all the records up until to the end of our log.
-                buf.append(record_buf);
-                record_buf.clear();
                 break;
-            }
         }
 
         // Setting the last scanned seq number as the max seq number header of the response.
-        memcpy(buf.data(), &(--seq_no), sizeof(seq_no));
+        --seq_no;
+        memcpy(stream.header_buf.data(), &seq_no, sizeof(seq_no));
+
+        // The stream reads the log file through its own fd once the logger releases the lock.
+        stream.fd = dup(logger->get_fd());
+        if (stream.fd == -1)
+        {
+            LOG_ERROR << errno << ": Error duplicating log file fd.";
+            return -1;
+        }
+
+        return 0;
+    }
+
+    log_read_stream::~log_read_stream()
+    {
+        if (fd != -1)
+            close(fd);
+    }
+
+    /**
+     * Reads the log read stream at the given position. Log record data are read directly into the given buffer.
+     * The read fails if log records were removed after the stream was collected, since the data read from
+     * the collected locations may no longer belong to the streamed records.
+     * @param stream The stream to read.
+     * @param buf Buffer to populate.
+     * @param size Read size. Set to the actual read size.
+     * @param offset Read offset within the stream.
+     * @return Returns 0 on success, -1 on error.
+     */
+    int read_log_stream(log_read_stream &stream, char *buf, size_t *size, const off_t offset)
+    {
+        // If the requested offset is beyond our stream size.
+        if ((size_t)offset >= stream.size)
+        {
+            *size = 0;
+            return 0;
+        }
+
+        const size_t read_len = MIN(*size, stream.size - offset);
+
+        // Find the segment containing the read offset.
+        auto itr = std::upper_bound(stream.segments.begin(), stream.segments.end(), (size_t)offset,
+                                    [](const size_t pos, const read_segment &seg) { return pos < seg.stream_offset; });
+        itr--;
+
+        size_t copied = 0;
+        for (; copied < read_len && itr != stream.segments.end(); itr++)
+        {
+            const size_t seg_pos = offset + copied - itr->stream_offset;
+            const size_t len = MIN(itr->len - seg_pos, read_len - copied);
+
+            if (itr->log_offset == -1)
+            {
+                memcpy(buf + copied, stream.header_buf.data() + itr->buf_offset + seg_pos, len);
+            }
+            else if (pread(stream.fd, buf + copied, len, itr->log_offset + seg_pos) < (ssize_t)len)
+            {
+                LOG_ERROR << errno << ": Error reading log records from log file.";
+                return -1;
+            }
+
+            copied += len;
+        }
+
+        // Checked after reading so the data read before a removal are not served.
+        if (audit::log_removal_count != stream.removal_count)
+        {
+            LOG_ERROR << "Log records of the read stream were removed while reading.";
+            return -1;
+        }
 
+        *size = copied;
         return 0;
     }
 
     /**
-     * Appending log records to hpfs log file.
+     * Appending log records to hpfs log file. All the received log records are appended with a single log write
+     * and the index entries are appended with a single index write.
      * @param buf Buffer to append.
      * @param size Size of the buffer.
      * @return Returns 1 if success, 0 if joining point check failed, otherwise -1 on error.
@@ -459,13 +612,15 @@ namespace hpfs::audit::logger_index
             return -1;
         }
 
+        std::scoped_lock lock(index_ctx.write_mutex);
+
         std::optional<audit::audit_logger> logger;
         std::optional<vfs::virtual_filesystem> virt_fs;
         std::optional<hmap::tree::hmap_tree> htree;
 
         // First initialize the logger virtual fs and htree.
         if (audit::audit_logger::create(logger, audit::LOG_MODE::LOG_SYNC_WRITE, ctx.log_file_path) == -1 ||
-            vfs::virtual_filesystem::create(virt_fs, false, ctx.seed_dir, logger.value()) == -1 ||
+            vfs::virtual_filesystem::create(virt_fs, false, ctx.seed_dir, logger.value(), ctx.read_engine) == -1 ||
             hmap::tree::hmap_tree::create(htree, virt_fs.value()) == -1)
         {
             LOG_ERROR << "Error initializing log, virtual fs and htree.";
@@ -487,13 +642,16 @@ namespace hpfs::audit::logger_index
         const uint64_t *received_max_seq_no = (const uint64_t *)std::string_view(buf + offset, 8).data();
         offset += 8;
 
+        std::vector<received_log_record> records;
+        std::vector<log_append_entry> append_entries;
+
         while (offset < size)
         {
             const uint64_t *seq_no = (const uint64_t *)std::string_view(buf + offset, 8).data();
             offset += 8;
             const log_record_header *rh = (const log_record_header *)std::string_view(buf + offset, sizeof(log_record_header)).data();
             offset += sizeof(log_record_header);
-            const std::string vpath(buf + offset, rh->vpath_len);
+            std::string_view vpath(buf + offset, rh->vpath_len);
             offset += rh->vpath_len;
             std::string_view payload(buf + offset, rh->payload_len);
             offset += rh->payload_len;
@@ -543,51 +701,79 @@ namespace hpfs::audit::logger_index
             }
             first_record = false;
 
-            off_t log_offset;
-            hmap::hasher::h32 log_root_hash;
-            if ((rh->root_hash != hmap::hasher::h32_empty && rh->operation != 0) &&
-                persist_log_record(logger.value(), virt_fs.value(), htree.value(), *seq_no, rh->operation, vpath, payload, block_data, log_offset, log_root_hash) == -1)
+            received_log_record &record = records.emplace_back();
+            record.seq_no = *seq_no;
+            record.payload = payload;
+
+            // Records without a root hash or an operation only carry a seq no.
+            if (rh->root_hash != hmap::hasher::h32_empty && rh->operation != 0)
             {
-                LOG_ERROR << "Error persisting log record. seq no " << *seq_no;
-                return -1;
+                record.append_idx = append_entries.size();
+
+                log_append_entry &entry = append_entries.emplace_back();
+                entry.vpath = vpath;
+                entry.operation = rh->operation;
+                entry.payload_buf = {(void *)payload.data(), payload.size()};
+                if (!block_data.empty())
+                    entry.data_bufs.push_back({(void *)block_data.data(), block_data.size()});
+                entry.root_hash = rh->root_hash;
             }
+        }
 
-            // If this is a seq no log record, update the log index file.
-            if (*seq_no != 0)
-            {
-                uint8_t offset_be[8];
+        // Log records are written together with the root hashes received from the peer. We only
+        // rewrite a record header if our own hash calculation results in a different root hash.
+        const off_t last_record_before_append = logger->get_header().last_record;
+        if (logger->append_logs(append_entries) == -1)
+        {
+            LOG_ERROR << "Error appending logs.";
+            return -1;
+        }
 
-                const size_t missing_count = *seq_no - prev_seq_no - 1;
-                struct iovec iov_vec[(missing_count + 1) * 2];
+        int ret = 1;
+        std::string index_buf; // Index entries to be appended to the index file.
 
-                // Update index with last log records offset and root hash.
-                util::uint64_to_bytes(offset_be, prev_offset);
-                for (int i = 0; i < missing_count; i++)
+        for (const received_log_record &record : records)
+        {
+            off_t log_offset = prev_offset;
+            hmap::hasher::h32 log_root_hash = prev_root_hash;
+
+            if (record.append_idx != -1)
+            {
+                log_append_entry &entry = append_entries[record.append_idx];
+                const int res = replay_log_record(virt_fs.value(), htree.value(), entry, record.payload, log_root_hash);
+                if (res == -1 || res == 0)
                 {
-                    iov_vec[i * 2].iov_base = offset_be;
-                    iov_vec[i * 2].iov_len = sizeof(offset_be);
+                    // The record cannot be applied on top of our filesystem. Remove it and the records after it from the log
+                    // and only index the records before it.
+                    if (res == -1)
+                        LOG_ERROR << "Error persisting log record. seq no " << record.seq_no << " " << entry.vpath;
+                    else
+                        LOG_ERROR << "Invalid log record for the filesystem state. seq no " << record.seq_no << " " << entry.vpath;
+                    const off_t keep_offset = record.append_idx > 0 ? append_entries[record.append_idx - 1].offset : last_record_before_append;
+                    if (logger->truncate_log_file(keep_offset) == -1)
+                        return -1;
 
-                    iov_vec[(i * 2) + 1].iov_base = &(prev_root_hash);
-                    iov_vec[(i * 2) + 1].iov_len = sizeof(prev_root_hash);
+                    ret = -1;
+                    break;
                 }
 
-                // Update index for the current log record.
-                util::uint64_to_bytes(offset_be, log_offset);
-                iov_vec[missing_count * 2].iov_base = offset_be;
-                iov_vec[missing_count * 2].iov_len = sizeof(offset_be);
-
-                iov_vec[(missing_count * 2) + 1].iov_base = &(log_root_hash);
-                iov_vec[(missing_count * 2) + 1].iov_len = sizeof(log_root_hash);
-
-                if (pwritev(index_ctx.fd, iov_vec, (missing_count + 1) * 2, index_ctx.eof) == -1)
-                {
-                    LOG_ERROR << errno << ": Error writing to log index file.";
+                log_offset = entry.offset;
+                if (log_root_hash != entry.rh.root_hash &&
+                    logger->update_log_record_hash(entry.offset, log_root_hash, entry.rh) == -1)
                     return -1;
-                }
+            }
 
-                index_ctx.eof += (sizeof(offset_be) + sizeof(log_root_hash)) * (missing_count + 1);
+            // If this is a seq no log record, update the log index.
+            if (record.seq_no != 0)
+            {
+                // Update index with last log records offset and root hash.
+                for (uint64_t seq_no = prev_seq_no + 1; seq_no < record.seq_no; seq_no++)
+                    append_index_entry(index_buf, prev_offset, prev_root_hash);
+
+                // Update index for the current log record.
+                append_index_entry(index_buf, log_offset, log_root_hash);
 
-                prev_seq_no = *seq_no;
+                prev_seq_no = record.seq_no;
                 prev_offset = log_offset;
                 prev_root_hash = log_root_hash;
             }
@@ -595,62 +781,45 @@ namespace hpfs::audit::logger_index
 
         // If there're no log records for the seq numbers < max_seq_no.
         // Update the index for them with the offset and root hash value of last log record.
-        last_seq_no = get_last_seq_no();
-        if (*received_max_seq_no > last_seq_no)
+        last_seq_no = get_last_seq_no() + (index_buf.size() / INDEX_ENTRY_SIZE);
+        if (ret == 1 && *received_max_seq_no > last_seq_no)
         {
-            off_t prev_offset;
-            hmap::hasher::h32 prev_root_hash;
-            if (get_last_index_data(prev_offset, prev_root_hash) == -1)
+            if (index_buf.empty() && get_last_index_data(prev_offset, prev_root_hash) == -1)
                 return -1;
 
-            uint8_t offset_be[8];
-            util::uint64_to_bytes(offset_be, prev_offset);
-
-            const size_t missing_count = *received_max_seq_no - last_seq_no;
-            struct iovec iov_vec[missing_count * 2];
-
             // Populate missing data with last log record's offset and root hash.
-            for (int i = 0; i < missing_count; i++)
-            {
-                iov_vec[i * 2].iov_base = offset_be;
-                iov_vec[i * 2].iov_len = sizeof(offset_be);
-
-                iov_vec[(i * 2) + 1].iov_base = &(prev_root_hash);
-                iov_vec[(i * 2) + 1].iov_len = sizeof(prev_root_hash);
-            }
+            for (uint64_t seq_no = last_seq_no; seq_no < *received_max_seq_no; seq_no++)
+                append_index_entry(index_buf, prev_offset, prev_root_hash);
+        }
 
-            if (pwritev(index_ctx.fd, iov_vec, missing_count * 2, index_ctx.eof) == -1)
+        if (!index_buf.empty())
+        {
+            if (pwrite(index_ctx.fd, index_buf.data(), index_buf.size(), index_ctx.eof) == -1)
             {
                 LOG_ERROR << errno << ": Error writing to log index file.";
                 return -1;
             }
 
-            index_ctx.eof += (sizeof(offset_be) + sizeof(prev_root_hash)) * missing_count;
+            index_ctx.eof += index_buf.size();
         }
 
-        return 1;
+        return ret;
     }
 
     /**
-     * Persisting log records and updating the hashes.
-     * @param logger Logger instance.
-     * @param virt_fs Virtual file system instance.Seq no of the log record
+     * Applies an appended log record to the virtual filesystem and updates the hash tree accordingly.
+     * @param virt_fs Virtual file system instance.
      * @param htree Hash tree instance.
-     * @param seq_no Seq no of the log record.
-     * @param op File operation.
-     * @param vpath Vpath in the log record.
-     * @param paylod Payload in the log record.
-     * @param block_data Block data in the log record.
-     * @param log_offset Offset of the newly added log record.
-     * @param root_hash Updated root hash after persisting the log record.
-     * @return Returns 0 on success, -1 on error.
+     * @param entry The appended log record.
+     * @param payload Payload of the log record.
+     * @param root_hash Updated root hash after applying the log record.
+     * @return Returns 1 on success, 0 if the log record is invalid for the current vfs state, -1 on error.
     */
-    int persist_log_record(audit::audit_logger &logger, vfs::virtual_filesystem &virt_fs, hmap::tree::hmap_tree &htree, const uint64_t seq_no, const audit::FS_OPERATION op,
-                           const std::string &vpath, std::string_view payload, std::string_view block_data, off_t &log_offset, hmap::hasher::h32 &root_hash)
+    int replay_log_record(vfs::virtual_filesystem &virt_fs, hmap::tree::hmap_tree &htree, const log_append_entry &entry,
+                          std::string_view payload, hmap::hasher::h32 &root_hash)
     {
-        const iovec payload_vec{(void *)payload.data(), payload.size()};
-        std::vector<iovec> block_data_vec;
-        block_data_vec.push_back({(void *)block_data.data(), block_data.size()});
+        const std::string vpath(entry.vpath);
+        const FS_OPERATION op = entry.operation;
 
         vfs::vnode *vn = NULL;
         if (virt_fs.get_vnode(vpath, &vn) == -1)
@@ -661,23 +830,16 @@ namespace hpfs::audit::logger_index
         if (op == audit::FS_OPERATION::MKDIR || op == audit::FS_OPERATION::CREATE)
         {
             if (vn)
-                return -EEXIST;
+                return 0;
         }
         else if (!vn)
-            return -ENOENT;
-
-        log_record_header rh;
-        log_offset = logger.append_log(rh, vpath, op, &payload_vec,
-                                       block_data_vec.data(), block_data_vec.size());
+            return 0;
 
-        if (log_offset == 0)
-        {
-            LOG_ERROR << "Error appending logs.";
-            return -1;
-        }
+        // Vnode gets removed from the vfs when a rename is applied. So we capture the type beforehand.
+        const bool is_dir = vn && !S_ISREG(vn->st.st_mode);
 
-        // After appending the log records and calculating the hash. Update the vfs.
-        if (virt_fs.build_vfs() == -1)
+        // Update the vfs upto the end of this log record.
+        if (virt_fs.build_vfs(entry.offset + audit_logger::get_metrics(entry.rh).total_size) == -1)
         {
             LOG_ERROR << "Error building the virtual file system.";
             return -1;
@@ -722,7 +884,7 @@ namespace hpfs::audit::logger_index
         case (audit::FS_OPERATION::RENAME):
         {
             const std::string to_vpath(std::string_view((char *)payload.data(), payload.size() - 1));
-            if (htree.apply_vnode_rename(vpath, to_vpath, !S_ISREG(vn->st.st_mode)) == -1)
+            if (htree.apply_vnode_rename(vpath, to_vpath, is_dir) == -1)
                 return -1;
             break;
         }
@@ -731,24 +893,35 @@ namespace hpfs::audit::logger_index
         }
 
         root_hash = htree.get_root_hash();
+        return 1;
+    }
 
-        // Update the log record with root hash.
-        if (logger.update_log_record_hash(log_offset, root_hash, rh) == -1)
-            return -1;
-
-        return 0;
+    /**
+     * Appends an index entry to the given index buffer.
+     * @param index_buf Buffer to append the entry to.
+     * @param offset Log record offset.
+     * @param root_hash Root hash after the log record.
+     */
+    void append_index_entry(std::string &index_buf, const off_t offset, const hmap::hasher::h32 &root_hash)
+    {
+        // Offsets are persisted in big endian.
+        uint8_t offset_be[8];
+        util::uint64_to_bytes(offset_be, offset);
+        index_buf.append((char *)offset_be, sizeof(offset_be));
+        index_buf.append((char *)&root_hash, sizeof(root_hash));
     }
 
     /**
      * Checks request for any read.
      * @param query Query passed from the outside.
+     * @param fh Fuse file handle populated at the open.
      * @param buf Data buffer to be returned.
      * @param size Read size.
      * @param offset Read offset.
      * @return 0 if request succesfully was interpreted by index control. 1 if the request
      *         should be passed through to the virtual fs. <0 on error.
     */
-    int index_check_read(std::string_view query, char *buf, size_t *size, const off_t offset)
+    int index_check_read(std::string_view query, const uint64_t fh, char *buf, size_t *size, const off_t offset)
     {
         if (query.length() > INDEX_READ_QUERY_FULLSTOP_LEN && strncmp(query.data(), INDEX_READ_QUERY_FULLSTOP, INDEX_READ_QUERY_FULLSTOP_LEN) == 0)
         {
@@ -756,17 +929,18 @@ namespace hpfs::audit::logger_index
             if (!index_ctx.initialized)
                 return -ENOENT;
 
-            // Serve the read requests with the read buffer which is populated in the file open.
-            if (offset >= index_ctx.read_buf.length()) // If the requested offset is beyond our buffer size.
-                *size = 0;
-            else if (index_ctx.read_buf.length() - offset <= *size) // If we are sending the last page.
+            index_handle *handle = (index_handle *)fh;
+            if (handle == NULL)
+                return -EBADF;
+
+            // Serve the read requests with the read stream which is populated in the file open.
+            if (!handle->read_stream)
             {
-                *size = index_ctx.read_buf.length() - offset;
-                memcpy(buf, index_ctx.read_buf.c_str() + offset, *size);
+                *size = 0;
+                return 0;
             }
-            else
-                memcpy(buf, index_ctx.read_buf.c_str() + offset, *size);
-            return 0;
+
+            return read_log_stream(handle->read_stream.value(), buf, size, offset) == -1 ? -EIO : 0;
         }
 
         return 1;
@@ -775,13 +949,14 @@ namespace hpfs::audit::logger_index
     /**
      * Checks request for any write.
      * @param query Query passed from the outside.
+     * @param fh Fuse file handle populated at the open.
      * @param buf Buffer to be written.
      * @param size Write size.
      * @param offset Write offset.
      * @return 0 if request succesfully was interpreted by index control. 1 if the request
      *         should be passed through to the virtual fs. <0 on error.
     */
-    int index_check_write(std::string_view query, const char *buf, size_t *size, const off_t offset)
+    int index_check_write(std::string_view query, const uint64_t fh, const char *buf, size_t *size, const off_t offset)
     {
         if (query.length() > INDEX_WRITE_QUERY_FULLSTOP_LEN && strncmp(query.data(), INDEX_WRITE_QUERY_FULLSTOP, INDEX_WRITE_QUERY_FULLSTOP_LEN) == 0)
         {
@@ -789,16 +964,21 @@ namespace hpfs::audit::logger_index
             if (!index_ctx.initialized)
                 return -ENOENT;
 
+            index_handle *handle = (index_handle *)fh;
+            if (handle == NULL)
+                return -EBADF;
+
             // Populated the write buffer with receiving data until we reach the end of the buffer.
-            if (offset >= index_ctx.write_buf.length()) // If the requested offset is beyond our buffer size.
+            std::string &write_buf = handle->write_buf;
+            if (offset >= write_buf.length()) // If the requested offset is beyond our buffer size.
                 *size = 0;
-            else if (index_ctx.write_buf.length() - offset <= *size) // If we are writing the last page.
+            else if (write_buf.length() - offset <= *size) // If we are writing the last page.
             {
-                *size = index_ctx.write_buf.length() - offset;
-                memcpy(index_ctx.write_buf.data() + offset, buf, *size);
+                *size = write_buf.length() - offset;
+                memcpy(write_buf.data() + offset, buf, *size);
             }
             else
-                memcpy(index_ctx.write_buf.data() + offset, buf, *size);
+                memcpy(write_buf.data() + offset, buf, *size);
 
             return 0;
         }
@@ -829,13 +1009,43 @@ namespace hpfs::audit::logger_index
         return 1;
     }
 
+    /**
+     * Collects the read stream requested by a ::hpfs.index.read.<min_seq_no>.<max_seq_no> query.
+     * @param query Read query.
+     * @param stream Stream to populate.
+     * @return Returns 0 on success, -1 on error.
+     */
+    int open_read_stream(std::string_view query, log_read_stream &stream)
+    {
+        // Split the query by '.'.
+        const std::vector<std::string> params = util::split_string(query, ".");
+        uint64_t min_seq_no, max_seq_no;
+        if (params.size() != 5 ||
+            util::stoull(params.at(3).data(), min_seq_no) == -1 ||
+            util::stoull(params.at(4).data(), max_seq_no) == -1)
+        {
+            LOG_ERROR << "Log read parameter error: Invalid parameters";
+            return -1;
+        }
+
+        if (read_log_records(stream, min_seq_no, max_seq_no, ctx.log_read_limit) == -1)
+        {
+            LOG_ERROR << "Error reading logs: Seq no from " << min_seq_no << " to " << max_seq_no;
+            return -1;
+        }
+
+        return 0;
+    }
+
     /**
      * Checks open request for the index.
      * @param query Query passed from the outside.
+     * @param fh Fuse file handle to be populated with the state of the opened index file.
+     * @param direct_io Set if the reads of the opened file must bypass the page cache.
      * @return 0 if request succesfully was interpreted by index control. 1 if the request
      *         should be passed through to the virtual fs. <0 on error.
     */
-    int index_check_open(std::string_view query)
+    int index_check_open(std::string_view query, uint64_t &fh, bool &direct_io)
     {
         // We are populating read buffer at the open operation of the ::hpfs.index.read file.
         if (query.length() > INDEX_READ_QUERY_FULLSTOP_LEN && strncmp(query.data(), INDEX_READ_QUERY_FULLSTOP, INDEX_READ_QUERY_FULLSTOP_LEN) == 0)
@@ -844,23 +1054,18 @@ namespace hpfs::audit::logger_index
             if (!index_ctx.initialized)
                 return -ENOENT;
 
-            // Split the query by '.'.
-            const std::vector<std::string> params = util::split_string(query, ".");
-            uint64_t min_seq_no, max_seq_no;
-            if (params.size() != 5 ||
-                util::stoull(params.at(3).data(), min_seq_no) == -1 ||
-                util::stoull(params.at(4).data(), max_seq_no) == -1)
+            index_handle *handle = new index_handle();
+            handle->read_stream.emplace();
+            if (open_read_stream(query, handle->read_stream.value()) == -1)
             {
-                LOG_ERROR << "Log read parameter error: Invalid parameters";
-                return -1;
-            }
-
-            if (read_log_records(index_ctx.read_buf, min_seq_no, max_seq_no, MAX_LOG_READ_SIZE) == -1)
-            {
-                LOG_ERROR << "Error reading logs: Seq no from " << min_seq_no << " to " << max_seq_no;
+                delete handle;
                 return -1;
             }
 
+            // The response is collected at the open. So its size is only known by the open handle and the reads must
+            // not be clipped to the file size reported by an earlier getattr.
+            fh = (uint64_t)handle;
+            direct_io = true;
             return 0;
         }
         // We are allocating the write buffer at the open operation of the ::hpfs.index.write file.
@@ -880,9 +1085,11 @@ namespace hpfs::audit::logger_index
                 return -1;
             }
 
-            // Resize the write buffer to the buffer length.
-            index_ctx.write_buf.resize(buf_len);
+            // Allocate the write buffer with the buffer length.
+            index_handle *handle = new index_handle();
+            handle->write_buf.resize(buf_len);
 
+            fh = (uint64_t)handle;
             return 0;
         }
         else if (query.length() > INDEX_UPDATE_QUERY_FULLSTOP_LEN && strncmp(query.data(), INDEX_UPDATE_QUERY_FULLSTOP, INDEX_UPDATE_QUERY_FULLSTOP_LEN) == 0)
@@ -892,31 +1099,59 @@ namespace hpfs::audit::logger_index
     }
 
     /**
-     * Flush the index file after closing. Temporary read buf will be cleaned and write buffer will be appended.
+     * Flush the index file after closing. Read stream will be closed and write buffer will be appended.
      * @param query Query passed from the outside.
+     * @param fh Fuse file handle populated at the open.
      * @return 0 if request succesfully was interpreted by index control. 1 if the request
      *         should be passed through to the virtual fs. <0 on error.
     */
-    int index_check_flush(std::string_view query)
+    int index_check_flush(std::string_view query, const uint64_t fh)
     {
-        // Resize the read buffer to 0 when releasing the ::hpfs.index.read file.
+        index_handle *handle = (index_handle *)fh;
+
+        // Close the read stream when releasing the ::hpfs.index.read file.
         if (query.length() > INDEX_READ_QUERY_FULLSTOP_LEN && strncmp(query.data(), INDEX_READ_QUERY_FULLSTOP, INDEX_READ_QUERY_FULLSTOP_LEN) == 0)
         {
-            index_ctx.read_buf.resize(0);
+            if (handle != NULL)
+                handle->read_stream.reset();
             return 0;
         }
         // Append the collected write buffer and resize the write buffer to 0 when releasing the ::hpfs.index.write file.
         else if (query.length() > INDEX_WRITE_QUERY_FULLSTOP_LEN && strncmp(query.data(), INDEX_WRITE_QUERY_FULLSTOP, INDEX_WRITE_QUERY_FULLSTOP_LEN) == 0)
         {
-            const int res = append_log_records(index_ctx.write_buf.c_str(), index_ctx.write_buf.length());
+            // Flush can be called multiple times for a single open. Only the first flush has the collected logs.
+            if (handle == NULL || handle->write_buf.empty())
+                return 0;
+
+            const int res = append_log_records(handle->write_buf.c_str(), handle->write_buf.length());
+            handle->write_buf.clear();
+            merger::wake(); // Appended logs can be merged now.
             if (res == -1 || res == 0)
             {
                 if (res == -1)
                     LOG_ERROR << "Error appending logs";
-                index_ctx.write_buf.resize(0);
                 return -1;
             }
-            index_ctx.write_buf.resize(0);
+            return 0;
+        }
+
+        return 1;
+    }
+
+    /**
+     * Releases the state of an index read/write file when it's closed.
+     * @param query Query passed from the outside.
+     * @param fh Fuse file handle populated at the open. Reset to 0 once released.
+     * @return 0 if request succesfully was interpreted by index control. 1 if the request
+     *         should be passed through to the virtual fs.
+    */
+    int index_check_release(std::string_view query, uint64_t &fh)
+    {
+        if ((query.length() > INDEX_READ_QUERY_FULLSTOP_LEN && strncmp(query.data(), INDEX_READ_QUERY_FULLSTOP, INDEX_READ_QUERY_FULLSTOP_LEN) == 0) ||
+            (query.length() > INDEX_WRITE_QUERY_FULLSTOP_LEN && strncmp(query.data(), INDEX_WRITE_QUERY_FULLSTOP, INDEX_WRITE_QUERY_FULLSTOP_LEN) == 0))
+        {
+            delete (index_handle *)fh;
+            fh = 0;
             return 0;
         }
 
@@ -927,10 +1162,11 @@ namespace hpfs::audit::logger_index
      * Checks getattr requests for any index-related metadata activity.
      * @param query Query passed from the outside.
      * @param stbuf Stat to be populated if this is a index control
+     * @param fh Fuse file handle populated at the open. 0 if the file isn't open.
      * @return 0 if request succesfully was interpreted by index control. 1 if the request
      *         should be passed through to the virtual fs. <0 on error.
      */
-    int index_check_getattr(std::string_view query, struct stat *stbuf)
+    int index_check_getattr(std::string_view query, struct stat *stbuf, const uint64_t fh)
     {
         if (query.length() > INDEX_UPDATE_QUERY_FULLSTOP_LEN && strncmp(query.data(), INDEX_UPDATE_QUERY_FULLSTOP, INDEX_UPDATE_QUERY_FULLSTOP_LEN) == 0)
         {
@@ -942,7 +1178,14 @@ namespace hpfs::audit::logger_index
                 LOG_ERROR << errno << ": Error in stat of index file.";
                 return -1;
             }
-            stbuf->st_size = MAX_LOG_READ_SIZE;
+
+            // An open read file reports the size of its collected response. Otherwise the read limit is reported since
+            // the response is only collected at the open. Reads are not clipped to this size since they use direct io.
+            const index_handle *handle = (index_handle *)fh;
+            if (handle != NULL && handle->read_stream)
+                stbuf->st_size = handle->read_stream->size;
+            else
+                stbuf->st_size = ctx.log_read_limit == 0 ? std::numeric_limits<off_t>::max() : ctx.log_read_limit;
             return 0;
         }
 
@@ -998,13 +1241,15 @@ namespace hpfs::audit::logger_index
             return -1;
         }
 
+        std::scoped_lock lock(index_ctx.write_mutex);
+
         std::optional<audit::audit_logger> logger;
         std::optional<vfs::virtual_filesystem> virt_fs;
         std::optional<hmap::tree::hmap_tree> htree;
 
         // First initialize the logger virtual fs and htree.
         if (audit::audit_logger::create(logger, audit::LOG_MODE::LOG_SYNC_WRITE, ctx.log_file_path) == -1 ||
-            vfs::virtual_filesystem::create(virt_fs, false, ctx.seed_dir, logger.value()) == -1 ||
+            vfs::virtual_filesystem::create(virt_fs, false, ctx.seed_dir, logger.value(), ctx.read_engine) == -1 ||
             hmap::tree::hmap_tree::create(htree, virt_fs.value()) == -1)
         {
             LOG_ERROR << "Error initializing log, virtual fs and htree.";
@@ -1020,6 +1265,14 @@ namespace hpfs::audit::logger_index
             return -1;
         }
 
+        // Collect the vpaths updated by the log records which are going to be truncated.
+        std::unordered_map<std::string, bool> updated_vpaths;
+        if (get_updated_vpaths(updated_vpaths, logger.value(), log_offset) == -1)
+        {
+            LOG_ERROR << "Error collecting updated vpaths of the truncated log records.";
+            return -1;
+        }
+
         // If the seq no to truncate is 0 we set the index truncating offset to version header length;
         const off_t end_of_index = seq_no > 0 ? get_data_offset_of_index_file(seq_no + 1) : version::VERSION_BYTES_LEN;
 
@@ -1039,11 +1292,11 @@ namespace hpfs::audit::logger_index
 
         index_ctx.eof = end_of_index;
 
-        // Reaching this point means truncation is successful. Delete existing hmap and re-calculate.
+        // Reaching this point means truncation is successful. Re-calculate the hash maps of the updated vpaths.
 
         hmap::hasher::h32 root_hash;
-        if (virt_fs->re_build_vfs() == -1 ||            // Clear and re-build vfs.
-            htree->re_build_hash_maps(root_hash) == -1) // Clear and re-build hash map.
+        if (virt_fs->re_build_vfs() == -1 ||                            // Clear and re-build vfs.
+            htree->re_build_hash_maps(root_hash, updated_vpaths) == -1) // Re-build the affected hash maps.
         {
             LOG_ERROR << "Error re-calculating root hash after truncation.";
             return -1;
@@ -1053,6 +1306,51 @@ namespace hpfs::audit::logger_index
         return 0;
     }
 
+    /**
+     * Collects the vpaths updated by the log records after the specified log record.
+     * @param vpaths Updated vpaths. Value indicates whether the entire sub tree of the vpath has been affected (renames).
+     * @param logger Logger instance.
+     * @param log_offset Offset of the last log record to be excluded. 0 to include all the log records.
+     * @return Returns 0 on success and -1 on error.
+    */
+    int get_updated_vpaths(std::unordered_map<std::string, bool> &vpaths, audit::audit_logger &logger, const off_t log_offset)
+    {
+        log_cursor cursor;
+        cursor.offset = log_offset;
+        log_record record;
+        std::vector<uint8_t> payload;
+
+        // Skip the excluded log record.
+        if (log_offset > 0 && logger.read_log_next(cursor, record, payload) == -1)
+        {
+            LOG_ERROR << "Error reading log at offset " << log_offset;
+            return -1;
+        }
+
+        while (true)
+        {
+            const int res = logger.read_log_next(cursor, record, payload);
+            if (res == -1)
+            {
+                LOG_ERROR << "Error reading log at offset " << cursor.offset;
+                return -1;
+            }
+
+            if (res == 0) // No log record was read. We are at end of log.
+                break;
+
+            vpaths[record.vpath] |= (record.operation == FS_OPERATION::RENAME);
+
+            if (record.operation == FS_OPERATION::RENAME)
+            {
+                const std::string to_vpath(std::string_view((char *)payload.data(), payload.size() - 1));
+                vpaths[to_vpath] = true;
+            }
+        }
+
+        return 0;
+    }
+
     /**
      * Gets the log record offset corresponding to the given seq_no from the index file.
      * @param log_offset Log offset of the given sequence number.
@@ -1061,11 +1359,11 @@ namespace hpfs::audit::logger_index
     */
     int get_log_offset_from_index_file(off_t &log_offset, const uint64_t seq_no)
     {
-        uint8_t offset_bytes[8];
         const off_t data_offset = get_data_offset_of_index_file(seq_no);
-        if (pread(index_ctx.fd, offset_bytes, 8, data_offset) < sizeof(offset_bytes))
+        const uint8_t *offset_bytes = get_index_data(data_offset, sizeof(uint64_t));
+        if (offset_bytes == NULL)
         {
-            LOG_ERROR << errno << ": Error getting log offset for seq_no: " << std::to_string(seq_no);
+            LOG_ERROR << "Error getting log offset for seq_no: " << std::to_string(seq_no);
             return -1;
         }
         log_offset = util::uint64_from_bytes(offset_bytes);
@@ -1079,7 +1377,69 @@ namespace hpfs::audit::logger_index
     */
     off_t get_data_offset_of_index_file(const uint64_t seq_no)
     {
-        return version::VERSION_BYTES_LEN + (seq_no - 1) * (sizeof(uint64_t) + sizeof(hmap::hasher::h32));
+        return version::VERSION_BYTES_LEN + (seq_no - 1) * INDEX_ENTRY_SIZE;
+    }
+
+    /**
+     * Reserves the address range for the index file memory map and maps the current index file contents.
+     * @return Returns 0 on success and -1 on error.
+     */
+    int map_index_file()
+    {
+        void *ptr = mmap(NULL, INDEX_MMAP_RESERVE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ptr == MAP_FAILED)
+        {
+            LOG_ERROR << errno << ": Error reserving index file memory map.";
+            return -1;
+        }
+
+        index_ctx.mmap_ptr = (uint8_t *)ptr;
+        index_ctx.mmap_size = 0;
+        if (get_index_data(0, index_ctx.eof) == NULL)
+        {
+            unmap_index_file();
+            return -1;
+        }
+
+        return 0;
+    }
+
+    void unmap_index_file()
+    {
+        if (index_ctx.mmap_ptr != NULL)
+        {
+            munmap(index_ctx.mmap_ptr, INDEX_MMAP_RESERVE_SIZE);
+            index_ctx.mmap_ptr = NULL;
+            index_ctx.mmap_size = 0;
+        }
+    }
+
+    /**
+     * Gives a pointer to the specified range of the index file. The memory map gets extended in place
+     * if the index file has grown beyond the mapped size.
+     * @param data_offset Index file offset of the data.
+     * @param len Length of the data.
+     * @return Pointer to the data. NULL on error or if the range is beyond the index file.
+     */
+    const uint8_t *get_index_data(const off_t data_offset, const size_t len)
+    {
+        const size_t end = data_offset + len;
+        if (end > (size_t)index_ctx.eof || end > INDEX_MMAP_RESERVE_SIZE)
+            return NULL;
+
+        std::scoped_lock lock(index_ctx.mmap_mutex);
+        if (end > index_ctx.mmap_size)
+        {
+            // Replace the whole mapping over the reserved range. Existing pointers remain valid.
+            if (mmap(index_ctx.mmap_ptr, index_ctx.eof, PROT_READ, MAP_SHARED | MAP_FIXED, index_ctx.fd, 0) == MAP_FAILED)
+            {
+                LOG_ERROR << errno << ": Error memory mapping index file.";
+                return NULL;
+            }
+            index_ctx.mmap_size = index_ctx.eof;
+        }
+
+        return index_ctx.mmap_ptr + data_offset;
     }
 
 } // namespace hpfs::audit::logger_index
\ No newline at end of file
@@ -3,6 +3,9 @@
 
 #include <string>
 #include <optional>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
 #include <sys/stat.h>
 #include "audit.hpp"
 #include "../hmap/hasher.hpp"
@@ -11,17 +14,60 @@
 
 namespace hpfs::audit::logger_index
 {
+    // A contiguous part of a log read response. Served either from the log file or from the stream header buffer.
+    struct read_segment
+    {
+        size_t stream_offset = 0; // Offset of the segment within the response.
+        size_t len = 0;
+        off_t log_offset = -1; // Log file offset of the segment data. -1 if the data is in the header buffer.
+        size_t buf_offset = 0; // Header buffer offset of the segment data.
+    };
+
+    // Log read response which is served directly from the log file instead of being copied to memory.
+    // The log lock is only held while the segments are collected, so a slow reader does not hold back log appends and truncation.
+    struct log_read_stream
+    {
+        int fd = -1;                        // Duplicate of the log file fd. Keeps the collected log file readable if it gets replaced by a compaction.
+        uint64_t removal_count = 0;         // audit::log_removal_count when the segments were collected.
+        std::string header_buf;             // Response header and the seq_no prefixes of the log records.
+        std::vector<read_segment> segments; // Response segments ordered by the stream offset.
+        size_t size = 0;                    // Total response size.
+
+        log_read_stream() = default;
+        log_read_stream(const log_read_stream &) = delete;
+        log_read_stream &operator=(const log_read_stream &) = delete;
+        ~log_read_stream();
+    };
+
+    // State of an open log index read/write file. Referenced by the fuse file handle so several
+    // log syncs can be served in parallel.
+    struct index_handle
+    {
+        std::optional<log_read_stream> read_stream; // Log read response of a ::hpfs.index.read file.
+        std::string write_buf;                      // Buffer to collect the logs written to a ::hpfs.index.write file.
+    };
+
+    // A log record received with a log index write.
+    struct received_log_record
+    {
+        uint64_t seq_no = 0;
+        std::string_view payload;
+        int append_idx = -1; // Position of the record within the appended log records. -1 if the record isn't appended.
+    };
+
     struct index_context
     {
-        int fd = -1;              // The index file fd used throughout the session.
-        off_t eof = 0;            // End of file (End offset of index file).
+        int fd = -1;                // The index file fd used throughout the session.
+        std::atomic<off_t> eof = 0; // End of file (End offset of index file).
         bool initialized = false; // Indicates that the index has been initialized properly.
         std::string index_file_path;
-        /* Because fuse is multithreaded and reading and writing processed by mulitple threads for several page blocks,
-        We use two local buffers to collect read and write logs and serve the reading logas and appending logs from these buffers.
-        This log read cannot be done from multiple threads by hpcore */
-        std::string read_buf;  // Tempory buffer to keep reading result.
-        std::string write_buf; // Tempory buffer to collect writing logs.
+        std::mutex write_mutex; // Serializes the index file updates made by concurrent log syncs.
+
+        // Read-only memory map of the index file. The map is placed within a reserved address range so the
+        // pointer remains valid while the map gets extended as the index file grows.
+        uint8_t *mmap_ptr = NULL;
+        size_t mmap_size = 0;
+        std::mutex mmap_mutex;
     };
 
     extern index_context index_ctx;
@@ -42,31 +88,47 @@ namespace hpfs::audit::logger_index
 
     int read_hash(hmap::hasher::h32 &hash, const uint64_t seq_no);
 
-    int read_log_records(std::string &buf, const uint64_t min_seq_no, const uint64_t max_seq_no = 0, const uint64_t max_size = 0);
+    int read_next_distinct_offset(uint64_t &seq_no, off_t &offset);
+
+    int read_log_records(log_read_stream &stream, const uint64_t min_seq_no, const uint64_t max_seq_no = 0, const uint64_t max_size = 0);
+
+    int read_log_stream(log_read_stream &stream, char *buf, size_t *size, const off_t offset);
 
     int append_log_records(const char *buf, const size_t size);
 
-    int persist_log_record(audit::audit_logger &logger, vfs::virtual_filesystem &virt_fs, hmap::tree::hmap_tree &htree, const uint64_t seq_no, const audit::FS_OPERATION op,
-                           const std::string &vpath, std::string_view payload, std::string_view block_data, off_t &log_offset, hmap::hasher::h32 &root_hash);
+    int replay_log_record(vfs::virtual_filesystem &virt_fs, hmap::tree::hmap_tree &htree, const log_append_entry &entry,
+                          std::string_view payload, hmap::hasher::h32 &root_hash);
+
+    void append_index_entry(std::string &index_buf, const off_t offset, const hmap::hasher::h32 &root_hash);
 
-    int index_check_read(std::string_view query, char *buf, size_t *size, const off_t offset);
+    int index_check_read(std::string_view query, const uint64_t fh, char *buf, size_t *size, const off_t offset);
 
-    int index_check_write(std::string_view query, const char *buf, size_t *size, const off_t offset);
+    int index_check_write(std::string_view query, const uint64_t fh, const char *buf, size_t *size, const off_t offset);
 
-    int index_check_open(std::string_view query);
+    int index_check_open(std::string_view query, uint64_t &fh, bool &direct_io);
 
-    int index_check_flush(std::string_view query);
+    int index_check_flush(std::string_view query, const uint64_t fh);
 
-    int index_check_getattr(std::string_view query, struct stat *stbuf);
+    int index_check_release(std::string_view query, uint64_t &fh);
+
+    int index_check_getattr(std::string_view query, struct stat *stbuf, const uint64_t fh);
 
     int index_check_truncate(std::string_view query);
 
     int truncate_log_and_index_file(const uint64_t seq_no);
 
+    int get_updated_vpaths(std::unordered_map<std::string, bool> &vpaths, audit::audit_logger &logger, const off_t log_offset);
+
     int get_log_offset_from_index_file(off_t &log_offset, const uint64_t seq_no);
 
     off_t get_data_offset_of_index_file(const uint64_t seq_no);
 
+    int map_index_file();
+
+    void unmap_index_file();
+
+    const uint8_t *get_index_data(const off_t data_offset, const size_t len);
+
 } // namespace hpfs::audit::logger_index
 
 #endif
\ No newline at end of file
@@ -32,12 +32,14 @@
 #include <string>
 #include <sys/statvfs.h>
 #include "hpfs.hpp"
+#include "fusefs.hpp"
 #include "session.hpp"
 #include "inodes.hpp"
 #include "vfs/vfs.hpp"
 #include "vfs/fuse_adapter.hpp"
 #include "hmap/query.hpp"
 #include "audit/logger_index.hpp"
+#include "kernel_cache.hpp"
 
 /**
  * Sets the 'session' local variable if session exists. Otherwise returns error code.
@@ -48,14 +50,29 @@
     if (!sess)                                           \
         return -ENOENT;
 
-#define CHECK_UGID                                                                  \
-    const fuse_context *fctx = fuse_get_context();                                  \
-    if (!(fctx->uid == hpfs::ctx.self_uid && fctx->gid == hpfs::ctx.self_gid) &&    \
-        !(hpfs::ctx.ugid_enabled && fctx->uid == hpfs::ctx.allowed_uid && fctx->gid == hpfs::ctx.allowed_gid)) \
-        return -EACCES;
+/**
+ * Low-level frontend checks the caller with its own request context before calling into these handlers.
+ * There's no high-level fuse context in that mode.
+ */
+#define CHECK_UGID                                                                         \
+    if (!hpfs::ctx.fuse_lowlevel)                                                          \
+    {                                                                                      \
+        const fuse_context *fctx = fuse_get_context();                                     \
+        if (!is_caller_allowed(fctx->uid, fctx->gid))                                      \
+            return -EACCES;                                                                \
+    }
 
 namespace hpfs::fusefs
 {
+    /**
+     * Checks whether the specified user/group is allowed to access the mount.
+     */
+    bool is_caller_allowed(const uid_t uid, const gid_t gid)
+    {
+        return (uid == hpfs::ctx.self_uid && gid == hpfs::ctx.self_gid) ||
+               (hpfs::ctx.ugid_enabled && uid == hpfs::ctx.allowed_uid && gid == hpfs::ctx.allowed_gid);
+    }
+
     void *fs_init(struct fuse_conn_info *conn,
                   struct fuse_config *cfg)
     {
@@ -63,27 +80,53 @@ namespace hpfs::fusefs
         cfg->use_ino = 1;
         cfg->nullpath_ok = 0;
 
-        /* Pick up changes from lower filesystem right away. This is
-	   also necessary for better hardlink support. When the kernel
-	   calls the unlink() handler, it does not know the inode of
-	   the to-be-removed entry and can therefore not invalidate
-	   the cache of the associated inode - resulting in an
-	   incorrect st_nlink value being reported for any remaining
-	   hardlinks to this inode. */
+        // High-level api only supports cache timeouts for the whole mount. Control files, hash map queries and
+        // session dirs change behind the kernel and must not be cached. So the kernel does not cache any entries or
+        // attributes here. Cache timeouts are only available with the low-level frontend.
         cfg->entry_timeout = 0;
         cfg->attr_timeout = 0;
         cfg->negative_timeout = 0;
 
+        // Nothing is cached by path. So only the inode (data) of a changed path needs to be invalidated.
+        struct fuse *f = fuse_get_context()->fuse;
+        kernel_cache::init([f](const std::string &full_path, const bool removed) {
+            return fuse_invalidate_path(f, full_path.c_str());
+        });
+
         return NULL;
     }
 
+    void fs_destroy(void *private_data)
+    {
+        kernel_cache::deinit();
+    }
+
+    /**
+     * Gets the no. of seconds the kernel may cache the entry/attributes of the path. Contents of RO sessions
+     * never change so they can be cached longer. Root, session dirs, control files and hash map queries change
+     * without the kernel knowing. So they are not cached.
+     */
+    double get_cache_timeout(const char *full_path)
+    {
+        if (strcmp(full_path, "/") == 0 || strstr(full_path, "::hpfs") != NULL)
+            return 0;
+
+        const auto &[sess_name, res_path] = session::split_path(full_path);
+        if (res_path == "/")
+            return 0;
+
+        SESSION_READ_LOCK
+        const session::fs_session *sess = session::get(sess_name);
+        if (!sess)
+            return 0;
+
+        return sess->readonly ? ctx.ro_cache_timeout : ctx.rw_cache_timeout;
+    }
+
     int fs_getattr(const char *full_path, struct stat *stbuf, struct fuse_file_info *fi)
     {
         CHECK_UGID
 
-            (void)
-            fi;
-
         // Treat root path as success so we will return dummy stat for root.
         // Fuse host will fail if we return error code for root.
         if (strcmp(full_path, "/") == 0)
@@ -98,7 +141,7 @@ namespace hpfs::fusefs
         // 0 = Successfuly interpreted as a log index control request.
         // 1 = Request should be handled by the virtual fs.
         // <0 = Error code needs to be returned.
-        const int index_check_result = audit::logger_index::index_check_getattr(full_path, stbuf);
+        const int index_check_result = audit::logger_index::index_check_getattr(full_path, stbuf, fi ? fi->fh : 0);
         if (index_check_result < 1)
             return index_check_result;
 
@@ -180,6 +223,7 @@ namespace hpfs::fusefs
     int fs_mkdir(const char *full_path, mode_t mode)
     {
         CHECK_UGID
+        kernel_cache::flush_guard invalidation_flush;
 
         const auto &[sess_name, res_path] = session::split_path(full_path);
         CHECK_SESSION(sess_name);
@@ -189,6 +233,7 @@ namespace hpfs::fusefs
     int fs_rmdir(const char *full_path)
     {
         CHECK_UGID
+        kernel_cache::flush_guard invalidation_flush;
 
         const auto &[sess_name, res_path] = session::split_path(full_path);
         CHECK_SESSION(sess_name);
@@ -205,6 +250,7 @@ namespace hpfs::fusefs
     int fs_rename(const char *from, const char *to, unsigned int flags)
     {
         CHECK_UGID
+        kernel_cache::flush_guard invalidation_flush;
 
         if (flags)
             return -EINVAL;
@@ -230,6 +276,7 @@ namespace hpfs::fusefs
     int fs_unlink(const char *full_path)
     {
         CHECK_UGID
+        kernel_cache::flush_guard invalidation_flush;
 
         // 0 = Successfuly interpreted as a session control request.
         // 1 = Request should be handled by the virtual fs.
@@ -253,6 +300,7 @@ namespace hpfs::fusefs
                  struct fuse_file_info *fi)
     {
         CHECK_UGID
+        kernel_cache::flush_guard invalidation_flush;
 
         const auto &[sess_name, res_path] = session::split_path(full_path);
         CHECK_SESSION(sess_name);
@@ -276,6 +324,7 @@ namespace hpfs::fusefs
     int fs_create(const char *full_path, mode_t mode, struct fuse_file_info *fi)
     {
         CHECK_UGID
+        kernel_cache::flush_guard invalidation_flush;
 
         // 0 = Successfuly interpreted as a session control request.
         // 1 = Request should be handled by the virtual fs.
@@ -298,12 +347,15 @@ namespace hpfs::fusefs
     int fs_open(const char *full_path, struct fuse_file_info *fi)
     {
         CHECK_UGID
+        kernel_cache::flush_guard invalidation_flush;
 
         // Check whether this is a index file control request.
         // 0 = Successfuly interpreted as a log index control request.
         // 1 = Request should be handled by the virtual fs.
         // <0 = Error code needs to be returned.
-        const int index_check_result = audit::logger_index::index_check_open(full_path);
+        bool direct_io = false;
+        const int index_check_result = audit::logger_index::index_check_open(full_path, fi->fh, direct_io);
+        fi->direct_io = direct_io;
         if (index_check_result < 1)
             return index_check_result;
 
@@ -335,7 +387,7 @@ namespace hpfs::fusefs
         // 1 = Request should be handled by the virtual fs.
         // <0 = Error code needs to be returned.
         // Only is this is successfully interprited buf and size will be populated otherwise they will be kept as it is.
-        const int index_check_result = audit::logger_index::index_check_read(full_path, buf, &size, offset);
+        const int index_check_result = audit::logger_index::index_check_read(full_path, fi->fh, buf, &size, offset);
         if (index_check_result < 1)
         {
             // If the read is success send the size as the response.
@@ -360,16 +412,40 @@ namespace hpfs::fusefs
         return sess->fuse_adapter->read(res_path, buf, size, offset);
     }
 
+    /**
+     * Serves virtual fs file reads by passing the data segments covering the read range to the reply callback.
+     * Used by the low-level frontend to splice the file data from the backing files.
+     * @return 1 if the request is not a virtual fs file read and should be served with fs_read. Otherwise the
+     *         result of the reply callback or <0 on error.
+     */
+    int fs_read_segs(const char *full_path, size_t size, off_t offset, const vfs::data_segs_reply &reply)
+    {
+        CHECK_UGID
+
+        // Index files and hash map queries are not backed by vnode data.
+        const auto &[sess_name, res_path] = session::split_path(full_path);
+        SESSION_READ_LOCK
+        session::fs_session *sess = session::get(sess_name);
+        if (!sess)
+            return 1;
+
+        if (sess->hmap_query && sess->hmap_query->parse_request_path(res_path.data()).mode != hmap::query::MODE::UNDEFINED)
+            return 1;
+
+        return sess->fuse_adapter->read_segs(res_path, size, offset, reply);
+    }
+
     int fs_write(const char *full_path, const char *buf, size_t size,
                  off_t offset, struct fuse_file_info *fi)
     {
         CHECK_UGID
+        kernel_cache::flush_guard invalidation_flush;
 
         // Check whether this is a index file control request.
         // 0 = Successfuly interpreted as a log index control request.
         // 1 = Request should be handled by the virtual fs.
         // <0 = Error code needs to be returned.
-        const int index_check_result = audit::logger_index::index_check_write(full_path, buf, &size, offset);
+        const int index_check_result = audit::logger_index::index_check_write(full_path, fi->fh, buf, &size, offset);
         if (index_check_result < 1)
         {
             // If the write is success send the size as the response.
@@ -393,7 +469,24 @@ namespace hpfs::fusefs
         return statvfs(ctx.fs_dir.c_str(), stbuf);
     }
 
-    static int fs_flush(const char *full_path, struct fuse_file_info *fi)
+    /**
+     * Commits the log header updates deferred by the session of the path so the records written so far
+     * survive a crash. Only requested by fsync. Closing files leaves the deferred commits to the commit batch
+     * and the commit timer.
+     * @return 0 on success. <0 on error.
+     */
+    int flush_session(const char *full_path)
+    {
+        const auto &[sess_name, res_path] = session::split_path(full_path);
+        SESSION_READ_LOCK
+        session::fs_session *sess = session::get(sess_name);
+        if (!sess)
+            return 0;
+
+        return sess->fuse_adapter->flush() == -1 ? -EIO : 0;
+    }
+
+    int fs_flush(const char *full_path, struct fuse_file_info *fi)
     {
         CHECK_UGID
 
@@ -407,8 +500,10 @@ namespace hpfs::fusefs
         // 0 = Successfuly interpreted as a log index control request.
         // 1 = Request should be handled by the virtual fs.
         // <0 = Error code needs to be returned.
-        const int index_check_result = audit::logger_index::index_check_flush(full_path);
-        // Even if this is handled by the index check we let the rest to proceed.
+        // Index files keep their own state in the file handle. So we don't let the rest to proceed for them.
+        const int index_check_result = audit::logger_index::index_check_flush(full_path, fi->fh);
+        if (index_check_result < 1)
+            return 0;
 
         if (fi->fh > 0)
             close(dup(fi->fh));
@@ -420,6 +515,12 @@ namespace hpfs::fusefs
     {
         CHECK_UGID
 
+        // Check whether this is a index file control request.
+        // 0 = Successfuly released the index file state.
+        // 1 = Request should be handled by the virtual fs.
+        if (audit::logger_index::index_check_release(full_path, fi->fh) == 0)
+            return 0;
+
         if (fi->fh > 0)
             close(fi->fh);
         return 0;
@@ -428,6 +529,7 @@ namespace hpfs::fusefs
     int fs_truncate(const char *full_path, off_t size, struct fuse_file_info *fi)
     {
         CHECK_UGID
+        kernel_cache::flush_guard invalidation_flush;
 
         // Check whether this is a index file truncate control request.
         // 0 = Successfuly interpreted as a log index truncate control request.
@@ -444,7 +546,9 @@ namespace hpfs::fusefs
 
     int fs_fsync(const char *full_path, int isdatasync, struct fuse_file_info *fi)
     {
-        return 0;
+        CHECK_UGID
+
+        return flush_session(full_path);
     }
 
 #ifdef HAVE_POSIX_FALLOCATE
@@ -557,7 +661,7 @@ namespace hpfs::fusefs
         //fs_oper.releasedir = fs_releasedir;
         //fs_oper.fsyncdir = NULL;
         fs_oper.init = fs_init;
-        //fs_oper.destroy = NULL;
+        fs_oper.destroy = fs_destroy;
         fs_oper.access = fs_access;
         fs_oper.create = fs_create;
 #ifdef HAVE_LIBULOCKMGR
@@ -1,9 +1,38 @@
 #ifndef _HPFS_FUSE_
 #define _HPFS_FUSE_
 
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 31
+#endif
+
+#include <fuse3/fuse.h>
+#include "vfs/fuse_adapter.hpp"
+
 namespace hpfs::fusefs
 {
     int init(char *arg0);
-}
+    bool is_caller_allowed(const uid_t uid, const gid_t gid);
+    double get_cache_timeout(const char *full_path);
+
+    // Path based request handlers shared with the low-level frontend.
+    int fs_getattr(const char *full_path, struct stat *stbuf, struct fuse_file_info *fi);
+    int fs_readdir(const char *full_path, void *buf, fuse_fill_dir_t filler,
+                   off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags);
+    int fs_mkdir(const char *full_path, mode_t mode);
+    int fs_rmdir(const char *full_path);
+    int fs_rename(const char *from, const char *to, unsigned int flags);
+    int fs_unlink(const char *full_path);
+    int fs_chmod(const char *full_path, mode_t mode, struct fuse_file_info *fi);
+    int fs_create(const char *full_path, mode_t mode, struct fuse_file_info *fi);
+    int fs_open(const char *full_path, struct fuse_file_info *fi);
+    int fs_read(const char *full_path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+    int fs_read_segs(const char *full_path, size_t size, off_t offset, const vfs::data_segs_reply &reply);
+    int fs_write(const char *full_path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+    int fs_statfs(const char *full_path, struct statvfs *stbuf);
+    int fs_flush(const char *full_path, struct fuse_file_info *fi);
+    int fs_release(const char *full_path, struct fuse_file_info *fi);
+    int fs_truncate(const char *full_path, off_t size, struct fuse_file_info *fi);
+    int fs_fsync(const char *full_path, int isdatasync, struct fuse_file_info *fi);
+} // namespace hpfs::fusefs
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,720 @@
+/**
+ * Fuse low-level api frontend.
+ * Kernel requests are keyed by inode numbers which are mapped to the full paths served by the path based handlers
+ * in fusefs.cpp. This avoids libfuse building the full path for every request. File reads are replied with the
+ * data segments of the backing seed/log files so the kernel can splice them without a userspace copy.
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <fuse3/fuse_lowlevel.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <shared_mutex>
+#include "hpfs.hpp"
+#include "fusefs.hpp"
+#include "fusefs_lowlevel.hpp"
+#include "inodes.hpp"
+#include "kernel_cache.hpp"
+#include "util.hpp"
+#include "tracelog.hpp"
+
+/**
+ * Replies with access error if the caller is not allowed to access the mount.
+ */
+#define CHECK_CALLER(req)                                     \
+    {                                                         \
+        const fuse_ctx *fctx = fuse_req_ctx(req);             \
+        if (!fusefs::is_caller_allowed(fctx->uid, fctx->gid)) \
+        {                                                     \
+            fuse_reply_err(req, EACCES);                      \
+            return;                                           \
+        }                                                     \
+    }
+
+/**
+ * Sets the 'path' local variable with the path of the inode. Otherwise replies with no entry error.
+ */
+#define GET_PATH(req, ino)           \
+    std::string path;                \
+    if (get_path(ino, path) == -1)   \
+    {                                \
+        fuse_reply_err(req, ENOENT); \
+        return;                      \
+    }
+
+/**
+ * Sets the 'path' local variable with the path of the named child of the parent inode.
+ * Otherwise replies with no entry error.
+ */
+#define GET_CHILD_PATH(req, parent, name)             \
+    std::string path;                                 \
+    if (get_child_path(parent, name, path) == -1)     \
+    {                                                 \
+        fuse_reply_err(req, ENOENT);                  \
+        return;                                       \
+    }
+
+namespace hpfs::fusefs_lowlevel
+{
+    struct inode_entry
+    {
+        std::string path;
+        uint64_t nlookup = 0; // No. of kernel lookups which are not forgotten yet.
+    };
+
+    // Inodes known to the kernel keyed by the inode no. An inode is kept until the kernel forgets it, even after
+    // its path has been removed.
+    std::unordered_map<fuse_ino_t, inode_entry> inode_entries;
+
+    // Inode nos. keyed by the current path.
+    std::unordered_map<std::string, fuse_ino_t> path_inodes;
+    std::shared_mutex inodes_mutex;
+
+    // Directory listing captured at opendir so readdir can serve it in chunks by the entry offset.
+    typedef std::vector<std::pair<std::string, struct stat>> dir_listing;
+
+    /**
+     * Gets the current path of the specified inode.
+     * @return 0 on success. -1 if the inode is not known.
+     */
+    int get_path(const fuse_ino_t ino, std::string &path)
+    {
+        if (ino == FUSE_ROOT_ID)
+        {
+            path = "/";
+            return 0;
+        }
+
+        std::shared_lock lock(inodes_mutex);
+        const auto itr = inode_entries.find(ino);
+        if (itr == inode_entries.end())
+            return -1;
+
+        path = itr->second.path;
+        return 0;
+    }
+
+    /**
+     * Gets the path of the named child of the specified parent inode.
+     * @return 0 on success. -1 if the parent inode is not known.
+     */
+    int get_child_path(const fuse_ino_t parent, const char *name, std::string &path)
+    {
+        if (get_path(parent, path) == -1)
+            return -1;
+
+        path.append(path.back() == '/' ? "" : "/").append(name);
+        return 0;
+    }
+
+    /**
+     * Records a kernel lookup of the path. A new inode no. is assigned if the path isn't known yet.
+     * @return The inode no. of the path.
+     */
+    fuse_ino_t add_lookup(const std::string &path)
+    {
+        std::unique_lock lock(inodes_mutex);
+        const auto [itr, added] = path_inodes.try_emplace(path, 0);
+        if (added)
+        {
+            itr->second = inodes::next();
+            inode_entries[itr->second].path = path;
+        }
+
+        inode_entries[itr->second].nlookup++;
+        return itr->second;
+    }
+
+    /**
+     * Removes the lookups forgotten by the kernel and drops the inode if there are no more lookups.
+     */
+    void forget_lookups(const fuse_ino_t ino, const uint64_t nlookup)
+    {
+        std::unique_lock lock(inodes_mutex);
+        const auto itr = inode_entries.find(ino);
+        if (itr == inode_entries.end())
+            return;
+
+        inode_entry &entry = itr->second;
+        entry.nlookup -= MIN(nlookup, entry.nlookup);
+        if (entry.nlookup == 0)
+        {
+            const auto path_itr = path_inodes.find(entry.path);
+            if (path_itr != path_inodes.end() && path_itr->second == ino)
+                path_inodes.erase(path_itr);
+            inode_entries.erase(itr);
+        }
+    }
+
+    /**
+     * Unlinks the path from its inode so a new entry created at the same path gets a new inode.
+     */
+    void remove_path(const std::string &path)
+    {
+        std::unique_lock lock(inodes_mutex);
+        path_inodes.erase(path);
+    }
+
+    /**
+     * Unlinks the path and its descendants from their inodes so new entries at the same paths get new inodes.
+     */
+    void remove_tree_paths(const std::string &path)
+    {
+        std::unique_lock lock(inodes_mutex);
+
+        // Inode table is not indexed by the parent. So we scan it for the descendants, same as in renames.
+        for (const auto &[ino, entry] : inode_entries)
+        {
+            if (entry.path.compare(0, path.size(), path) != 0 ||
+                (entry.path.size() > path.size() && entry.path[path.size()] != '/'))
+                continue;
+
+            const auto path_itr = path_inodes.find(entry.path);
+            if (path_itr != path_inodes.end() && path_itr->second == ino)
+                path_inodes.erase(path_itr);
+        }
+    }
+
+    /**
+     * Moves the inodes of the path and its descendants to the new path.
+     */
+    void rename_path(const std::string &from, const std::string &to)
+    {
+        std::unique_lock lock(inodes_mutex);
+
+        // Any inode at the target path has been replaced by the rename.
+        path_inodes.erase(to);
+
+        // Inode table is not indexed by the parent. So we scan it for the descendants. Renames are rare enough
+        // compared to the other requests.
+        for (auto &[ino, entry] : inode_entries)
+        {
+            if (entry.path.compare(0, from.size(), from) != 0 ||
+                (entry.path.size() > from.size() && entry.path[from.size()] != '/'))
+                continue;
+
+            const auto path_itr = path_inodes.find(entry.path);
+            if (path_itr != path_inodes.end() && path_itr->second == ino)
+                path_inodes.erase(path_itr);
+
+            entry.path = to + entry.path.substr(from.size());
+            path_inodes[entry.path] = ino;
+        }
+    }
+
+    /**
+     * Populates the kernel directory entry of the path and records the lookup.
+     * @return 0 on success. <0 on error.
+     */
+    int make_entry(const std::string &path, fuse_entry_param &e)
+    {
+        memset(&e, 0, sizeof(e));
+        const int res = fusefs::fs_getattr(path.c_str(), &e.attr, NULL);
+        if (res < 0)
+            return res;
+
+        e.ino = add_lookup(path);
+        e.attr.st_ino = e.ino;
+        e.attr_timeout = fusefs::get_cache_timeout(path.c_str());
+        e.entry_timeout = e.attr_timeout;
+        return 0;
+    }
+
+    /**
+     * Drops the kernel cache of the path. Attributes and data of its inode are invalidated. Directory entries are
+     * not invalidated since the paths that change without the kernel knowing are not cached by entry, and entry
+     * invalidation needs the parent dir lock which the kernel may be holding for the request being handled.
+     * @param removed Whether the path no longer refers to the same entry. If so, the path and its descendants are
+     *                unlinked from their inodes so the kernel sees new inodes when they are looked up again.
+     * @return 0 on success. -ENOENT if the kernel does not know the path. <0 on error.
+     */
+    int invalidate_path(fuse_session *se, const std::string &path, const bool removed)
+    {
+        fuse_ino_t ino = 0;
+        {
+            std::shared_lock lock(inodes_mutex);
+            const auto itr = path_inodes.find(path);
+            if (itr != path_inodes.end())
+                ino = itr->second;
+        }
+
+        if (removed)
+            remove_tree_paths(path);
+
+        if (ino == 0)
+            return -ENOENT;
+
+        return fuse_lowlevel_notify_inval_inode(se, ino, 0, 0);
+    }
+
+    /**
+     * Replies read data as the given data segments. File backed segments are sent straight from their files
+     * (spliced if the kernel supports it) and zero filled ranges are sent from a shared zeroed buffer.
+     * @return 0 on success. -errno if the reply failed.
+     */
+    int reply_data_segs(fuse_req_t req, const std::vector<vfs::vdata_segment> &segs)
+    {
+        if (segs.empty())
+            return fuse_reply_buf(req, NULL, 0);
+
+        thread_local std::vector<char> zeros;
+        for (const vfs::vdata_segment &seg : segs)
+        {
+            if (seg.physical_fd == 0 && zeros.size() < seg.size)
+                zeros.resize(seg.size);
+        }
+
+        // Buffer vector has room for one buffer in itself. Rest of the buffers follow it.
+        std::vector<uint8_t> bufv_mem(sizeof(fuse_bufvec) + ((segs.size() - 1) * sizeof(fuse_buf)));
+        fuse_bufvec *bufv = (fuse_bufvec *)bufv_mem.data();
+        bufv->count = segs.size();
+        bufv->idx = 0;
+        bufv->off = 0;
+
+        for (size_t i = 0; i < segs.size(); i++)
+        {
+            const vfs::vdata_segment &seg = segs[i];
+            fuse_buf &buf = bufv->buf[i];
+            buf.size = seg.size;
+            if (seg.physical_fd == 0)
+            {
+                buf.flags = (fuse_buf_flags)0;
+                buf.mem = zeros.data();
+                buf.fd = -1;
+                buf.pos = 0;
+            }
+            else
+            {
+                buf.flags = (fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+                buf.mem = NULL;
+                buf.fd = seg.physical_fd;
+                buf.pos = seg.physical_offset;
+            }
+        }
+
+        return fuse_reply_data(req, bufv, (fuse_buf_copy_flags)0);
+    }
+
+    int fill_dir_listing(void *buf, const char *name, const struct stat *stbuf, off_t off, fuse_fill_dir_flags flags)
+    {
+        ((dir_listing *)buf)->emplace_back(name, *stbuf);
+        return 0;
+    }
+
+    void fs_init(void *userdata, struct fuse_conn_info *conn)
+    {
+        // Read replies consist of backing file segments. So we let the kernel take them through splice.
+        if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+            conn->want |= FUSE_CAP_SPLICE_WRITE;
+
+        // Write data can be spliced from the kernel as well.
+        if (conn->capable & FUSE_CAP_SPLICE_READ)
+            conn->want |= FUSE_CAP_SPLICE_READ;
+    }
+
+    void fs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+    {
+        CHECK_CALLER(req)
+        GET_CHILD_PATH(req, parent, name)
+
+        fuse_entry_param e;
+        const int res = make_entry(path, e);
+        if (res < 0)
+            fuse_reply_err(req, -res);
+        else
+            fuse_reply_entry(req, &e);
+    }
+
+    void fs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+    {
+        forget_lookups(ino, nlookup);
+        fuse_reply_none(req);
+    }
+
+    void fs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+    {
+        for (size_t i = 0; i < count; i++)
+            forget_lookups(forgets[i].ino, forgets[i].nlookup);
+        fuse_reply_none(req);
+    }
+
+    void fs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+    {
+        CHECK_CALLER(req)
+        GET_PATH(req, ino)
+
+        struct stat st;
+        const int res = fusefs::fs_getattr(path.c_str(), &st, fi);
+        if (res < 0)
+        {
+            fuse_reply_err(req, -res);
+            return;
+        }
+
+        st.st_ino = ino;
+        fuse_reply_attr(req, &st, fusefs::get_cache_timeout(path.c_str()));
+    }
+
+    void fs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+    {
+        CHECK_CALLER(req)
+        GET_PATH(req, ino)
+
+        // Ownership and timestamp changes are ignored like in the high-level frontend.
+        int res = 0;
+        if (to_set & FUSE_SET_ATTR_MODE)
+            res = fusefs::fs_chmod(path.c_str(), attr->st_mode, fi);
+        if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+            res = fusefs::fs_truncate(path.c_str(), attr->st_size, fi);
+
+        struct stat st;
+        if (res == 0)
+            res = fusefs::fs_getattr(path.c_str(), &st, fi);
+
+        if (res < 0)
+        {
+            fuse_reply_err(req, -res);
+            return;
+        }
+
+        st.st_ino = ino;
+        fuse_reply_attr(req, &st, fusefs::get_cache_timeout(path.c_str()));
+    }
+
+    void fs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+    {
+        CHECK_CALLER(req)
+        GET_CHILD_PATH(req, parent, name)
+
+        // Only regular files are supported. Session control files are created this way as well.
+        if (!S_ISREG(mode))
+        {
+            fuse_reply_err(req, EPERM);
+            return;
+        }
+
+        fuse_file_info fi;
+        memset(&fi, 0, sizeof(fi));
+        fuse_entry_param e;
+        int res = fusefs::fs_create(path.c_str(), mode, &fi);
+        if (res == 0)
+            res = make_entry(path, e);
+
+        if (res < 0)
+            fuse_reply_err(req, -res);
+        else
+            fuse_reply_entry(req, &e);
+    }
+
+    void fs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+    {
+        CHECK_CALLER(req)
+        GET_CHILD_PATH(req, parent, name)
+
+        fuse_entry_param e;
+        int res = fusefs::fs_mkdir(path.c_str(), mode);
+        if (res == 0)
+            res = make_entry(path, e);
+
+        if (res < 0)
+            fuse_reply_err(req, -res);
+        else
+            fuse_reply_entry(req, &e);
+    }
+
+    void fs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+    {
+        CHECK_CALLER(req)
+        GET_CHILD_PATH(req, parent, name)
+
+        const int res = fusefs::fs_unlink(path.c_str());
+        if (res == 0)
+            remove_path(path);
+        fuse_reply_err(req, -res);
+    }
+
+    void fs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+    {
+        CHECK_CALLER(req)
+        GET_CHILD_PATH(req, parent, name)
+
+        const int res = fusefs::fs_rmdir(path.c_str());
+        if (res == 0)
+            remove_path(path);
+        fuse_reply_err(req, -res);
+    }
+
+    void fs_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname,
+                   unsigned int flags)
+    {
+        CHECK_CALLER(req)
+
+        std::string from, to;
+        if (get_child_path(parent, name, from) == -1 || get_child_path(newparent, newname, to) == -1)
+        {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+
+        const int res = fusefs::fs_rename(from.c_str(), to.c_str(), flags);
+        if (res == 0)
+            rename_path(from, to);
+        fuse_reply_err(req, -res);
+    }
+
+    void fs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+    {
+        CHECK_CALLER(req)
+        GET_CHILD_PATH(req, parent, name)
+
+        fuse_entry_param e;
+        int res = fusefs::fs_create(path.c_str(), mode, fi);
+        if (res == 0)
+            res = make_entry(path, e);
+
+        if (res < 0)
+            fuse_reply_err(req, -res);
+        else
+            fuse_reply_create(req, &e, fi);
+    }
+
+    void fs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+    {
+        CHECK_CALLER(req)
+        GET_PATH(req, ino)
+
+        const int res = fusefs::fs_open(path.c_str(), fi);
+        if (res < 0)
+            fuse_reply_err(req, -res);
+        else
+            fuse_reply_open(req, fi);
+    }
+
+    void fs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+    {
+        CHECK_CALLER(req)
+        GET_PATH(req, ino)
+
+        // Virtual fs file data is replied while the file is locked. The reply itself handles any send failures.
+        bool replied = false;
+        int res = fusefs::fs_read_segs(path.c_str(), size, off, [&](const std::vector<vfs::vdata_segment> &segs) {
+            replied = true;
+            return reply_data_segs(req, segs);
+        });
+
+        if (replied)
+            return;
+
+        // Index files and hash map queries are served with a data buffer.
+        std::vector<char> buf;
+        if (res == 1)
+        {
+            buf.resize(size);
+            res = fusefs::fs_read(path.c_str(), buf.data(), size, off, fi);
+        }
+
+        if (res < 0)
+            fuse_reply_err(req, -res);
+        else
+            fuse_reply_buf(req, buf.data(), res);
+    }
+
+    void fs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf, off_t off, struct fuse_file_info *fi)
+    {
+        CHECK_CALLER(req)
+        GET_PATH(req, ino)
+
+        size_t size = fuse_buf_size(in_buf);
+        const char *data = (const char *)in_buf->buf[0].mem;
+
+        // Spliced write data has to be copied into memory once since the log record places it between the
+        // block paddings.
+        thread_local std::vector<char> write_buf;
+        if (in_buf->count > 1 || (in_buf->buf[0].flags & FUSE_BUF_IS_FD))
+        {
+            write_buf.resize(size);
+            fuse_bufvec mem_buf = FUSE_BUFVEC_INIT(size);
+            mem_buf.buf[0].mem = write_buf.data();
+
+            const ssize_t copied = fuse_buf_copy(&mem_buf, in_buf, (fuse_buf_copy_flags)0);
+            if (copied < 0)
+            {
+                fuse_reply_err(req, -copied);
+                return;
+            }
+
+            size = copied;
+            data = write_buf.data();
+        }
+
+        const int res = fusefs::fs_write(path.c_str(), data, size, off, fi);
+        if (res < 0)
+            fuse_reply_err(req, -res);
+        else
+            fuse_reply_write(req, res);
+    }
+
+    void fs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+    {
+        CHECK_CALLER(req)
+        GET_PATH(req, ino)
+
+        fuse_reply_err(req, -fusefs::fs_flush(path.c_str(), fi));
+    }
+
+    void fs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+    {
+        CHECK_CALLER(req)
+        GET_PATH(req, ino)
+
+        fuse_reply_err(req, -fusefs::fs_release(path.c_str(), fi));
+    }
+
+    void fs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+    {
+        CHECK_CALLER(req)
+        GET_PATH(req, ino)
+
+        fuse_reply_err(req, -fusefs::fs_fsync(path.c_str(), datasync, fi));
+    }
+
+    void fs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+    {
+        CHECK_CALLER(req)
+        GET_PATH(req, ino)
+
+        dir_listing *listing = new dir_listing();
+        const int res = fusefs::fs_readdir(path.c_str(), listing, fill_dir_listing, 0, fi, (fuse_readdir_flags)0);
+        if (res < 0)
+        {
+            delete listing;
+            fuse_reply_err(req, -res);
+            return;
+        }
+
+        fi->fh = (uint64_t)listing;
+        fuse_reply_open(req, fi);
+    }
+
+    void fs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+    {
+        CHECK_CALLER(req)
+
+        const dir_listing &listing = *(dir_listing *)fi->fh;
+        std::vector<char> buf(size);
+        size_t buf_len = 0;
+
+        // Offset of an entry is the offset to continue from after that entry.
+        for (size_t i = off; i < listing.size(); i++)
+        {
+            const auto &[name, st] = listing[i];
+            const size_t entry_len = fuse_add_direntry(req, buf.data() + buf_len, size - buf_len, name.c_str(), &st, i + 1);
+            if (entry_len > size - buf_len)
+                break;
+            buf_len += entry_len;
+        }
+
+        fuse_reply_buf(req, buf.data(), buf_len);
+    }
+
+    void fs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+    {
+        delete (dir_listing *)fi->fh;
+        fuse_reply_err(req, 0);
+    }
+
+    void fs_statfs(fuse_req_t req, fuse_ino_t ino)
+    {
+        CHECK_CALLER(req)
+        GET_PATH(req, ino)
+
+        struct statvfs st;
+        if (fusefs::fs_statfs(path.c_str(), &st) == -1)
+            fuse_reply_err(req, errno);
+        else
+            fuse_reply_statfs(req, &st);
+    }
+
+    void fs_access(fuse_req_t req, fuse_ino_t ino, int mask)
+    {
+        CHECK_CALLER(req)
+
+        fuse_reply_err(req, 0);
+    }
+
+    void assign_operations(fuse_lowlevel_ops &fs_oper)
+    {
+        fs_oper.init = fs_init;
+        fs_oper.lookup = fs_lookup;
+        fs_oper.forget = fs_forget;
+        fs_oper.forget_multi = fs_forget_multi;
+        fs_oper.getattr = fs_getattr;
+        fs_oper.setattr = fs_setattr;
+        fs_oper.mknod = fs_mknod;
+        fs_oper.mkdir = fs_mkdir;
+        fs_oper.unlink = fs_unlink;
+        fs_oper.rmdir = fs_rmdir;
+        fs_oper.rename = fs_rename;
+        fs_oper.create = fs_create;
+        fs_oper.open = fs_open;
+        fs_oper.read = fs_read;
+        fs_oper.write_buf = fs_write_buf;
+        fs_oper.flush = fs_flush;
+        fs_oper.release = fs_release;
+        fs_oper.fsync = fs_fsync;
+        fs_oper.opendir = fs_opendir;
+        fs_oper.readdir = fs_readdir;
+        fs_oper.releasedir = fs_releasedir;
+        fs_oper.statfs = fs_statfs;
+        fs_oper.access = fs_access;
+    }
+
+    fuse_lowlevel_ops fs_oper;
+
+    int init(char *arg0)
+    {
+        fuse_args args = FUSE_ARGS_INIT(0, NULL);
+        fuse_opt_add_arg(&args, arg0);
+        fuse_opt_add_arg(&args, "-ofsname=hpfs");
+        fuse_opt_add_arg(&args, "-oallow_other"); // Default: "-odefault_permissions"
+
+        umask(0);
+        assign_operations(fs_oper);
+
+        fuse_session *se = fuse_session_new(&args, &fs_oper, sizeof(fs_oper), NULL);
+        if (se == NULL)
+        {
+            LOG_ERROR << "Error in fuse low-level session creation.";
+            fuse_opt_free_args(&args);
+            return -1;
+        }
+
+        int ret = -1;
+        if (fuse_set_signal_handlers(se) == 0)
+        {
+            if (fuse_session_mount(se, ctx.mount_dir.c_str()) == 0)
+            {
+                kernel_cache::init([se](const std::string &full_path, const bool removed) {
+                    return invalidate_path(se, full_path, removed);
+                });
+
+                // This is a blocking call. This will exit when the session receives a signal.
+                ret = fuse_session_loop_mt(se, 0) == 0 ? 0 : -1;
+                kernel_cache::deinit();
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+
+        fuse_session_destroy(se);
+        fuse_opt_free_args(&args);
+        return ret;
+    }
+
+} // namespace hpfs::fusefs_lowlevel
@@ -0,0 +1,9 @@
+#ifndef _HPFS_FUSE_LOWLEVEL_
+#define _HPFS_FUSE_LOWLEVEL_
+
+namespace hpfs::fusefs_lowlevel
+{
+    int init(char *arg0);
+}
+
+#endif
@@ -0,0 +1,260 @@
+#include <sys/stat.h>
+#include <math.h>
+#include <thread>
+#include "builder.hpp"
+#include "tree.hpp"
+#include "../tracelog.hpp"
+#include "../util.hpp"
+#include "../vfs/vfs.hpp"
+
+namespace hpfs::hmap::builder
+{
+    constexpr const char *ROOT_VPATH = "/";
+
+    // Limits of a block hashing task. Blocks of small files are batched into a single task so the per task
+    // overhead does not dominate when there are many small files.
+    constexpr size_t HASH_BATCH_MAX_LEN = tree::BLOCK_SIZE;
+    constexpr size_t HASH_BATCH_MAX_BLOCKS = 1024;
+
+    hmap_builder::hmap_builder(vfs::virtual_filesystem &virt_fs, const size_t thread_count)
+        : virt_fs(virt_fs),
+          thread_count(thread_count > 0 ? thread_count : MAX(std::thread::hardware_concurrency(), 1))
+    {
+    }
+
+    /**
+     * Calculates the hash maps of the specified dir and all its descendants.
+     * @param hmaps List of calculated hash maps keyed by vpath (including the specified dir).
+     * @param root_hash Calculated node hash of the specified dir.
+     * @param vpath Vpath of the dir to start the build at.
+     * @return 0 on success. -1 on error.
+     */
+    int hmap_builder::build(std::vector<std::pair<std::string, store::vnode_hmap>> &hmaps, hasher::h32 &root_hash,
+                            const std::string &vpath)
+    {
+        build_node &root_node = add_node(vpath, NULL, false);
+
+        // Root dir does not have a vnode and its meta hash is always empty.
+        if (vpath == ROOT_VPATH)
+        {
+            root_node.hmap.meta_hash = hasher::h32_empty;
+        }
+        else
+        {
+            vfs::vnode *vn = NULL;
+            if (virt_fs.get_vnode(vpath, &vn) == -1 || !vn)
+            {
+                LOG_ERROR << "Dir hash calc failure in vfs vnode get. " << vpath;
+                return -1;
+            }
+            tree::hmap_tree::generate_meta_hash(root_node.hmap, *vn);
+        }
+
+        enqueue_task([this, &root_node]() { return walk_dir(root_node); });
+        run_tasks();
+
+        if (failed)
+            return -1;
+
+        // All block hashes and child lists are complete at this point. Children always come after their
+        // parent in the node list, so walking it backwards finalizes each node before it is added to the parent.
+        for (auto itr = nodes.rbegin(); itr != nodes.rend(); itr++)
+        {
+            store::vnode_hmap &hmap = itr->hmap;
+
+            // Empty files keep the default (empty) node hash, same as the incremental file hash calculation.
+            if (!hmap.is_file || !hmap.block_hashes.empty())
+            {
+                hmap.node_hash ^= hmap.name_hash;
+                hmap.node_hash ^= hmap.meta_hash;
+            }
+
+            for (const hasher::h32 &block_hash : hmap.block_hashes)
+                hmap.node_hash ^= block_hash;
+
+            if (itr->parent)
+                itr->parent->hmap.node_hash ^= hmap.node_hash;
+        }
+
+        root_hash = root_node.hmap.node_hash;
+
+        hmaps.reserve(hmaps.size() + nodes.size());
+        for (build_node &node : nodes)
+            hmaps.emplace_back(std::move(node.vpath), std::move(node.hmap));
+        nodes.clear();
+
+        return 0;
+    }
+
+    build_node &hmap_builder::add_node(const std::string &vpath, build_node *parent, const bool is_file)
+    {
+        build_node *node;
+        {
+            std::scoped_lock lock(nodes_mutex);
+            node = &nodes.emplace_back();
+        }
+
+        node->vpath = vpath;
+        node->parent = parent;
+        node->hmap.is_file = is_file;
+        node->hmap.node_hash = hasher::h32_empty;
+        tree::hmap_tree::generate_name_hash(node->hmap, vpath);
+        return *node;
+    }
+
+    /**
+     * Lists the children of the specified dir and schedules tasks for each sub dir and batch of file blocks.
+     */
+    int hmap_builder::walk_dir(build_node &dir_node)
+    {
+        vfs::vdir_children_map dir_children;
+        if (virt_fs.get_dir_children(dir_node.vpath, dir_children) == -1)
+        {
+            LOG_ERROR << "Dir hash calc failure in vfs dir children get. " << dir_node.vpath;
+            return -1;
+        }
+
+        hash_batch batch;
+        for (const auto &[child_name, st] : dir_children)
+        {
+            std::string child_vpath = dir_node.vpath;
+            if (child_vpath.back() != '/')
+                child_vpath.append("/");
+            child_vpath.append(child_name);
+
+            const bool is_dir = S_ISDIR(st.st_mode);
+            build_node &child_node = add_node(child_vpath, &dir_node, !is_dir);
+
+            if (is_dir)
+            {
+                vfs::vnode *vn = NULL;
+                if (virt_fs.get_vnode(child_vpath, &vn) == -1 || !vn)
+                {
+                    LOG_ERROR << "Dir hash calc failure in vfs vnode get. " << child_vpath;
+                    return -1;
+                }
+                tree::hmap_tree::generate_meta_hash(child_node.hmap, *vn);
+                enqueue_task([this, &child_node]() { return walk_dir(child_node); });
+            }
+            else if (add_file(child_node, batch) == -1)
+            {
+                return -1;
+            }
+        }
+
+        enqueue_hash_batch(batch);
+        return 0;
+    }
+
+    /**
+     * Calculates the meta hash of the specified file and adds its blocks to the hash batch. Batches are scheduled
+     * as hashing tasks as they fill up.
+     */
+    int hmap_builder::add_file(build_node &file_node, hash_batch &batch)
+    {
+        vfs::vnode *vn = NULL;
+        if (virt_fs.get_vnode(file_node.vpath, &vn) == -1 || !vn)
+        {
+            LOG_ERROR << "File hash calc failure in vfs vnode get. " << file_node.vpath;
+            return -1;
+        }
+
+        tree::hmap_tree::generate_meta_hash(file_node.hmap, *vn);
+
+        const size_t file_size = vn->st.st_size;
+        const uint32_t block_count = file_size == 0
+                                         ? 0
+                                         : ceil((double)file_size / (double)tree::BLOCK_SIZE);
+
+        // Block hash list is sized upfront so each task only writes to its own slots.
+        file_node.hmap.block_hashes.resize(block_count);
+        for (uint32_t block_id = 0; block_id < block_count; block_id++)
+        {
+            batch.blocks.push_back(tree::file_block{tree::file_data_source{*vn, file_size}, block_id, &file_node.hmap.block_hashes[block_id]});
+            batch.data_len += MIN(tree::BLOCK_SIZE, file_size - ((size_t)block_id * tree::BLOCK_SIZE));
+            if (batch.data_len >= HASH_BATCH_MAX_LEN || batch.blocks.size() >= HASH_BATCH_MAX_BLOCKS)
+                enqueue_hash_batch(batch);
+        }
+
+        return 0;
+    }
+
+    /**
+     * Schedules a task to hash the blocks of the batch and starts over with an empty batch.
+     */
+    void hmap_builder::enqueue_hash_batch(hash_batch &batch)
+    {
+        if (batch.blocks.empty())
+            return;
+
+        enqueue_task([blocks = std::move(batch.blocks)]() {
+            return tree::hmap_tree::hash_file_blocks(blocks);
+        });
+        batch = hash_batch{};
+    }
+
+    void hmap_builder::enqueue_task(std::function<int()> task)
+    {
+        std::scoped_lock lock(tasks_mutex);
+        if (failed)
+            return;
+
+        tasks.push_back(std::move(task));
+        pending_tasks++;
+        tasks_cv.notify_one();
+    }
+
+    /**
+     * Executes queued tasks on the calling thread and (thread_count - 1) worker threads until there are
+     * no more pending tasks or until a task fails.
+     */
+    void hmap_builder::run_tasks()
+    {
+        const auto work = [this]() {
+            while (true)
+            {
+                std::function<int()> task;
+                {
+                    std::unique_lock lock(tasks_mutex);
+
+                    // Executing tasks may queue more tasks. So we wait until all pending tasks are complete.
+                    tasks_cv.wait(lock, [this]() { return !tasks.empty() || pending_tasks == 0; });
+                    if (tasks.empty())
+                        return;
+
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+
+                const int res = task();
+
+                std::scoped_lock lock(tasks_mutex);
+                pending_tasks--;
+
+                // On failure we discard all the queued tasks so the workers exit as soon as possible.
+                if (res == -1)
+                {
+                    failed = true;
+                    pending_tasks -= tasks.size();
+                    tasks.clear();
+                }
+
+                if (pending_tasks == 0)
+                    tasks_cv.notify_all();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < thread_count; i++)
+            workers.emplace_back([&work]() {
+                util::mask_signal();
+                work();
+            });
+
+        work();
+
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+
+} // namespace hpfs::hmap::builder
@@ -0,0 +1,70 @@
+#ifndef _HPFS_HMAP_BUILDER_
+#define _HPFS_HMAP_BUILDER_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include "hasher.hpp"
+#include "store.hpp"
+#include "tree.hpp"
+#include "../vfs/virtual_filesystem.hpp"
+
+namespace hpfs::hmap::builder
+{
+    // A vnode discovered during the tree walk along with its hash map.
+    struct build_node
+    {
+        std::string vpath;
+        build_node *parent = NULL; // NULL for the dir the build was started at.
+        store::vnode_hmap hmap;
+    };
+
+    // File blocks collected to be hashed together in a single task.
+    struct hash_batch
+    {
+        std::vector<tree::file_block> blocks;
+        size_t data_len = 0; // Total length of the block data.
+    };
+
+    /**
+     * Calculates the hash maps of an entire directory tree from scratch using a pool of threads.
+     * Directory listings and batches of file block hashes are processed as independent tasks taken from a
+     * shared queue. Node hashes are combined with XOR after all tasks complete so the results are identical
+     * regardless of the no. of threads or the order the tasks got executed.
+     */
+    class hmap_builder
+    {
+    private:
+        vfs::virtual_filesystem &virt_fs;
+        const size_t thread_count;
+
+        // Discovered vnodes. Parents always appear before their children. We use a deque because
+        // references to existing elements remain valid while new nodes are being appended.
+        std::deque<build_node> nodes;
+        std::mutex nodes_mutex;
+
+        std::deque<std::function<int()>> tasks;
+        std::mutex tasks_mutex;
+        std::condition_variable tasks_cv;
+        size_t pending_tasks = 0; // No. of queued + executing tasks.
+        bool failed = false;
+
+        build_node &add_node(const std::string &vpath, build_node *parent, const bool is_file);
+        void enqueue_task(std::function<int()> task);
+        void run_tasks();
+        int walk_dir(build_node &dir_node);
+        int add_file(build_node &file_node, hash_batch &batch);
+        void enqueue_hash_batch(hash_batch &batch);
+
+    public:
+        hmap_builder(vfs::virtual_filesystem &virt_fs, const size_t thread_count);
+        int build(std::vector<std::pair<std::string, store::vnode_hmap>> &hmaps, hasher::h32 &root_hash,
+                  const std::string &vpath);
+    };
+
+} // namespace hpfs::hmap::builder
+
+#endif
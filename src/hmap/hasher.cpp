@@ -3,12 +3,26 @@
 #include <blake3.h>
 #include <string.h>
 #include <iomanip>
+#include <thread>
+#include <vector>
 
 /**
  * Based on https://github.com/codetsunami/file-ptracer/blob/master/merkle.cpp
  */
 namespace hpfs::hmap::hasher
 {
+    // Minimum no. of input bytes per lane. Smaller batches are not worth the thread start up cost.
+    constexpr size_t MIN_LANE_LEN = 1024 * 1024; // 1MB
+
+    // blake3 constants used by the chunk tree. (See the blake3 specification)
+    constexpr size_t BLOCK_LEN = 64;
+    constexpr uint8_t CHUNK_START = 1 << 0;
+    constexpr uint8_t CHUNK_END = 1 << 1;
+    constexpr uint8_t PARENT = 1 << 2;
+    constexpr uint8_t ROOT = 1 << 3;
+    constexpr uint32_t IV[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+    constexpr uint8_t MSG_PERMUTATION[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+
     /**
      * Helper functions for working with 32 byte hash type h32.
      */
@@ -77,4 +91,226 @@ namespace hpfs::hmap::hasher
         blake3_hasher_finalize(&hasher, reinterpret_cast<uint8_t *>(&hash), sizeof(h32));
     }
 
+    /**
+     * Hashes a batch of independent inputs. Large batches are split into contiguous lanes of inputs which are hashed
+     * by parallel threads. Smaller batches are hashed on the calling thread.
+     * @param hashes Hashes of the inputs. Must have room for 'count' hashes.
+     * @param inputs Inputs to hash.
+     * @param count No. of inputs.
+     * @param max_lanes Maximum no. of threads (including the calling thread) to hash the batch with.
+     */
+    void hash_bufs(h32 *hashes, const hash_input *inputs, const size_t count, const size_t max_lanes)
+    {
+        size_t total_len = 0;
+        for (size_t i = 0; i < count; i++)
+            total_len += inputs[i].len1 + inputs[i].len2;
+
+        const size_t lanes = MIN(MIN(max_lanes, count), MAX(1, total_len / MIN_LANE_LEN));
+        if (lanes <= 1)
+        {
+            hash_lane(hashes, inputs, count);
+            return;
+        }
+
+        // Calling thread takes the last lane. Remainder inputs are spread across the first lanes.
+        std::vector<std::thread> threads;
+        threads.reserve(lanes - 1);
+        size_t start = 0;
+        for (size_t lane = 0; lane < lanes; lane++)
+        {
+            const size_t lane_count = (count / lanes) + (lane < (count % lanes) ? 1 : 0);
+            if (lane == lanes - 1)
+                hash_lane(hashes + start, inputs + start, lane_count);
+            else
+                threads.emplace_back(hash_lane, hashes + start, inputs + start, lane_count);
+            start += lane_count;
+        }
+
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+
+    /**
+     * Hashes the inputs one after the other reusing the same hasher.
+     */
+    void hash_lane(h32 *hashes, const hash_input *inputs, const size_t count)
+    {
+        blake3_hasher hasher;
+        for (size_t i = 0; i < count; i++)
+        {
+            const hash_input &input = inputs[i];
+            blake3_hasher_init(&hasher);
+            blake3_hasher_update(&hasher, input.buf1, input.len1);
+            if (input.len2 > 0)
+                blake3_hasher_update(&hasher, input.buf2, input.len2);
+            blake3_hasher_finalize(&hasher, reinterpret_cast<uint8_t *>(&hashes[i]), sizeof(h32));
+        }
+    }
+
+    /**
+     * Hashes an input longer than a chunk while keeping the chaining values of its hash tree. The hash is the same as the
+     * hash_buf() hash of the input.
+     * @param hash Hash of the input.
+     * @param tree Hash tree to populate.
+     * @param input Input to hash. Must be longer than a chunk.
+     */
+    void build_chunk_tree(h32 &hash, chunk_tree &tree, const hash_input &input)
+    {
+        tree.input_len = input.len1 + input.len2;
+        tree.levels.clear();
+
+        std::vector<h32> &chunks = tree.levels.emplace_back((tree.input_len + CHUNK_LEN - 1) / CHUNK_LEN);
+        uint8_t chunk_buf[CHUNK_LEN];
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            // Chunks are taken from the second buffer directly unless they overlap the first buffer.
+            const size_t chunk_offset = i * CHUNK_LEN;
+            const size_t chunk_len = MIN(CHUNK_LEN, tree.input_len - chunk_offset);
+            if (chunk_offset >= input.len1)
+            {
+                hash_chunk(chunks[i], (const uint8_t *)input.buf2 + (chunk_offset - input.len1), chunk_len, i);
+                continue;
+            }
+
+            const size_t len1 = MIN(chunk_len, input.len1 - chunk_offset);
+            memcpy(chunk_buf, (const uint8_t *)input.buf1 + chunk_offset, len1);
+            memcpy(chunk_buf + len1, input.buf2, chunk_len - len1);
+            hash_chunk(chunks[i], chunk_buf, chunk_len, i);
+        }
+
+        // Parent levels are populated by updating the whole tree.
+        size_t level_size = chunks.size();
+        while (level_size > 2)
+        {
+            level_size = (level_size + 1) / 2;
+            tree.levels.emplace_back(level_size);
+        }
+
+        update_chunk_tree(hash, tree, 0, NULL, 0);
+    }
+
+    /**
+     * Rehashes an input whose hash tree is known, after a run of its chunks have changed.
+     * @param hash Hash of the input.
+     * @param tree Hash tree of the input. Must be built with the current input length.
+     * @param first_chunk Index of the first changed chunk.
+     * @param data Input data of the changed chunks starting at the first changed chunk.
+     * @param len Length of the changed chunk data. Must be a multiple of chunk length unless it reaches the end of input.
+     */
+    void update_chunk_tree(h32 &hash, chunk_tree &tree, const size_t first_chunk, const uint8_t *data, const size_t len)
+    {
+        std::vector<h32> &chunks = tree.levels.front();
+        for (size_t offset = 0; offset < len; offset += CHUNK_LEN)
+            hash_chunk(chunks[first_chunk + (offset / CHUNK_LEN)], data + offset, MIN(CHUNK_LEN, len - offset), first_chunk + (offset / CHUNK_LEN));
+
+        // Recalculate the parent nodes above the changed chunks. Whole tree is recalculated if no chunks were given.
+        size_t first = len == 0 ? 0 : first_chunk;
+        size_t last = len == 0 ? (chunks.size() - 1) : (first_chunk + ((len - 1) / CHUNK_LEN));
+        for (size_t level = 1; level < tree.levels.size(); level++)
+        {
+            const std::vector<h32> &children = tree.levels[level - 1];
+            std::vector<h32> &nodes = tree.levels[level];
+            first /= 2;
+            last /= 2;
+            for (size_t i = first; i <= last; i++)
+            {
+                if ((i * 2) + 1 < children.size())
+                    hash_parent(nodes[i], children[i * 2], children[(i * 2) + 1], false);
+                else
+                    nodes[i] = children[i * 2];
+            }
+        }
+
+        const std::vector<h32> &top = tree.levels.back();
+        hash_parent(hash, top[0], top[1], true);
+    }
+
+    /**
+     * Calculates the chaining value of a (non root) chunk.
+     */
+    void hash_chunk(h32 &cv, const uint8_t *chunk, const size_t len, const uint64_t chunk_index)
+    {
+        uint32_t words[8];
+        memcpy(words, IV, sizeof(words));
+
+        uint8_t block_buf[BLOCK_LEN];
+        for (size_t offset = 0; offset < len || offset == 0; offset += BLOCK_LEN)
+        {
+            const size_t block_len = MIN(BLOCK_LEN, len - offset);
+            const uint8_t *block = chunk + offset;
+            if (block_len < BLOCK_LEN) // Last partial block is zero padded.
+            {
+                memset(block_buf, 0, BLOCK_LEN);
+                memcpy(block_buf, block, block_len);
+                block = block_buf;
+            }
+
+            const uint8_t flags = (offset == 0 ? CHUNK_START : 0) | (offset + BLOCK_LEN >= len ? CHUNK_END : 0);
+            compress(words, block, block_len, chunk_index, flags);
+        }
+
+        memcpy(&cv, words, sizeof(cv)); // Chaining value words are little endian. (Same as the hash bytes)
+    }
+
+    /**
+     * Calculates the chaining value of a parent node. Root node chaining value is the hash of the input.
+     */
+    void hash_parent(h32 &cv, const h32 &left, const h32 &right, const bool is_root)
+    {
+        uint8_t block[BLOCK_LEN];
+        memcpy(block, &left, sizeof(h32));
+        memcpy(block + sizeof(h32), &right, sizeof(h32));
+
+        uint32_t words[8];
+        memcpy(words, IV, sizeof(words));
+        compress(words, block, BLOCK_LEN, 0, PARENT | (is_root ? ROOT : 0));
+        memcpy(&cv, words, sizeof(cv));
+    }
+
+    /**
+     * blake3 compression function. Replaces the given chaining value with the compression output chaining value.
+     * Portable version based on the blake3 reference implementation. Word byte order is assumed to be little endian.
+     */
+    void compress(uint32_t cv[8], const uint8_t *block, const uint8_t block_len, const uint64_t counter, const uint8_t flags)
+    {
+        uint32_t m[16];
+        memcpy(m, block, sizeof(m));
+
+        uint32_t s[16] = {cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+                          IV[0], IV[1], IV[2], IV[3], (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags};
+
+        const auto rotr = [](const uint32_t w, const int c) { return (w >> c) | (w << (32 - c)); };
+        const auto g = [&](const int a, const int b, const int c, const int d, const uint32_t x, const uint32_t y) {
+            s[a] = s[a] + s[b] + x;
+            s[d] = rotr(s[d] ^ s[a], 16);
+            s[c] = s[c] + s[d];
+            s[b] = rotr(s[b] ^ s[c], 12);
+            s[a] = s[a] + s[b] + y;
+            s[d] = rotr(s[d] ^ s[a], 8);
+            s[c] = s[c] + s[d];
+            s[b] = rotr(s[b] ^ s[c], 7);
+        };
+
+        for (int round = 0; round < 7; round++)
+        {
+            // Mix the columns and then the diagonals.
+            g(0, 4, 8, 12, m[0], m[1]);
+            g(1, 5, 9, 13, m[2], m[3]);
+            g(2, 6, 10, 14, m[4], m[5]);
+            g(3, 7, 11, 15, m[6], m[7]);
+            g(0, 5, 10, 15, m[8], m[9]);
+            g(1, 6, 11, 12, m[10], m[11]);
+            g(2, 7, 8, 13, m[12], m[13]);
+            g(3, 4, 9, 14, m[14], m[15]);
+
+            uint32_t permuted[16];
+            for (int i = 0; i < 16; i++)
+                permuted[i] = m[MSG_PERMUTATION[i]];
+            memcpy(m, permuted, sizeof(m));
+        }
+
+        for (int i = 0; i < 8; i++)
+            cv[i] = s[i] ^ s[i + 8];
+    }
+
 } // namespace hpfs::hmap::hasher
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 namespace hpfs::hmap::hasher
 {
@@ -20,9 +21,40 @@ namespace hpfs::hmap::hasher
     };
     extern h32 h32_empty;
 
+    // An independent input of a hash batch. Its hash is the hash of buf1 followed by buf2.
+    struct hash_input
+    {
+        const void *buf1 = NULL;
+        size_t len1 = 0;
+        const void *buf2 = NULL;
+        size_t len2 = 0;
+    };
+
+    // blake3 chunk length. Inputs are hashed as a binary tree of chunks.
+    constexpr size_t CHUNK_LEN = 1024;
+
+    /**
+     * Chaining values of the blake3 hash tree of an input longer than a chunk. Keeping the tree allows rehashing the input
+     * by hashing only the changed chunks and the tree nodes above them. levels[0] has the chunk chaining values and each
+     * next level has the parent node chaining values of the level below. (An odd node at the end of a level is carried
+     * to the next level as it is) The last level has the two children of the root node.
+     */
+    struct chunk_tree
+    {
+        size_t input_len = 0;
+        std::vector<std::vector<h32>> levels;
+    };
+
     std::ostream &operator<<(std::ostream &output, const h32 &h);
     void hash_buf(h32 &hash, std::string_view sv);
     void hash_buf(h32 &hash, const void *buf1, const size_t len1, const void *buf2, const size_t len2);
+    void hash_bufs(h32 *hashes, const hash_input *inputs, const size_t count, const size_t max_lanes = 1);
+    void hash_lane(h32 *hashes, const hash_input *inputs, const size_t count);
+    void build_chunk_tree(h32 &hash, chunk_tree &tree, const hash_input &input);
+    void update_chunk_tree(h32 &hash, chunk_tree &tree, const size_t first_chunk, const uint8_t *data, const size_t len);
+    void hash_chunk(h32 &cv, const uint8_t *chunk, const size_t len, const uint64_t chunk_index);
+    void hash_parent(h32 &cv, const h32 &left, const h32 &right, const bool is_root);
+    void compress(uint32_t cv[8], const uint8_t *block, const uint8_t block_len, const uint64_t counter, const uint8_t flags);
 
 } // namespace hpfs::hmap::hasher
 
@@ -50,15 +50,24 @@ namespace hpfs::hmap::query
         return req; // Return the request struct with 'undefined' request type.
     }
 
+    /**
+     * Builds the request path of the specified query on the vpath.
+     */
+    const std::string hmap_query::get_request_path(const std::string &vpath, const MODE mode)
+    {
+        return vpath + (mode == MODE::HASH ? HASH_REQUEST_PATTERN : CHILDREN_REQUEST_PATTERN);
+    }
+
     int hmap_query::getattr(const request &req, struct stat *stbuf) const
     {
-        store::vnode_hmap *node_hmap;
-        if (tree.get_vnode_hmap(&node_hmap, req.vpath) == -1)
+        store::vnode_hmap node_hmap;
+        const int res = tree.get_vnode_hmap(node_hmap, req.vpath, req.mode == MODE::CHILDREN);
+        if (res == -1)
         {
             LOG_ERROR << "Error in hmap query getattr tree get" << req.vpath;
             return -1;
         }
-        if (!node_hmap)
+        if (res == 0)
             return -ENOENT;
 
         stbuf->st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
@@ -72,9 +81,9 @@ namespace hpfs::hmap::query
             // If it's a file, we take the file block hashes.
             // If it's a directory, we take the directory children node hashes.
 
-            if (node_hmap->is_file)
+            if (node_hmap.is_file)
             {
-                stbuf->st_size = sizeof(hasher::h32) * node_hmap->block_hashes.size();
+                stbuf->st_size = sizeof(hasher::h32) * node_hmap.block_hashes.size();
             }
             else // Is directory
             {
@@ -95,27 +104,28 @@ namespace hpfs::hmap::query
 
     int hmap_query::read(const request &req, char *buf, const size_t size) const
     {
-        store::vnode_hmap *node_hmap;
-        if (tree.get_vnode_hmap(&node_hmap, req.vpath) == -1)
+        store::vnode_hmap node_hmap;
+        const int res = tree.get_vnode_hmap(node_hmap, req.vpath, req.mode == MODE::CHILDREN);
+        if (res == -1)
         {
             LOG_ERROR << "Error in hmap query read tree get" << req.vpath;
             return -1;
         }
-        if (!node_hmap)
+        if (res == 0)
             return -ENOENT;
 
         if (req.mode == MODE::HASH) // Node hash
         {
             const size_t read_len = MIN(size, sizeof(hasher::h32));
-            memcpy(buf, &node_hmap->node_hash, read_len);
+            memcpy(buf, &node_hmap.node_hash, read_len);
             return read_len;
         }
         else // Children
         {
             // If it's a file, we take the file block hashes.
             // If it's a directory, we take the directory children node hashes.
-            return (node_hmap->is_file)
-                       ? read_file_block_hashes(*node_hmap, buf, size)
+            return (node_hmap.is_file)
+                       ? read_file_block_hashes(node_hmap, buf, size)
                        : read_dir_children_hashes(req.vpath, buf, size);
         }
     }
@@ -147,15 +157,15 @@ namespace hpfs::hmap::query
                 child_vpath.append("/");
             child_vpath.append(child_name);
 
-            store::vnode_hmap *node_hmap;
-            if (tree.get_vnode_hmap(&node_hmap, child_vpath) == -1 || !node_hmap)
+            store::vnode_hmap node_hmap;
+            if (tree.get_vnode_hmap(node_hmap, child_vpath, false) != 1)
             {
                 LOG_ERROR << "Error in hmap query dir children tree get" << vpath;
                 return -1;
             }
 
-            children_hashes[idx].is_file = node_hmap->is_file;
-            children_hashes[idx].node_hash = node_hmap->node_hash;
+            children_hashes[idx].is_file = node_hmap.is_file;
+            children_hashes[idx].node_hash = node_hmap.node_hash;
             strcpy(children_hashes[idx].name, child_name.c_str());
             idx++;
         }
@@ -38,6 +38,7 @@ namespace hpfs::hmap::query
     public:
         hmap_query(tree::hmap_tree &tree, vfs::virtual_filesystem &virt_fs);
         request parse_request_path(const char *request_path) const;
+        static const std::string get_request_path(const std::string &vpath, const MODE mode);
         int getattr(const request &req, struct stat *stbuf) const;
         int read(const request &req, char *buf, const size_t size) const;
         int read_file_block_hashes(const store::vnode_hmap &node_hmap, char *buf, const size_t size) const;
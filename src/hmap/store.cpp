@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include "store.hpp"
+#include "store_db.hpp"
 #include "hasher.hpp"
 #include "../hpfs.hpp"
 #include "../tracelog.hpp"
@@ -16,44 +17,183 @@ namespace hpfs::hmap::store
 {
     constexpr const char *HASH_MAP_CACHE_FILE_EXT = ".hcache";
     constexpr int FILE_PERMS = 0644;
+    constexpr size_t HASH_MAP_ENTRY_OVERHEAD = 128; // Approx. memory taken by the map node and the LRU list node of a hash map.
+    constexpr double EVICT_TARGET_RATIO = 0.9;      // Eviction goes below the memory limit so it does not happen on every operation.
 
     void hmap_store::set_dirty(const std::string &vpath)
     {
-        dirty_vpaths.emplace(vpath);
+        // Dirty list holds a reference to the vpath id until the hash map is persisted.
+        const vpaths::vpath_id id = vpaths.acquire(vpath);
+        if (!dirty_vpaths.emplace(id).second)
+            vpaths.release(id);
+    }
+
+    void hmap_store::set_dirty(const vpaths::vpath_id id)
+    {
+        if (dirty_vpaths.emplace(id).second)
+            vpaths.add_ref(id);
     }
 
     vnode_hmap *hmap_store::find_hash_map(const std::string &vpath)
     {
-        auto iter = hash_map.find(vpath);
+        const vpaths::vpath_id id = vpaths.find(vpath);
+        const auto iter = (id == vpaths::NO_VPATH_ID) ? hash_map.end() : hash_map.find(id);
+        if (iter == hash_map.end())
+            return load_hash_map(vpath);
 
+        stats.hits++;
+        touch_hash_map(*iter);
+        return &iter->second.hmap;
+    }
+
+    vnode_hmap *hmap_store::find_hash_map(const vpaths::vpath_id id)
+    {
+        const auto iter = hash_map.find(id);
         if (iter == hash_map.end())
-        {
-            // Attempt to load from persisted cache.
-            vnode_hmap cached_hmap;
-            int res = read_hash_map_cache_file(cached_hmap, vpath);
-            if (res == 1)
-            {
-                const auto [insert_iter, success] = hash_map.try_emplace(vpath, std::move(cached_hmap));
-                iter = insert_iter;
-            }
-        }
+            return load_hash_map(vpaths.get_path(id));
+
+        stats.hits++;
+        touch_hash_map(*iter);
+        return &iter->second.hmap;
+    }
+
+    /**
+     * Attempts to load a hash map which is not in memory from the persisted cache.
+     * @return The loaded hash map. NULL if not persisted or on error.
+     */
+    vnode_hmap *hmap_store::load_hash_map(const std::string &vpath)
+    {
+        stats.misses++;
 
-        vnode_hmap *node_hmap = (iter == hash_map.end()) ? NULL : &iter->second;
-        return node_hmap;
+        vnode_hmap cached_hmap;
+        const int res = hpfs::ctx.hmap_db_enabled ? store_db::read_hash_map(cached_hmap, vpath)
+                                                  : read_hash_map_cache_file(cached_hmap, vpath);
+        if (res != 1)
+            return NULL;
+
+        return &insert_acquired_hash_map(vpaths.acquire(vpath), std::move(cached_hmap));
     }
 
     void hmap_store::erase_hash_map(const std::string &vpath)
     {
-        hash_map.erase(vpath);
+        const vpaths::vpath_id id = vpaths.find(vpath);
+        const auto iter = (id == vpaths::NO_VPATH_ID) ? hash_map.end() : hash_map.find(id);
+        if (iter != hash_map.end())
+            erase_cached_hash_map(iter);
     }
 
     void hmap_store::insert_hash_map(const std::string &vpath, vnode_hmap &&node_hmap)
     {
-        hash_map.try_emplace(vpath, std::move(node_hmap));
+        insert_acquired_hash_map(vpaths.acquire(vpath), std::move(node_hmap));
+    }
+
+    /**
+     * Inserts or replaces the hash map of a vpath id acquired by the caller. The hash map keeps the acquired reference
+     * if it is a new one. Otherwise the reference is released.
+     * @return The inserted hash map.
+     */
+    vnode_hmap &hmap_store::insert_acquired_hash_map(const vpaths::vpath_id id, vnode_hmap &&node_hmap)
+    {
+        const auto [iter, inserted] = hash_map.try_emplace(id);
+        iter->second.hmap = std::move(node_hmap);
+        if (inserted)
+        {
+            lru_hmaps.push_front(&(*iter));
+            iter->second.lru_itr = lru_hmaps.begin();
+        }
+        else
+        {
+            vpaths.release(id);
+        }
+        touch_hash_map(*iter);
+        return iter->second.hmap;
+    }
+
+    /**
+     * Marks the hash map as the most recently used one. Its memory gets measured again at the next trim since the
+     * caller may modify it.
+     */
+    void hmap_store::touch_hash_map(std::pair<const vpaths::vpath_id, cached_hmap> &entry)
+    {
+        lru_hmaps.splice(lru_hmaps.begin(), lru_hmaps, entry.second.lru_itr);
+        entry.second.touched = true;
+    }
+
+    void hmap_store::erase_cached_hash_map(std::unordered_map<vpaths::vpath_id, cached_hmap>::iterator iter)
+    {
+        const vpaths::vpath_id id = iter->first;
+        stats.mem_size -= iter->second.mem_len;
+        lru_hmaps.erase(iter->second.lru_itr);
+        hash_map.erase(iter);
+        vpaths.release(id);
+    }
+
+    void hmap_store::clear_dirty_vpaths()
+    {
+        for (const vpaths::vpath_id id : dirty_vpaths)
+            vpaths.release(id);
+        dirty_vpaths.clear();
+    }
+
+    /**
+     * Erases the hash maps of the specified vpath and all its descendants from the store and the persisted cache.
+     * @return 0 on success. -1 on error.
+     */
+    int hmap_store::erase_hash_map_tree(const std::string &vpath)
+    {
+        // Tree id is held until the erasure is done since releasing the erased ids may otherwise free it.
+        const vpaths::vpath_id tree_id = vpaths.acquire(vpath);
+
+        for (auto iter = hash_map.begin(); iter != hash_map.end();)
+        {
+            const auto next = std::next(iter);
+            if (vpaths.is_in_tree(iter->first, tree_id))
+                erase_cached_hash_map(iter);
+            iter = next;
+        }
+
+        for (auto iter = dirty_vpaths.begin(); iter != dirty_vpaths.end();)
+        {
+            const vpaths::vpath_id id = *iter;
+            if (vpaths.is_in_tree(id, tree_id))
+            {
+                iter = dirty_vpaths.erase(iter);
+                vpaths.release(id);
+            }
+            else
+            {
+                iter++;
+            }
+        }
+
+        vpaths.release(tree_id);
+
+        if (hpfs::ctx.hmap_db_enabled)
+            return store_db::erase_hash_maps(vpath);
+
+        const std::string cache_filename = get_vpath_cache_file(vpath);
+        if (unlink(cache_filename.c_str()) == -1 && errno != ENOENT)
+        {
+            LOG_ERROR << errno << ": Error when removing cache file " << cache_filename;
+            return -1;
+        }
+
+        // Cache dir only exists if there are hash maps of children.
+        const std::string cache_dir = get_vpath_cache_dir(vpath);
+        if (util::is_dir_exists(cache_dir) && util::remove_directory_recursively(cache_dir) == -1)
+        {
+            LOG_ERROR << errno << ": Error when removing cache dir " << cache_dir;
+            return -1;
+        }
+
+        return 0;
     }
 
     int hmap_store::move_hash_map_cache(const std::string &from_vpath, const std::string &to_vpath, const bool is_dir)
     {
+        if (hpfs::ctx.hmap_db_enabled)
+            return store_db::move_hash_maps(from_vpath, to_vpath, is_dir);
+
         const std::string cache_filename_from = get_vpath_cache_file(from_vpath);
         const std::string cache_filename_to = get_vpath_cache_file(to_vpath);
         if (rename(cache_filename_from.data(), cache_filename_to.data()) == -1)
@@ -77,10 +217,31 @@ namespace hpfs::hmap::store
 
     int hmap_store::persist_hash_maps()
     {
-        for (const std::string &vpath : dirty_vpaths)
+        if (hpfs::ctx.hmap_db_enabled)
+        {
+            // All dirty hash maps are appended to the db with a single write.
+            // Deleted hash maps are passed as NULL so the db records them as deleted.
+            std::vector<std::string> vpaths_list;
+            std::vector<std::pair<std::string_view, const vnode_hmap *>> hmaps;
+            vpaths_list.reserve(dirty_vpaths.size()); // Reserved so the string views remain valid.
+            hmaps.reserve(dirty_vpaths.size());
+            for (const vpaths::vpath_id id : dirty_vpaths)
+            {
+                const auto iter = hash_map.find(id);
+                hmaps.emplace_back(vpaths_list.emplace_back(vpaths.get_path(id)), iter == hash_map.end() ? NULL : &iter->second.hmap);
+            }
+
+            if (store_db::write_hash_maps(hmaps) == -1)
+                return -1;
+
+            clear_dirty_vpaths();
+            return 0;
+        }
+
+        for (const vpaths::vpath_id id : dirty_vpaths)
         {
-            const auto iter = hash_map.find(vpath);
-            const std::string cache_filename = get_vpath_cache_file(vpath);
+            const auto iter = hash_map.find(id);
+            const std::string cache_filename = get_vpath_cache_file(vpaths.get_path(id));
 
             if (iter == hash_map.end())
             {
@@ -89,11 +250,11 @@ namespace hpfs::hmap::store
             }
             else
             {
-                if (persist_hash_map_cache_file(iter->second, cache_filename) == -1)
+                if (persist_hash_map_cache_file(iter->second.hmap, cache_filename) == -1)
                     return -1;
             }
         }
-        dirty_vpaths.clear();
+        clear_dirty_vpaths();
 
         return 0;
     }
@@ -196,14 +357,115 @@ namespace hpfs::hmap::store
     */
     int hmap_store::clear()
     {
-        if (util::remove_directory_recursively(hpfs::ctx.hmap_dir) == -1)
+        if (hpfs::ctx.hmap_db_enabled)
+        {
+            if (store_db::clear() == -1)
+            {
+                LOG_ERROR << "Error cleaning persisted hmap db after truncation";
+                return -1;
+            }
+        }
+        else if (util::remove_directory_recursively(hpfs::ctx.hmap_dir) == -1)
         {
             LOG_ERROR << "Error cleaning persisted hmap files after truncation";
             return -1;
         }
         hash_map.clear();
+        lru_hmaps.clear();
         dirty_vpaths.clear();
+        vpaths.clear();
+        stats.mem_size = 0;
         return 0;
     }
 
+    /**
+     * Updates the memory estimate of the in-memory hash maps and evicts the least recently used ones if they exceed
+     * the configured memory limit. Hash maps handed out earlier must not be used after this. The store is not thread
+     * safe. So callers must serialize the access to it (hash map tree does it with its tree lock).
+     * @return 0 on success. -1 on error.
+     */
+    int hmap_store::trim()
+    {
+        // Hash maps handed out since the last trim are at the front of the LRU list.
+        for (auto entry : lru_hmaps)
+        {
+            cached_hmap &cached = entry->second;
+            if (!cached.touched)
+                break;
+
+            const size_t mem_len = HASH_MAP_ENTRY_OVERHEAD + (cached.hmap.block_hashes.capacity() * sizeof(hasher::h32));
+            stats.mem_size = stats.mem_size - cached.mem_len + mem_len;
+            cached.mem_len = mem_len;
+            cached.touched = false;
+        }
+
+        if (hpfs::ctx.hmap_cache_limit == 0 || stats.mem_size <= hpfs::ctx.hmap_cache_limit)
+            return 0;
+
+        return evict_hash_maps(hpfs::ctx.hmap_cache_limit * EVICT_TARGET_RATIO);
+    }
+
+    /**
+     * Evicts the least recently used hash maps until the memory estimate drops to the target size. Dirty hash maps
+     * are persisted before they are evicted so they can be read back later.
+     * @return 0 on success. -1 on error.
+     */
+    int hmap_store::evict_hash_maps(const size_t target_size)
+    {
+        // Collect the hash maps to evict from the back of the LRU list.
+        std::vector<std::pair<const vpaths::vpath_id, cached_hmap> *> evicted;
+        size_t mem_size = stats.mem_size;
+        for (auto itr = lru_hmaps.rbegin(); itr != lru_hmaps.rend() && mem_size > target_size; itr++)
+        {
+            evicted.push_back(*itr);
+            mem_size -= (*itr)->second.mem_len;
+        }
+
+        // Persist the dirty ones among them. Db writes are done together.
+        std::vector<std::string> vpaths_list;
+        std::vector<std::pair<std::string_view, const vnode_hmap *>> dirty_hmaps;
+        vpaths_list.reserve(evicted.size()); // Reserved so the string views remain valid.
+        for (const auto entry : evicted)
+        {
+            if (dirty_vpaths.count(entry->first) == 0)
+                continue;
+
+            const std::string &vpath = vpaths_list.emplace_back(vpaths.get_path(entry->first));
+            if (hpfs::ctx.hmap_db_enabled)
+                dirty_hmaps.emplace_back(vpath, &entry->second.hmap);
+            else if (persist_hash_map_cache_file(entry->second.hmap, get_vpath_cache_file(vpath)) == -1)
+            {
+                LOG_ERROR << errno << ": Error persisting evicted hash map. " << vpath;
+                return -1;
+            }
+        }
+
+        if (!dirty_hmaps.empty() && store_db::write_hash_maps(dirty_hmaps) == -1)
+        {
+            LOG_ERROR << "Error persisting evicted hash maps.";
+            return -1;
+        }
+
+        for (const auto entry : evicted)
+        {
+            const vpaths::vpath_id id = entry->first;
+            if (dirty_vpaths.erase(id) == 1)
+                vpaths.release(id);
+            erase_cached_hash_map(hash_map.find(id));
+        }
+
+        stats.evictions += evicted.size();
+        return 0;
+    }
+
+    const cache_stats &hmap_store::get_stats() const
+    {
+        return stats;
+    }
+
+    vpaths::vpath_table &hmap_store::get_vpaths()
+    {
+        return vpaths;
+    }
+
 } // namespace hpfs::hmap::store
\ No newline at end of file
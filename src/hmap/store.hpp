@@ -3,9 +3,11 @@
 
 #include <string>
 #include <vector>
+#include <list>
 #include <unordered_set>
 #include <unordered_map>
 #include "hasher.hpp"
+#include "../vpaths.hpp"
 
 namespace hpfs::hmap::store
 {
@@ -18,27 +20,64 @@ namespace hpfs::hmap::store
         std::vector<hasher::h32> block_hashes; // Only relevant for files.
     };
 
+    // A hash map kept in memory.
+    struct cached_hmap
+    {
+        vnode_hmap hmap;
+        std::list<std::pair<const vpaths::vpath_id, cached_hmap> *>::iterator lru_itr; // Position in the LRU list.
+        size_t mem_len = 0;   // Estimated memory taken by the hash map when it was last measured.
+        bool touched = false; // Whether the hash map has been handed out since it was last measured.
+    };
+
+    // In-memory hash map counters.
+    struct cache_stats
+    {
+        uint64_t hits = 0;      // Lookups found in memory.
+        uint64_t misses = 0;    // Lookups which had to read the persisted hash maps.
+        uint64_t evictions = 0; // Hash maps evicted to keep within the memory limit.
+        size_t mem_size = 0;    // Estimated memory taken by the in-memory hash maps.
+    };
+
     class hmap_store
     {
     private:
-        // Hash maps of vnodes keyed by the vpath.
-        std::unordered_map<std::string, vnode_hmap> hash_map;
+        // Interned vpaths of the hash maps. Each hash map and dirty vpath holds a reference to its vpath id.
+        vpaths::vpath_table vpaths;
+
+        // Hash maps of vnodes keyed by the vpath id.
+        std::unordered_map<vpaths::vpath_id, cached_hmap> hash_map;
+
+        // In-memory hash maps ordered by the last access. Most recent first.
+        std::list<std::pair<const vpaths::vpath_id, cached_hmap> *> lru_hmaps;
+        cache_stats stats;
 
         // List of vpaths with modifications (including deletions) during the session.
-        std::unordered_set<std::string> dirty_vpaths;
+        std::unordered_set<vpaths::vpath_id> dirty_vpaths;
         int read_hash_map_cache_file(vnode_hmap &node_hmap, const std::string &vpath);
         int persist_hash_map_cache_file(const vnode_hmap &node_hmap, const std::string &filename);
         const std::string get_vpath_cache_file(const std::string &vpath);
         const std::string get_vpath_cache_dir(const std::string &vpath);
+        vnode_hmap *load_hash_map(const std::string &vpath);
+        vnode_hmap &insert_acquired_hash_map(const vpaths::vpath_id id, vnode_hmap &&node_hmap);
+        void touch_hash_map(std::pair<const vpaths::vpath_id, cached_hmap> &entry);
+        void erase_cached_hash_map(std::unordered_map<vpaths::vpath_id, cached_hmap>::iterator iter);
+        void clear_dirty_vpaths();
+        int evict_hash_maps(const size_t target_size);
 
     public:
         void set_dirty(const std::string &vpath);
+        void set_dirty(const vpaths::vpath_id id);
         vnode_hmap *find_hash_map(const std::string &vpath);
+        vnode_hmap *find_hash_map(const vpaths::vpath_id id);
         void erase_hash_map(const std::string &vpath);
+        int erase_hash_map_tree(const std::string &vpath);
         void insert_hash_map(const std::string &vpath, vnode_hmap &&node_hmap);
         int move_hash_map_cache(const std::string &from_vpath, const std::string &to_vpath, const bool is_dir);
         int persist_hash_maps();
         int clear();
+        int trim();
+        const cache_stats &get_stats() const;
+        vpaths::vpath_table &get_vpaths();
     };
 } // namespace hpfs::hmap::store
 
@@ -0,0 +1,585 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "store_db.hpp"
+#include "hasher.hpp"
+#include "../hpfs.hpp"
+#include "../tracelog.hpp"
+#include "../util.hpp"
+#include "../version.hpp"
+
+namespace hpfs::hmap::store_db
+{
+    constexpr int FILE_PERMS = 0644;
+    constexpr const char *COMPACTION_FILE_EXT = ".tmp";
+
+    // Compaction is triggered when superseded records take up more space than this and also more than the live records.
+    constexpr size_t COMPACTION_MIN_GARBAGE_SIZE = 4 * 1024 * 1024; // 4MB
+
+    // Buffered write size used when copying live records during compaction.
+    constexpr size_t COMPACTION_WRITE_SIZE = 4 * 1024 * 1024; // 4MB
+
+    // No. of hashes preceding the block hashes (node hash, name hash, meta hash).
+    constexpr size_t NODE_HASH_COUNT = 3;
+
+    db_context db_ctx;
+
+    // Record that has been serialized into a write buffer and yet to be indexed.
+    struct pending_record
+    {
+        std::string vpath;
+        size_t buf_offset;
+        size_t size;
+        bool is_deleted;
+    };
+
+    /**
+     * Initialize the hash map db file.
+     * @param file_path Path of the hash map db file.
+     * @return Returns 0 on success, -1 on error.
+     */
+    int init(std::string_view file_path)
+    {
+        // Hash maps are persisted as per-vpath cache files unless the db is enabled.
+        if (!ctx.hmap_db_enabled)
+            return 0;
+
+        db_ctx.file_path = file_path;
+
+        // Open or create the db file.
+        if (!util::is_file_exists(file_path))
+        {
+            // Create new file and include version header.
+            db_ctx.fd = open(file_path.data(), O_CREAT | O_RDWR, FILE_PERMS);
+            if (db_ctx.fd != -1)
+            {
+                if (write(db_ctx.fd, version::HP_VERSION_BYTES, version::VERSION_BYTES_LEN) < version::VERSION_BYTES_LEN)
+                {
+                    LOG_ERROR << errno << ": Error adding version header to the hmap db file";
+                    close(db_ctx.fd);
+                    db_ctx.fd = -1;
+                    return -1;
+                }
+            }
+        }
+        else
+        {
+            // Open an already existing file.
+            db_ctx.fd = open(file_path.data(), O_RDWR);
+        }
+        if (db_ctx.fd == -1)
+        {
+            LOG_ERROR << errno << ": Error in opening hmap db file.";
+            return -1;
+        }
+
+        struct stat st;
+        if (fstat(db_ctx.fd, &st) == -1)
+        {
+            LOG_ERROR << errno << ": Error in stat of hmap db file.";
+            close(db_ctx.fd);
+            db_ctx.fd = -1;
+            return -1;
+        }
+        db_ctx.eof = st.st_size;
+
+        if (scan_records() == -1)
+        {
+            deinit();
+            return -1;
+        }
+
+        db_ctx.initialized = true;
+        return 0;
+    }
+
+    void deinit()
+    {
+        if (db_ctx.mmap_ptr != NULL)
+        {
+            munmap(db_ctx.mmap_ptr, db_ctx.mmap_size);
+            db_ctx.mmap_ptr = NULL;
+            db_ctx.mmap_size = 0;
+        }
+
+        if (db_ctx.fd != -1)
+        {
+            close(db_ctx.fd);
+            db_ctx.fd = -1;
+        }
+
+        db_ctx.index.clear();
+        db_ctx.live_bytes = 0;
+        db_ctx.initialized = false;
+    }
+
+    /**
+     * Reads the latest hash map of the specified vpath from the db.
+     * @return 0 if no hash map found. 1 if hash map read success. -1 on error.
+     */
+    int read_hash_map(store::vnode_hmap &node_hmap, const std::string &vpath)
+    {
+        std::scoped_lock lock(db_ctx.db_mutex);
+        if (!db_ctx.initialized)
+        {
+            LOG_ERROR << "Hmap db hasn't been initialized properly.";
+            return -1;
+        }
+
+        const auto itr = db_ctx.index.find(vpath);
+        if (itr == db_ctx.index.end())
+            return 0;
+
+        const db_entry &entry = itr->second;
+        if ((entry.offset + entry.size) > db_ctx.mmap_size && remap() == -1)
+            return -1;
+
+        const uint8_t *ptr = db_ctx.mmap_ptr + entry.offset;
+        db_record_header rh;
+        memcpy(&rh, ptr, sizeof(rh));
+        ptr += sizeof(rh) + rh.vpath_len;
+
+        node_hmap.is_file = (rh.is_file == 1);
+        memcpy(&node_hmap.node_hash, ptr, sizeof(hasher::h32));
+        memcpy(&node_hmap.name_hash, ptr + sizeof(hasher::h32), sizeof(hasher::h32));
+        memcpy(&node_hmap.meta_hash, ptr + (2 * sizeof(hasher::h32)), sizeof(hasher::h32));
+        node_hmap.block_hashes.resize(rh.block_count);
+        memcpy(node_hmap.block_hashes.data(), ptr + (NODE_HASH_COUNT * sizeof(hasher::h32)), rh.block_count * sizeof(hasher::h32));
+
+        return 1;
+    }
+
+    /**
+     * Appends the specified hash maps to the db with a single sequential write.
+     * @param hmaps List of hash maps keyed by vpath. NULL hash map indicates the vpath has been deleted.
+     * @return 0 on success. -1 on error.
+     */
+    int write_hash_maps(const std::vector<std::pair<std::string_view, const store::vnode_hmap *>> &hmaps)
+    {
+        std::scoped_lock lock(db_ctx.db_mutex);
+        if (!db_ctx.initialized)
+        {
+            LOG_ERROR << "Hmap db hasn't been initialized properly.";
+            return -1;
+        }
+
+        std::string buf;
+        std::vector<pending_record> records;
+        records.reserve(hmaps.size());
+
+        for (const auto &[vpath, node_hmap] : hmaps)
+        {
+            const size_t buf_offset = buf.size();
+            serialize_record(buf, vpath, node_hmap);
+            records.push_back(pending_record{std::string(vpath), buf_offset, buf.size() - buf_offset, node_hmap == NULL});
+        }
+
+        if (buf.empty())
+            return 0;
+
+        const off_t offset = db_ctx.eof;
+        if (append_buf(buf) == -1)
+            return -1;
+
+        for (const pending_record &record : records)
+            update_index(record.vpath, offset + record.buf_offset, record.size, record.is_deleted);
+
+        // Compaction failure is not fatal because the records that we appended are intact.
+        const size_t garbage_bytes = db_ctx.eof - version::VERSION_BYTES_LEN - db_ctx.live_bytes;
+        if (garbage_bytes > COMPACTION_MIN_GARBAGE_SIZE && garbage_bytes > db_ctx.live_bytes)
+            compact();
+
+        return 0;
+    }
+
+    /**
+     * Moves the hash map of the specified vpath to a new vpath. If the vpath is a dir, hash maps of all
+     * its descendants are moved as well.
+     * @return 0 on success. -1 on error.
+     */
+    int move_hash_maps(const std::string &from_vpath, const std::string &to_vpath, const bool is_dir)
+    {
+        std::scoped_lock lock(db_ctx.db_mutex);
+        if (!db_ctx.initialized)
+        {
+            LOG_ERROR << "Hmap db hasn't been initialized properly.";
+            return -1;
+        }
+
+        if (db_ctx.index.count(from_vpath) == 0)
+        {
+            LOG_ERROR << "Error when moving hmap db record from " << from_vpath << " to " << to_vpath;
+            return -1;
+        }
+
+        if ((size_t)db_ctx.eof > db_ctx.mmap_size && remap() == -1)
+            return -1;
+
+        std::string buf;
+        std::vector<pending_record> records;
+
+        const auto move_record = [&](const std::string &vpath, const db_entry &entry) {
+            // Copy of the record under the new vpath.
+            std::string new_vpath = to_vpath + vpath.substr(from_vpath.size());
+            size_t buf_offset = buf.size();
+            serialize_record_copy(buf, new_vpath, entry);
+            records.push_back(pending_record{std::move(new_vpath), buf_offset, buf.size() - buf_offset, false});
+
+            // Tombstone for the old vpath.
+            buf_offset = buf.size();
+            serialize_record(buf, vpath, NULL);
+            records.push_back(pending_record{vpath, buf_offset, buf.size() - buf_offset, true});
+        };
+
+        const auto from_itr = db_ctx.index.find(from_vpath);
+        move_record(from_itr->first, from_itr->second);
+
+        if (is_dir)
+        {
+            const auto [begin, end] = get_descendants(from_vpath);
+            for (auto itr = begin; itr != end; itr++)
+                move_record(itr->first, itr->second);
+        }
+
+        const off_t offset = db_ctx.eof;
+        if (append_buf(buf) == -1)
+            return -1;
+
+        for (const pending_record &record : records)
+            update_index(record.vpath, offset + record.buf_offset, record.size, record.is_deleted);
+
+        return 0;
+    }
+
+    /**
+     * Removes the hash maps of the specified vpath and all its descendants from the db.
+     * @param vpath Vpath of the hash map sub tree.
+     * @return 0 on success. -1 on error.
+     */
+    int erase_hash_maps(const std::string &vpath)
+    {
+        std::scoped_lock lock(db_ctx.db_mutex);
+        if (!db_ctx.initialized)
+        {
+            LOG_ERROR << "Hmap db hasn't been initialized properly.";
+            return -1;
+        }
+
+        std::string buf;
+        std::vector<pending_record> records;
+
+        const auto erase_record = [&](const std::string &entry_vpath) {
+            const size_t buf_offset = buf.size();
+            serialize_record(buf, entry_vpath, NULL);
+            records.push_back(pending_record{entry_vpath, buf_offset, buf.size() - buf_offset, true});
+        };
+
+        if (db_ctx.index.count(vpath) == 1)
+            erase_record(vpath);
+
+        const auto [begin, end] = get_descendants(vpath);
+        for (auto itr = begin; itr != end; itr++)
+            erase_record(itr->first);
+
+        if (records.empty())
+            return 0;
+
+        const off_t offset = db_ctx.eof;
+        if (append_buf(buf) == -1)
+            return -1;
+
+        for (const pending_record &record : records)
+            update_index(record.vpath, offset + record.buf_offset, record.size, record.is_deleted);
+
+        return 0;
+    }
+
+    /**
+     * Removes all the hash maps from the db.
+     * @return 0 on success. -1 on error.
+     */
+    int clear()
+    {
+        std::scoped_lock lock(db_ctx.db_mutex);
+        if (!db_ctx.initialized)
+        {
+            LOG_ERROR << "Hmap db hasn't been initialized properly.";
+            return -1;
+        }
+
+        if (ftruncate(db_ctx.fd, version::VERSION_BYTES_LEN) == -1)
+        {
+            LOG_ERROR << errno << ": Error when truncating hmap db file.";
+            return -1;
+        }
+
+        db_ctx.eof = version::VERSION_BYTES_LEN;
+        db_ctx.index.clear();
+        db_ctx.live_bytes = 0;
+        return remap();
+    }
+
+    /**
+     * Returns the index range of the hash maps under the specified vpath. Descendant vpaths are sorted together
+     * since they all start with the vpath followed by '/'. The range ends before the first vpath starting with the
+     * vpath followed by the next character after '/'.
+     */
+    std::pair<std::map<std::string, db_entry>::iterator, std::map<std::string, db_entry>::iterator> get_descendants(const std::string &vpath)
+    {
+        return {db_ctx.index.lower_bound(vpath + '/'), db_ctx.index.lower_bound(vpath + (char)('/' + 1))};
+    }
+
+    size_t get_record_size(const db_record_header &rh)
+    {
+        size_t size = sizeof(db_record_header) + rh.vpath_len;
+        if (rh.is_deleted == 0)
+            size += (NODE_HASH_COUNT + (size_t)rh.block_count) * sizeof(hasher::h32);
+        return size;
+    }
+
+    /**
+     * Builds the vpath index by scanning all the records in the db file. Any incomplete record at the end
+     * of the file (due to an interrupted append) gets truncated.
+     * @return 0 on success. -1 on error.
+     */
+    int scan_records()
+    {
+        if (remap() == -1)
+            return -1;
+
+        off_t offset = version::VERSION_BYTES_LEN;
+        while (offset < db_ctx.eof)
+        {
+            if ((size_t)(db_ctx.eof - offset) < sizeof(db_record_header))
+                break;
+
+            db_record_header rh;
+            memcpy(&rh, db_ctx.mmap_ptr + offset, sizeof(rh));
+            const size_t size = get_record_size(rh);
+            if ((size_t)(db_ctx.eof - offset) < size)
+                break;
+
+            const std::string vpath((char *)db_ctx.mmap_ptr + offset + sizeof(rh), rh.vpath_len);
+            update_index(vpath, offset, size, rh.is_deleted == 1);
+            offset += size;
+        }
+
+        if (offset < db_ctx.eof)
+        {
+            LOG_WARNING << "Discarding incomplete hmap db record at offset " << offset;
+            if (ftruncate(db_ctx.fd, offset) == -1)
+            {
+                LOG_ERROR << errno << ": Error when truncating hmap db file.";
+                return -1;
+            }
+            db_ctx.eof = offset;
+            return remap();
+        }
+
+        return 0;
+    }
+
+    /**
+     * Re-creates the read-only memory map so it covers the entire db file.
+     * @return 0 on success. -1 on error.
+     */
+    int remap()
+    {
+        if (db_ctx.mmap_ptr != NULL)
+        {
+            munmap(db_ctx.mmap_ptr, db_ctx.mmap_size);
+            db_ctx.mmap_ptr = NULL;
+            db_ctx.mmap_size = 0;
+        }
+
+        void *ptr = mmap(NULL, db_ctx.eof, PROT_READ, MAP_SHARED, db_ctx.fd, 0);
+        if (ptr == MAP_FAILED)
+        {
+            LOG_ERROR << errno << ": Error when memory mapping hmap db file.";
+            return -1;
+        }
+
+        db_ctx.mmap_ptr = (uint8_t *)ptr;
+        db_ctx.mmap_size = db_ctx.eof;
+        return 0;
+    }
+
+    int write_buf(const int fd, const std::string &buf, const off_t offset)
+    {
+        size_t written = 0;
+        while (written < buf.size())
+        {
+            const ssize_t res = pwrite(fd, buf.data() + written, buf.size() - written, offset + written);
+            if (res == -1)
+                return -1;
+            written += res;
+        }
+        return 0;
+    }
+
+    /**
+     * Appends the specified buffer to the end of the db file.
+     * @return 0 on success. -1 on error.
+     */
+    int append_buf(const std::string &buf)
+    {
+        if (write_buf(db_ctx.fd, buf, db_ctx.eof) == -1)
+        {
+            LOG_ERROR << errno << ": Error when appending to hmap db file.";
+
+            // Remove any partially written records.
+            ftruncate(db_ctx.fd, db_ctx.eof);
+            return -1;
+        }
+
+        db_ctx.eof += buf.size();
+        return 0;
+    }
+
+    /**
+     * Serializes a record for the specified hash map into the buffer.
+     * @param node_hmap The hash map. NULL produces a tombstone record.
+     */
+    void serialize_record(std::string &buf, std::string_view vpath, const store::vnode_hmap *node_hmap)
+    {
+        db_record_header rh;
+        rh.vpath_len = vpath.size();
+        rh.block_count = node_hmap ? node_hmap->block_hashes.size() : 0;
+        rh.is_file = (node_hmap && node_hmap->is_file) ? 1 : 0;
+        rh.is_deleted = node_hmap ? 0 : 1;
+
+        buf.append((char *)&rh, sizeof(rh));
+        buf.append(vpath);
+
+        if (node_hmap)
+        {
+            buf.append((char *)&node_hmap->node_hash, sizeof(hasher::h32));
+            buf.append((char *)&node_hmap->name_hash, sizeof(hasher::h32));
+            buf.append((char *)&node_hmap->meta_hash, sizeof(hasher::h32));
+            buf.append((char *)node_hmap->block_hashes.data(), sizeof(hasher::h32) * node_hmap->block_hashes.size());
+        }
+    }
+
+    /**
+     * Serializes a copy of an existing db record into the buffer under a different vpath.
+     */
+    void serialize_record_copy(std::string &buf, std::string_view vpath, const db_entry &entry)
+    {
+        const uint8_t *ptr = db_ctx.mmap_ptr + entry.offset;
+        db_record_header rh;
+        memcpy(&rh, ptr, sizeof(rh));
+
+        const size_t hashes_offset = sizeof(rh) + rh.vpath_len;
+        rh.vpath_len = vpath.size();
+
+        buf.append((char *)&rh, sizeof(rh));
+        buf.append(vpath);
+        buf.append((char *)ptr + hashes_offset, entry.size - hashes_offset);
+    }
+
+    void update_index(const std::string &vpath, const off_t offset, const size_t size, const bool is_deleted)
+    {
+        const auto itr = db_ctx.index.find(vpath);
+        if (itr != db_ctx.index.end())
+        {
+            db_ctx.live_bytes -= itr->second.size;
+            if (is_deleted)
+                db_ctx.index.erase(itr);
+            else
+                itr->second = db_entry{offset, size};
+        }
+        else if (!is_deleted)
+        {
+            db_ctx.index.try_emplace(vpath, db_entry{offset, size});
+        }
+
+        if (!is_deleted)
+            db_ctx.live_bytes += size;
+    }
+
+    /**
+     * Rewrites the db file with only the latest records of existing vpaths and swaps it with the current file.
+     * @return 0 on success. -1 on error.
+     */
+    int compact()
+    {
+        if ((size_t)db_ctx.eof > db_ctx.mmap_size && remap() == -1)
+            return -1;
+
+        const std::string compaction_file_path = db_ctx.file_path + COMPACTION_FILE_EXT;
+        const int fd = open(compaction_file_path.c_str(), O_CREAT | O_TRUNC | O_RDWR, FILE_PERMS);
+        if (fd == -1)
+        {
+            LOG_ERROR << errno << ": Error when creating hmap db compaction file.";
+            return -1;
+        }
+
+        // New offsets are applied to the index only after the compacted file is swapped in.
+        std::vector<std::pair<db_entry *, off_t>> new_offsets;
+        new_offsets.reserve(db_ctx.index.size());
+
+        std::string buf((char *)version::HP_VERSION_BYTES, version::VERSION_BYTES_LEN);
+        off_t buf_offset = 0; // File offset of the buffer start.
+
+        bool write_failed = false;
+
+        for (auto &[vpath, entry] : db_ctx.index)
+        {
+            new_offsets.emplace_back(&entry, buf_offset + buf.size());
+            buf.append((char *)db_ctx.mmap_ptr + entry.offset, entry.size);
+
+            if (buf.size() >= COMPACTION_WRITE_SIZE)
+            {
+                if (write_buf(fd, buf, buf_offset) == -1)
+                {
+                    write_failed = true;
+                    break;
+                }
+                buf_offset += buf.size();
+                buf.clear();
+            }
+        }
+
+        // Compacted file must be on disk before it replaces the db file. Otherwise a crash could leave an empty db.
+        if (write_failed || write_buf(fd, buf, buf_offset) == -1 || fsync(fd) == -1 ||
+            rename(compaction_file_path.c_str(), db_ctx.file_path.c_str()) == -1)
+        {
+            LOG_ERROR << errno << ": Error when writing hmap db compaction file.";
+            close(fd);
+            unlink(compaction_file_path.c_str());
+            return -1;
+        }
+
+        // Persist the rename. The compacted file is already in place. So a failure here is not reverted.
+        sync_dir();
+
+        const size_t old_size = db_ctx.eof;
+        close(db_ctx.fd);
+        db_ctx.fd = fd;
+        db_ctx.eof = buf_offset + buf.size();
+
+        for (auto &[entry, offset] : new_offsets)
+            entry->offset = offset;
+
+        LOG_DEBUG << "Hmap db compacted from " << old_size << " to " << db_ctx.eof << " bytes.";
+        return remap();
+    }
+
+    /**
+     * Syncs the dir containing the db file so a rename of the db file is persisted.
+     * @return 0 on success. -1 on error.
+     */
+    int sync_dir()
+    {
+        const int dir_fd = open(util::get_parent_path(db_ctx.file_path).c_str(), O_RDONLY | O_DIRECTORY);
+        const int res = (dir_fd == -1 || fsync(dir_fd) == -1) ? -1 : 0;
+        if (res == -1)
+            LOG_ERROR << errno << ": Error syncing hmap db file dir.";
+        if (dir_fd != -1)
+            close(dir_fd);
+        return res;
+    }
+
+} // namespace hpfs::hmap::store_db
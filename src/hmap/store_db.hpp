@@ -0,0 +1,89 @@
+#ifndef _HPFS_HMAP_STORE_DB_
+#define _HPFS_HMAP_STORE_DB_
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <map>
+#include "store.hpp"
+
+/**
+ * Single file hash map database which can be used by the hash map store instead of per-vpath cache files.
+ * The db file is an append-only sequence of records. Each persist appends the latest hash maps of the dirty
+ * vpaths (or tombstones for deleted vpaths) and an in-memory index keeps track of the latest record of each vpath.
+ * Superseded records are dropped by compacting the file once they outweigh the live records.
+ * Format - [version][record1][record2][record3]...
+ * Record - [db_record_header][vpath][node_hash][name_hash][meta_hash][block_hashes]
+ */
+namespace hpfs::hmap::store_db
+{
+    struct db_record_header
+    {
+        uint32_t vpath_len = 0;
+        uint32_t block_count = 0;
+        uint8_t is_file = 0;
+        uint8_t is_deleted = 0;      // Tombstone records do not contain any hashes.
+        uint8_t reserved[2] = {0, 0}; // Explicit alignment padding so every header byte written to disk is initialized.
+    };
+
+    // Location of the latest record of a vpath.
+    struct db_entry
+    {
+        off_t offset = 0;
+        size_t size = 0;
+    };
+
+    struct db_context
+    {
+        int fd = -1;              // The db file fd used throughout the process.
+        off_t eof = 0;            // End of file (End offset of db file).
+        uint8_t *mmap_ptr = NULL; // Read-only memory map of the db file.
+        size_t mmap_size = 0;
+        size_t live_bytes = 0; // Total size of the records referenced by the index.
+        bool initialized = false;
+        std::string file_path;
+        std::map<std::string, db_entry> index; // Latest record location keyed by vpath. Ordered so sub trees are contiguous.
+        std::mutex db_mutex;                             // Db is shared among all the sessions of the process.
+    };
+
+    extern db_context db_ctx;
+
+    int init(std::string_view file_path);
+
+    void deinit();
+
+    int read_hash_map(store::vnode_hmap &node_hmap, const std::string &vpath);
+
+    int write_hash_maps(const std::vector<std::pair<std::string_view, const store::vnode_hmap *>> &hmaps);
+
+    int move_hash_maps(const std::string &from_vpath, const std::string &to_vpath, const bool is_dir);
+
+    int erase_hash_maps(const std::string &vpath);
+
+    int clear();
+
+    std::pair<std::map<std::string, db_entry>::iterator, std::map<std::string, db_entry>::iterator> get_descendants(const std::string &vpath);
+
+    size_t get_record_size(const db_record_header &rh);
+
+    int scan_records();
+
+    int remap();
+
+    int write_buf(const int fd, const std::string &buf, const off_t offset);
+
+    int append_buf(const std::string &buf);
+
+    void serialize_record(std::string &buf, std::string_view vpath, const store::vnode_hmap *node_hmap);
+
+    void serialize_record_copy(std::string &buf, std::string_view vpath, const db_entry &entry);
+
+    void update_index(const std::string &vpath, const off_t offset, const size_t size, const bool is_deleted);
+
+    int compact();
+
+    int sync_dir();
+
+} // namespace hpfs::hmap::store_db
+
+#endif
@@ -8,9 +8,14 @@
 #include <libgen.h>
 #include <math.h>
 #include <optional>
+#include <algorithm>
+#include <thread>
+#include <mutex>
 #include "hasher.hpp"
 #include "store.hpp"
 #include "tree.hpp"
+#include "builder.hpp"
+#include "../hpfs.hpp"
 #include "../tracelog.hpp"
 #include "../util.hpp"
 #include "../vfs/vfs.hpp"
@@ -18,11 +23,17 @@
 
 namespace hpfs::hmap::tree
 {
-#define PRINT_ROOT_HASH LOG_DEBUG << "Root hash: " << store.find_hash_map(ROOT_VPATH)->node_hash;
+#define PRINT_ROOT_HASH LOG_DEBUG << "Root hash: " << read_root_hash();
+#define TREE_LOCK std::scoped_lock tree_lock(tree_mutex);
 
-    constexpr size_t BLOCK_SIZE = 4194304; // 4MB
     constexpr const char *ROOT_VPATH = "/";
 
+    // Block updates upto this length rehash the touched chunks using the block hash tree. Longer updates rehash the
+    // whole block with the vectorized blake3 implementation.
+    constexpr size_t CHUNK_TREE_MAX_UPDATE = 128 * 1024; // 128KB
+    constexpr size_t CHUNK_TREE_CACHE_SIZE = 64;         // Max no. of block hash trees kept. (~256KB each)
+    constexpr size_t BLOCK_OFFSET_LEN = sizeof(uint64_t); // Block offset prefix of the block hash input.
+
     int hmap_tree::create(std::optional<hmap_tree> &tree, hpfs::vfs::virtual_filesystem &virt_fs)
     {
         tree.emplace(virt_fs);
@@ -58,58 +69,136 @@ namespace hpfs::hmap::tree
             LOG_INFO << "Loaded root hash: " << root_hmap->node_hash;
         }
 
+        if (store.trim() == -1)
+            return -1;
+
         initialized = true;
         return 0;
     }
 
-    int hmap_tree::get_vnode_hmap(store::vnode_hmap **node_hmap, const std::string &vpath)
+    /**
+     * Copies the hash map of the specified vpath. Stored hash maps are not handed out since they may get modified or
+     * evicted by other operations as soon as the tree lock is released.
+     * @param node_hmap Copy of the hash map.
+     * @param vpath Vpath of the hash map.
+     * @param with_block_hashes Whether to copy the file block hashes as well.
+     * @return 1 if the hash map was found. 0 if not found. -1 on error.
+     */
+    int hmap_tree::get_vnode_hmap(store::vnode_hmap &node_hmap, const std::string &vpath, const bool with_block_hashes)
     {
-        *node_hmap = store.find_hash_map(vpath);
-        return 0;
+        TREE_LOCK
+        apply_pending_hash_updates();
+
+        // Hash maps may only be evicted before any of them are looked up.
+        if (store.trim() == -1)
+            return -1;
+
+        const store::vnode_hmap *hmap_entry = store.find_hash_map(vpath);
+        if (hmap_entry == NULL)
+            return 0;
+
+        node_hmap.is_file = hmap_entry->is_file;
+        node_hmap.node_hash = hmap_entry->node_hash;
+        node_hmap.name_hash = hmap_entry->name_hash;
+        node_hmap.meta_hash = hmap_entry->meta_hash;
+        if (with_block_hashes)
+            node_hmap.block_hashes = hmap_entry->block_hashes;
+        return 1;
     }
 
+    /**
+     * Calculates the hash maps of the specified dir and all its descendants from scratch and inserts them
+     * to the hash store. The calculation is spread across the configured no. of hashing threads.
+     * @param node_hash Calculated node hash of the dir.
+     * @param vpath Vpath of the dir.
+     * @return 0 on success. -1 on error.
+     */
     int hmap_tree::calculate_dir_hash(hasher::h32 &node_hash, const std::string &vpath)
+    {
+        // Files under the dir are hashed from scratch. So their block hash trees may be out of date.
+        erase_subtree_chunk_trees(vpath == ROOT_VPATH ? "" : vpath);
+
+        std::vector<std::pair<std::string, store::vnode_hmap>> hmaps;
+        builder::hmap_builder hbuilder(virt_fs, hpfs::ctx.hmap_threads);
+        if (hbuilder.build(hmaps, node_hash, vpath) == -1)
+        {
+            LOG_ERROR << "Dir hash calc failure in hmap build. " << vpath;
+            return -1;
+        }
+
+        for (auto &[node_vpath, node_hmap] : hmaps)
+        {
+            store.insert_hash_map(node_vpath, std::move(node_hmap));
+            store.set_dirty(node_vpath);
+        }
+
+        return 0;
+    }
+
+    int hmap_tree::calculate_file_hash(hasher::h32 &node_hash, const std::string &vpath)
     {
         vfs::vnode *vn = NULL;
-        if (vpath != ROOT_VPATH && (virt_fs.get_vnode(vpath, &vn) == -1 || !vn))
+        if (virt_fs.get_vnode(vpath, &vn) == -1 || !vn)
         {
             LOG_ERROR << "File hash calc failure in vfs vnode get. " << vpath;
             return -1;
         }
 
-        vfs::vdir_children_map dir_children;
-        if (virt_fs.get_dir_children(vpath.c_str(), dir_children) == -1)
+        store::vnode_hmap file_hmap{true};
+        generate_name_hash(file_hmap, vpath);                                // Name hash.
+        generate_meta_hash(file_hmap, *vn);                                  // Meta hash.
+        file_update_hashes update;
+        if (hash_updated_blocks(update, vpath, file_data_source{*vn, (size_t)vn->st.st_size}, 0, vn->st.st_size) == -1)
+        {
+            LOG_ERROR << "File hash calc failure in applying file data update. " << vpath;
+            return -1;
+        }
+        apply_file_data_update(file_hmap, update); // File hash.
+
+        node_hash = file_hmap.node_hash;
+        store.insert_hash_map(vpath, std::move(file_hmap));
+        store.set_dirty(vpath);
+
+        return 0;
+    }
+
+    /**
+     * Calculates the hash map of the specified dir using the existing hash maps of its children.
+     * Only the children without a hash map are calculated from scratch.
+     * @param node_hash Calculated node hash of the dir.
+     * @param vpath Vpath of the dir.
+     * @param vn Vnode of the dir.
+     * @return 0 on success. -1 on error.
+     */
+    int hmap_tree::calculate_dir_node_hash(hasher::h32 &node_hash, const std::string &vpath, const vfs::vnode &vn)
+    {
+        vfs::vdir_children_map children;
+        if (virt_fs.get_dir_children(vpath, children) == -1)
         {
             LOG_ERROR << "Dir hash calc failure in vfs dir children get. " << vpath;
             return -1;
         }
 
-        // Initialize dir hash with the dir name hash.
+        // Root dir meta hash is always empty.
         store::vnode_hmap dir_hmap{false};
         generate_name_hash(dir_hmap, vpath);
-        if (vn)
-            generate_meta_hash(dir_hmap, *vn);
-        else
-            dir_hmap.meta_hash = hasher::h32_empty;
-
+        if (vpath != ROOT_VPATH)
+            generate_meta_hash(dir_hmap, vn);
         dir_hmap.node_hash = dir_hmap.name_hash;
         dir_hmap.node_hash ^= dir_hmap.meta_hash;
 
-        for (const auto &[child_name, st] : dir_children)
+        for (const auto &[child_name, child_st] : children)
         {
-            std::string child_vpath = std::string(vpath);
-            if (child_vpath.back() != '/')
-                child_vpath.append("/");
-            child_vpath.append(child_name);
-
-            const bool is_dir = S_ISDIR(st.st_mode);
+            const std::string child_vpath = (vpath == ROOT_VPATH ? vpath : (vpath + "/")) + child_name;
 
             hasher::h32 child_hash;
-            if ((is_dir && calculate_dir_hash(child_hash, child_vpath) == -1) ||
-                (!is_dir && calculate_file_hash(child_hash, child_vpath) == -1))
+            const store::vnode_hmap *child_hmap = store.find_hash_map(child_vpath);
+            if (child_hmap)
+                child_hash = child_hmap->node_hash;
+            else if ((S_ISREG(child_st.st_mode) ? calculate_file_hash(child_hash, child_vpath)
+                                                : calculate_dir_hash(child_hash, child_vpath)) == -1)
                 return -1;
 
-            // XOR child hash to the parent dir node hash.
             dir_hmap.node_hash ^= child_hash;
         }
 
@@ -120,52 +209,112 @@ namespace hpfs::hmap::tree
         return 0;
     }
 
-    int hmap_tree::calculate_file_hash(hasher::h32 &node_hash, const std::string &vpath)
+    /**
+     * Applies the change of a node hash to the hash maps of all its ancestors.
+     * With lazy propagation the change is only recorded against the parent. XOR-ing the old and new hashes into the parent
+     * changes the parent hash by the same amount, so the same change reaches every ancestor including the root. The root
+     * hash is therefore known right away while the ancestor hash maps are updated later in one pass. Changes are only
+     * counted towards the root if the parent hash map exists, as the eager propagation stops at a missing hash map.
+     * @param vpath Vpath of the node.
+     * @param old_hash Node hash before the change.
+     * @param new_hash Node hash after the change.
+     */
+    void hmap_tree::propogate_hash_update(const std::string &vpath, const hasher::h32 &old_hash, const hasher::h32 &new_hash)
     {
-        vfs::vnode *vn = NULL;
-        if (virt_fs.get_vnode(vpath, &vn) == -1 || !vn)
+        // XOR-ing the old and new hashes into the parent hash changes the parent hash by the same amount as the node hash.
+        // So the same change gets XOR-ed into every ancestor.
+        hasher::h32 change = old_hash;
+        change ^= new_hash;
+
+        // Parent of root is considered to be root itself.
+        vpaths::vpath_table &vpaths = store.get_vpaths();
+        const size_t slash_pos = vpath.rfind('/');
+        const vpaths::vpath_id parent_id = (slash_pos == 0 || slash_pos == std::string::npos)
+                                               ? vpaths::ROOT_VPATH_ID
+                                               : vpaths.acquire(std::string_view(vpath).substr(0, slash_pos));
+
+        if (hpfs::ctx.hmap_lazy_propagation)
         {
-            LOG_ERROR << "File hash calc failure in vfs vnode get. " << vpath;
-            return -1;
+            // Like the eager propagation, a change does not go past a missing hash map. Ancestors of an existing hash map
+            // always have hash maps. So once the parent hash map is found, the change is sure to reach the root.
+            if (store.find_hash_map(parent_id) == NULL)
+            {
+                vpaths.release(parent_id);
+                return;
+            }
+
+            // Pending update keeps the acquired reference to the parent id.
+            const auto [pending, inserted] = pending_hash_updates.try_emplace({vpaths.get_depth(parent_id), parent_id}, hasher::h32_empty);
+            if (!inserted)
+                vpaths.release(parent_id);
+            pending->second ^= change;
+            pending_root_hash_update ^= change;
+            return;
         }
 
-        store::vnode_hmap file_hmap{true};
-        generate_name_hash(file_hmap, vpath);                                // Name hash.
-        generate_meta_hash(file_hmap, *vn);                                  // Meta hash.
-        if (apply_file_data_update(file_hmap, *vn, 0, vn->st.st_size) == -1) // File hash.
+        for (vpaths::vpath_id id = parent_id;; id = vpaths.get_parent(id))
         {
-            LOG_ERROR << "File hash calc failure in applying file data update. " << vpath;
-            return -1;
-        }
+            store::vnode_hmap *hmap_entry = store.find_hash_map(id);
+            if (hmap_entry == NULL)
+                break;
 
-        node_hash = file_hmap.node_hash;
-        store.insert_hash_map(vpath, std::move(file_hmap));
-        store.set_dirty(vpath);
+            hmap_entry->node_hash ^= change;
+            store.set_dirty(id);
 
-        return 0;
+            if (id == vpaths::ROOT_VPATH_ID)
+                break;
+        }
+
+        vpaths.release(parent_id);
     }
 
-    void hmap_tree::propogate_hash_update(const std::string &vpath, const hasher::h32 &old_hash, const hasher::h32 &new_hash)
+    /**
+     * Applies the pending node hash changes of the lazy hash propagation to the ancestor hash maps. Changes of the deepest
+     * vpaths are applied first so each dir collects the changes of all its descendants before passing them to its parent.
+     */
+    void hmap_tree::apply_pending_hash_updates()
     {
-        std::string parent_path = util::get_parent_path(vpath);
-        store::vnode_hmap *hmap_entry = store.find_hash_map(parent_path);
-        if (hmap_entry == NULL)
-            return;
-        store::vnode_hmap &parent_hmap = *hmap_entry;
+        vpaths::vpath_table &vpaths = store.get_vpaths();
+        while (!pending_hash_updates.empty())
+        {
+            const auto itr = pending_hash_updates.begin();
+            const vpaths::vpath_id id = itr->first.second;
+            const hasher::h32 change = itr->second;
+            pending_hash_updates.erase(itr);
+
+            store::vnode_hmap *hmap_entry = (change == hasher::h32_empty) ? NULL : store.find_hash_map(id);
+            if (hmap_entry != NULL)
+            {
+                hmap_entry->node_hash ^= change;
+                store.set_dirty(id);
+
+                if (id != vpaths::ROOT_VPATH_ID)
+                {
+                    const vpaths::vpath_id parent_id = vpaths.get_parent(id);
+                    const auto [pending, inserted] = pending_hash_updates.try_emplace({vpaths.get_depth(parent_id), parent_id}, hasher::h32_empty);
+                    if (inserted)
+                        vpaths.add_ref(parent_id);
+                    pending->second ^= change;
+                }
+            }
 
-        // XOR old hash and new hash into parent hash.
-        // Remember the old parent hash before updating it.
-        const hasher::h32 parent_old_hash = parent_hmap.node_hash;
-        parent_hmap.node_hash ^= old_hash;
-        parent_hmap.node_hash ^= new_hash;
-        store.set_dirty(parent_path);
+            vpaths.release(id);
+        }
 
-        if (parent_path != ROOT_VPATH)
-            propogate_hash_update(parent_path, parent_old_hash, parent_hmap.node_hash);
+        pending_root_hash_update = hasher::h32_empty;
+    }
+
+    size_t hmap_tree::get_vpath_depth(const std::string &vpath)
+    {
+        return vpath == ROOT_VPATH ? 0 : std::count(vpath.begin(), vpath.end(), '/');
     }
 
     int hmap_tree::apply_vnode_create(const std::string &vpath)
     {
+        TREE_LOCK
+        if (store.trim() == -1)
+            return -1;
+
         vfs::vnode *vn = NULL;
         if (virt_fs.get_vnode(vpath, &vn) == -1 || !vn)
             return -1;
@@ -191,6 +340,10 @@ namespace hpfs::hmap::tree
 
     int hmap_tree::apply_vnode_metadata_update(const std::string &vpath, const vfs::vnode &vn)
     {
+        TREE_LOCK
+        if (store.trim() == -1)
+            return -1;
+
         store::vnode_hmap *hmap_entry = store.find_hash_map(vpath);
         if (hmap_entry == NULL)
         {
@@ -212,9 +365,119 @@ namespace hpfs::hmap::tree
         return 0;
     }
 
+    /**
+     * Reads the file data of the specified range as it is after the update. Vnode data beyond the vnode size reads as
+     * zeros and the update buffer (if any) is placed over the vnode data.
+     * @return 0 on success. -1 on error.
+     */
+    int file_data_source::read(uint8_t *dst, const size_t len, const off_t offset) const
+    {
+        const size_t vn_size = vn.st.st_size;
+        const size_t vn_len = offset >= (off_t)vn_size ? 0 : MIN(len, vn_size - offset);
+        if (vn_len > 0)
+        {
+            if (vn.mmap.ptr)
+                memcpy(dst, (uint8_t *)vn.mmap.ptr + offset, vn_len);
+            else if (vfs::virtual_filesystem::read_vnode_data(vn, dst, vn_len, offset) == -1)
+                return -1;
+        }
+
+        if (vn_len < len)
+            memset(dst + vn_len, 0, len - vn_len);
+
+        const off_t overlay_start = MAX(offset, buf_offset);
+        const off_t overlay_end = MIN(offset + (off_t)len, buf_offset + (off_t)buf_len);
+        if (buf && overlay_start < overlay_end)
+            memcpy(dst + (overlay_start - offset), buf + (overlay_start - buf_offset), overlay_end - overlay_start);
+
+        return 0;
+    }
+
+    /**
+     * Returns the file data of the specified range straight from the vnode memory map if the range is not affected
+     * by the update.
+     * @return Pointer to the data. NULL if the data has to be read with read().
+     */
+    const uint8_t *file_data_source::map(const size_t len, const off_t offset) const
+    {
+        if (!vn.mmap.ptr || (offset + len) > (size_t)vn.st.st_size)
+            return NULL;
+
+        if (buf && offset < buf_offset + (off_t)buf_len && buf_offset < offset + (off_t)len)
+            return NULL;
+
+        return (uint8_t *)vn.mmap.ptr + offset;
+    }
+
     int hmap_tree::apply_vnode_data_update(const std::string &vpath, const vfs::vnode &vn,
                                            const off_t file_update_offset, const size_t file_update_size)
     {
+        TREE_LOCK
+        file_update_hashes update;
+        if (S_ISREG(vn.st.st_mode) &&
+            hash_updated_blocks(update, vpath, file_data_source{vn, (size_t)vn.st.st_size}, file_update_offset, file_update_size) == -1)
+        {
+            LOG_ERROR << "Hash calc vnode update apply failed. File data update failure. " << vpath;
+            return -1;
+        }
+
+        return apply_updated_blocks(vpath, vn, update);
+    }
+
+    /**
+     * Applies the block hashes of a file data update calculated with prepare_file_data_update() to the hash maps.
+     * The file data update must have been applied to the vnode in between.
+     * @return 0 on success. -1 on error.
+     */
+    int hmap_tree::apply_vnode_data_update(const std::string &vpath, const vfs::vnode &vn, const file_update_hashes &update)
+    {
+        TREE_LOCK
+        return apply_updated_blocks(vpath, vn, update);
+    }
+
+    /**
+     * Calculates the block hashes of a file data update before the update is applied to the vnode. This lets the
+     * block hashing of a write run without holding up the updates of the other files. The caller must keep the file
+     * from being modified until the update is applied.
+     * Block hash trees of the file are updated with the new data. So discard_file_data_update() must be called if
+     * the update does not get applied.
+     * @param update Calculated block hashes.
+     * @param vn Vnode of the file before the update.
+     * @param file_size File size after the update.
+     * @param update_offset File offset of the updated range.
+     * @param update_size Length of the updated range.
+     * @param buf New data of the file which is placed at buf_offset. NULL if the update has no new data. (eg. truncate)
+     * @return 0 on success. -1 on error.
+     */
+    int hmap_tree::prepare_file_data_update(file_update_hashes &update, const std::string &vpath, const vfs::vnode &vn,
+                                            const size_t file_size, const off_t update_offset, const size_t update_size,
+                                            const char *buf, const off_t buf_offset)
+    {
+        // Tree lock is not needed since only the block hash tree cache is used. So the hash map updates of the other
+        // files can go ahead while this file is being hashed.
+        const file_data_source src{vn, file_size, buf, buf_offset, buf ? update_size : 0};
+        if (hash_updated_blocks(update, vpath, src, update_offset, update_size) == -1)
+        {
+            LOG_ERROR << "Hash calc file data update failed. " << vpath;
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /**
+     * Drops the block hash trees of a file whose prepared data update did not get applied.
+     */
+    void hmap_tree::discard_file_data_update(const std::string &vpath)
+    {
+        erase_chunk_trees(vpath);
+    }
+
+    int hmap_tree::apply_updated_blocks(const std::string &vpath, const vfs::vnode &vn, const file_update_hashes &update)
+    {
+        if (store.trim() == -1)
+            return -1;
+
         store::vnode_hmap *hmap_entry = store.find_hash_map(vpath);
         if (hmap_entry == NULL)
         {
@@ -229,12 +492,7 @@ namespace hpfs::hmap::tree
         // the file hash.
         if (S_ISREG(vn.st.st_mode))
         {
-            if (apply_file_data_update(node_hmap, vn, file_update_offset, file_update_size) == -1)
-            {
-                LOG_ERROR << "Hash calc vnode update apply failed. File data update failure. " << vpath;
-                return -1;
-            }
-
+            apply_file_data_update(node_hmap, update);
             store.set_dirty(vpath);
         }
 
@@ -244,56 +502,288 @@ namespace hpfs::hmap::tree
         return 0;
     }
 
-    int hmap_tree::apply_file_data_update(store::vnode_hmap &node_hmap, const vfs::vnode &vn,
-                                          const off_t update_offset, const size_t update_size)
+    /**
+     * Places the updated block hashes in the file hash map and recalculates the file hash.
+     */
+    void hmap_tree::apply_file_data_update(store::vnode_hmap &node_hmap, const file_update_hashes &update)
     {
-        const size_t file_size = vn.st.st_size;
         const uint32_t old_block_count = node_hmap.block_hashes.size();
-        const uint32_t required_block_count = file_size == 0
+        const uint32_t required_block_count = update.file_size == 0
                                                   ? 0
-                                                  : ceil((double)file_size / (double)BLOCK_SIZE);
+                                                  : ceil((double)update.file_size / (double)BLOCK_SIZE);
 
         if (old_block_count == required_block_count && old_block_count == 0)
-            return 0;
+            return;
 
         // Resize the block hashes list according to current file size.
         node_hmap.block_hashes.resize(required_block_count);
+        for (size_t i = 0; i < update.block_hashes.size(); i++)
+            node_hmap.block_hashes[update.first_block_id + i] = update.block_hashes[i];
 
-        // Reset file hash with name and meta hash.
+        // Reset file hash with name and meta hash and add the block hashes.
         node_hmap.node_hash = node_hmap.name_hash;
         node_hmap.node_hash ^= node_hmap.meta_hash;
+        for (const hasher::h32 &block_hash : node_hmap.block_hashes)
+            node_hmap.node_hash ^= block_hash;
+    }
 
-        const off_t update_end_offset = update_offset + update_size;
+    /**
+     * Calculates the hashes of the file blocks touched by a file data update.
+     * @param update Calculated block hashes.
+     * @param src File data after the update.
+     * @param update_offset File offset of the updated range.
+     * @param update_size Length of the updated range.
+     * @return 0 on success. -1 on error.
+     */
+    int hmap_tree::hash_updated_blocks(file_update_hashes &update, const std::string &vpath, const file_data_source &src,
+                                       const off_t update_offset, const size_t update_size)
+    {
+        const uint32_t required_block_count = src.file_size == 0
+                                                  ? 0
+                                                  : ceil((double)src.file_size / (double)BLOCK_SIZE);
 
-        // Calculate hashes of updated blocks.
-        for (uint32_t block_id = (update_offset / BLOCK_SIZE);; block_id++)
+        const off_t update_end_offset = update_offset + update_size;
+        const uint32_t update_end_block_id = MIN(required_block_count, (update_end_offset + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+        // Block hash list is sized upfront so the batches can refer to their slots.
+        update.file_size = src.file_size;
+        update.first_block_id = update_offset / BLOCK_SIZE;
+        update.block_hashes.assign(update_end_block_id > update.first_block_id ? (update_end_block_id - update.first_block_id) : 0,
+                                   hasher::h32_empty);
+
+        // Block hash trees of the blocks beyond the new file end are no longer valid.
+        erase_chunk_trees(vpath, required_block_count);
+
+        // Calculate hashes of updated blocks. Blocks with small updates only rehash the touched chunks. Rest are hashed
+        // in batches which have a block for each hashing thread.
+        const size_t lanes = hpfs::ctx.hmap_threads > 0 ? hpfs::ctx.hmap_threads : MAX(std::thread::hardware_concurrency(), 1);
+        std::vector<file_block> batch;
+        for (uint32_t block_id = update.first_block_id; block_id < update_end_block_id; block_id++)
         {
-            const off_t block_offset = block_id * BLOCK_SIZE;
-            if (block_offset >= update_end_offset)
-                break;
+            const off_t block_offset = (off_t)block_id * BLOCK_SIZE;
+            hasher::h32 &block_hash = update.block_hashes[block_id - update.first_block_id];
+            const off_t changed_offset = MAX(update_offset, block_offset);
+            const size_t changed_len = MIN(update_end_offset, block_offset + (off_t)BLOCK_SIZE) - changed_offset;
+            if (changed_len <= CHUNK_TREE_MAX_UPDATE)
+            {
+                if (hash_file_block_chunks(block_hash, vpath, src, block_id, changed_offset, changed_len) == -1)
+                    return -1;
+                continue;
+            }
 
-            // Calculate the new block hash.
-            const void *read_buf = (uint8_t *)vn.mmap.ptr + block_offset;
-            const int read_len = MIN(BLOCK_SIZE, (file_size - block_offset));
+            erase_chunk_trees(vpath, block_id);
+            batch.push_back(file_block{src, block_id, &block_hash});
+            if (batch.size() == lanes)
+            {
+                if (hash_file_blocks(batch, lanes) == -1)
+                    return -1;
+                batch.clear();
+            }
+        }
 
-            uint8_t block_offset_buf[8];
-            util::uint64_to_bytes(block_offset_buf, block_offset);
+        if (!batch.empty() && hash_file_blocks(batch, lanes) == -1)
+            return -1;
 
-            hasher::h32 block_hash;
-            hasher::hash_buf(block_hash, block_offset_buf, sizeof(block_offset_buf), read_buf, read_len);
+        return 0;
+    }
 
-            node_hmap.block_hashes[block_id] = block_hash;
+    /**
+     * Calculates the hash of a file block after a small update using the hash tree of the block. Only the chunks touched by
+     * the update are rehashed if the block hash tree is known. Otherwise the hash tree is built by hashing the whole block.
+     * @param block_hash Calculated block hash.
+     * @param vpath Vpath of the file.
+     * @param src File data after the update.
+     * @param block_id Block to hash.
+     * @param changed_offset File offset of the updated data within the block.
+     * @param changed_len Length of the updated data.
+     * @return 0 on success. -1 on error.
+     */
+    int hmap_tree::hash_file_block_chunks(hasher::h32 &block_hash, const std::string &vpath, const file_data_source &src, const uint32_t block_id,
+                                          const off_t changed_offset, const size_t changed_len)
+    {
+        const off_t block_offset = (off_t)block_id * BLOCK_SIZE;
+        const size_t block_len = MIN(BLOCK_SIZE, (src.file_size - block_offset));
+        const size_t input_len = BLOCK_OFFSET_LEN + block_len;
+
+        uint8_t block_offset_buf[BLOCK_OFFSET_LEN];
+        util::uint64_to_bytes(block_offset_buf, block_offset);
+
+        // Blocks which fit in a single chunk are simply rehashed.
+        if (input_len <= hasher::CHUNK_LEN)
+        {
+            uint8_t data[hasher::CHUNK_LEN];
+            if (src.read(data, block_len, block_offset) == -1)
+            {
+                LOG_ERROR << "Error when reading file block for hashing. block:" << block_id;
+                return -1;
+            }
+            hasher::hash_buf(block_hash, block_offset_buf, BLOCK_OFFSET_LEN, data, block_len);
+            return 0;
         }
 
-        // Add block hashes to the file hash.
-        for (const hasher::h32 &block_hash : node_hmap.block_hashes)
-            node_hmap.node_hash ^= block_hash;
+        // The block hash tree is taken out of the cache while it is used. So the cache is not locked during the hashing.
+        std::list<block_chunk_tree> taken;
+        take_chunk_tree(taken, vpath, block_id);
+        block_chunk_tree *cached = taken.empty() ? NULL : &taken.front();
+        if (cached && cached->tree.input_len == input_len)
+        {
+            // Chunks of the block hash input touched by the update. Block hash input is prefixed with the block offset.
+            const size_t first_chunk = (BLOCK_OFFSET_LEN + (changed_offset - block_offset)) / hasher::CHUNK_LEN;
+            const size_t end_chunk = MAX(first_chunk + 1, ((BLOCK_OFFSET_LEN + (changed_offset - block_offset) + changed_len) + hasher::CHUNK_LEN - 1) / hasher::CHUNK_LEN);
+            const size_t input_offset = first_chunk * hasher::CHUNK_LEN;
+            const size_t len = MIN(end_chunk * hasher::CHUNK_LEN, input_len) - input_offset;
+
+            thread_local std::vector<uint8_t> chunk_buf;
+            chunk_buf.resize(len);
+            const size_t prefix_len = input_offset < BLOCK_OFFSET_LEN ? (BLOCK_OFFSET_LEN - input_offset) : 0;
+            if (prefix_len > 0)
+                memcpy(chunk_buf.data(), block_offset_buf + input_offset, prefix_len);
+
+            const off_t data_offset = block_offset + (input_offset + prefix_len - BLOCK_OFFSET_LEN);
+            const size_t data_len = len - prefix_len;
+            if (src.read(chunk_buf.data() + prefix_len, data_len, data_offset) == -1)
+            {
+                LOG_ERROR << "Error when reading file chunks for hashing. block:" << block_id;
+                return -1;
+            }
+
+            hasher::update_chunk_tree(block_hash, cached->tree, first_chunk, chunk_buf.data(), len);
+            put_chunk_tree(taken);
+            return 0;
+        }
+
+        // Build the block hash tree from the whole block.
+        const uint8_t *data = src.map(block_len, block_offset);
+        std::vector<uint8_t> read_buf;
+        if (!data)
+        {
+            read_buf.resize(block_len);
+            if (src.read(read_buf.data(), block_len, block_offset) == -1)
+            {
+                LOG_ERROR << "Error when reading file block for hashing. block:" << block_id;
+                return -1;
+            }
+            data = read_buf.data();
+        }
 
+        if (!cached)
+            cached = &taken.emplace_front(block_chunk_tree{vpath, block_id});
+        hasher::build_chunk_tree(block_hash, cached->tree, hasher::hash_input{block_offset_buf, BLOCK_OFFSET_LEN, data, block_len});
+
+        put_chunk_tree(taken);
         return 0;
     }
 
+    /**
+     * Moves the cached hash tree of the specified file block (if any) out of the cache into the given list.
+     */
+    void hmap_tree::take_chunk_tree(std::list<block_chunk_tree> &taken, const std::string &vpath, const uint32_t block_id)
+    {
+        std::scoped_lock lock(chunk_trees_mutex);
+        const auto file_itr = chunk_tree_index.find(vpath);
+        if (file_itr == chunk_tree_index.end())
+            return;
+
+        const auto block_itr = file_itr->second.find(block_id);
+        if (block_itr == file_itr->second.end())
+            return;
+
+        taken.splice(taken.begin(), chunk_trees, block_itr->second);
+        file_itr->second.erase(block_itr);
+        if (file_itr->second.empty())
+            chunk_tree_index.erase(file_itr);
+    }
+
+    /**
+     * Places a hash tree taken with take_chunk_tree() back in the cache as the most recently used one.
+     */
+    void hmap_tree::put_chunk_tree(std::list<block_chunk_tree> &taken)
+    {
+        std::scoped_lock lock(chunk_trees_mutex);
+        while (!taken.empty())
+        {
+            chunk_trees.splice(chunk_trees.begin(), taken, taken.begin());
+            const block_chunk_tree &cached = chunk_trees.front();
+
+            // Any other tree of the same block is out of date.
+            const auto [block_itr, inserted] = chunk_tree_index[cached.vpath].try_emplace(cached.block_id, chunk_trees.begin());
+            if (!inserted)
+            {
+                chunk_trees.erase(block_itr->second);
+                block_itr->second = chunk_trees.begin();
+            }
+        }
+
+        while (chunk_trees.size() > CHUNK_TREE_CACHE_SIZE)
+        {
+            unindex_chunk_tree(chunk_trees.back());
+            chunk_trees.pop_back();
+        }
+    }
+
+    /**
+     * Drops the cached hash trees of the blocks of the specified file from the given block onwards.
+     */
+    void hmap_tree::erase_chunk_trees(const std::string &vpath, const uint32_t from_block_id)
+    {
+        std::scoped_lock lock(chunk_trees_mutex);
+        const auto file_itr = chunk_tree_index.find(vpath);
+        if (file_itr == chunk_tree_index.end())
+            return;
+
+        std::map<uint32_t, std::list<block_chunk_tree>::iterator> &blocks = file_itr->second;
+        for (auto block_itr = blocks.lower_bound(from_block_id); block_itr != blocks.end();)
+        {
+            chunk_trees.erase(block_itr->second);
+            block_itr = blocks.erase(block_itr);
+        }
+
+        if (blocks.empty())
+            chunk_tree_index.erase(file_itr);
+    }
+
+    /**
+     * Drops the cached hash trees of the files at or under the specified vpath.
+     */
+    void hmap_tree::erase_subtree_chunk_trees(const std::string &vpath)
+    {
+        std::scoped_lock lock(chunk_trees_mutex);
+        for (auto file_itr = chunk_tree_index.begin(); file_itr != chunk_tree_index.end();)
+        {
+            const std::string &cached_vpath = file_itr->first;
+            if (cached_vpath.compare(0, vpath.size(), vpath) != 0 ||
+                (cached_vpath.size() != vpath.size() && cached_vpath[vpath.size()] != '/'))
+            {
+                file_itr++;
+                continue;
+            }
+
+            for (const auto &[block_id, itr] : file_itr->second)
+                chunk_trees.erase(itr);
+            file_itr = chunk_tree_index.erase(file_itr);
+        }
+    }
+
+    /**
+     * Removes a cached hash tree from the cache index. Caller must hold the hash tree cache lock.
+     */
+    void hmap_tree::unindex_chunk_tree(const block_chunk_tree &cached)
+    {
+        const auto file_itr = chunk_tree_index.find(cached.vpath);
+        if (file_itr == chunk_tree_index.end())
+            return;
+
+        file_itr->second.erase(cached.block_id);
+        if (file_itr->second.empty())
+            chunk_tree_index.erase(file_itr);
+    }
+
     int hmap_tree::apply_vnode_delete(const std::string &vpath)
     {
+        TREE_LOCK
+        if (store.trim() == -1)
+            return -1;
+
         store::vnode_hmap *hmap_entry = store.find_hash_map(vpath);
         if (hmap_entry == NULL)
         {
@@ -301,9 +791,22 @@ namespace hpfs::hmap::tree
             return -1;
         }
 
-        const hasher::h32 node_hash = hmap_entry->node_hash;
+        // A dir may have changes from its (already deleted) children pending to be applied to its hash.
+        hasher::h32 node_hash = hmap_entry->node_hash;
+        vpaths::vpath_table &vpaths = store.get_vpaths();
+        const vpaths::vpath_id id = vpaths.find(vpath);
+        const auto pending = (id == vpaths::NO_VPATH_ID) ? pending_hash_updates.end()
+                                                         : pending_hash_updates.find({vpaths.get_depth(id), id});
+        if (pending != pending_hash_updates.end())
+        {
+            node_hash ^= pending->second;
+            pending_hash_updates.erase(pending);
+            vpaths.release(id);
+        }
+
         store.erase_hash_map(vpath);
         store.set_dirty(vpath);
+        erase_subtree_chunk_trees(vpath);
 
         propogate_hash_update(vpath, node_hash, hasher::h32_empty);
         PRINT_ROOT_HASH
@@ -313,6 +816,13 @@ namespace hpfs::hmap::tree
 
     int hmap_tree::apply_vnode_rename(const std::string &from_vpath, const std::string &to_vpath, const bool is_dir)
     {
+        TREE_LOCK
+        // Hash maps are persisted and moved with the sub tree. So they must be up to date.
+        apply_pending_hash_updates();
+
+        if (store.trim() == -1)
+            return -1;
+
         // Backup and delete the hash node.
         store::vnode_hmap *hmap_entry = store.find_hash_map(from_vpath);
         if (hmap_entry == NULL)
@@ -328,6 +838,8 @@ namespace hpfs::hmap::tree
 
         store::vnode_hmap node_hmap = *hmap_entry; // Create a copy and erase the hmap entry.
         store.erase_hash_map(from_vpath);
+        erase_subtree_chunk_trees(from_vpath);
+        erase_subtree_chunk_trees(to_vpath);
 
         // Update hash map with removed node hash.
         propogate_hash_update(from_vpath, node_hmap.node_hash, hasher::h32_empty);
@@ -348,13 +860,79 @@ namespace hpfs::hmap::tree
     }
 
     hmap::hasher::h32 hmap_tree::get_root_hash()
+    {
+        TREE_LOCK
+        return read_root_hash();
+    }
+
+    hmap::hasher::h32 hmap_tree::read_root_hash()
     {
         store::vnode_hmap *node_hmap = store.find_hash_map(ROOT_VPATH);
         if (node_hmap == NULL)
         {
             return hmap::hasher::h32_empty;
         }
-        return node_hmap->node_hash;
+
+        // Pending changes of the lazy hash propagation are yet to be applied to the root hash map.
+        hasher::h32 root_hash = node_hmap->node_hash;
+        root_hash ^= pending_root_hash_update;
+        return root_hash;
+    }
+
+    /**
+     * Calculates the hashes of a batch of file blocks (possibly of different files) with a single batch hash.
+     * Block data is taken from the vnode memory maps where the data source allows it. Rest of the blocks are read
+     * into a buffer first.
+     * Block hash is the hash of the big-endian block offset followed by the block data.
+     * @param blocks File blocks to hash.
+     * @param max_lanes Maximum no. of threads to hash the batch with.
+     * @return 0 on success. -1 on error.
+     */
+    int hmap_tree::hash_file_blocks(const std::vector<file_block> &blocks, const size_t max_lanes)
+    {
+        const auto get_block_len = [](const file_block &block) {
+            return MIN(BLOCK_SIZE, (block.src.file_size - ((off_t)block.block_id * BLOCK_SIZE)));
+        };
+
+        size_t read_len = 0;
+        for (const file_block &block : blocks)
+        {
+            if (!block.src.map(get_block_len(block), (off_t)block.block_id * BLOCK_SIZE))
+                read_len += get_block_len(block);
+        }
+        std::vector<uint8_t> read_buf(read_len);
+
+        std::vector<uint8_t> block_offset_bufs(blocks.size() * BLOCK_OFFSET_LEN);
+        std::vector<hasher::hash_input> inputs(blocks.size());
+        size_t read_pos = 0;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            const off_t block_offset = (off_t)blocks[i].block_id * BLOCK_SIZE;
+            const size_t block_len = get_block_len(blocks[i]);
+            const uint8_t *data = blocks[i].src.map(block_len, block_offset);
+
+            if (!data)
+            {
+                if (blocks[i].src.read(read_buf.data() + read_pos, block_len, block_offset) == -1)
+                {
+                    LOG_ERROR << "Error when reading file block for hashing. block:" << blocks[i].block_id;
+                    return -1;
+                }
+                data = read_buf.data() + read_pos;
+                read_pos += block_len;
+            }
+
+            uint8_t *block_offset_buf = block_offset_bufs.data() + (i * BLOCK_OFFSET_LEN);
+            util::uint64_to_bytes(block_offset_buf, block_offset);
+            inputs[i] = hasher::hash_input{block_offset_buf, BLOCK_OFFSET_LEN, data, block_len};
+        }
+
+        std::vector<hasher::h32> hashes(blocks.size());
+        hasher::hash_bufs(hashes.data(), inputs.data(), inputs.size(), max_lanes);
+        for (size_t i = 0; i < blocks.size(); i++)
+            *blocks[i].hash = hashes[i];
+
+        return 0;
     }
 
     void hmap_tree::generate_name_hash(store::vnode_hmap &vn_hmap, std::string_view vpath)
@@ -376,6 +954,13 @@ namespace hpfs::hmap::tree
     */
     int hmap_tree::re_build_hash_maps(hasher::h32 &root_hash)
     {
+        TREE_LOCK
+        // Everything gets calculated from scratch.
+        for (const auto &[key, change] : pending_hash_updates)
+            store.get_vpaths().release(key.second);
+        pending_hash_updates.clear();
+        pending_root_hash_update = hasher::h32_empty;
+
         if (store.clear() == -1 ||                             // Clear the existing hash store.
             calculate_dir_hash(root_hash, ROOT_VPATH) == -1 || // Calculate entire filesystem hash from scratch.
             store.persist_hash_maps() == -1)                   // Persist calculated hashes to disk.
@@ -386,12 +971,96 @@ namespace hpfs::hmap::tree
         return 0;
     }
 
+    /**
+     * Re-calculates only the hash maps of the specified vpaths and their ancestors according to the current vfs
+     * and persists them. All the other hash maps are considered to be up to date.
+     * @param root_hash Recalculated root hash.
+     * @param vpaths Vpaths to re-calculate. Value indicates whether the hash maps of the entire sub tree of the
+     *               vpath need to be re-calculated (eg. renamed dirs) instead of just the vpath.
+     * @return -1 on error and 0 on success.
+    */
+    int hmap_tree::re_build_hash_maps(hasher::h32 &root_hash, const std::unordered_map<std::string, bool> &vpaths)
+    {
+        TREE_LOCK
+        apply_pending_hash_updates();
+
+        // Include the ancestors of the vpaths as their hashes include the hashes of the vpaths.
+        std::unordered_map<std::string, bool> nodes;
+        for (const auto &[vpath, is_tree] : vpaths)
+        {
+            nodes[vpath] |= is_tree;
+            for (std::string parent_path = vpath; parent_path != ROOT_VPATH;)
+            {
+                parent_path = util::get_parent_path(parent_path);
+                if (!nodes.try_emplace(parent_path, false).second)
+                    break; // Rest of the ancestors have already been included.
+            }
+        }
+
+        // Descendants must be calculated before their ancestors. So we process the deepest vpaths first.
+        std::vector<std::pair<std::string, bool>> ordered_nodes(nodes.begin(), nodes.end());
+        std::sort(ordered_nodes.begin(), ordered_nodes.end(), [](const auto &a, const auto &b) {
+            return get_vpath_depth(a.first) > get_vpath_depth(b.first);
+        });
+
+        for (const auto &[vpath, is_tree] : ordered_nodes)
+        {
+            // Skip the vpaths which get calculated as a part of an ancestor sub tree.
+            bool in_ancestor_tree = false;
+            for (std::string parent_path = vpath; !in_ancestor_tree && parent_path != ROOT_VPATH;)
+            {
+                parent_path = util::get_parent_path(parent_path);
+                in_ancestor_tree = nodes.at(parent_path);
+            }
+            if (in_ancestor_tree)
+                continue;
+
+            vfs::vnode *vn = NULL;
+            if (virt_fs.get_vnode(vpath, &vn) == -1)
+            {
+                LOG_ERROR << "Hash map re-build failure in vfs vnode get. " << vpath;
+                return -1;
+            }
+
+            // Stale hash maps of the sub tree must not be reused.
+            if ((!vn || is_tree) && store.erase_hash_map_tree(vpath) == -1)
+                return -1;
+
+            if (!vn)
+                continue;
+
+            hasher::h32 node_hash;
+            const int res = S_ISREG(vn->st.st_mode) ? calculate_file_hash(node_hash, vpath)
+                                                    : (is_tree ? calculate_dir_hash(node_hash, vpath)
+                                                               : calculate_dir_node_hash(node_hash, vpath, *vn));
+            if (res == -1)
+            {
+                LOG_ERROR << "Error re building the hash map. " << vpath;
+                return -1;
+            }
+        }
+
+        if (store.persist_hash_maps() == -1)
+        {
+            LOG_ERROR << "Error persisting re-built hash maps.";
+            return -1;
+        }
+
+        root_hash = read_root_hash();
+        return 0;
+    }
+
     hmap_tree::~hmap_tree()
     {
         if (initialized && !moved)
         {
             // Persist any hash map updates to the disk.
+            apply_pending_hash_updates();
             store.persist_hash_maps();
+
+            const store::cache_stats &stats = store.get_stats();
+            LOG_INFO << "Hash map cache hits: " << stats.hits << " misses: " << stats.misses
+                     << " evictions: " << stats.evictions << " memory: " << stats.mem_size;
         }
     }
 
@@ -4,13 +4,58 @@
 #include <string>
 #include <vector>
 #include <optional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
 #include "hasher.hpp"
 #include "store.hpp"
+#include "../vpaths.hpp"
 #include "../vfs/vfs.hpp"
 #include "../vfs/virtual_filesystem.hpp"
 
 namespace hpfs::hmap::tree
 {
+    constexpr size_t BLOCK_SIZE = 4194304; // 4MB
+
+    // File data as it is after a file data update. The update buffer is placed over the vnode data if the update has not
+    // been applied to the vnode yet.
+    struct file_data_source
+    {
+        const vfs::vnode &vn;   // Vnode with the file data.
+        size_t file_size = 0;   // File size after the update.
+        const char *buf = NULL; // New file data which is not in the vnode yet. NULL if there is none.
+        off_t buf_offset = 0;
+        size_t buf_len = 0;
+
+        int read(uint8_t *dst, const size_t len, const off_t offset) const;
+        const uint8_t *map(const size_t len, const off_t offset) const;
+    };
+
+    // A file block which is hashed as part of a hash batch.
+    struct file_block
+    {
+        file_data_source src; // File data to hash the block of.
+        uint32_t block_id = 0;
+        hasher::h32 *hash = NULL; // Where the calculated block hash is placed.
+    };
+
+    // Hashes of the file blocks touched by a file data update.
+    struct file_update_hashes
+    {
+        size_t file_size = 0;                  // File size after the update.
+        uint32_t first_block_id = 0;           // Block id of the first updated block.
+        std::vector<hasher::h32> block_hashes; // Hashes of the updated blocks starting from the first updated block.
+    };
+
+    // Hash tree of a file block kept so small updates to the block only rehash the chunks they touch.
+    struct block_chunk_tree
+    {
+        std::string vpath;
+        uint32_t block_id = 0;
+        hasher::chunk_tree tree;
+    };
+
     class hmap_tree
     {
     private:
@@ -18,27 +63,61 @@ namespace hpfs::hmap::tree
         bool initialized = false; // Indicates that the instance has been initialized properly.
         store::hmap_store store;
         hpfs::vfs::virtual_filesystem &virt_fs;
-        void generate_name_hash(store::vnode_hmap &vn_hmap, std::string_view vpath);
-        void generate_meta_hash(store::vnode_hmap &vn_hmap, const vfs::vnode &vn);
+        std::list<block_chunk_tree> chunk_trees; // Hash trees of the recently updated file blocks. Most recent first.
+        std::mutex chunk_trees_mutex;            // Guards the hash tree cache. File data updates are hashed without the tree lock.
+
+        // Cached hash trees by vpath and block id. So the cache is looked up without walking the hash tree list.
+        std::unordered_map<std::string, std::map<uint32_t, std::list<block_chunk_tree>::iterator>> chunk_tree_index;
+
+        // Serializes the public operations since queries run concurrently with the hash updates of the vfs writes.
+        std::mutex tree_mutex;
+
+        // Node hash changes not yet applied to the ancestor hash maps (lazy hash propagation). Keyed by the depth and the
+        // vpath id of the hash map to apply the change to. Deepest first. Each entry holds a reference to its vpath id.
+        std::map<std::pair<uint32_t, vpaths::vpath_id>, hasher::h32, std::greater<>> pending_hash_updates;
+        hasher::h32 pending_root_hash_update = hasher::h32_empty; // Combined change of all pending updates to the root hash.
+
+        int hash_updated_blocks(file_update_hashes &update, const std::string &vpath, const file_data_source &src,
+                                const off_t update_offset, const size_t update_size);
+        int hash_file_block_chunks(hasher::h32 &block_hash, const std::string &vpath, const file_data_source &src, const uint32_t block_id,
+                                   const off_t changed_offset, const size_t changed_len);
+        int apply_updated_blocks(const std::string &vpath, const vfs::vnode &vn, const file_update_hashes &update);
+        static void apply_file_data_update(store::vnode_hmap &node_hmap, const file_update_hashes &update);
+        void take_chunk_tree(std::list<block_chunk_tree> &taken, const std::string &vpath, const uint32_t block_id);
+        void put_chunk_tree(std::list<block_chunk_tree> &taken);
+        void erase_chunk_trees(const std::string &vpath, const uint32_t from_block_id = 0);
+        void erase_subtree_chunk_trees(const std::string &vpath);
+        void unindex_chunk_tree(const block_chunk_tree &cached);
+        static size_t get_vpath_depth(const std::string &vpath);
+        hmap::hasher::h32 read_root_hash();
 
     public:
+        static void generate_name_hash(store::vnode_hmap &vn_hmap, std::string_view vpath);
+        static void generate_meta_hash(store::vnode_hmap &vn_hmap, const vfs::vnode &vn);
+        static int hash_file_blocks(const std::vector<file_block> &blocks, const size_t max_lanes = 1);
         int init();
         static int create(std::optional<hmap_tree> &tree, hpfs::vfs::virtual_filesystem &virt_fs);
         hmap_tree(hpfs::vfs::virtual_filesystem &virt_fs);
-        int get_vnode_hmap(store::vnode_hmap **node_hmap, const std::string &vpath);
+        int get_vnode_hmap(store::vnode_hmap &node_hmap, const std::string &vpath, const bool with_block_hashes = true);
         int calculate_dir_hash(hasher::h32 &node_hash, const std::string &vpath);
         int calculate_file_hash(hasher::h32 &node_hash, const std::string &vpath);
+        int calculate_dir_node_hash(hasher::h32 &node_hash, const std::string &vpath, const vfs::vnode &vn);
         void propogate_hash_update(const std::string &vpath, const hasher::h32 &old_hash, const hasher::h32 &new_hash);
+        void apply_pending_hash_updates();
         int apply_vnode_create(const std::string &vpath);
         int apply_vnode_metadata_update(const std::string &vpath, const vfs::vnode &vn);
         int apply_vnode_data_update(const std::string &vpath, const vfs::vnode &vn,
                                     const off_t file_update_offset, const size_t file_update_size);
-        int apply_file_data_update(store::vnode_hmap &node_hmap, const vfs::vnode &vn,
-                                   const off_t update_offset, const size_t update_size);
+        int apply_vnode_data_update(const std::string &vpath, const vfs::vnode &vn, const file_update_hashes &update);
+        int prepare_file_data_update(file_update_hashes &update, const std::string &vpath, const vfs::vnode &vn,
+                                     const size_t file_size, const off_t update_offset, const size_t update_size,
+                                     const char *buf = NULL, const off_t buf_offset = 0);
+        void discard_file_data_update(const std::string &vpath);
         int apply_vnode_delete(const std::string &vpath);
         int apply_vnode_rename(const std::string &from_vpath, const std::string &to_vpath, const bool is_dir);
         hmap::hasher::h32 get_root_hash();
         int re_build_hash_maps(hasher::h32 &root_hash);
+        int re_build_hash_maps(hasher::h32 &root_hash, const std::unordered_map<std::string, bool> &vpaths);
         ~hmap_tree();
     };
 
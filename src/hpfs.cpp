@@ -7,11 +7,13 @@
 #include "hpfs.hpp"
 #include "util.hpp"
 #include "fusefs.hpp"
+#include "fusefs_lowlevel.hpp"
 #include "merger.hpp"
 #include "tracelog.hpp"
 #include "audit/audit.hpp"
 #include "session.hpp"
 #include "audit/logger_index.hpp"
+#include "hmap/store_db.hpp"
 #include "version.hpp"
 
 namespace hpfs
@@ -21,6 +23,8 @@ namespace hpfs
     constexpr const char *HMAP_DIR_NAME = "hmap";
     constexpr const char *LOG_FILE_NAME = "log.hpfs";
     constexpr const char *LOG_INDEX_FILE_NAME = "log.hpfs.idx";
+    constexpr const char *HMAP_DB_FILE_NAME = "hmap.db";
+    constexpr const char *VFS_SNAPSHOT_FILE_NAME = "vfs.snapshot";
     constexpr int DIR_PERMS = 0755;
 
     hpfs_context ctx;
@@ -82,16 +86,19 @@ namespace hpfs
         }
         else
         {
-            if (merger::init() == -1 || audit::logger_index::init(ctx.log_index_file_path))
+            if (merger::init() == -1 || audit::logger_index::init(ctx.log_index_file_path) ||
+                hmap::store_db::init(ctx.hmap_db_file_path) == -1)
                 return -1;
 
             if (run_ro_rw_session(argv[0]) == -1)
             {
+                hmap::store_db::deinit();
                 audit::logger_index::deinit();
                 merger::deinit();
                 return -1;
             }
 
+            hmap::store_db::deinit();
             audit::logger_index::deinit();
             merger::deinit();
             return 0;
@@ -118,7 +125,7 @@ namespace hpfs
         // This is a blocking call. This will exit when fuse_main receives a signal.
         LOG_INFO << "Starting FUSE session... (access: " << ctx.self_uid << ":" << ctx.self_gid
                  << (ctx.ugid_enabled ? (" + " + std::to_string(ctx.allowed_uid) + ":" + std::to_string(ctx.allowed_gid)) : "") << ")";
-        const int ret = fusefs::init(arg0);
+        const int ret = ctx.fuse_lowlevel ? fusefs_lowlevel::init(arg0) : fusefs::init(arg0);
         LOG_INFO << "Ended FUSE session.";
 
         // Even though FUSE is up, we do not automatically create a hpfs session. In order to be able to
@@ -150,6 +157,8 @@ namespace hpfs
         ctx.hmap_dir.append(ctx.fs_dir).append("/").append(HMAP_DIR_NAME);
         ctx.log_file_path.append(ctx.fs_dir).append("/").append(LOG_FILE_NAME);
         ctx.log_index_file_path.append(ctx.fs_dir).append("/").append(LOG_INDEX_FILE_NAME);
+        ctx.hmap_db_file_path.append(ctx.fs_dir).append("/").append(HMAP_DB_FILE_NAME);
+        ctx.vfs_snapshot_file_path.append(ctx.fs_dir).append("/").append(VFS_SNAPSHOT_FILE_NAME);
 
         if (!util::is_dir_exists(ctx.seed_dir) && mkdir(ctx.seed_dir.c_str(), DIR_PERMS) == -1)
         {
@@ -187,6 +196,21 @@ namespace hpfs
         // Initialize options.
         std::string fs_dir, mount_dir, ugid, trace_mode;
         bool is_merge_enabled;
+        size_t merge_low_watermark = 1 * 1024 * 1024;
+        size_t merge_high_watermark = 100 * 1024 * 1024;
+        uint32_t merge_slice = 50;
+        size_t commit_batch = 1;
+        uint32_t commit_window = 10;
+        size_t hmap_threads = 0;
+        bool is_hmap_db_enabled = false;
+        bool is_hmap_lazy_propagation = false;
+        size_t hmap_cache_limit = 0;
+        uint64_t log_read_limit = 4 * 1024 * 1024;
+        size_t vfs_snapshot_interval = 10000;
+        std::string read_engine;
+        bool is_fuse_lowlevel = false;
+        double ro_cache_timeout = 3600;
+        double rw_cache_timeout = 0;
 
         // fs
         fs->add_option("-f,--fs-dir", fs_dir, "Filesystem metadata dir")->required()->check(CLI::ExistingDirectory);
@@ -194,6 +218,21 @@ namespace hpfs
         fs->add_option("-u,--ugid", ugid, "Additional user group access in \"uid:gid\" format. Default: empty");
         fs->add_option("-t,--trace", trace_mode, "Trace mode")->check(CLI::IsMember({"dbg", "none", "inf", "wrn", "err"}))->default_str("wrn");
         fs->add_flag("-g,--merge", is_merge_enabled, "Whether the log merger is enabled or not");
+        fs->add_option("--merge-low-watermark", merge_low_watermark, "Log size in bytes below which merging waits until the log stops growing. Default: 1048576");
+        fs->add_option("--merge-high-watermark", merge_high_watermark, "Log size in bytes above which merging competes with sessions for the log. Default: 104857600");
+        fs->add_option("--merge-slice", merge_slice, "Max milliseconds the log is locked by a merge slice. Default: 50");
+        fs->add_option("--commit-batch", commit_batch, "Max no. of log records of concurrent writers appended together and per log header commit. Default: 1");
+        fs->add_option("--commit-window", commit_window, "Max milliseconds a deferred log header commit waits before it is flushed. Default: 10");
+        fs->add_option("--log-read-limit", log_read_limit, "Max response size in bytes of a log index read. Default: 4194304 (0 for no limit)");
+        fs->add_flag("--hmap-db", is_hmap_db_enabled, "Whether hash maps are persisted in a single db file instead of per-file caches");
+        fs->add_option("--hmap-threads", hmap_threads, "No. of threads used for hash map calculation. Default: 0 (no. of cpu cores)");
+        fs->add_flag("--hmap-lazy", is_hmap_lazy_propagation, "Whether hash changes are applied to the parent hash maps only when they are queried or persisted");
+        fs->add_option("--hmap-cache-limit", hmap_cache_limit, "Max bytes of hash maps kept in memory. Default: 0 (no limit)");
+        fs->add_option("--vfs-snapshot-interval", vfs_snapshot_interval, "Min no. of replayed log records before a vfs snapshot is taken at session start/stop. Default: 10000 (0 to disable)");
+        fs->add_option("--read-engine", read_engine, "File data read engine")->check(CLI::IsMember({"mmap", "extent"}))->default_str("mmap");
+        fs->add_flag("--fuse-lowlevel", is_fuse_lowlevel, "Whether the fuse low-level api frontend (with spliced reads) is used");
+        fs->add_option("--ro-cache-timeout", ro_cache_timeout, "Seconds the kernel may cache entries/attributes of RO sessions with --fuse-lowlevel. Default: 3600");
+        fs->add_option("--rw-cache-timeout", rw_cache_timeout, "Seconds the kernel may cache entries/attributes of RW sessions with --fuse-lowlevel. Default: 0");
 
         // rdlog
         rdlog->add_option("-f,--fs-dir", fs_dir, "Filesystem metadata dir")->required()->check(CLI::ExistingDirectory);
@@ -242,6 +281,28 @@ namespace hpfs
             {
                 ctx.run_mode = RUN_MODE::FS;
                 ctx.merge_enabled = is_merge_enabled;
+                ctx.merge_low_watermark = merge_low_watermark;
+                ctx.merge_high_watermark = merge_high_watermark;
+                ctx.merge_slice = merge_slice;
+                ctx.log_commit_batch = commit_batch;
+                ctx.log_commit_window = commit_window;
+
+                // Deferred header commits must be flushed within a bounded time.
+                if (ctx.log_commit_batch > 1 && ctx.log_commit_window == 0)
+                {
+                    std::cerr << "Commit window must be greater than 0 when commit batch is greater than 1.\n";
+                    return -1;
+                }
+                ctx.hmap_threads = hmap_threads;
+                ctx.hmap_db_enabled = is_hmap_db_enabled;
+                ctx.hmap_lazy_propagation = is_hmap_lazy_propagation;
+                ctx.hmap_cache_limit = hmap_cache_limit;
+                ctx.log_read_limit = log_read_limit;
+                ctx.vfs_snapshot_interval = vfs_snapshot_interval;
+                ctx.read_engine = (read_engine == "extent") ? READ_ENGINE::EXTENT : READ_ENGINE::MMAP;
+                ctx.fuse_lowlevel = is_fuse_lowlevel;
+                ctx.ro_cache_timeout = ro_cache_timeout;
+                ctx.rw_cache_timeout = rw_cache_timeout;
 
                 // ugid arg (optional) specified uid/gid combination that is allowed to access the fuse mount
                 // in addition to the mount owner.
@@ -23,11 +23,32 @@ namespace hpfs
         ERROR
     };
 
+    enum READ_ENGINE
+    {
+        MMAP,  // Vnode data is read from a memory map with all the data segments overlaid.
+        EXTENT // Vnode data is read from the backing files by looking up the data segments.
+    };
+
     struct hpfs_context
     {
         RUN_MODE run_mode;
         TRACE_LEVEL trace_level;
         bool merge_enabled;
+        size_t merge_low_watermark = 1 * 1024 * 1024;    // Log size below which merging waits until the log stops growing.
+        size_t merge_high_watermark = 100 * 1024 * 1024; // Log size above which merging competes with the sessions for the log.
+        uint32_t merge_slice = 50;                        // Max milliseconds the log is locked by a merge slice.
+        size_t log_commit_batch = 1;     // Max no. of log records per group commit write and per log header commit.
+        uint32_t log_commit_window = 10; // Max milliseconds a deferred log header commit waits before it is flushed.
+        uint64_t log_read_limit = 4 * 1024 * 1024; // Max response size of a log index read. 0 means no limit.
+        bool hmap_db_enabled = false;   // Whether hash maps are persisted in a single db file instead of per-vpath cache files.
+        size_t hmap_threads = 0;        // No. of threads used for hash map calculation. 0 means no. of cpu cores.
+        bool hmap_lazy_propagation = false; // Whether node hash changes reach the ancestor hash maps only when they are needed.
+        size_t hmap_cache_limit = 0;        // Max bytes of hash maps kept in memory. 0 means no limit.
+        size_t vfs_snapshot_interval = 10000; // Min no. of replayed log records before a vfs snapshot is taken at session start/stop. 0 disables snapshots.
+        READ_ENGINE read_engine = READ_ENGINE::MMAP; // Vnode data read engine used by the fs sessions.
+        bool fuse_lowlevel = false; // Whether the fuse low-level api frontend is used instead of the high-level one.
+        double ro_cache_timeout = 3600; // Seconds the kernel may cache the entries/attributes of RO sessions. (Low-level frontend only)
+        double rw_cache_timeout = 0;    // Seconds the kernel may cache the entries/attributes of RW sessions. (Low-level frontend only)
         std::string fs_dir; // The parent dir containing all metadata information for hpfs.
         std::string seed_dir;
         std::string mount_dir;
@@ -35,6 +56,8 @@ namespace hpfs
         std::string trace_dir;
         std::string log_file_path;
         std::string log_index_file_path;
+        std::string hmap_db_file_path;
+        std::string vfs_snapshot_file_path;
         struct stat default_stat; // Stat used as a base stat for virtual entries.
 
         uid_t self_uid = 0;
@@ -0,0 +1,80 @@
+#include <errno.h>
+#include <unordered_map>
+#include "kernel_cache.hpp"
+#include "tracelog.hpp"
+
+/**
+ * Invalidation of the kernel caches of the paths that change without the kernel knowing.
+ * (eg. hash map query files) The kernel keeps its caches up to date for operations which are sent through the mount.
+ *
+ * Changed paths are queued while a request is being handled and the invalidations are sent synchronously before
+ * the request is replied. So the caller never sees stale data after its own request returns. Paths with entries
+ * that can change behind the kernel are never cached by the kernel. So only the inodes are invalidated here, which
+ * does not need the directory locks the kernel may be holding for the request being handled.
+ */
+
+namespace hpfs::kernel_cache
+{
+    kernel_cache_context kc_ctx;
+
+    // Paths queued by the request being handled on this thread. Repeated changes are coalesced.
+    thread_local std::unordered_map<std::string, bool> pending_paths;
+
+    /**
+     * Enables invalidations with the frontend specific invalidator.
+     * @return 0 on success. -1 on error.
+     */
+    int init(const invalidator &invalidate_path)
+    {
+        kc_ctx.invalidate_path = invalidate_path;
+        kc_ctx.initialized = true;
+        return 0;
+    }
+
+    void deinit()
+    {
+        kc_ctx.initialized = false;
+    }
+
+    /**
+     * Queues the full mount path to be invalidated from the kernel cache when the current request is done.
+     * Does nothing if the frontend cannot send invalidations.
+     */
+    void invalidate(const std::string &full_path, const bool removed)
+    {
+        if (!kc_ctx.initialized)
+            return;
+
+        bool &path_removed = pending_paths[full_path];
+        path_removed = path_removed || removed;
+    }
+
+    /**
+     * Sends the invalidations queued by the current request. Must not be called while holding any locks needed
+     * to serve other requests, since the kernel may need those requests to complete before it can invalidate.
+     */
+    void flush()
+    {
+        if (pending_paths.empty())
+            return;
+
+        std::unordered_map<std::string, bool> paths;
+        paths.swap(pending_paths);
+        if (!kc_ctx.initialized)
+            return;
+
+        for (const auto &[path, removed] : paths)
+        {
+            // No entry means the kernel does not have the path cached.
+            const int res = kc_ctx.invalidate_path(path, removed);
+            if (res < 0 && res != -ENOENT)
+                LOG_DEBUG << -res << ": Kernel cache invalidation failed. " << path;
+        }
+    }
+
+    flush_guard::~flush_guard()
+    {
+        flush();
+    }
+
+} // namespace hpfs::kernel_cache
@@ -0,0 +1,35 @@
+#ifndef _HPFS_KERNEL_CACHE_
+#define _HPFS_KERNEL_CACHE_
+
+#include <string>
+#include <functional>
+#include <atomic>
+
+namespace hpfs::kernel_cache
+{
+    // Frontend specific function which drops the kernel cache of a full mount path. 'removed' indicates that the
+    // path no longer refers to the same entry (eg. a stopped session dir). <0 on error.
+    typedef std::function<int(const std::string &full_path, const bool removed)> invalidator;
+
+    struct kernel_cache_context
+    {
+        std::atomic<bool> initialized = false; // Indicates that the frontend can send invalidations.
+        invalidator invalidate_path;
+    };
+
+    // Sends the invalidations queued by the current request when it goes out of scope. Declared by the request
+    // handlers before they take any locks, so the invalidations are sent after the locks are released and before
+    // the request is replied.
+    struct flush_guard
+    {
+        ~flush_guard();
+    };
+
+    int init(const invalidator &invalidate_path);
+    void deinit();
+    void invalidate(const std::string &full_path, const bool removed = false);
+    void flush();
+
+} // namespace hpfs::kernel_cache
+
+#endif
@@ -6,6 +6,10 @@
 #include <signal.h>
 #include <sys/sendfile.h>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <unordered_map>
 #include "merger.hpp"
 #include "util.hpp"
 #include "hpfs.hpp"
@@ -14,12 +18,25 @@
 
 namespace hpfs::merger
 {
-    constexpr useconds_t CHECK_INTERVAL = 100000; // 100ms.
+    constexpr uint32_t CHECK_INTERVAL = 100; // 100ms. Re-check interval while there are log records to merge.
+    constexpr uint32_t IDLE_INTERVAL = 1000; // 1s. Check interval while the log is empty.
 
-    // The log file size threshold to trigger priority merge.
-    constexpr size_t PRIORITY_MERGE_SIZE_THRESHOLD = 100 * 1024 * 1024; // 100MB
+    // Weight of the history in the smoothed log growth rate and lock contention.
+    constexpr double GROWTH_SMOOTHING = 0.7;
+    constexpr double CONTENTION_SMOOTHING = 0.8;
+
+    // Limits of a merge batch. Log stays locked for merging until the whole batch is merged.
+    constexpr size_t MERGE_BATCH_MAX_RECORDS = 1000;
+    constexpr size_t MERGE_BATCH_MAX_DATA = 32 * 1024 * 1024; // 32MB of block data.
+
+    // Minimum purged space at the front of the log before it gets compacted while there are remaining log records.
+    // (Compaction may have to copy the remaining log records) Purged space of an empty log is always dropped.
+    constexpr size_t COMPACT_MIN_SIZE = 64 * 1024 * 1024; // 64MB.
 
     bool should_stop = false;
+    bool woken = false;
+    std::mutex wake_mutex;
+    std::condition_variable wake_cv;
     std::thread merger_thread;
     std::optional<hpfs::audit::audit_logger> audit_logger;
 
@@ -40,118 +57,386 @@ namespace hpfs::merger
         if (!ctx.merge_enabled)
             return;
 
-        should_stop = true;
+        {
+            std::scoped_lock lock(wake_mutex);
+            should_stop = true;
+        }
+        wake_cv.notify_one();
+
         if (merger_thread.joinable())
             merger_thread.join();
     }
 
+    /**
+     * Makes the merger check the log right away. Called whenever a writer releases the log so merging does not
+     * have to wait for the next check interval.
+     */
+    void wake()
+    {
+        if (!ctx.merge_enabled)
+            return;
+
+        {
+            std::scoped_lock lock(wake_mutex);
+            woken = true;
+        }
+        wake_cv.notify_one();
+    }
+
     void merger_loop()
     {
         util::mask_signal();
         LOG_INFO << "Log merger started.";
-        uint16_t counter = 10;
         hpfs::audit::audit_logger &logger = audit_logger.value();
+        merge_schedule sched;
+        sched.last_check = util::epoch();
 
         while (!should_stop)
         {
-            if (counter == 10)
-            {
-                size_t merged_count = 0; // No. of records that were merged during this cycle.
+            const uint32_t wait_ms = run_merge_cycle(logger, sched);
 
-                while (!should_stop)
-                {
-                    // We lock the header and release it only after the merge is complete.
-                    flock header_lock;
-                    if (logger.set_lock(header_lock, hpfs::audit::LOCK_TYPE::MERGE_LOCK) == -1 ||
-                        logger.read_header() == -1)
-                        break;
-
-                    // Normally we merge one record at a time. This allows any RW/RO sessions to jump in, essentially making
-                    // the merge operation a lower priority than RW/RO sessions.
-                    // However, if the log file has grown too large, we merge ALL records instead of one at a time.
-                    const audit::log_header &header = logger.get_header();
-                    const bool priority_merge = ((header.last_record - header.first_record) >= PRIORITY_MERGE_SIZE_THRESHOLD);
-
-                    // Keep processing the oldest record of the log as long as it succeeds.
-                    // Result  0 = There was no log record to process.
-                    // Result  1 = There was a log record and it was succesfully merged.
-                    // Result -1 = There was an error when processing log front.
-                    int merge_result = 0;
-                    while ((merge_result = merge_log_front(logger)) == 1)
-                    {
-                        if (merged_count == 0)
-                        {
-                            if (priority_merge)
-                                LOG_WARNING << "Started priority merge...";
-                            else
-                                LOG_INFO << "Started merging records...";
-                        }
-
-                        merged_count++;
-                        if (!priority_merge || should_stop) // Stop after merging one log record if we are not doing priority merge.
-                            break;
-                    }
+            std::unique_lock lock(wake_mutex);
+            wake_cv.wait_for(lock, std::chrono::milliseconds(wait_ms), [] { return should_stop || woken; });
+            woken = false;
+        }
 
-                    logger.release_lock(header_lock);
+        audit_logger.reset();
+        LOG_INFO << "Log merge stopped.";
+    }
 
-                    // Go back to idle sleep if there were no records or on error.
-                    if (merge_result != 1)
-                    {
-                        if (merged_count > 0)
-                            LOG_INFO << "Switching to idle. " << merged_count << " records were merged.";
-                        break;
-                    }
-                }
+    /**
+     * Measures the log and merges a time bounded slice of it if needed.
+     * - Logs below the low watermark which are still growing are left to grow so the merge batches get to collapse
+     *   more superseded records.
+     * - Regular merging only takes the log if no session is using it. Merge slices get shorter when sessions use
+     *   the log frequently, and merging gets more frequent as the log grows towards the high watermark.
+     * - Above the high watermark, merging waits for the log along with the sessions and runs the slices back to back
+     *   until the log is back under the low watermark.
+     * @return No. of milliseconds to wait before the next cycle.
+     */
+    uint32_t run_merge_cycle(hpfs::audit::audit_logger &logger, merge_schedule &sched)
+    {
+        // Unlocked header read is good enough to measure the log. It's read again under the lock for merging.
+        if (logger.read_header() == -1)
+            return IDLE_INTERVAL;
+
+        const hpfs::audit::log_header &header = logger.get_header();
+
+        // Log records are appended at increasing offsets. So the advancement of the last record tells the growth.
+        const int64_t now = util::epoch();
+        const size_t grown = (sched.last_log_end > 0 && header.last_record > sched.last_log_end) ? (header.last_record - sched.last_log_end) : 0;
+        if (header.last_record > 0)
+            sched.last_log_end = header.last_record;
+        sched.growth_rate = (GROWTH_SMOOTHING * sched.growth_rate) +
+                            ((1 - GROWTH_SMOOTHING) * grown * 1000.0 / MAX(1, now - sched.last_check));
+        sched.last_check = now;
+
+        const size_t log_size = header.first_record == 0 ? 0 : (header.last_record - header.first_record);
+        if (log_size == 0)
+        {
+            if (sched.merged_count > 0)
+                LOG_INFO << "Switching to idle. " << sched.merged_count << " records were merged.";
+            sched.merged_count = 0;
+            sched.priority = false;
+            return IDLE_INTERVAL;
+        }
 
-                counter = 0;
-            }
+        if (!sched.priority && log_size >= ctx.merge_high_watermark)
+        {
+            sched.priority = true;
+            LOG_WARNING << "Started priority merge... Log size:" << log_size;
+        }
+        else if (sched.priority && log_size < ctx.merge_low_watermark)
+        {
+            sched.priority = false;
+        }
+
+        // Expected growth within the next second is counted in so merging starts ahead of bursts.
+        if (!sched.priority && grown > 0 && (log_size + sched.growth_rate) < ctx.merge_low_watermark)
+            return CHECK_INTERVAL;
+
+        flock merge_lock;
+        if (logger.set_lock(merge_lock, hpfs::audit::LOCK_TYPE::MERGE_LOCK, sched.priority) == -1)
+        {
+            if (errno != EAGAIN && errno != EACCES)
+                return IDLE_INTERVAL;
 
-            // We perform idle sleep for small time windows due to lesser delay in handling interrupts.
-            usleep(CHECK_INTERVAL);
-            counter++;
+            // Log is in use by a session. Merger gets woken up when the log is released.
+            sched.contention = (CONTENTION_SMOOTHING * sched.contention) + (1 - CONTENTION_SMOOTHING);
+            return CHECK_INTERVAL;
+        }
+        sched.contention *= CONTENTION_SMOOTHING;
+
+        // Keep merging batches until the slice time is over.
+        const int64_t slice = sched.priority ? ctx.merge_slice : MAX(1, ctx.merge_slice * (1 - (0.75 * sched.contention)));
+        const int64_t slice_start = util::epoch();
+        int merge_result = logger.read_header();
+        size_t merged_count = 0;
+        hpfs::audit::log_cursor cursor;
+        while (merge_result != -1 && !should_stop && (util::epoch() - slice_start) < slice)
+        {
+            // Result  0 = There were no log records to process.
+            // Result >0 = No. of log records that were succesfully merged.
+            // Result -1 = There was an error when processing log front.
+            if ((merge_result = merge_log_batch(logger, cursor)) < 1)
+                break;
+
+            if (sched.merged_count == 0 && merged_count == 0 && !sched.priority)
+                LOG_INFO << "Started merging records...";
+            merged_count += merge_result;
         }
 
-        audit_logger.reset();
-        LOG_INFO << "Log merge stopped.";
+        // Log records are moved by compaction. So the vfs snapshot which refers to them is no longer usable.
+        const off_t compacted = merge_result == -1 ? 0 : logger.compact_log(COMPACT_MIN_SIZE);
+        if (compacted > 0)
+        {
+            if (unlink(ctx.vfs_snapshot_file_path.c_str()) == -1 && errno != ENOENT)
+                LOG_ERROR << errno << ": Error removing vfs snapshot after log compaction.";
+            sched.last_log_end = logger.get_header().last_record;
+        }
+
+        logger.release_lock(merge_lock);
+        sched.merged_count += merged_count;
+        LOG_DEBUG << "Merge slice: " << merged_count << " records in " << (util::epoch() - slice_start) << "ms.";
+
+        // Back off on error.
+        if (merge_result == -1)
+            return IDLE_INTERVAL;
+
+        if (sched.priority)
+            return 0;
+
+        // Between the watermarks the merge duty cycle grows with the log size. (50% at the low watermark upto 100% at
+        // the high watermark)
+        const hpfs::audit::log_header &remaining = logger.get_header();
+        const size_t remaining_size = remaining.first_record == 0 ? 0 : (remaining.last_record - remaining.first_record);
+        if (remaining_size <= ctx.merge_low_watermark || ctx.merge_high_watermark <= ctx.merge_low_watermark)
+            return remaining_size == 0 ? 0 : slice;
+
+        const double fill = MIN(1.0, (double)(remaining_size - ctx.merge_low_watermark) / (ctx.merge_high_watermark - ctx.merge_low_watermark));
+        return slice * (1 - fill);
     }
 
     /**
-     * Merges the oldest log record to the seed.
-     * @return 0 when no log records found. 1 on successful merge. -1 on failure.
+     * Merges a batch of the oldest log records to the seed and purges them from the log with a single header update.
+     * Records superseded by later records of the batch are purged without being applied to the seed.
+     * @param cursor Log cursor positioned at the oldest log record. Advanced past the batch after the merge.
+     * @return No. of merged log records. 0 when no log records found. -1 on failure.
      */
-    int merge_log_front(hpfs::audit::audit_logger &logger)
+    int merge_log_batch(hpfs::audit::audit_logger &logger, hpfs::audit::log_cursor &cursor)
     {
-        off_t offset = 0;
-        hpfs::audit::log_record record;
+        // Read a run of the oldest log records along with any associated payloads.
+        std::vector<batch_record> batch;
+        size_t batch_data_len = 0;
+        while (batch.size() < MERGE_BATCH_MAX_RECORDS && batch_data_len < MERGE_BATCH_MAX_DATA)
+        {
+            batch_record &br = batch.emplace_back();
+            const int res = logger.read_log_next(cursor, br.record, br.payload);
+            if (res == -1)
+                return -1;
 
-        // Read the first log record (oldest).
-        if (logger.read_log_at(offset, offset, record) == -1)
-            return -1;
+            if (res == 0) // No more records.
+            {
+                batch.pop_back();
+                break;
+            }
+
+            batch_data_len += br.record.block_data_len;
+        }
 
-        if (offset == -1) // Offset would be set to -1 if no records were read.
+        if (batch.empty()) // No records were read.
             return 0;
 
-        // Reaching here means a log record has been read.
+        mark_superseded_records(batch);
 
-        std::vector<uint8_t> payload;
-        if (logger.read_payload(payload, record) == -1 || // Read any associated payload.
-            merge_log_record(record, payload) == -1 ||    // Merge the record with the seed.
-            logger.purge_log(record) == -1)               // Purge the log record and update the header.
+        // Merge the records with the seed. Consecutive writes to the same file share the opened seed file.
+        seed_file seed;
+        size_t merged = 0;
+        for (; merged < batch.size(); merged++)
         {
-            LOG_ERROR << errno << ": Error merging log record.";
+            const batch_record &br = batch[merged];
+            if (!br.superseded && merge_log_record(br.record, br.payload, seed) == -1)
+                break;
+        }
+        const int merge_errno = errno;
+
+        // Purge whatever got merged even if the batch failed midway, so they will not be merged again. A skipped record
+        // can only be purged if the record superseding it got merged as well. So the skipped records superseded by the
+        // records which did not get merged are merged now. Otherwise the records after the failed one would not find
+        // the seed in the state they expect. (eg. writes to a file whose create was skipped in favour of its unlink)
+        size_t purge_count = merged;
+        for (size_t i = 0; merged < batch.size() && i < merged; i++)
+        {
+            const batch_record &br = batch[i];
+            if (br.superseded && br.superseded_by >= merged && merge_log_record(br.record, br.payload, seed) == -1)
+            {
+                // Records from here onwards are left in the log. Merged ones among them get merged again.
+                LOG_ERROR << errno << ": Error merging skipped log record. " << br.record.vpath;
+                purge_count = i;
+                break;
+            }
+        }
+        close_seed_file(seed);
+
+        if (purge_count > 0)
+        {
+            const hpfs::audit::log_record &last = batch[purge_count - 1].record;
+            if (logger.purge_logs(batch.front().record.offset, last.offset + last.size) == -1)
+                purge_count = 0;
+        }
+
+        if (merged < batch.size() || purge_count < merged)
+        {
+            LOG_ERROR << merge_errno << ": Error merging log records.";
             return -1;
         }
 
-        return 1;
+        return merged;
+    }
+
+    /**
+     * Marks the records whose effect on the seed gets overridden by later records of the batch.
+     * - Records of a file which gets created and unlinked within the batch (including the create and unlink).
+     * - Writes/truncates/chmods of a file which gets unlinked later.
+     * - Writes fully overwritten by a later write or discarded by a later truncate.
+     * - Truncates followed by a truncate to the same or smaller size, and chmods followed by another chmod.
+     * The batch is scanned backwards keeping track of what happens to each file later in the batch. Renames move
+     * whole sub trees, so tracking starts over at any rename.
+     */
+    void mark_superseded_records(std::vector<batch_record> &batch)
+    {
+        struct write_range
+        {
+            off_t start = 0;
+            off_t end = 0;
+            size_t index = 0; // Batch index of the write.
+        };
+
+        // Batch indexes are -1 when there's no such later operation.
+        struct later_ops
+        {
+            int unlink = -1;                       // Later unlink of the file.
+            int min_truncate = -1;                 // Later truncate to the smallest size.
+            off_t min_truncate_size = -1;          // Smallest size the file gets truncated to later. -1 if none.
+            int chmod = -1;                        // Next chmod of the file.
+            std::vector<write_range> write_ranges; // Later writes.
+        };
+        std::unordered_map<std::string, later_ops> files;
+
+        const auto supersede = [&](const size_t index, const int by) {
+            batch[index].superseded = true;
+            batch[index].superseded_by = by;
+        };
+
+        for (int i = (int)batch.size() - 1; i >= 0; i--)
+        {
+            batch_record &br = batch[i];
+            const hpfs::audit::log_record &record = br.record;
+
+            switch (record.operation)
+            {
+            case hpfs::audit::FS_OPERATION::RENAME:
+                files.clear();
+                break;
+
+            case hpfs::audit::FS_OPERATION::MKDIR:
+            case hpfs::audit::FS_OPERATION::RMDIR:
+                // Anything before these belongs to a different dir/file of the same vpath.
+                files.erase(record.vpath);
+                break;
+
+            case hpfs::audit::FS_OPERATION::UNLINK:
+                files[record.vpath] = later_ops{i};
+                break;
+
+            case hpfs::audit::FS_OPERATION::CREATE:
+            {
+                // The file did not exist before the create. So a create followed by an unlink leaves no trace.
+                const auto file = files.find(record.vpath);
+                if (file != files.end())
+                {
+                    if (file->second.unlink != -1)
+                    {
+                        supersede(i, file->second.unlink);
+                        supersede(file->second.unlink, i);
+                    }
+                    files.erase(file);
+                }
+                break;
+            }
+
+            case hpfs::audit::FS_OPERATION::WRITE:
+            {
+                later_ops &later = files[record.vpath];
+                const hpfs::audit::op_write_payload_header &wh = *(hpfs::audit::op_write_payload_header *)br.payload.data();
+                const off_t start = wh.offset;
+                const off_t end = wh.offset + wh.size;
+
+                int by = later.unlink;
+                if (by == -1 && later.min_truncate_size != -1 && start >= later.min_truncate_size)
+                    by = later.min_truncate;
+                for (auto range = later.write_ranges.begin(); by == -1 && range != later.write_ranges.end(); range++)
+                {
+                    if (range->start <= start && range->end >= end)
+                        by = range->index;
+                }
+
+                if (by != -1)
+                    supersede(i, by);
+                else
+                    later.write_ranges.push_back(write_range{start, end, (size_t)i});
+                break;
+            }
+
+            case hpfs::audit::FS_OPERATION::TRUNCATE:
+            {
+                later_ops &later = files[record.vpath];
+                const hpfs::audit::op_truncate_payload_header &th = *(hpfs::audit::op_truncate_payload_header *)br.payload.data();
+                const off_t size = th.size;
+
+                int by = later.unlink;
+                if (by == -1 && later.min_truncate_size != -1 && later.min_truncate_size <= size)
+                    by = later.min_truncate;
+
+                if (by != -1)
+                {
+                    supersede(i, by);
+                }
+                else
+                {
+                    later.min_truncate = i;
+                    later.min_truncate_size = size;
+                }
+                break;
+            }
+
+            case hpfs::audit::FS_OPERATION::CHMOD:
+            {
+                later_ops &later = files[record.vpath];
+                const int by = later.unlink != -1 ? later.unlink : later.chmod;
+                if (by != -1)
+                    supersede(i, by);
+                later.chmod = i;
+                break;
+            }
+
+            default:
+                break;
+            }
+        }
     }
 
     /**
      * Physically merges the specified log record with the seed.
      */
-    int merge_log_record(const hpfs::audit::log_record &record, const std::vector<uint8_t> payload)
+    int merge_log_record(const hpfs::audit::log_record &record, const std::vector<uint8_t> &payload, seed_file &seed)
     {
         LOG_DEBUG << "Merging log record... [" << record.vpath << " op:" << record.operation << "]";
 
+        // Only consecutive writes to the same file can share the opened seed file.
+        if (seed.fd != -1 && (record.operation != hpfs::audit::FS_OPERATION::WRITE || seed.vpath != record.vpath))
+            close_seed_file(seed);
+
         hpfs::audit::audit_logger &logger = audit_logger.value();
         const std::string seed_path_str = std::string(hpfs::ctx.seed_dir).append(record.vpath);
         const char *seed_path = seed_path_str.c_str();
@@ -214,25 +499,24 @@ namespace hpfs::merger
         {
             const hpfs::audit::op_write_payload_header wh = *(hpfs::audit::op_write_payload_header *)payload.data();
 
-            int seed_fd = open(seed_path, O_RDWR);
-            if (seed_fd <= 0)
+            if (seed.fd == -1)
             {
-                LOG_ERROR << errno << ": Error in log merge open for write. " << seed_path;
-                return -1;
+                seed.fd = open(seed_path, O_RDWR);
+                if (seed.fd == -1)
+                {
+                    LOG_ERROR << errno << ": Error in log merge open for write. " << seed_path;
+                    return -1;
+                }
+                seed.vpath = record.vpath;
             }
 
             // Copy data from directly from log file to seed file.
-            lseek(seed_fd, wh.offset, SEEK_SET);
-            off_t read_offset = record.block_data_offset + wh.data_offset_in_block;
-            if (sendfile(seed_fd, logger.get_fd(), &read_offset, wh.size) != wh.size)
+            if (copy_write_data(logger.get_fd(), seed.fd, record.block_data_offset + wh.data_offset_in_block, wh.offset, wh.size) == -1)
             {
-                close(seed_fd);
-                LOG_ERROR << errno << ": Error in log merge sendfile. " << seed_path;
+                LOG_ERROR << errno << ": Error in log merge data copy. " << seed_path;
                 return -1;
             }
 
-            close(seed_fd);
-
             break;
         }
 
@@ -263,4 +547,42 @@ namespace hpfs::merger
         return 0;
     }
 
+    /**
+     * Copies write data from the log file to the seed file within the kernel using copy_file_range. Falls back to
+     * sendfile if copy_file_range cannot be used between the two files.
+     * @return 0 on success. -1 on error.
+     */
+    int copy_write_data(const int log_fd, const int seed_fd, off_t log_offset, off_t seed_offset, size_t len)
+    {
+        while (len > 0)
+        {
+            const ssize_t copied = copy_file_range(log_fd, &log_offset, seed_fd, &seed_offset, len, 0);
+            if (copied == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                if (lseek(seed_fd, seed_offset, SEEK_SET) == -1 ||
+                    sendfile(seed_fd, log_fd, &log_offset, len) != len)
+                    return -1;
+                return 0;
+            }
+            else if (copied <= 0)
+            {
+                return -1;
+            }
+
+            len -= copied;
+        }
+
+        return 0;
+    }
+
+    void close_seed_file(seed_file &seed)
+    {
+        if (seed.fd == -1)
+            return;
+
+        close(seed.fd);
+        seed.fd = -1;
+        seed.vpath.clear();
+    }
+
 } // namespace hpfs::merger
\ No newline at end of file
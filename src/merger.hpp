@@ -6,12 +6,44 @@
 
 namespace hpfs::merger
 {
+    // A log record read into a merge batch.
+    struct batch_record
+    {
+        hpfs::audit::log_record record;
+        std::vector<uint8_t> payload;
+        bool superseded = false; // Whether the effect of this record is overridden by a later record of the batch.
+        size_t superseded_by = 0; // Index of the batch record which overrides this record.
+    };
+
+    // Seed file kept open across consecutive write records of the same vpath.
+    struct seed_file
+    {
+        std::string vpath;
+        int fd = -1;
+    };
+
+    // Merge scheduling state measured across the merge cycles.
+    struct merge_schedule
+    {
+        int64_t last_check = 0;  // Timestamp of the last merge cycle.
+        off_t last_log_end = 0;  // Last record offset seen by the last merge cycle.
+        double growth_rate = 0;  // Smoothed log growth rate in bytes per second.
+        double contention = 0;   // Smoothed ratio of the merge attempts which found the log in use by sessions.
+        bool priority = false;   // Whether the log has grown beyond the high watermark and is yet to reach the low watermark.
+        size_t merged_count = 0; // No. of records merged since the merger last went idle.
+    };
+
     int init();
     void deinit();
+    void wake();
     void signal_handler(int signum);
     void merger_loop();
-    int merge_log_front(hpfs::audit::audit_logger &logger);
-    int merge_log_record(const hpfs::audit::log_record &record, const std::vector<uint8_t> payload);
+    uint32_t run_merge_cycle(hpfs::audit::audit_logger &logger, merge_schedule &sched);
+    int merge_log_batch(hpfs::audit::audit_logger &logger, hpfs::audit::log_cursor &cursor);
+    void mark_superseded_records(std::vector<batch_record> &batch);
+    int merge_log_record(const hpfs::audit::log_record &record, const std::vector<uint8_t> &payload, seed_file &seed);
+    int copy_write_data(const int log_fd, const int seed_fd, off_t log_offset, off_t seed_offset, size_t len);
+    void close_seed_file(seed_file &seed);
 } // namespace merger
 
-#endif
\ No newline at end of file
+#endif
@@ -9,6 +9,9 @@
 #include "hmap/tree.hpp"
 #include "hmap/query.hpp"
 #include "inodes.hpp"
+#include "kernel_cache.hpp"
+#include "merger.hpp"
+#include "util.hpp"
 #include "audit/audit.hpp"
 #include "hpfs.hpp"
 #include "tracelog.hpp"
@@ -144,6 +147,13 @@ namespace hpfs::session
             if (itr != sessions.end())
             {
                 sessions.erase(itr);
+
+                // Kernel may still have the session dir contents cached. The session dir is invalidated before the
+                // stop request returns, so a new session with the same name is not served from the old cache.
+                kernel_cache::invalidate("/" + args.name, true);
+
+                // Log may be free for merging now.
+                merger::wake();
                 LOG_INFO << (args.readonly ? "RO" : "RW") << " session '" << args.name << "' stopped.";
                 return 0;
             }
@@ -152,6 +162,25 @@ namespace hpfs::session
         }
     }
 
+    /**
+     * Invalidates the kernel cache of the hash map query files affected by a change of the vpath. Hash of the vpath
+     * and all its parents change with it. Children hashes (and their count) of the vpath change as well.
+     * @param session_dir Mount path of the session dir.
+     */
+    void invalidate_hmap_queries(const std::string &session_dir, const std::string &vpath)
+    {
+        kernel_cache::invalidate(session_dir + hmap::query::hmap_query::get_request_path(vpath, hmap::query::MODE::CHILDREN));
+
+        std::string path = vpath;
+        while (true)
+        {
+            kernel_cache::invalidate(session_dir + hmap::query::hmap_query::get_request_path(path, hmap::query::MODE::HASH));
+            if (path == "/")
+                break;
+            path = util::get_parent_path(path);
+        }
+    }
+
     fs_session *get(const std::string &name)
     {
         const auto itr = sessions.find(name);
@@ -171,7 +200,8 @@ namespace hpfs::session
             vfs::virtual_filesystem::create(session.virt_fs,
                                             args.readonly,
                                             ctx.seed_dir,
-                                            session.audit_logger.value()) == -1)
+                                            session.audit_logger.value(),
+                                            ctx.read_engine) == -1)
         {
             sessions.erase(itr);
             return -1;
@@ -194,6 +224,15 @@ namespace hpfs::session
                                      session.audit_logger.value(),
                                      session.hmap_tree);
 
+        // Hash map query files change with the vfs without the kernel knowing. (Contents of RO sessions never change)
+        if (args.hmap_enabled && !args.readonly)
+        {
+            const std::string session_dir = "/" + args.name;
+            session.fuse_adapter->set_change_handler([session_dir](const std::string &vpath) {
+                invalidate_hmap_queries(session_dir, vpath);
+            });
+        }
+
         LOG_INFO << (args.readonly ? "RO" : "RW") << " session '" << args.name << "' started.";
         return 0;
     }
@@ -31,10 +31,10 @@ namespace hpfs::session
         bool readonly;
         bool hmap_enabled;
         std::optional<vfs::virtual_filesystem> virt_fs;
-        std::optional<vfs::fuse_adapter> fuse_adapter;
         std::optional<audit::audit_logger> audit_logger;
         std::optional<hmap::tree::hmap_tree> hmap_tree;
         std::optional<hmap::query::hmap_query> hmap_query;
+        std::optional<vfs::fuse_adapter> fuse_adapter; // Declared last so its commit timer stops before the logger goes away.
 
         fs_session(const ino_t ino, const bool readonly, const bool hmap_enabled)
             : ino(ino), readonly(readonly), hmap_enabled(hmap_enabled)
@@ -47,6 +47,7 @@ namespace hpfs::session
     int session_check_getattr(const char *path, struct stat *stbuf);
     int session_check_create(const char *path);
     int session_check_unlink(const char *path);
+    void invalidate_hmap_queries(const std::string &session_dir, const std::string &vpath);
     fs_session *get(const std::string &name);
     int start(const fs_session_args &args);
     void stop_all();
@@ -34,15 +34,15 @@ namespace util
     }
 
     int set_lock(const int fd, struct flock &lock, const bool is_rwlock,
-                 const off_t start, const off_t len)
+                 const off_t start, const off_t len, const bool wait)
     {
         lock.l_type = is_rwlock ? F_WRLCK : F_RDLCK;
         lock.l_whence = SEEK_SET;
         lock.l_start = start,
         lock.l_len = len;
         lock.l_pid = 0;
-        const int ret = fcntl(fd, F_OFD_SETLKW, &lock);
-        if (ret == -1)
+        const int ret = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock);
+        if (ret == -1 && (wait || (errno != EAGAIN && errno != EACCES))) // Conflicting lock is not an error when not waiting.
             LOG_ERROR << errno << ": Error when setting lock. type:" << lock.l_type;
 
         return ret;
@@ -18,7 +18,7 @@ namespace util
     bool is_dir_exists(std::string_view path);
     bool is_file_exists(std::string_view path);
     int set_lock(const int fd, struct flock &lock, const bool is_rwlock,
-                 const off_t start, const off_t len);
+                 const off_t start, const off_t len, const bool wait = true);
     int release_lock(const int fd, struct flock &lock);
     void mask_signal();
     const std::string get_name(std::string_view path);
@@ -6,13 +6,33 @@
 #include "../hmap/tree.hpp"
 #include "../util.hpp"
 #include "../tracelog.hpp"
+#include "../hpfs.hpp"
 
 /**
  * Bridge between fuse interface and the hpfs virtual filesystem interface.
+ *
+ * Locking scheme:
+ * - Operations on a single vpath take the fs lock in shared mode plus the vpath stripe lock of the target vpath
+ *   (shared for reads, exclusive for modifications). So operations on unrelated vpaths can run in parallel.
+ * - Operations affecting multiple vpaths (rename/rmdir) take the fs lock in exclusive mode.
+ * - Log append, the resulting vfs build-up, the hash map update and the log record hash rewrite are serialized with
+ *   the audit lock. File block hashes of writes/truncates are calculated before taking the audit lock under the vpath
+ *   lock. So the audit lock only covers the append, folding the precalculated hashes into the root hash and the
+ *   record header rewrite.
+ *
+ * Group commit:
+ * - Log records of concurrent writers are queued while they hold their vpath locks. Whichever writer finds no commit
+ *   in progress becomes the leader. It takes the audit lock, appends upto a commit batch of queued records with one
+ *   contiguous write and one header commit, applies them in order and wakes up the writers of the batch.
+ * - When log header commits are batched, a commit timer flushes the deferred header commit of an idle writer within
+ *   the commit window. fsync requests flush it right away.
  */
 
-#define FS_READ_LOCK std::shared_lock lock(fs_mutex);
-#define FS_WRITE_LOCK std::unique_lock lock(fs_mutex);
+#define FS_READ_LOCK std::shared_lock fs_lock(fs_mutex);
+#define FS_WRITE_LOCK std::unique_lock fs_lock(fs_mutex);
+#define VPATH_READ_LOCK(vpath) std::shared_lock vpath_lock(get_vpath_mutex(vpath));
+#define VPATH_WRITE_LOCK(vpath) std::unique_lock vpath_lock(get_vpath_mutex(vpath));
+#define AUDIT_LOCK std::scoped_lock audit_lock(audit_mutex);
 
 namespace hpfs::vfs
 {
@@ -23,11 +43,163 @@ namespace hpfs::vfs
                                                                                     logger(logger),
                                                                                     htree(htree)
     {
+        if (!readonly && ctx.log_commit_batch > 1)
+            commit_timer_thread = std::thread(&fuse_adapter::commit_timer_loop, this);
+    }
+
+    fuse_adapter::~fuse_adapter()
+    {
+        if (!commit_timer_thread.joinable())
+            return;
+
+        {
+            std::scoped_lock lock(commit_timer_mutex);
+            commit_timer_stop = true;
+        }
+        commit_timer_cv.notify_one();
+        commit_timer_thread.join();
+    }
+
+    /**
+     * Flushes any deferred log header commit once every commit window. So an appended record never stays
+     * uncommitted for longer than the commit window even if no more appends arrive.
+     */
+    void fuse_adapter::commit_timer_loop()
+    {
+        util::mask_signal();
+
+        std::unique_lock lock(commit_timer_mutex);
+        while (!commit_timer_stop)
+        {
+            commit_timer_cv.wait_for(lock, std::chrono::milliseconds(ctx.log_commit_window));
+            if (!commit_timer_stop && flush() == -1)
+                LOG_ERROR << "Error when flushing deferred log header commit.";
+        }
+    }
+
+    /**
+     * Commits any log header update deferred by batched commits so the appended records survive a crash.
+     * @return 0 on success. -1 on error.
+     */
+    int fuse_adapter::flush()
+    {
+        if (readonly)
+            return 0;
+
+        AUDIT_LOCK
+        return logger.flush_header();
+    }
+
+    /**
+     * Queues a log record for the next group commit and waits until it has been appended and applied. The calling
+     * writer commits the queued records itself if no other writer is doing so.
+     * @param entry Log record to append. Populated with the written header and the offset of the record.
+     * @param apply_hashes Applies the record to the hash maps. Only called when the hash maps are enabled.
+     * @return 0 on success. -1 on error.
+     */
+    int fuse_adapter::append_log(hpfs::audit::log_append_entry &entry, const std::function<int()> &apply_hashes)
+    {
+        pending_append append{entry, apply_hashes};
+
+        std::unique_lock lock(append_queue_mutex);
+        append_queue.push_back(&append);
+
+        while (!append.done)
+        {
+            if (append_leader_active)
+            {
+                append_queue_cv.wait(lock);
+                continue;
+            }
+
+            // Become the leader and commit the records queued so far upto the commit batch size.
+            append_leader_active = true;
+            const size_t batch_size = MIN(append_queue.size(), MAX(ctx.log_commit_batch, 1));
+            const std::vector<pending_append *> batch(append_queue.begin(), append_queue.begin() + batch_size);
+            append_queue.erase(append_queue.begin(), append_queue.begin() + batch_size);
+
+            lock.unlock();
+            commit_appends(batch);
+            lock.lock();
+
+            for (pending_append *p : batch)
+                p->done = true;
+            append_leader_active = false;
+            append_queue_cv.notify_all();
+        }
+
+        return append.result;
+    }
+
+    /**
+     * Appends a batch of queued log records with a single write and applies each of them to the vfs and the hash
+     * maps in log order. So the root hash written with each record reflects the records upto that record.
+     */
+    void fuse_adapter::commit_appends(const std::vector<pending_append *> &batch)
+    {
+        AUDIT_LOCK
+
+        std::vector<hpfs::audit::log_append_entry> entries;
+        entries.reserve(batch.size());
+        for (const pending_append *p : batch)
+            entries.push_back(p->entry);
+
+        if (logger.append_logs(entries, true) == -1)
+        {
+            LOG_ERROR << "Error appending " << batch.size() << " log records.";
+            for (pending_append *p : batch)
+                p->result = -1;
+            return;
+        }
+
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            hpfs::audit::log_append_entry &entry = batch[i]->entry;
+            entry.rh = entries[i].rh;
+            entry.offset = entries[i].offset;
+
+            const off_t record_end = entry.offset + hpfs::audit::audit_logger::get_metrics(entry.rh).total_size;
+            if (virt_fs.build_vfs(record_end) == -1 ||
+                (htree && batch[i]->apply_hashes() == -1) ||
+                (htree && logger.update_log_record_hash(entry.offset, htree->get_root_hash(), entry.rh) == -1))
+                batch[i]->result = -1;
+        }
+    }
+
+    /**
+     * Returns the stripe lock which guards the specified vpath.
+     */
+    std::shared_mutex &fuse_adapter::get_vpath_mutex(const std::string &vpath)
+    {
+        return vpath_mutexes[std::hash<std::string>{}(vpath) % VPATH_LOCK_STRIPES];
+    }
+
+    /**
+     * Sets the handler which gets notified of the vpaths modified by this adapter.
+     */
+    void fuse_adapter::set_change_handler(const vpath_change_handler &handler)
+    {
+        change_handler = handler;
+    }
+
+    /**
+     * Notifies the change handler (if any) about a modified vpath. Parent dir is notified as well when an entry
+     * has been added to or removed from it.
+     */
+    void fuse_adapter::notify_change(const std::string &vpath, const bool include_parent)
+    {
+        if (!change_handler)
+            return;
+
+        change_handler(vpath);
+        if (include_parent && vpath != "/")
+            change_handler(util::get_parent_path(vpath));
     }
 
     int fuse_adapter::getattr(const std::string &vpath, struct stat *stbuf)
     {
         FS_READ_LOCK
+        VPATH_READ_LOCK(vpath)
 
         vfs::vnode *vn = NULL;
         if (virt_fs.get_vnode(vpath, &vn) == -1)
@@ -42,6 +214,7 @@ namespace hpfs::vfs
     int fuse_adapter::readdir(const std::string &vpath, vfs::vdir_children_map &children)
     {
         FS_READ_LOCK
+        VPATH_READ_LOCK(vpath)
 
         vfs::vnode *vn = NULL;
         if (virt_fs.get_vnode(vpath, &vn) == -1)
@@ -59,7 +232,8 @@ namespace hpfs::vfs
         if (readonly)
             return -EACCES;
 
-        FS_WRITE_LOCK
+        FS_READ_LOCK
+        VPATH_WRITE_LOCK(vpath)
 
         vfs::vnode *vn = NULL;
         if (virt_fs.get_vnode(vpath, &vn) == -1)
@@ -67,15 +241,11 @@ namespace hpfs::vfs
         if (vn)
             return -EEXIST;
 
-        audit::log_record_header rh;
-        iovec payload{&mode, sizeof(mode)};
-        off_t log_rec_start_offset = logger.append_log(rh, vpath, hpfs::audit::FS_OPERATION::MKDIR, &payload);
-        if (log_rec_start_offset == 0 ||
-            virt_fs.build_vfs() == -1 ||
-            (htree && htree->apply_vnode_create(vpath) == -1) ||
-            (htree && logger.update_log_record_hash(log_rec_start_offset, htree->get_root_hash(), rh) == -1))
+        audit::log_append_entry entry{vpath, hpfs::audit::FS_OPERATION::MKDIR, {&mode, sizeof(mode)}};
+        if (append_log(entry, [&]() { return htree->apply_vnode_create(vpath); }) == -1)
             return -1;
 
+        notify_change(vpath, true);
         return 0;
     }
 
@@ -185,7 +355,8 @@ namespace hpfs::vfs
         if (readonly)
             return -EACCES;
 
-        FS_WRITE_LOCK
+        FS_READ_LOCK
+        VPATH_WRITE_LOCK(vpath)
 
         vfs::vnode *vn = NULL;
         if (virt_fs.get_vnode(vpath, &vn) == -1)
@@ -204,7 +375,8 @@ namespace hpfs::vfs
         if (readonly)
             return -EACCES;
 
-        FS_WRITE_LOCK
+        FS_READ_LOCK
+        VPATH_WRITE_LOCK(vpath)
 
         vfs::vnode *vn = NULL;
         if (virt_fs.get_vnode(vpath, &vn) == -1)
@@ -212,21 +384,18 @@ namespace hpfs::vfs
         if (vn)
             return -EEXIST;
 
-        audit::log_record_header rh;
-        iovec payload{&mode, sizeof(mode)};
-        off_t log_rec_start_offset = logger.append_log(rh, vpath, hpfs::audit::FS_OPERATION::CREATE, &payload);
-        if (log_rec_start_offset == 0 ||
-            virt_fs.build_vfs() == -1 ||
-            (htree && htree->apply_vnode_create(vpath) == -1) ||
-            (htree && logger.update_log_record_hash(log_rec_start_offset, htree->get_root_hash(), rh) == -1))
+        audit::log_append_entry entry{vpath, hpfs::audit::FS_OPERATION::CREATE, {&mode, sizeof(mode)}};
+        if (append_log(entry, [&]() { return htree->apply_vnode_create(vpath); }) == -1)
             return -1;
 
+        notify_change(vpath, true);
         return 0;
     }
 
     int fuse_adapter::read(const std::string &vpath, char *buf, const size_t size, const off_t offset)
     {
         FS_READ_LOCK
+        VPATH_READ_LOCK(vpath)
 
         vfs::vnode *vn = NULL;
         if (virt_fs.get_vnode(vpath, &vn) == -1)
@@ -241,17 +410,48 @@ namespace hpfs::vfs
         if ((offset + size) > vn->st.st_size)
             read_len = vn->st.st_size - offset;
 
-        memcpy(buf, (uint8_t *)vn->mmap.ptr + offset, read_len);
+        if (virt_fs.read_vnode_data(*vn, buf, read_len, offset) == -1)
+            return -1;
 
         return read_len;
     }
 
+    /**
+     * Passes the data segments covering the read range to the reply callback while the file is locked. This lets
+     * the file data be sent straight from the backing seed/log files without copying them into a buffer.
+     * @return Result of the reply callback. <0 on error.
+     */
+    int fuse_adapter::read_segs(const std::string &vpath, const size_t size, const off_t offset, const data_segs_reply &reply)
+    {
+        FS_READ_LOCK
+        VPATH_READ_LOCK(vpath)
+
+        vfs::vnode *vn = NULL;
+        if (virt_fs.get_vnode(vpath, &vn) == -1)
+            return -1;
+        if (!vn)
+            return -ENOENT;
+
+        std::vector<vdata_segment> segs;
+        if (vn->st.st_size > 0 && offset < vn->st.st_size)
+        {
+            size_t read_len = size;
+            if ((offset + size) > vn->st.st_size)
+                read_len = vn->st.st_size - offset;
+
+            virt_fs.get_vnode_data_segs(*vn, read_len, offset, segs);
+        }
+
+        return reply(segs);
+    }
+
     int fuse_adapter::write(const std::string &vpath, const char *buf, const size_t size, const off_t offset)
     {
         if (readonly)
             return -EACCES;
 
-        FS_WRITE_LOCK
+        FS_READ_LOCK
+        VPATH_WRITE_LOCK(vpath)
 
         vfs::vnode *vn = NULL;
         if (virt_fs.get_vnode(vpath, &vn) == -1)
@@ -259,42 +459,70 @@ namespace hpfs::vfs
         if (!vn)
             return -ENOENT;
 
-        // Holds the offset of the log record that is going to be appended/modified.
-        off_t log_record_offset = 0;
-
-        // Log record header that was appended/modified.
-        hpfs::audit::log_record_header rh;
+        // Block hashes of the written data are calculated before taking the audit lock. So writes to unrelated
+        // files only wait for each other's log appends and hash map updates.
+        hpfs::hmap::tree::file_update_hashes update_hashes;
+        if (htree && htree->prepare_file_data_update(update_hashes, vpath, *vn, MAX((size_t)vn->st.st_size, offset + size),
+                                                     offset, size, buf, offset) == -1)
+            return -1;
 
-        // First, attempt an optimized write.
-        const int optimze_res = optimized_write(vpath, buf, size, offset, *vn, rh);
-        if (optimze_res == -1)
+        if (log_write(vpath, buf, size, offset, *vn, update_hashes) == -1)
         {
-            LOG_ERROR << "Optimized write failed. size:" << size << " offset:" << offset << " vpath:" << vpath;
+            // Block hash trees may have been updated with data which did not get logged.
+            if (htree)
+                htree->discard_file_data_update(vpath);
             return -1;
         }
-        else if (optimze_res == 1) // Optimized write successful.
-        {
-            LOG_DEBUG << "Optimized write performed. size:" << size << " offset:" << offset << " vpath:" << vpath;
-            const hpfs::audit::log_header &h = logger.get_header();
-            log_record_offset = h.last_record;
-        }
-        else // Optimized write criteria not met. So we need to perform a normal write.
+
+        notify_change(vpath, false);
+        return size;
+    }
+
+    /**
+     * Logs a write and applies it to the vfs and the hash maps.
+     * @param update_hashes Block hashes of the write calculated before the write was logged.
+     * @return 0 on success. -1 on error.
+     */
+    int fuse_adapter::log_write(const std::string &vpath, const char *buf, const size_t size, const off_t offset,
+                                vfs::vnode &vn, const hpfs::hmap::tree::file_update_hashes &update_hashes)
+    {
         {
-            if ((log_record_offset = normal_write(vpath, buf, size, offset, vn, rh)) == 0)
+            AUDIT_LOCK
+
+            // Log record header that was modified.
+            hpfs::audit::log_record_header rh;
+
+            // First, attempt an optimized write.
+            const int optimze_res = optimized_write(vpath, buf, size, offset, vn, rh);
+            if (optimze_res == -1)
             {
-                LOG_ERROR << "Normal write failed. size:" << size << " offset:" << offset << " vpath:" << vpath;
+                LOG_ERROR << "Optimized write failed. size:" << size << " offset:" << offset << " vpath:" << vpath;
                 return -1;
             }
-            LOG_DEBUG << "Normal write performed. size:" << size << " offset:" << offset << " vpath:" << vpath;
+            else if (optimze_res == 1) // Optimized write successful.
+            {
+                LOG_DEBUG << "Optimized write performed. size:" << size << " offset:" << offset << " vpath:" << vpath;
+                const off_t log_record_offset = logger.get_header().last_record;
+                if (log_record_offset == 0 ||
+                    virt_fs.build_vfs() == -1 ||
+                    (htree && htree->apply_vnode_data_update(vpath, vn, update_hashes) == -1) ||
+                    (htree && logger.update_log_record_hash(log_record_offset, htree->get_root_hash(), rh) == -1))
+                    return -1;
+
+                return 0;
+            }
         }
 
-        if (log_record_offset == 0 ||
-            virt_fs.build_vfs() == -1 ||
-            (htree && htree->apply_vnode_data_update(vpath, *vn, offset, size) == -1) ||
-            (htree && logger.update_log_record_hash(log_record_offset, htree->get_root_hash(), rh) == -1))
+        // Optimized write criteria not met. So we need to perform a normal write. The audit lock must not be held
+        // while waiting for the group commit since the committing writer takes it.
+        if (normal_write(vpath, buf, size, offset, vn, update_hashes) == -1)
+        {
+            LOG_ERROR << "Normal write failed. size:" << size << " offset:" << offset << " vpath:" << vpath;
             return -1;
+        }
+        LOG_DEBUG << "Normal write performed. size:" << size << " offset:" << offset << " vpath:" << vpath;
 
-        return size;
+        return 0;
     }
 
     int fuse_adapter::truncate(const std::string &vpath, const off_t new_size)
@@ -302,7 +530,8 @@ namespace hpfs::vfs
         if (readonly)
             return -EACCES;
 
-        FS_WRITE_LOCK
+        FS_READ_LOCK
+        VPATH_WRITE_LOCK(vpath)
 
         vfs::vnode *vn = NULL;
         if (virt_fs.get_vnode(vpath, &vn) == -1)
@@ -314,6 +543,7 @@ namespace hpfs::vfs
             return 0;
 
         std::vector<iovec> block_buf_segs;
+        std::vector<uint8_t> ex_data_buf;
         hpfs::audit::op_truncate_payload_header th{(size_t)new_size, 0, 0};
 
         if (new_size > current_size)
@@ -322,26 +552,31 @@ namespace hpfs::vfs
             // so the extra NULL bytes can be mapped to memory.
 
             off_t block_buf_start = 0, block_buf_end = 0;
-            virt_fs.populate_block_buf_segs(block_buf_segs, block_buf_start, block_buf_end,
-                                            NULL, 0, new_size, vn->st.st_size, (uint8_t *)vn->mmap.ptr);
+            if (virt_fs.populate_block_buf_segs(block_buf_segs, ex_data_buf, block_buf_start, block_buf_end,
+                                                NULL, 0, new_size, *vn) == -1)
+                return -1;
 
             const size_t block_buf_size = block_buf_end - block_buf_start;
             th.mmap_block_offset = block_buf_start;
             th.mmap_block_size = block_buf_size;
         }
 
-        audit::log_record_header rh;
-        iovec payload{&th, sizeof(th)};
-        off_t log_rec_start_offset = logger.append_log(rh, vpath, hpfs::audit::FS_OPERATION::TRUNCATE, &payload,
-                                                       block_buf_segs.data(), block_buf_segs.size());
-        if (log_rec_start_offset == 0 ||
-            virt_fs.build_vfs() == -1 ||
-            (htree && htree->apply_vnode_data_update(vpath, *vn,
-                                                     MIN(new_size, current_size),
-                                                     MAX(0, new_size - current_size)) == -1) ||
-            (htree && logger.update_log_record_hash(log_rec_start_offset, htree->get_root_hash(), rh) == -1))
+        // Block hashes are calculated before taking the audit lock like with writes.
+        hpfs::hmap::tree::file_update_hashes update_hashes;
+        if (htree && htree->prepare_file_data_update(update_hashes, vpath, *vn, new_size,
+                                                     MIN(new_size, current_size), MAX(0, new_size - current_size)) == -1)
             return -1;
 
+        audit::log_append_entry entry{vpath, hpfs::audit::FS_OPERATION::TRUNCATE, {&th, sizeof(th)}, block_buf_segs};
+        if (append_log(entry, [&]() { return htree->apply_vnode_data_update(vpath, *vn, update_hashes); }) == -1)
+        {
+            // Block hash trees may have been updated with data which did not get logged.
+            if (htree)
+                htree->discard_file_data_update(vpath);
+            return -1;
+        }
+
+        notify_change(vpath, false);
         return 0;
     }
 
@@ -350,7 +585,8 @@ namespace hpfs::vfs
         if (readonly)
             return -EACCES;
 
-        FS_WRITE_LOCK
+        FS_READ_LOCK
+        VPATH_WRITE_LOCK(vpath)
 
         vfs::vnode *vn = NULL;
         if (virt_fs.get_vnode(vpath, &vn) == -1)
@@ -358,41 +594,36 @@ namespace hpfs::vfs
         if (!vn)
             return -ENOENT;
 
-        audit::log_record_header rh;
-        iovec payload{&mode, sizeof(mode)};
-        off_t log_rec_start_offset = logger.append_log(rh, vpath, hpfs::audit::FS_OPERATION::CHMOD, &payload);
-        if (log_rec_start_offset == 0 ||
-            virt_fs.build_vfs() == -1 ||
-            (htree && htree->apply_vnode_metadata_update(vpath, *vn) == -1) ||
-            (htree && logger.update_log_record_hash(log_rec_start_offset, htree->get_root_hash(), rh) == -1))
+        audit::log_append_entry entry{vpath, hpfs::audit::FS_OPERATION::CHMOD, {&mode, sizeof(mode)}};
+        if (append_log(entry, [&]() { return htree->apply_vnode_metadata_update(vpath, *vn); }) == -1)
             return -1;
 
+        notify_change(vpath, false);
         return 0;
     }
 
     /**
      * Non-optimized, normal write which simply appends a log record with the written data.
-     * @return Appended log record offset on success. 0 on error.
+     * @return 0 on success. -1 on error.
      */
-    off_t fuse_adapter::normal_write(const std::string &vpath, const char *buf, const size_t wr_size, const off_t wr_start,
-                                     vfs::vnode *vn, audit::log_record_header &rh)
+    int fuse_adapter::normal_write(const std::string &vpath, const char *buf, const size_t wr_size, const off_t wr_start,
+                                   vfs::vnode &vn, const hpfs::hmap::tree::file_update_hashes &update_hashes)
     {
         // We prepare list of block buf segments based on where the write buf lies within the block buf.
         off_t block_buf_start = 0, block_buf_end = 0;
         std::vector<iovec> block_buf_segs;
-        virt_fs.populate_block_buf_segs(block_buf_segs, block_buf_start, block_buf_end,
-                                        buf, wr_size, wr_start, vn->st.st_size, (uint8_t *)vn->mmap.ptr);
+        std::vector<uint8_t> ex_data_buf;
+        if (virt_fs.populate_block_buf_segs(block_buf_segs, ex_data_buf, block_buf_start, block_buf_end,
+                                            buf, wr_size, wr_start, vn) == -1)
+            return -1;
 
         // No write-optimization performed.
         const size_t block_buf_size = block_buf_end - block_buf_start;
         hpfs::audit::op_write_payload_header wh{wr_size, wr_start, block_buf_size,
                                                 block_buf_start, (wr_start - block_buf_start)};
 
-        iovec payload{&wh, sizeof(wh)};
-        const off_t log_rec_start_offset = logger.append_log(rh, vpath, hpfs::audit::FS_OPERATION::WRITE, &payload,
-                                                             block_buf_segs.data(), block_buf_segs.size());
-
-        return log_rec_start_offset;
+        audit::log_append_entry entry{vpath, hpfs::audit::FS_OPERATION::WRITE, {&wh, sizeof(wh)}, block_buf_segs};
+        return append_log(entry, [&]() { return htree->apply_vnode_data_update(vpath, vn, update_hashes); });
     }
 
     /**
@@ -455,8 +686,10 @@ namespace hpfs::vfs
             // We prepare list of block buf segments based on where the write buf lies within the block buf.
             off_t block_buf_start = 0, block_buf_end = 0;
             std::vector<iovec> block_buf_segs;
-            virt_fs.populate_block_buf_segs(block_buf_segs, block_buf_start, block_buf_end,
-                                            buf, wr_size, wr_start, vn.st.st_size, (uint8_t *)vn.mmap.ptr);
+            std::vector<uint8_t> ex_data_buf;
+            if (virt_fs.populate_block_buf_segs(block_buf_segs, ex_data_buf, block_buf_start, block_buf_end,
+                                                buf, wr_size, wr_start, vn) == -1)
+                return -1;
 
             // We need to place the new write block offset relative to the previous write block.
             const off_t block_data_write_offset = lm.block_data_offset + (new_block_start - prev_block_start);
@@ -478,28 +711,22 @@ namespace hpfs::vfs
 
     int fuse_adapter::delete_entry(const std::string &vpath, const bool is_dir)
     {
-        audit::log_record_header rh;
-        off_t log_rec_start_offset = logger.append_log(rh, vpath, is_dir ? hpfs::audit::FS_OPERATION::RMDIR : hpfs::audit::FS_OPERATION::UNLINK);
-        if (log_rec_start_offset == 0 ||
-            virt_fs.build_vfs() == -1 ||
-            (htree && htree->apply_vnode_delete(vpath) == -1) ||
-            (htree && logger.update_log_record_hash(log_rec_start_offset, htree->get_root_hash(), rh) == -1))
+        audit::log_append_entry entry{vpath, is_dir ? hpfs::audit::FS_OPERATION::RMDIR : hpfs::audit::FS_OPERATION::UNLINK};
+        if (append_log(entry, [&]() { return htree->apply_vnode_delete(vpath); }) == -1)
             return -1;
 
+        notify_change(vpath, true);
         return 0;
     }
 
     int fuse_adapter::rename_entry(const std::string &from_vpath, const std::string &to_vpath, const bool is_dir)
     {
-        audit::log_record_header rh;
-        iovec payload{(void *)to_vpath.data(), to_vpath.size() + 1};
-        off_t log_rec_start_offset = logger.append_log(rh, from_vpath, hpfs::audit::FS_OPERATION::RENAME, &payload);
-        if (log_rec_start_offset == 0 ||
-            virt_fs.build_vfs() == -1 ||
-            (htree && htree->apply_vnode_rename(from_vpath, to_vpath, is_dir) == -1) ||
-            (htree && logger.update_log_record_hash(log_rec_start_offset, htree->get_root_hash(), rh) == -1))
+        audit::log_append_entry entry{from_vpath, hpfs::audit::FS_OPERATION::RENAME, {(void *)to_vpath.data(), to_vpath.size() + 1}};
+        if (append_log(entry, [&]() { return htree->apply_vnode_rename(from_vpath, to_vpath, is_dir); }) == -1)
             return -1;
 
+        notify_change(from_vpath, true);
+        notify_change(to_vpath, true);
         return 0;
     }
 
@@ -2,12 +2,36 @@
 #define _HPFS_VFS_FUSE_ADAPTER_
 
 #include <shared_mutex>
+#include <mutex>
+#include <array>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <condition_variable>
 #include "virtual_filesystem.hpp"
 #include "../hmap/tree.hpp"
 #include "../audit/audit.hpp"
 
 namespace hpfs::vfs
 {
+    // No. of lock stripes used to guard vnodes by their vpath.
+    constexpr size_t VPATH_LOCK_STRIPES = 64;
+
+    // Receives the data segments covering a read while the file is locked. Segments with no physical fd are zeros.
+    typedef std::function<int(const std::vector<vdata_segment> &segs)> data_segs_reply;
+
+    // Receives the vpaths modified by the adapter so any caches of them outside the adapter can be invalidated.
+    typedef std::function<void(const std::string &vpath)> vpath_change_handler;
+
+    // A log record waiting in the append queue to be written with the next group commit.
+    struct pending_append
+    {
+        hpfs::audit::log_append_entry &entry;
+        const std::function<int()> &apply_hashes; // Applies the record to the hash maps once the vfs has been built up to it.
+        int result = 0;
+        bool done = false;
+    };
+
     class fuse_adapter
     {
     private:
@@ -15,11 +39,29 @@ namespace hpfs::vfs
         virtual_filesystem &virt_fs;
         hpfs::audit::audit_logger &logger;
         std::optional<hpfs::hmap::tree::hmap_tree> &htree;
-        std::shared_mutex fs_mutex;
+        std::shared_mutex fs_mutex;                                      // Exclusively locked by operations affecting multiple vpaths (rename/rmdir).
+        std::array<std::shared_mutex, VPATH_LOCK_STRIPES> vpath_mutexes; // Vpath striped locks guarding individual vnodes.
+        std::mutex audit_mutex;                                          // Serializes log appends and the resulting vfs/hmap updates.
+        vpath_change_handler change_handler;                             // Optional handler notified of the modified vpaths.
+        bool commit_timer_stop = false;                                  // Indicates that the commit timer thread should exit.
+        std::mutex commit_timer_mutex;
+        std::condition_variable commit_timer_cv;
+        std::thread commit_timer_thread; // Flushes deferred log header commits of an idle writer.
+        std::mutex append_queue_mutex;
+        std::condition_variable append_queue_cv;
+        std::deque<pending_append *> append_queue; // Log records of concurrent writers waiting for a group commit.
+        bool append_leader_active = false;         // Indicates that a writer is committing a batch of queued log records.
 
     private:
-        off_t normal_write(const std::string &vpath, const char *buf, const size_t wr_size, const off_t wr_start,
-                         vfs::vnode *vn, audit::log_record_header &rh);
+        std::shared_mutex &get_vpath_mutex(const std::string &vpath);
+        void notify_change(const std::string &vpath, const bool include_parent);
+        void commit_timer_loop();
+        int append_log(hpfs::audit::log_append_entry &entry, const std::function<int()> &apply_hashes);
+        void commit_appends(const std::vector<pending_append *> &batch);
+        int normal_write(const std::string &vpath, const char *buf, const size_t wr_size, const off_t wr_start,
+                         vfs::vnode &vn, const hpfs::hmap::tree::file_update_hashes &update_hashes);
+        int log_write(const std::string &vpath, const char *buf, const size_t size, const off_t offset,
+                      vfs::vnode &vn, const hpfs::hmap::tree::file_update_hashes &update_hashes);
         int optimized_write(const std::string &vpath, const char *buf, const size_t wr_size, const off_t wr_start,
                             vfs::vnode &vn, audit::log_record_header &rh);
         int delete_entry(const std::string &to_vpath, const bool is_dir);
@@ -28,6 +70,9 @@ namespace hpfs::vfs
     public:
         fuse_adapter(const bool readonly, virtual_filesystem &virt_fs,
                      hpfs::audit::audit_logger &logger, std::optional<hpfs::hmap::tree::hmap_tree> &htree);
+        ~fuse_adapter();
+        void set_change_handler(const vpath_change_handler &handler);
+        int flush();
         int getattr(const std::string &vpath, struct stat *stbuf);
         int readdir(const std::string &vpath, vfs::vdir_children_map &children);
         int mkdir(const std::string &vpath, mode_t mode);
@@ -36,6 +81,7 @@ namespace hpfs::vfs
         int unlink(const std::string &vpath);
         int create(const std::string &vpath, mode_t mode);
         int read(const std::string &vpath, char *buf, const size_t size, const off_t offset);
+        int read_segs(const std::string &vpath, const size_t size, const off_t offset, const data_segs_reply &reply);
         int write(const std::string &vpath, const char *buf, const size_t size, const off_t offset);
         int truncate(const std::string &vpath, const off_t new_size);
         int chmod(const std::string &vpath, mode_t mode);
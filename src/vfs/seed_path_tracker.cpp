@@ -1,5 +1,7 @@
 #include <string>
 #include <string_view>
+#include <memory>
+#include <vector>
 #include "../util.hpp"
 #include "seed_path_tracker.hpp"
 
@@ -32,12 +34,20 @@ namespace hpfs::vfs
     }
     
     /**
-     * Returns whether the specified subpath is an ancestor of the specified full path.
+     * Returns the next non-empty component of the path starting from the given position and advances the position
+     * to the end of that component.
+     * @return The path component. Empty if there are no more components.
      */
-    bool seed_path_tracker::is_ancestor(const std::string &full_path, const std::string &sub_path)
+    std::string_view seed_path_tracker::next_component(std::string_view path, size_t &pos)
     {
-        // Either the sub path has to be a "folder" prefix of the full path or both of them has to be fully identical.
-        return full_path.rfind(sub_path, 0) == 0 && (full_path.size() == sub_path.size() || full_path.at(sub_path.size()) == '/');
+        while (pos < path.size() && path[pos] == '/')
+            pos++;
+
+        const size_t start = pos;
+        while (pos < path.size() && path[pos] != '/')
+            pos++;
+
+        return path.substr(start, pos - start);
     }
 
     /**
@@ -46,26 +56,34 @@ namespace hpfs::vfs
      */
     const std::string seed_path_tracker::resolve(const std::string &vpath_to_resolve)
     {
-        if (renamed_seed_paths.empty())
+        if (renamed_seed_path_refs.empty())
             return vpath_to_resolve;
 
         // Consider rename mappings for this vpath or for any if its parent directories.
-        // We attempt to find the longest rename match for the given vpath. (closest ancestor match)
+        // We walk down the renames trie and pick the deepest rename match for the given vpath. (closest ancestor match)
         size_t longest_match_len = 0;
-        std::string longest_match_seed_path;
-        for (auto [vpath, seed_path] : renamed_seed_paths)
+        const std::string *longest_match_seed_path = NULL;
+        const rename_node *node = &renamed_seed_paths;
+        size_t pos = 0;
+        std::string_view name;
+        while (!(name = next_component(vpath_to_resolve, pos)).empty())
         {
-            if (is_ancestor(vpath_to_resolve, vpath) && (vpath.size() > longest_match_len))
+            const auto itr = node->children.find(std::string(name));
+            if (itr == node->children.end())
+                break;
+
+            node = itr->second.get();
+            if (node->seed_path)
             {
-                longest_match_len = vpath.size();
-                longest_match_seed_path = seed_path;
+                longest_match_len = pos;
+                longest_match_seed_path = &node->seed_path.value();
             }
         }
 
         // If a match is found, replace the renamed portion of the vpath.
         // Otherwise return provided vpath as is.
-        if (longest_match_len > 0)
-            return (longest_match_seed_path + vpath_to_resolve.substr(longest_match_len));
+        if (longest_match_seed_path)
+            return (*longest_match_seed_path + vpath_to_resolve.substr(longest_match_len));
         else
             return vpath_to_resolve;
     }
@@ -75,12 +93,7 @@ namespace hpfs::vfs
      */
     bool seed_path_tracker::is_renamed(const std::string &check_path)
     {
-        for (auto [vpath, seed_path] : renamed_seed_paths)
-        {
-            if (seed_path == check_path)
-                return true;
-        }
-        return false;
+        return renamed_seed_path_refs.count(check_path) == 1;
     }
 
     /**
@@ -109,27 +122,24 @@ namespace hpfs::vfs
         // Find out any children seed paths previously renamed that are effected by this rename and update them.
         // (eg. when parent dir renames, it effects children seed paths too)
         {
-            // Find any children renames that are effected.
-            std::unordered_map<std::string, std::string> renames_to_update;
-            for (auto [vpath, seed_path] : renamed_seed_paths)
-            {
-                if (is_ancestor(vpath, from))
-                    renames_to_update[vpath] = seed_path;
-            }
+            // Detach the renames under the source vpath. Those are the children renames that are effected.
+            std::vector<std::pair<std::string, std::string>> renames_to_update;
+            const std::unique_ptr<rename_node> from_node = detach_renamed_tree(from);
+            if (from_node)
+                collect_renamed_seed_paths(renames_to_update, *from_node, to);
 
-            // Update effected children with the new parent vpath.
-            for (auto [vpath, seed_path] : renames_to_update)
+            // Re-attach effected children with the new parent vpath.
+            for (const auto &[new_vpath, seed_path] : renames_to_update)
             {
-                renamed_seed_paths.erase(vpath);
-                const std::string new_vpath = to + vpath.substr(from.size());
                 if (new_vpath != seed_path)
-                    renamed_seed_paths[new_vpath] = seed_path;
+                    set_renamed_seed_path(new_vpath, seed_path);
+                release_seed_path(seed_path);
             }
         }
 
         // Add the rename mapping (if needed).
         if (to != resolved)
-            renamed_seed_paths[to] = resolved;
+            set_renamed_seed_path(to, resolved);
 
         return;
     }
@@ -154,14 +164,138 @@ namespace hpfs::vfs
         // Undo seed dir path rename (if needed).
         if (is_dir)
         {
-            for (auto itr = renamed_seed_paths.begin(); itr != renamed_seed_paths.end();)
+            const std::unique_ptr<rename_node> node = detach_renamed_tree(vpath);
+            if (node)
             {
-                if (is_ancestor(itr->first, vpath))
-                    itr = renamed_seed_paths.erase(itr);
-                else
-                    itr++;
+                std::vector<std::pair<std::string, std::string>> renames_to_undo;
+                collect_renamed_seed_paths(renames_to_undo, *node, vpath);
+                for (const auto &[renamed_vpath, seed_path] : renames_to_undo)
+                    release_seed_path(seed_path);
             }
         }
     }
 
+    /**
+     * Forgets all the tracked renames and deletions.
+     */
+    void seed_path_tracker::clear()
+    {
+        renamed_seed_paths.seed_path.reset();
+        renamed_seed_paths.children.clear();
+        renamed_seed_path_refs.clear();
+        deleted_seed_paths.clear();
+    }
+
+    /**
+     * Collects all the tracked renames (renamed vpath and original seed path) and deletions.
+     */
+    void seed_path_tracker::export_state(std::vector<std::pair<std::string, std::string>> &renames, std::vector<std::string> &deleted)
+    {
+        for (const auto &[name, child] : renamed_seed_paths.children)
+            collect_renamed_seed_paths(renames, *child, "/" + name);
+
+        deleted.insert(deleted.end(), deleted_seed_paths.begin(), deleted_seed_paths.end());
+    }
+
+    /**
+     * Replaces the tracked renames and deletions with the provided ones (as collected by export_state).
+     */
+    void seed_path_tracker::import_state(const std::vector<std::pair<std::string, std::string>> &renames, const std::vector<std::string> &deleted)
+    {
+        clear();
+
+        for (const auto &[vpath, seed_path] : renames)
+            set_renamed_seed_path(vpath, seed_path);
+
+        deleted_seed_paths.insert(deleted.begin(), deleted.end());
+    }
+
+    /**
+     * Records the original seed path of the specified renamed vpath, replacing any existing rename mapping of the vpath.
+     */
+    void seed_path_tracker::set_renamed_seed_path(const std::string &vpath, const std::string &seed_path)
+    {
+        rename_node *node = &renamed_seed_paths;
+        size_t pos = 0;
+        std::string_view name;
+        while (!(name = next_component(vpath, pos)).empty())
+        {
+            std::unique_ptr<rename_node> &child = node->children[std::string(name)];
+            if (!child)
+                child = std::make_unique<rename_node>();
+            node = child.get();
+        }
+
+        if (node->seed_path)
+            release_seed_path(node->seed_path.value());
+
+        node->seed_path = seed_path;
+        renamed_seed_path_refs[seed_path]++;
+    }
+
+    /**
+     * Drops one renamed vpath reference of the specified seed path from the reverse lookup.
+     */
+    void seed_path_tracker::release_seed_path(const std::string &seed_path)
+    {
+        const auto itr = renamed_seed_path_refs.find(seed_path);
+        if (itr != renamed_seed_path_refs.end() && --itr->second == 0)
+            renamed_seed_path_refs.erase(itr);
+    }
+
+    /**
+     * Removes the renames trie node of the specified vpath (along with the renames of all its children) from the trie.
+     * Ancestor nodes that are no longer needed are pruned as well. Reverse lookup is not updated by this.
+     * @return The detached node. NULL if there are no renames under the vpath.
+     */
+    std::unique_ptr<rename_node> seed_path_tracker::detach_renamed_tree(const std::string &vpath)
+    {
+        // Collect the trie path leading to the node so we can prune the empty ancestors afterwards.
+        std::vector<std::pair<rename_node *, std::string>> trie_path;
+        rename_node *node = &renamed_seed_paths;
+        size_t pos = 0;
+        std::string_view name;
+        while (!(name = next_component(vpath, pos)).empty())
+        {
+            const auto itr = node->children.find(std::string(name));
+            if (itr == node->children.end())
+                return NULL;
+
+            trie_path.emplace_back(node, itr->first);
+            node = itr->second.get();
+        }
+
+        // Root node cannot be detached.
+        if (trie_path.empty())
+            return NULL;
+
+        auto [parent, child_name] = trie_path.back();
+        std::unique_ptr<rename_node> detached = std::move(parent->children[child_name]);
+        parent->children.erase(child_name);
+        trie_path.pop_back();
+
+        while (!trie_path.empty() && !parent->seed_path && parent->children.empty())
+        {
+            auto [ancestor, ancestor_child_name] = trie_path.back();
+            ancestor->children.erase(ancestor_child_name);
+            parent = ancestor;
+            trie_path.pop_back();
+        }
+
+        return detached;
+    }
+
+    /**
+     * Collects all the rename mappings under the specified trie node considering the node to be located at the given vpath.
+     */
+    void seed_path_tracker::collect_renamed_seed_paths(std::vector<std::pair<std::string, std::string>> &renames, const rename_node &node,
+                                                       const std::string &vpath)
+    {
+        if (node.seed_path)
+            renames.emplace_back(vpath, node.seed_path.value());
+
+        for (const auto &[name, child] : node.children)
+            collect_renamed_seed_paths(renames, *child, vpath + "/" + name);
+    }
+
 } // namespace hpfs::vfs
\ No newline at end of file
@@ -3,23 +3,43 @@
 
 #include <string>
 #include <string_view>
+#include <memory>
+#include <optional>
+#include <vector>
 #include <unordered_map>
 #include <unordered_set>
 
 namespace hpfs::vfs
 {
+    /**
+     * Path component trie node used to track the renamed vpaths.
+     */
+    struct rename_node
+    {
+        std::optional<std::string> seed_path; // Original seed path if this vpath has been renamed.
+        std::unordered_map<std::string, std::unique_ptr<rename_node>> children;
+    };
+
     class seed_path_tracker
     {
     private:
         bool moved = false;
         std::string_view seed_dir;
 
-        // Renamed seed paths (key: renamed vpath, value: original seed path)
-        std::unordered_map<std::string, std::string> renamed_seed_paths;
+        // Renamed seed paths organized as a trie of vpath components. (node path: renamed vpath, node value: original seed path)
+        rename_node renamed_seed_paths;
+
+        // No. of renamed vpaths pointing to each original seed path. (reverse lookup of the renames trie)
+        std::unordered_map<std::string, size_t> renamed_seed_path_refs;
 
         // Seed paths that has been vritually deleted and should not be accessible.
         std::unordered_set<std::string> deleted_seed_paths;
-        bool is_ancestor(const std::string &full_path, const std::string &sub_path);
+        static std::string_view next_component(std::string_view path, size_t &pos);
+        void set_renamed_seed_path(const std::string &vpath, const std::string &seed_path);
+        void release_seed_path(const std::string &seed_path);
+        std::unique_ptr<rename_node> detach_renamed_tree(const std::string &vpath);
+        void collect_renamed_seed_paths(std::vector<std::pair<std::string, std::string>> &renames, const rename_node &node,
+                                        const std::string &vpath);
 
     public:
         seed_path_tracker(std::string_view seed_dir);
@@ -28,6 +48,9 @@ namespace hpfs::vfs
         bool is_removed(const std::string &check_path);
         void rename(const std::string &from, const std::string &to, const bool is_dir);
         void remove(const std::string &vpath, const bool is_dir);
+        void clear();
+        void export_state(std::vector<std::pair<std::string, std::string>> &renames, std::vector<std::string> &deleted);
+        void import_state(const std::vector<std::pair<std::string, std::string>> &renames, const std::vector<std::string> &deleted);
     };
 
 } // namespace hpfs::vfs
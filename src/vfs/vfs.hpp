@@ -29,9 +29,15 @@ namespace hpfs::vfs
         struct stat st;
         int seed_fd = 0;
 
-        // How many data segs from the begining of list that has been mapped to memory.
-        uint32_t mapped_data_segs = 0;
+        // Visible data segments sorted by logical offset. Newer segments shadow the older ones as they get added so
+        // the segments never overlap. Adjacent segments with contiguous physical data are merged.
         std::vector<vdata_segment> data_segs;
+
+        // Added data segments that are yet to be overlaid on the memory map (in the order they were added).
+        std::vector<vdata_segment> unmapped_data_segs;
+
+        // Most recently added data segment. Extended when the block data of the last log record grows.
+        vdata_segment last_data_seg;
         struct vnode_mmap mmap;
 
         // Max file size that has been there for this vnode throughout the log history.
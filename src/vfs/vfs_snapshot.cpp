@@ -0,0 +1,161 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <mutex>
+#include "vfs_snapshot.hpp"
+#include "../tracelog.hpp"
+#include "../version.hpp"
+
+namespace hpfs::vfs::snapshot
+{
+    constexpr int FILE_PERMS = 0644;
+    constexpr const char *TEMP_FILE_EXT = ".tmp";
+
+    // Snapshot file is shared among all the sessions of the process.
+    std::mutex snapshot_mutex;
+
+    /**
+     * Reads the contents of the snapshot file excluding the version header.
+     * @return 0 if snapshot file does not exist or belongs to a different version. 1 if read success. -1 on error.
+     */
+    int read_snapshot_file(std::string &buf, const std::string &file_path)
+    {
+        std::scoped_lock lock(snapshot_mutex);
+
+        const int fd = open(file_path.c_str(), O_RDONLY);
+        if (fd == -1)
+        {
+            if (errno == ENOENT)
+                return 0;
+
+            LOG_ERROR << errno << ": Error in vfs snapshot file open. " << file_path;
+            return -1;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+        {
+            LOG_ERROR << errno << ": Error in vfs snapshot file stat. " << file_path;
+            close(fd);
+            return -1;
+        }
+
+        uint8_t version_bytes[version::VERSION_BYTES_LEN];
+        if (st.st_size < version::VERSION_BYTES_LEN ||
+            pread(fd, version_bytes, version::VERSION_BYTES_LEN, 0) < version::VERSION_BYTES_LEN ||
+            memcmp(version_bytes, version::HP_VERSION_BYTES, version::VERSION_BYTES_LEN) != 0)
+        {
+            LOG_WARNING << "Ignoring vfs snapshot file with unknown version. " << file_path;
+            close(fd);
+            return 0;
+        }
+
+        buf.resize(st.st_size - version::VERSION_BYTES_LEN);
+        size_t read_len = 0;
+        while (read_len < buf.size())
+        {
+            const ssize_t res = pread(fd, buf.data() + read_len, buf.size() - read_len, version::VERSION_BYTES_LEN + read_len);
+            if (res <= 0)
+            {
+                LOG_ERROR << errno << ": Error in vfs snapshot file read. " << file_path;
+                close(fd);
+                return -1;
+            }
+            read_len += res;
+        }
+
+        close(fd);
+        return 1;
+    }
+
+    /**
+     * Replaces the snapshot file with the provided contents. The file is written aside and renamed into place so
+     * readers never see a partially written snapshot.
+     * @return 0 on success. -1 on error.
+     */
+    int write_snapshot_file(const std::string &buf, const std::string &file_path)
+    {
+        std::scoped_lock lock(snapshot_mutex);
+
+        const std::string temp_file_path = file_path + TEMP_FILE_EXT;
+        const int fd = open(temp_file_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, FILE_PERMS);
+        if (fd == -1)
+        {
+            LOG_ERROR << errno << ": Error in vfs snapshot file open. " << temp_file_path;
+            return -1;
+        }
+
+        if (write(fd, version::HP_VERSION_BYTES, version::VERSION_BYTES_LEN) < version::VERSION_BYTES_LEN)
+        {
+            LOG_ERROR << errno << ": Error adding version header to the vfs snapshot file.";
+            close(fd);
+            unlink(temp_file_path.c_str());
+            return -1;
+        }
+
+        size_t written_len = 0;
+        while (written_len < buf.size())
+        {
+            const ssize_t res = write(fd, buf.data() + written_len, buf.size() - written_len);
+            if (res == -1)
+            {
+                LOG_ERROR << errno << ": Error in vfs snapshot file write. " << temp_file_path;
+                close(fd);
+                unlink(temp_file_path.c_str());
+                return -1;
+            }
+            written_len += res;
+        }
+
+        close(fd);
+        if (rename(temp_file_path.c_str(), file_path.c_str()) == -1)
+        {
+            LOG_ERROR << errno << ": Error when replacing vfs snapshot file. " << file_path;
+            unlink(temp_file_path.c_str());
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /**
+     * Appends the length prefixed string to the buffer.
+     */
+    void append_string(std::string &buf, std::string_view str)
+    {
+        const uint32_t len = str.size();
+        buf.append((char *)&len, sizeof(len));
+        buf.append(str);
+    }
+
+    /**
+     * Reads a length prefixed string from the front of the buffer and advances the buffer.
+     * @return Whether the buffer contained the complete string.
+     */
+    bool read_string(std::string_view &buf, std::string &str)
+    {
+        uint32_t len = 0;
+        if (!read_bytes(buf, &len, sizeof(len)) || buf.size() < len)
+            return false;
+
+        str = buf.substr(0, len);
+        buf.remove_prefix(len);
+        return true;
+    }
+
+    /**
+     * Copies the specified no. of bytes from the front of the buffer and advances the buffer.
+     * @return Whether the buffer contained the requested no. of bytes.
+     */
+    bool read_bytes(std::string_view &buf, void *dest, const size_t len)
+    {
+        if (buf.size() < len)
+            return false;
+
+        memcpy(dest, buf.data(), len);
+        buf.remove_prefix(len);
+        return true;
+    }
+
+} // namespace hpfs::vfs::snapshot
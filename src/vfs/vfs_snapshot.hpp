@@ -0,0 +1,69 @@
+#ifndef _HPFS_VFS_VFS_SNAPSHOT_
+#define _HPFS_VFS_VFS_SNAPSHOT_
+
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include "../audit/audit.hpp"
+
+/**
+ * Serialized snapshot of the vfs state (vnodes, data segments and seed path tracker state) as at a log offset.
+ * A new session loads the snapshot (if it still matches the log) and replays only the log records after it.
+ * Format - [version][snapshot_header][last record payload][renames][deleted seed paths][vnodes]
+ * Rename - [uint32 vpath_len][vpath][uint32 seed_path_len][seed_path]
+ * Deleted seed path - [uint32 seed_path_len][seed_path]
+ * Vnode - [snapshot_vnode_header][vpath][snapshot_segment1][snapshot_segment2]...
+ */
+namespace hpfs::vfs::snapshot
+{
+    struct snapshot_header
+    {
+        off_t log_offset = 0;   // Log offset the snapshot has been taken at (exclusive).
+        off_t first_record = 0; // First record offset of the log header. Merging changes this.
+
+        // Offset and header of the last log record included in the snapshot. Used to detect log truncations and
+        // in-place updates of the last record after the snapshot.
+        off_t last_record = 0;
+        audit::log_record_header last_record_header;
+
+        uint32_t rename_count = 0;
+        uint32_t deleted_count = 0;
+        uint32_t vnode_count = 0;
+    } __attribute__((packed));
+
+    struct snapshot_vnode_header
+    {
+        uint32_t vpath_len = 0;
+        uint32_t seg_count = 0;
+        uint8_t is_seed_backed = 0; // Whether the vnode data is backed by a seed file.
+        size_t max_size = 0;
+        struct stat st;
+    } __attribute__((packed));
+
+    enum SEGMENT_SOURCE : uint8_t
+    {
+        SEED = 0,
+        LOG = 1
+    };
+
+    struct snapshot_segment
+    {
+        SEGMENT_SOURCE source = SEGMENT_SOURCE::LOG;
+        size_t size = 0;
+        off_t physical_offset = 0;
+        off_t logical_offset = 0;
+    } __attribute__((packed));
+
+    int read_snapshot_file(std::string &buf, const std::string &file_path);
+
+    int write_snapshot_file(const std::string &buf, const std::string &file_path);
+
+    void append_string(std::string &buf, std::string_view str);
+
+    bool read_string(std::string_view &buf, std::string &str);
+
+    bool read_bytes(std::string_view &buf, void *dest, const size_t len);
+
+} // namespace hpfs::vfs::snapshot
+
+#endif
@@ -10,8 +10,11 @@
 #include <unordered_set>
 #include <libgen.h>
 #include <optional>
+#include <algorithm>
 #include "vfs.hpp"
 #include "virtual_filesystem.hpp"
+#include "vfs_snapshot.hpp"
+#include "../hpfs.hpp"
 #include "../inodes.hpp"
 #include "../util.hpp"
 #include "../tracelog.hpp"
@@ -20,9 +23,9 @@ namespace hpfs::vfs
 {
 
     int virtual_filesystem::create(std::optional<virtual_filesystem> &virt_fs, const bool readonly, std::string_view seed_dir,
-                                   hpfs::audit::audit_logger &logger)
+                                   hpfs::audit::audit_logger &logger, const READ_ENGINE read_engine)
     {
-        virt_fs.emplace(readonly, seed_dir, logger);
+        virt_fs.emplace(readonly, seed_dir, logger, read_engine);
         if (virt_fs->init() == -1)
         {
             virt_fs.reset();
@@ -34,10 +37,12 @@ namespace hpfs::vfs
 
     virtual_filesystem::virtual_filesystem(const bool readonly,
                                            std::string_view seed_dir,
-                                           hpfs::audit::audit_logger &logger) : readonly(readonly),
-                                                                                seed_dir(seed_dir),
-                                                                                seed_paths(seed_dir),
-                                                                                logger(logger)
+                                           hpfs::audit::audit_logger &logger,
+                                           const READ_ENGINE read_engine) : readonly(readonly),
+                                                                            read_engine(read_engine),
+                                                                            seed_dir(seed_dir),
+                                                                            seed_paths(seed_dir),
+                                                                            logger(logger)
     {
     }
 
@@ -47,14 +52,23 @@ namespace hpfs::vfs
         if (readonly)
             last_checkpoint = logger.get_header().last_checkpoint;
 
-        // We always add the root ("/") as a very first entry in the vfs.
+        // Restore the vfs from the latest snapshot (if usable) so only the log records after it need to be replayed.
+        // Otherwise we always add the root ("/") as a very first entry in the vfs.
         vnode_map::iterator iter;
-        if (add_vnode_from_seed("/", iter) == -1 || build_vfs() == -1)
+        int snapshot_res = 0;
+        if ((snapshot_res = load_snapshot()) == -1 ||
+            (snapshot_res == 0 && add_vnode_from_seed("/", iter) == -1) ||
+            build_vfs() == -1)
         {
             LOG_ERROR << "Error in vfs init.";
             return -1;
         }
 
+        {
+            std::unique_lock lock(vnodes_mutex);
+            take_snapshot();
+        }
+
         initialized = true;
         LOG_DEBUG << "VFS init complete.";
         return 0;
@@ -62,14 +76,26 @@ namespace hpfs::vfs
 
     int virtual_filesystem::get_vnode(const std::string &vpath_ori, vnode **vn)
     {
-        std::scoped_lock lock(vnodes_mutex);
-
         const std::string &vpath = (vpath_ori.front() == '/' &&
                                     vpath_ori.find_first_not_of('/') == std::string::npos)
                                        ? "/"
                                        : vpath_ori;
 
-        vnode_map::iterator iter = vnodes.find(vpath);
+        {
+            // Most lookups find an existing vnode. So we only need a shared lock for those.
+            std::shared_lock lock(vnodes_mutex);
+            const vnode_map::iterator iter = find_vnode(vpath);
+            if (iter != vnodes.end())
+            {
+                *vn = &iter->second;
+                return 0;
+            }
+        }
+
+        // Vnode not found. Check again under exclusive lock and attempt to load it from seed.
+        std::unique_lock lock(vnodes_mutex);
+
+        vnode_map::iterator iter = find_vnode(vpath);
         if (iter == vnodes.end() && add_vnode_from_seed(vpath, iter) == -1)
         {
             LOG_ERROR << "Error in vfs vnode get.";
@@ -81,14 +107,115 @@ namespace hpfs::vfs
         return 0;
     }
 
+    /**
+     * Populates the data segments covering the specified range (which must be within the file size) in logical
+     * offset order. Ranges not backed by any data segment are populated as segments with no physical fd (zeros).
+     */
+    void virtual_filesystem::get_vnode_data_segs(const vnode &vn, const size_t size, const off_t offset,
+                                                 std::vector<vdata_segment> &segs)
+    {
+        const off_t end = offset + size;
+        off_t pos = offset;
+
+        // Data segments are sorted and non-overlapping. So we can binary search for the first segment ending after
+        // the offset and walk forward from there.
+        auto seg = std::partition_point(vn.data_segs.begin(), vn.data_segs.end(), [&](const vdata_segment &s) {
+            return (off_t)(s.logical_offset + s.size) <= offset;
+        });
+
+        for (; seg != vn.data_segs.end() && seg->logical_offset < end; seg++)
+        {
+            if (pos < seg->logical_offset)
+            {
+                segs.push_back(vdata_segment{0, (size_t)(seg->logical_offset - pos), 0, pos});
+                pos = seg->logical_offset;
+            }
+
+            const size_t len = MIN(end, (off_t)(seg->logical_offset + seg->size)) - pos;
+            segs.push_back(vdata_segment{seg->physical_fd, len, seg->physical_offset + (pos - seg->logical_offset), pos});
+            pos += len;
+        }
+
+        if (pos < end)
+            segs.push_back(vdata_segment{0, (size_t)(end - pos), 0, pos});
+    }
+
+    /**
+     * Copies the vnode data in the specified range (which must be within the file size) into the buffer.
+     * Data is copied from the memory map if the vnode has one. Otherwise the data segments covering the range are
+     * read from their backing files.
+     * @return 0 on success. -1 on error.
+     */
+    int virtual_filesystem::read_vnode_data(const vnode &vn, void *buf, const size_t size, const off_t offset)
+    {
+        if (vn.mmap.ptr)
+        {
+            memcpy(buf, (uint8_t *)vn.mmap.ptr + offset, size);
+            return 0;
+        }
+
+        std::vector<vdata_segment> segs;
+        get_vnode_data_segs(vn, size, offset, segs);
+
+        for (const vdata_segment &seg : segs)
+        {
+            uint8_t *dest = (uint8_t *)buf + (seg.logical_offset - offset);
+            if (seg.physical_fd == 0)
+            {
+                memset(dest, 0, seg.size);
+            }
+            else if (pread(seg.physical_fd, dest, seg.size, seg.physical_offset) < (ssize_t)seg.size)
+            {
+                LOG_ERROR << errno << ": Error when reading vnode data segment.";
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    /**
+     * Looks up the vnode of the vpath. Does not modify the vpath table. So it can be called under a shared lock.
+     */
+    vnode_map::iterator virtual_filesystem::find_vnode(const std::string &vpath)
+    {
+        const vpaths::vpath_id id = vpaths.find(vpath);
+        return id == vpaths::NO_VPATH_ID ? vnodes.end() : vnodes.find(id);
+    }
+
     void virtual_filesystem::add_vnode(const std::string &vpath, vnode_map::iterator &vnode_iter)
     {
         vnode vn;
         vn.st = ctx.default_stat;
         vn.st.st_ino = vn.ino = inodes::next();
+        insert_vnode(vpath, std::move(vn), vnode_iter);
+    }
 
-        auto [iter, success] = vnodes.try_emplace(vpath, std::move(vn));
+    /**
+     * Inserts the vnode under the vpath unless there's already a vnode for the vpath.
+     * @param vnode_iter Iterator of the inserted vnode or the existing vnode.
+     * @return Whether the vnode was inserted.
+     */
+    bool virtual_filesystem::insert_vnode(const std::string &vpath, vnode &&vn, vnode_map::iterator &vnode_iter)
+    {
+        const vpaths::vpath_id id = vpaths.acquire(vpath);
+        const auto [iter, success] = vnodes.try_emplace(id, std::move(vn));
         vnode_iter = iter;
+        if (!success)
+            vpaths.release(id); // Existing vnode already holds a reference.
+        return success;
+    }
+
+    /**
+     * Collects the interned descendants of the specified vpath. Parents are collected before their children.
+     */
+    void virtual_filesystem::get_indexed_descendants(const vpaths::vpath_id id, std::vector<vpaths::vpath_id> &descendants)
+    {
+        for (vpaths::vpath_id child = vpaths.get_first_child(id); child != vpaths::NO_VPATH_ID; child = vpaths.get_next_sibling(child))
+        {
+            descendants.push_back(child);
+            get_indexed_descendants(child, descendants);
+        }
     }
 
     int virtual_filesystem::add_vnode_from_seed(const std::string &vpath, vnode_map::iterator &vnode_iter)
@@ -137,8 +264,7 @@ namespace hpfs::vfs
                 return -1;
             }
 
-            auto [iter, success] = vnodes.try_emplace(vpath, std::move(vn));
-            vnode_iter = iter;
+            insert_vnode(vpath, std::move(vn), vnode_iter);
         }
 
         return 0;
@@ -148,46 +274,62 @@ namespace hpfs::vfs
      * Playback any unread logs and build up the latest view of the virtual fs.
      * @return 0 on success. -1 on failure;
      */
-    int virtual_filesystem::build_vfs()
+    /**
+     * Applies the log records which have not been scanned yet to the vnodes.
+     * @param scan_upto Log offset to stop scanning at (exclusive of the log record starting at this offset).
+     *                  0 means scan till the end of the log (or last checkpoint in ReadOnly mode).
+     * @return 0 on success. -1 on error.
+     */
+    int virtual_filesystem::build_vfs(const off_t scan_upto)
     {
+        std::unique_lock lock(vnodes_mutex);
+
         // Return immediately if we have already reached last checkpoint in ReadOnly mode.
         if (readonly && log_scanned_upto >= last_checkpoint)
             return 0;
 
+        // Return immediately if we have already reached the requested scan limit.
+        if (scan_upto > 0 && log_scanned_upto >= scan_upto)
+            return 0;
+
         // Scan log records and build up vnodes relevant to log records.
-        off_t next_log_offset = log_scanned_upto;
+        hpfs::audit::log_cursor cursor;
+        cursor.offset = log_scanned_upto;
+        hpfs::audit::log_record record;
+        std::vector<uint8_t> payload;
 
         do
         {
-            hpfs::audit::log_record record;
-            if (logger.read_log_at(next_log_offset, next_log_offset, record) == -1)
+            const int res = logger.read_log_next(cursor, record, payload);
+            if (res == -1)
             {
                 LOG_ERROR << "Error in vfs read log.";
                 return -1;
             }
 
-            if (next_log_offset == -1) // No log record was read. We are at end of log.
+            if (res == 0) // No log record was read. We are at end of log.
                 break;
 
-            std::vector<uint8_t> payload;
-            if (logger.read_payload(payload, record) == -1 ||
-                apply_log_record(record, payload) == -1)
+            if (apply_log_record(record, payload) == -1)
             {
                 LOG_ERROR << "Error in vfs read and apply log.";
                 return -1;
             }
 
             log_scanned_upto = record.offset + record.size;
+            last_scanned_record = record.offset;
+            unsnapshotted_records++;
 
-        } while (next_log_offset > 0 &&
-                 (!readonly || log_scanned_upto < last_checkpoint));
+        } while (cursor.offset > 0 &&
+                 (!readonly || log_scanned_upto < last_checkpoint) &&
+                 (scan_upto == 0 || log_scanned_upto < scan_upto));
 
         return 0;
     }
 
-    int virtual_filesystem::apply_log_record(const hpfs::audit::log_record &record, const std::vector<uint8_t> payload)
+    int virtual_filesystem::apply_log_record(const hpfs::audit::log_record &record, const std::vector<uint8_t> &payload)
     {
-        vnode_map::iterator iter = vnodes.find(record.vpath);
+        vnode_map::iterator iter = find_vnode(record.vpath);
         if (iter == vnodes.end())
         {
 
@@ -230,28 +372,29 @@ namespace hpfs::vfs
 
             // Rename all vnode sub paths under this path. (Erase them and insert under new name)
             {
-                std::vector<std::string> vpaths_to_move;
-                for (const auto &[vpath, vnode] : vnodes)
-                {
-                    if (vpath.size() > from_vpath.size() && vpath.rfind(from_vpath, 0) == 0)
-                        vpaths_to_move.push_back(vpath);
-                }
+                std::vector<vpaths::vpath_id> ids_to_move;
+                get_indexed_descendants(iter->first, ids_to_move);
 
-                for (const std::string &vpath : vpaths_to_move)
+                for (const vpaths::vpath_id id : ids_to_move)
                 {
-                    const auto move_iter = vnodes.find(vpath);
+                    const auto move_iter = vnodes.find(id);
+                    if (move_iter == vnodes.end()) // Interned only as an ancestor of other vnodes.
+                        continue;
+
                     vnode move_vn = move_iter->second; // Create a copy.
                     vnodes.erase(move_iter);
-                    const std::string new_path = to_vpath + vpath.substr(from_vpath.size());
-                    vnodes.try_emplace(new_path, std::move(move_vn)); // Insert under new name.
+                    vnode_map::iterator new_iter;
+                    insert_vnode(to_vpath + vpaths.get_path(id).substr(from_vpath.size()), std::move(move_vn), new_iter); // Insert under new name.
+                    vpaths.release(id);
                 }
             }
 
             // Rename this vnode. (erase it from the list and insert under new name)
             vnode vn2 = vn; // Create a copy before erase.
+            const vpaths::vpath_id from_id = iter->first;
             vnodes.erase(iter);
-            auto [iter2, success] = vnodes.try_emplace(to_vpath, std::move(vn2));
-            iter = iter2;
+            vpaths.release(from_id);
+            insert_vnode(to_vpath, std::move(vn2), iter);
 
             break;
         }
@@ -270,8 +413,8 @@ namespace hpfs::vfs
             const hpfs::audit::op_write_payload_header wh = *(hpfs::audit::op_write_payload_header *)payload.data();
 
             if (record.block_data_len > 0)
-                vn.data_segs.push_back(vdata_segment{logger.get_fd(), record.block_data_len,
-                                                     record.block_data_offset, wh.mmap_block_offset});
+                add_data_seg(vn, vdata_segment{logger.get_fd(), record.block_data_len,
+                                               record.block_data_offset, wh.mmap_block_offset});
 
             // Update stats, if the new data boundry is larger than current file size.
             if (vn.st.st_size < (wh.offset + wh.size))
@@ -295,8 +438,8 @@ namespace hpfs::vfs
             const hpfs::audit::op_truncate_payload_header th = *(hpfs::audit::op_truncate_payload_header *)payload.data();
 
             if (record.block_data_len > 0)
-                vn.data_segs.push_back(vdata_segment{logger.get_fd(), record.block_data_len,
-                                                     record.block_data_offset, th.mmap_block_offset});
+                add_data_seg(vn, vdata_segment{logger.get_fd(), record.block_data_len,
+                                               record.block_data_offset, th.mmap_block_offset});
 
             vn.st.st_size = th.size;
             if (vn.st.st_size > vn.max_size)
@@ -329,7 +472,9 @@ namespace hpfs::vfs
         if (vn.seed_fd > 0)
             close(vn.seed_fd);
 
+        const vpaths::vpath_id id = vnode_iter->first;
         vnodes.erase(vnode_iter);
+        vpaths.release(id);
         vnode_iter = vnodes.end();
         return 0;
     }
@@ -341,32 +486,26 @@ namespace hpfs::vfs
     int virtual_filesystem::apply_last_write_log_adjustment(vfs::vnode &vn, const off_t wr_offset, const size_t wr_size,
                                                             const size_t block_size_increase)
     {
+        std::unique_lock lock(vnodes_mutex);
+
         if (block_size_increase > 0)
         {
             log_scanned_upto += block_size_increase; // Increase the log scanned marker to include the increased block bytes.
 
-            if (vn.data_segs.empty())
+            if (vn.last_data_seg.size == 0)
             {
                 LOG_ERROR << "No vnode data seg to extend.";
                 return -1;
             }
 
-            if (!vn.mmap.ptr)
-            {
-                LOG_ERROR << "No existing mmap to unmap and extend.";
-                return -1;
-            }
-
-            vdata_segment &seg = vn.data_segs.back();
-
-            // Unmap the last data segment before remapping it with the increased size.
-            if (munmap((uint8_t *)vn.mmap.ptr + seg.logical_offset, seg.size) == -1)
-            {
-                LOG_ERROR << errno << ": Error in munmap when extending last data seg.";
-                return -1;
-            }
-            vn.mapped_data_segs--;
-            seg.size += block_size_increase; // Increase the last segment block size;
+            // The increased block bytes follow the last data segment both in the log and in the file.
+            // So we overlay only the increased range and remember the extended segment as the last segment.
+            vdata_segment extended_seg = vn.last_data_seg;
+            add_data_seg(vn, vdata_segment{extended_seg.physical_fd, block_size_increase,
+                                           (off_t)(extended_seg.physical_offset + extended_seg.size),
+                                           (off_t)(extended_seg.logical_offset + extended_seg.size)});
+            extended_seg.size += block_size_increase;
+            vn.last_data_seg = extended_seg;
         }
 
         // Update vnode stats, if the new data boundry is larger than the previous file size.
@@ -384,9 +523,90 @@ namespace hpfs::vfs
         return 0;
     }
 
+    /**
+     * Adds a data segment on top of the existing data segments of the vnode. Any parts of the existing segments
+     * shadowed by the new segment are dropped and the new segment is merged with its neighbours if their physical
+     * data is contiguous. This keeps the no. of segments (and memory mappings) bounded by the no. of visible data
+     * ranges regardless of the write history.
+     */
+    void virtual_filesystem::add_data_seg(vnode &vn, const vdata_segment &seg)
+    {
+        if (seg.size == 0)
+            return;
+
+        vn.unmapped_data_segs.push_back(seg);
+        vn.last_data_seg = seg;
+
+        const off_t seg_end = seg.logical_offset + seg.size;
+        std::vector<vdata_segment> &segs = vn.data_segs;
+
+        // Find the range of existing segments overlapping with the new segment. Segments are sorted and
+        // non-overlapping so their end offsets are sorted as well.
+        auto first = std::partition_point(segs.begin(), segs.end(), [&](const vdata_segment &s) {
+            return (off_t)(s.logical_offset + s.size) <= seg.logical_offset;
+        });
+        auto last = std::partition_point(first, segs.end(), [&](const vdata_segment &s) {
+            return s.logical_offset < seg_end;
+        });
+
+        // Keep the parts of the overlapping segments which are not shadowed by the new segment.
+        vdata_segment replacement[3];
+        size_t count = 0;
+        if (first != last && first->logical_offset < seg.logical_offset)
+        {
+            const vdata_segment &head = *first;
+            replacement[count++] = vdata_segment{head.physical_fd, (size_t)(seg.logical_offset - head.logical_offset),
+                                                 head.physical_offset, head.logical_offset};
+        }
+
+        const size_t seg_idx = count;
+        replacement[count++] = seg;
+
+        if (first != last)
+        {
+            const vdata_segment &tail = *(last - 1);
+            const off_t tail_end = tail.logical_offset + tail.size;
+            if (tail_end > seg_end)
+                replacement[count++] = vdata_segment{tail.physical_fd, (size_t)(tail_end - seg_end),
+                                                     tail.physical_offset + (seg_end - tail.logical_offset), seg_end};
+        }
+
+        auto pos = segs.erase(first, last);
+        pos = segs.insert(pos, replacement, replacement + count);
+        size_t idx = (pos - segs.begin()) + seg_idx;
+
+        // Merge with the neighbours whose physical data continues the new segment.
+        const auto is_contiguous = [](const vdata_segment &a, const vdata_segment &b) {
+            return a.physical_fd == b.physical_fd &&
+                   (off_t)(a.logical_offset + a.size) == b.logical_offset &&
+                   (off_t)(a.physical_offset + a.size) == b.physical_offset;
+        };
+
+        if (idx + 1 < segs.size() && is_contiguous(segs[idx], segs[idx + 1]))
+        {
+            segs[idx].size += segs[idx + 1].size;
+            segs.erase(segs.begin() + idx + 1);
+        }
+
+        if (idx > 0 && is_contiguous(segs[idx - 1], segs[idx]))
+        {
+            segs[idx - 1].size += segs[idx].size;
+            segs.erase(segs.begin() + idx);
+        }
+    }
+
     int virtual_filesystem::update_vnode_mmap(vnode &vn)
     {
-        if (vn.mapped_data_segs == vn.data_segs.size())
+        // Extent read engine reads the data segments directly. So the vnodes are never memory mapped.
+        if (read_engine == READ_ENGINE::EXTENT)
+        {
+            vn.unmapped_data_segs.clear();
+            return 0;
+        }
+
+        // If there's no memory map yet, all the visible segments need to be mapped. Otherwise only the newly
+        // added segments need to be overlaid on the existing map.
+        if (vn.mmap.ptr ? vn.unmapped_data_segs.empty() : vn.data_segs.empty())
             return 0;
 
         const off_t required_map_size = BLOCK_END(vn.max_size);
@@ -400,41 +620,37 @@ namespace hpfs::vfs
             }
 
             vn.mmap.ptr = NULL;
-            vn.mapped_data_segs = 0;
         }
 
-        for (uint32_t idx = vn.mapped_data_segs; idx < vn.data_segs.size(); idx++)
+        const bool full_map = !vn.mmap.ptr;
+        if (full_map)
         {
-            const vdata_segment &seg = vn.data_segs.at(idx);
-
-            if (!vn.mmap.ptr)
+            // Reserve the address range for the full size needed. Visible segments are mapped onto it.
+            void *ptr = mmap(NULL, required_map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ptr == MAP_FAILED)
             {
-                // Create the mapping for the full size needed.
-                void *ptr = mmap(NULL, required_map_size, PROT_READ, MAP_PRIVATE, seg.physical_fd, seg.physical_offset);
-                if (ptr == MAP_FAILED)
-                {
-                    LOG_ERROR << errno << ": Error in vnode mmap creation.";
-                    return -1;
-                }
-
-                vn.mmap.ptr = ptr;
-                vn.mmap.size = required_map_size;
+                LOG_ERROR << errno << ": Error in vnode mmap creation.";
+                return -1;
             }
-            else
-            {
-                void *ptr = mmap(((uint8_t *)vn.mmap.ptr + seg.logical_offset),
-                                 seg.size, PROT_READ, MAP_PRIVATE | MAP_FIXED,
-                                 seg.physical_fd, seg.physical_offset);
 
-                if (ptr == MAP_FAILED)
-                {
-                    LOG_ERROR << errno << ": Error in vnode mmap update.";
-                    return -1;
-                }
+            vn.mmap.ptr = ptr;
+            vn.mmap.size = required_map_size;
+        }
+
+        for (const vdata_segment &seg : (full_map ? vn.data_segs : vn.unmapped_data_segs))
+        {
+            void *ptr = mmap(((uint8_t *)vn.mmap.ptr + seg.logical_offset),
+                             seg.size, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                             seg.physical_fd, seg.physical_offset);
+
+            if (ptr == MAP_FAILED)
+            {
+                LOG_ERROR << errno << ": Error in vnode mmap update.";
+                return -1;
             }
         }
 
-        vn.mapped_data_segs = vn.data_segs.size();
+        vn.unmapped_data_segs.clear();
         return 0;
     }
 
@@ -443,6 +659,8 @@ namespace hpfs::vfs
         std::unordered_set<std::string> possible_child_names;
 
         {
+            std::shared_lock lock(vnodes_mutex);
+
             // Read possible children from seed dir
             const std::string original_seed_path = seed_paths.resolve(vpath);
             if (!original_seed_path.empty())
@@ -472,15 +690,11 @@ namespace hpfs::vfs
 
         {
             // Find possible children from vnodes.
-            for (const auto &[vn_path, vn] : vnodes)
-            {
-                if (vn_path == "/")
-                    continue;
-
-                const std::string parent_path = util::get_parent_path(vn_path);
-                if (parent_path == vpath)
-                    possible_child_names.emplace(util::get_name(vn_path));
-            }
+            std::shared_lock lock(vnodes_mutex);
+            const vpaths::vpath_id id = vpaths.find(vpath);
+            for (vpaths::vpath_id child = id == vpaths::NO_VPATH_ID ? id : vpaths.get_first_child(id);
+                 child != vpaths::NO_VPATH_ID; child = vpaths.get_next_sibling(child))
+                possible_child_names.emplace(vpaths.get_name(child));
         }
 
         for (const auto &child_name : possible_child_names)
@@ -499,6 +713,7 @@ namespace hpfs::vfs
 
             if (child_vnode)
             {
+                std::shared_lock lock(vnodes_mutex);
                 children.try_emplace(child_name, child_vnode->st);
             }
         }
@@ -506,13 +721,31 @@ namespace hpfs::vfs
         return 0;
     }
 
-    void virtual_filesystem::populate_block_buf_segs(std::vector<iovec> &block_buf_segs,
-                                                     off_t &block_buf_start, off_t &block_buf_end,
-                                                     const char *buf, const size_t wr_size,
-                                                     const off_t wr_start, const size_t fsize, uint8_t *mmap_ptr)
+    /**
+     * Populates the block buffer segments covering the file blocks touched by a write. Existing file data within
+     * those blocks is referred from the vnode memory map. If the vnode is not memory mapped, existing data is read
+     * into the provided buffer which must outlive the block buffer segments.
+     * @return 0 on success. -1 on error.
+     */
+    int virtual_filesystem::populate_block_buf_segs(std::vector<iovec> &block_buf_segs, std::vector<uint8_t> &ex_data_buf,
+                                                    off_t &block_buf_start, off_t &block_buf_end,
+                                                    const char *buf, const size_t wr_size,
+                                                    const off_t wr_start, const vnode &vn)
     {
+        const size_t fsize = vn.st.st_size;
         const size_t wr_end = wr_start + wr_size;
 
+        // Existing data before and after the write buf are each less than a block. Without a memory map, they are
+        // read into the first and second block of the buffer respectively.
+        const auto get_ex_data = [&](const off_t offset, const size_t len, const size_t buf_block) -> void * {
+            if (vn.mmap.ptr)
+                return (uint8_t *)vn.mmap.ptr + offset;
+
+            ex_data_buf.resize(2 * BLOCK_SIZE);
+            uint8_t *ex_data = ex_data_buf.data() + (buf_block * BLOCK_SIZE);
+            return read_vnode_data(vn, ex_data, len, offset) == -1 ? NULL : ex_data;
+        };
+
         // Find the target file block offset range that should map to memory mapped file.
         block_buf_start = BLOCK_START(MIN(wr_start, fsize));
         block_buf_end = BLOCK_END(wr_start + wr_size);
@@ -526,7 +759,10 @@ namespace hpfs::vfs
             if (block_buf_start < fsize)
             {
                 const size_t ex_data_len = MIN(fsize, wr_start) - block_buf_start;
-                block_buf_segs.push_back({mmap_ptr + block_buf_start, ex_data_len});
+                void *ex_data = get_ex_data(block_buf_start, ex_data_len, 0);
+                if (!ex_data)
+                    return -1;
+                block_buf_segs.push_back({ex_data, ex_data_len});
             }
 
             // If write offset is beyond file size, add a segment for NULL bytes
@@ -545,14 +781,23 @@ namespace hpfs::vfs
             // If write end offset is before file end, add a segment containing existing
             // file data after write end upto block end.
             if (wr_end < fsize)
-                block_buf_segs.push_back({(mmap_ptr + wr_end), (MIN(fsize, block_buf_end) - wr_end)});
+            {
+                const size_t ex_data_len = MIN(fsize, block_buf_end) - wr_end;
+                void *ex_data = get_ex_data(wr_end, ex_data_len, 1);
+                if (!ex_data)
+                    return -1;
+                block_buf_segs.push_back({ex_data, ex_data_len});
+            }
 
             // Append segment for NULL data until block end.
             const off_t null_data_start = MAX(wr_end, fsize);
             if (null_data_start < block_buf_end)
                 block_buf_segs.push_back({NULL, (size_t)(block_buf_end - null_data_start)});
         }
+
+        return 0;
     }
+
     /**
      * Cleanup the existing vfs and re-build the vfs again.
      * @return -1 on error and 0 on success.
@@ -560,20 +805,25 @@ namespace hpfs::vfs
     int virtual_filesystem::re_build_vfs()
     {
         log_scanned_upto = 0;
+        last_scanned_record = 0;
+        unsnapshotted_records = 0;
         if (initialized && !moved)
         {
-            for (const auto &[vpath, vnode] : vnodes)
             {
-                if (vnode.seed_fd > 0)
-                    close(vnode.seed_fd);
+                std::unique_lock lock(vnodes_mutex);
+
+                // Seed renames/deletions are tracked again when the log gets replayed.
+                clear_vnodes();
 
-                if (vnode.mmap.ptr)
-                    munmap(vnode.mmap.ptr, vnode.mmap.size);
+                vnode_map::iterator iter;
+                if (add_vnode_from_seed("/", iter) == -1)
+                {
+                    LOG_ERROR << "Error in vfs init.";
+                    return -1;
+                }
             }
-            vnodes.clear();
 
-            vnode_map::iterator iter;
-            if (add_vnode_from_seed("/", iter) == -1 || build_vfs() == -1)
+            if (build_vfs() == -1)
             {
                 LOG_ERROR << "Error in vfs init.";
                 return -1;
@@ -582,18 +832,300 @@ namespace hpfs::vfs
         return 0;
     }
 
-    virtual_filesystem::~virtual_filesystem()
+    /**
+     * Releases all the vnodes along with the child index and the seed path tracking state.
+     */
+    void virtual_filesystem::clear_vnodes()
     {
-        if (initialized && !moved)
+        for (const auto &[id, vnode] : vnodes)
+        {
+            if (vnode.seed_fd > 0)
+                close(vnode.seed_fd);
+
+            if (vnode.mmap.ptr)
+                munmap(vnode.mmap.ptr, vnode.mmap.size);
+        }
+        vnodes.clear();
+        vpaths.clear();
+        seed_paths.clear();
+    }
+
+    /**
+     * Restores the vnodes and the seed path tracking state from the vfs snapshot file. The snapshot is only used if
+     * the log still contains the same records upto the snapshot offset and no records have been merged since.
+     * @return 1 if the vfs was restored from the snapshot. 0 if there's no usable snapshot. -1 on error.
+     */
+    int virtual_filesystem::load_snapshot()
+    {
+        if (ctx.vfs_snapshot_interval == 0)
+            return 0;
+
+        std::string buf;
+        const int res = snapshot::read_snapshot_file(buf, ctx.vfs_snapshot_file_path);
+        if (res < 1)
+            return res;
+
+        std::string_view data = buf;
+        snapshot::snapshot_header sh;
+        if (!snapshot::read_bytes(data, &sh, sizeof(sh)))
+        {
+            LOG_WARNING << "Ignoring incomplete vfs snapshot.";
+            return 0;
+        }
+
+        // ReadOnly session must not go beyond the last checkpoint.
+        if (sh.first_record != logger.get_header().first_record || (readonly && sh.log_offset > last_checkpoint))
+            return 0;
+
+        // Make sure the last snapshotted log record is still there as it was when the snapshot was taken.
+        const hpfs::audit::log_record_metrics lm = hpfs::audit::audit_logger::get_metrics(sh.last_record_header);
+        if (sh.last_record == 0 || sh.last_record > logger.get_header().last_record ||
+            sh.last_record + (off_t)lm.total_size != sh.log_offset)
+            return 0;
+
+        hpfs::audit::log_record_header rh;
+        if (pread(logger.get_fd(), &rh, sizeof(rh), sh.last_record) < (ssize_t)sizeof(rh))
+        {
+            LOG_ERROR << errno << ": Error reading log file for vfs snapshot validation.";
+            return -1;
+        }
+
+        if (memcmp(&rh, &sh.last_record_header, sizeof(rh)) != 0 || data.size() < rh.payload_len)
+            return 0;
+
+        std::string payload(rh.payload_len, '\0');
+        if (pread(logger.get_fd(), payload.data(), payload.size(), sh.last_record + lm.payload_offset) < (ssize_t)payload.size())
         {
-            for (const auto &[vpath, vnode] : vnodes)
+            LOG_ERROR << errno << ": Error reading log file for vfs snapshot validation.";
+            return -1;
+        }
+
+        if (data.substr(0, payload.size()) != payload)
+            return 0;
+        data.remove_prefix(payload.size());
+
+        std::unique_lock lock(vnodes_mutex);
+
+        // Restore the seed path tracking state first because seed backed vnodes are resolved with it.
+        {
+            std::vector<std::pair<std::string, std::string>> renames(sh.rename_count);
+            for (auto &[vpath, seed_path] : renames)
+            {
+                if (!snapshot::read_string(data, vpath) || !snapshot::read_string(data, seed_path))
+                {
+                    LOG_WARNING << "Ignoring incomplete vfs snapshot.";
+                    return 0;
+                }
+            }
+
+            std::vector<std::string> deleted(sh.deleted_count);
+            for (std::string &seed_path : deleted)
+            {
+                if (!snapshot::read_string(data, seed_path))
+                {
+                    LOG_WARNING << "Ignoring incomplete vfs snapshot.";
+                    return 0;
+                }
+            }
+
+            seed_paths.import_state(renames, deleted);
+        }
+
+        for (uint32_t i = 0; i < sh.vnode_count; i++)
+        {
+            snapshot::snapshot_vnode_header vh;
+            std::string vpath;
+            if (!snapshot::read_bytes(data, &vh, sizeof(vh)) || data.size() < vh.vpath_len ||
+                data.size() - vh.vpath_len < vh.seg_count * sizeof(snapshot::snapshot_segment))
+            {
+                LOG_WARNING << "Ignoring incomplete vfs snapshot.";
+                clear_vnodes();
+                return 0;
+            }
+            vpath = data.substr(0, vh.vpath_len);
+            data.remove_prefix(vh.vpath_len);
+
+            vnode vn;
+            vn.st = vh.st;
+            vn.st.st_ino = vn.ino = inodes::next();
+            vn.max_size = vh.max_size;
+
+            if (vh.is_seed_backed)
+            {
+                const std::string seed_path = std::string(seed_dir).append(seed_paths.resolve(vpath));
+                vn.seed_fd = open(seed_path.c_str(), O_RDONLY);
+                if (vn.seed_fd == -1)
+                {
+                    LOG_WARNING << errno << ": Ignoring vfs snapshot. Error when opening seed file." << seed_path;
+                    clear_vnodes();
+                    return 0;
+                }
+            }
+
+            // Seed files are only changed by merging. But we verify the seed data ranges anyway in case the seed file
+            // has been modified or the vnode has been resolved to a different seed file.
+            struct stat seed_st;
+            if (vn.seed_fd > 0 && fstat(vn.seed_fd, &seed_st) == -1)
+            {
+                LOG_ERROR << errno << ": Error in stat of seed file for vfs snapshot.";
+                close(vn.seed_fd);
+                clear_vnodes();
+                return -1;
+            }
+
+            bool seeds_matched = vn.seed_fd == 0 || S_ISREG(seed_st.st_mode);
+            for (uint32_t j = 0; j < vh.seg_count; j++)
             {
-                if (vnode.seed_fd > 0)
-                    close(vnode.seed_fd);
+                snapshot::snapshot_segment ss;
+                snapshot::read_bytes(data, &ss, sizeof(ss));
 
-                if (vnode.mmap.ptr)
-                    munmap(vnode.mmap.ptr, vnode.mmap.size);
+                vdata_segment seg{logger.get_fd(), ss.size, ss.physical_offset, ss.logical_offset};
+                if (ss.source == snapshot::SEGMENT_SOURCE::SEED)
+                {
+                    seeds_matched = seeds_matched && vn.seed_fd > 0 && (off_t)(ss.physical_offset + ss.size) <= seed_st.st_size;
+                    seg.physical_fd = vn.seed_fd;
+                }
+                add_data_seg(vn, seg);
+            }
+
+            if (!seeds_matched)
+            {
+                LOG_WARNING << "Ignoring vfs snapshot. Seed file mismatch. " << vpath;
+                if (vn.seed_fd > 0)
+                    close(vn.seed_fd);
+                clear_vnodes();
+                return 0;
+            }
+
+            if (update_vnode_mmap(vn) == -1)
+            {
+                LOG_ERROR << "Error when mmap update of vfs snapshot vnode. " << vpath;
+                if (vn.seed_fd > 0)
+                    close(vn.seed_fd);
+                clear_vnodes();
+                return -1;
             }
+
+            vnode_map::iterator iter;
+            insert_vnode(vpath, std::move(vn), iter);
+        }
+
+        log_scanned_upto = sh.log_offset;
+        last_scanned_record = sh.last_record;
+        unsnapshotted_records = 0;
+
+        LOG_DEBUG << "VFS restored from snapshot at log offset " << sh.log_offset;
+        return 1;
+    }
+
+    /**
+     * Takes a vfs snapshot if enough log records have been replayed since the last one. This is only done at init and
+     * close since the last log record of a session can still be rewritten in place (root hash and optimized writes)
+     * and a snapshot taken before that would never match the log again.
+     * Must be called while holding the vnodes lock.
+     */
+    void virtual_filesystem::take_snapshot()
+    {
+        // Merging changes the seed and invalidates snapshots. So we only take snapshots when the log is not merged.
+        // Failing to take a snapshot only affects the start up time of future sessions.
+        if (ctx.vfs_snapshot_interval > 0 && !ctx.merge_enabled &&
+            unsnapshotted_records >= ctx.vfs_snapshot_interval && persist_snapshot() == -1)
+            LOG_WARNING << "Skipped vfs snapshot due to an error.";
+    }
+
+    /**
+     * Writes the current vnodes and the seed path tracking state into the vfs snapshot file.
+     * Must be called while holding the vnodes lock.
+     * @return 0 on success. -1 on error.
+     */
+    int virtual_filesystem::persist_snapshot()
+    {
+        if (last_scanned_record == 0)
+            return 0;
+
+        snapshot::snapshot_header sh;
+        sh.log_offset = log_scanned_upto;
+        sh.first_record = logger.get_header().first_record;
+        sh.last_record = last_scanned_record;
+
+        if (pread(logger.get_fd(), &sh.last_record_header, sizeof(sh.last_record_header), sh.last_record) < (ssize_t)sizeof(sh.last_record_header))
+        {
+            LOG_ERROR << errno << ": Error reading log file for vfs snapshot.";
+            return -1;
+        }
+
+        // The snapshot must end at the end of the last scanned record.
+        const hpfs::audit::log_record_metrics lm = hpfs::audit::audit_logger::get_metrics(sh.last_record_header);
+        if (sh.last_record + (off_t)lm.total_size != sh.log_offset)
+            return 0;
+
+        std::string payload(sh.last_record_header.payload_len, '\0');
+        if (pread(logger.get_fd(), payload.data(), payload.size(), sh.last_record + lm.payload_offset) < (ssize_t)payload.size())
+        {
+            LOG_ERROR << errno << ": Error reading log file for vfs snapshot.";
+            return -1;
+        }
+
+        std::vector<std::pair<std::string, std::string>> renames;
+        std::vector<std::string> deleted;
+        seed_paths.export_state(renames, deleted);
+        sh.rename_count = renames.size();
+        sh.deleted_count = deleted.size();
+        sh.vnode_count = vnodes.size();
+
+        std::string buf;
+        buf.append((char *)&sh, sizeof(sh));
+        buf.append(payload);
+
+        for (const auto &[vpath, seed_path] : renames)
+        {
+            snapshot::append_string(buf, vpath);
+            snapshot::append_string(buf, seed_path);
+        }
+
+        for (const std::string &seed_path : deleted)
+            snapshot::append_string(buf, seed_path);
+
+        for (const auto &[id, vn] : vnodes)
+        {
+            const std::string vpath = vpaths.get_path(id);
+            snapshot::snapshot_vnode_header vh;
+            vh.vpath_len = vpath.size();
+            vh.seg_count = vn.data_segs.size();
+            vh.is_seed_backed = vn.seed_fd > 0 ? 1 : 0;
+            vh.max_size = vn.max_size;
+            vh.st = vn.st;
+
+            buf.append((char *)&vh, sizeof(vh));
+            buf.append(vpath);
+
+            for (const vdata_segment &seg : vn.data_segs)
+            {
+                snapshot::snapshot_segment ss;
+                ss.source = (vn.seed_fd > 0 && seg.physical_fd == vn.seed_fd) ? snapshot::SEGMENT_SOURCE::SEED
+                                                                              : snapshot::SEGMENT_SOURCE::LOG;
+                ss.size = seg.size;
+                ss.physical_offset = seg.physical_offset;
+                ss.logical_offset = seg.logical_offset;
+                buf.append((char *)&ss, sizeof(ss));
+            }
+        }
+
+        if (snapshot::write_snapshot_file(buf, ctx.vfs_snapshot_file_path) == -1)
+            return -1;
+
+        unsnapshotted_records = 0;
+        LOG_DEBUG << "VFS snapshot taken at log offset " << sh.log_offset;
+        return 0;
+    }
+
+    virtual_filesystem::~virtual_filesystem()
+    {
+        if (initialized && !moved)
+        {
+            std::unique_lock lock(vnodes_mutex);
+            take_snapshot();
+            clear_vnodes();
         }
     }
 
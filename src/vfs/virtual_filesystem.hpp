@@ -2,14 +2,17 @@
 #define _HPFS_VFS_VIRTUAL_FILESYSTEM_
 
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
+#include <shared_mutex>
 #include "vfs.hpp"
 #include "seed_path_tracker.hpp"
 #include "../audit/audit.hpp"
+#include "../vpaths.hpp"
 
 namespace hpfs::vfs
 {
-    typedef std::unordered_map<std::string, vnode> vnode_map;
+    typedef std::unordered_map<vpaths::vpath_id, vnode> vnode_map;
     typedef std::unordered_map<std::string, struct stat> vdir_children_map;
 
     class virtual_filesystem
@@ -18,9 +21,15 @@ namespace hpfs::vfs
         bool moved = false;
         bool initialized = false; // Indicates that the instance has been initialized properly.
         const bool readonly;
+        const READ_ENGINE read_engine; // Vnodes are memory mapped only with the mmap read engine.
         std::string_view seed_dir;
-        vnode_map vnodes;
-        std::mutex vnodes_mutex;
+        vnode_map vnodes; // Vnodes keyed by the interned vpath id.
+        std::shared_mutex vnodes_mutex; // Guards the vnode map, the vpath table and modifications of vnodes.
+
+        // Interned vpaths of the vnodes. Each vnode holds a reference to its vpath. Ancestors are kept as long as they
+        // have interned descendants. So the children of a vpath are the names having a vnode for the child vpath or
+        // for any of its descendants.
+        vpaths::vpath_table vpaths;
         seed_path_tracker seed_paths;
         hpfs::audit::audit_logger &logger;
 
@@ -32,24 +41,42 @@ namespace hpfs::vfs
         // (inclusive of log record).
         off_t log_scanned_upto = 0;
 
+        // Begin offset of the last log record that has been scanned for vfs buildup.
+        off_t last_scanned_record = 0;
+
+        // No. of log records applied since the last vfs snapshot.
+        size_t unsnapshotted_records = 0;
+
         int init();
+        vnode_map::iterator find_vnode(const std::string &vpath);
         void add_vnode(const std::string &vpath, vnode_map::iterator &vnode_iter);
+        bool insert_vnode(const std::string &vpath, vnode &&vn, vnode_map::iterator &vnode_iter);
+        void get_indexed_descendants(const vpaths::vpath_id id, std::vector<vpaths::vpath_id> &descendants);
         int add_vnode_from_seed(const std::string &vpath, vnode_map::iterator &vnode_iter);
-        int apply_log_record(const hpfs::audit::log_record &record, const std::vector<uint8_t> payload);
+        int apply_log_record(const hpfs::audit::log_record &record, const std::vector<uint8_t> &payload);
         int delete_vnode(vnode_map::iterator &vnode_iter);
+        void add_data_seg(vnode &vn, const vdata_segment &seg);
         int update_vnode_mmap(vnode &vn);
+        void clear_vnodes();
+        int load_snapshot();
+        void take_snapshot();
+        int persist_snapshot();
 
     public:
         static int create(std::optional<virtual_filesystem> &virt_fs, const bool readonly, std::string_view seed_dir,
-                          hpfs::audit::audit_logger &logger);
-        virtual_filesystem(const bool readonly, std::string_view seed_dir, hpfs::audit::audit_logger &logger);
+                          hpfs::audit::audit_logger &logger, const READ_ENGINE read_engine);
+        virtual_filesystem(const bool readonly, std::string_view seed_dir, hpfs::audit::audit_logger &logger,
+                           const READ_ENGINE read_engine);
         int get_vnode(const std::string &vpath, vnode **vn);
-        int build_vfs();
+        static void get_vnode_data_segs(const vnode &vn, const size_t size, const off_t offset,
+                                        std::vector<vdata_segment> &segs);
+        static int read_vnode_data(const vnode &vn, void *buf, const size_t size, const off_t offset);
+        int build_vfs(const off_t scan_upto = 0);
         int get_dir_children(const std::string &vpath, vdir_children_map &children);
-        void populate_block_buf_segs(std::vector<iovec> &block_buf_segs,
-                                     off_t &block_buf_start, off_t &block_buf_end,
-                                     const char *buf, const size_t wr_size,
-                                     const off_t wr_start, const size_t fsize, uint8_t *mmap_ptr);
+        int populate_block_buf_segs(std::vector<iovec> &block_buf_segs, std::vector<uint8_t> &ex_data_buf,
+                                    off_t &block_buf_start, off_t &block_buf_end,
+                                    const char *buf, const size_t wr_size,
+                                    const off_t wr_start, const vnode &vn);
         int apply_last_write_log_adjustment(vfs::vnode &vn, const off_t wr_offset, const size_t wr_size,
                                             const size_t block_size_increase);
         int re_build_vfs();
@@ -0,0 +1,225 @@
+#include <string>
+#include <string_view>
+#include <functional>
+#include "vpaths.hpp"
+
+namespace hpfs::vpaths
+{
+    size_t child_key_hash::operator()(const std::pair<vpath_id, std::string_view> &key) const
+    {
+        return std::hash<std::string_view>()(key.second) ^ (key.first * 0x9e3779b97f4a7c15);
+    }
+
+    vpath_table::vpath_table()
+    {
+        clear();
+    }
+
+    /**
+     * Returns the next non-empty component of the path starting from the given position and advances the position
+     * to the end of that component.
+     * @return The path component. Empty if there are no more components.
+     */
+    std::string_view vpath_table::next_component(std::string_view path, size_t &pos)
+    {
+        while (pos < path.size() && path[pos] == '/')
+            pos++;
+
+        const size_t start = pos;
+        while (pos < path.size() && path[pos] != '/')
+            pos++;
+
+        return path.substr(start, pos - start);
+    }
+
+    /**
+     * Looks up the id of an interned vpath.
+     * @return The vpath id. NO_VPATH_ID if the vpath is not interned.
+     */
+    vpath_id vpath_table::find(std::string_view vpath) const
+    {
+        vpath_id id = ROOT_VPATH_ID;
+        size_t pos = 0;
+        for (std::string_view name = next_component(vpath, pos); !name.empty() && id != NO_VPATH_ID; name = next_component(vpath, pos))
+            id = find_child(id, name);
+
+        return id;
+    }
+
+    vpath_id vpath_table::find_child(const vpath_id parent, std::string_view name) const
+    {
+        const auto iter = child_ids.find({parent, name});
+        return iter == child_ids.end() ? NO_VPATH_ID : iter->second;
+    }
+
+    /**
+     * Interns the vpath (if not already interned) and takes a reference to it. The reference must be released with
+     * release() when no longer needed.
+     * @return The vpath id.
+     */
+    vpath_id vpath_table::acquire(std::string_view vpath)
+    {
+        vpath_id id = ROOT_VPATH_ID;
+        size_t pos = 0;
+        for (std::string_view name = next_component(vpath, pos); !name.empty(); name = next_component(vpath, pos))
+        {
+            const vpath_id child_id = find_child(id, name);
+            id = child_id == NO_VPATH_ID ? add_child(id, name) : child_id;
+        }
+
+        add_ref(id);
+        return id;
+    }
+
+    vpath_id vpath_table::acquire_child(const vpath_id parent, std::string_view name)
+    {
+        const vpath_id child_id = find_child(parent, name);
+        const vpath_id id = child_id == NO_VPATH_ID ? add_child(parent, name) : child_id;
+        add_ref(id);
+        return id;
+    }
+
+    void vpath_table::add_ref(const vpath_id id)
+    {
+        if (id != ROOT_VPATH_ID) // Root is never released. So its references are not counted.
+            entries[id].refs++;
+    }
+
+    /**
+     * Releases a reference to the vpath. The vpath is removed when there are no more references to it. Ancestors which
+     * were only kept for the vpath are removed as well.
+     */
+    void vpath_table::release(const vpath_id id)
+    {
+        vpath_id release_id = id;
+        while (release_id != ROOT_VPATH_ID && --entries[release_id].refs == 0)
+        {
+            const vpath_id parent = entries[release_id].parent;
+            remove_entry(release_id);
+            release_id = parent; // The removed entry no longer refers to its parent.
+        }
+    }
+
+    vpath_id vpath_table::get_parent(const vpath_id id) const
+    {
+        return id == ROOT_VPATH_ID ? ROOT_VPATH_ID : entries[id].parent;
+    }
+
+    uint32_t vpath_table::get_depth(const vpath_id id) const
+    {
+        return entries[id].depth;
+    }
+
+    std::string_view vpath_table::get_name(const vpath_id id) const
+    {
+        return entries[id].name;
+    }
+
+    /**
+     * Builds the full vpath of the id.
+     */
+    const std::string vpath_table::get_path(const vpath_id id) const
+    {
+        if (id == ROOT_VPATH_ID)
+            return "/";
+
+        size_t len = 0;
+        for (vpath_id i = id; i != ROOT_VPATH_ID; i = entries[i].parent)
+            len += entries[i].name.size() + 1;
+
+        // Names are filled backwards from the end.
+        std::string vpath(len, '/');
+        for (vpath_id i = id; i != ROOT_VPATH_ID; i = entries[i].parent)
+        {
+            const std::string &name = entries[i].name;
+            len -= name.size();
+            vpath.replace(len, name.size(), name);
+            len--;
+        }
+
+        return vpath;
+    }
+
+    vpath_id vpath_table::get_first_child(const vpath_id id) const
+    {
+        return entries[id].first_child;
+    }
+
+    vpath_id vpath_table::get_next_sibling(const vpath_id id) const
+    {
+        return entries[id].next_sibling;
+    }
+
+    /**
+     * Checks whether the vpath is the tree root vpath or one of its descendants.
+     */
+    bool vpath_table::is_in_tree(const vpath_id id, const vpath_id tree_id) const
+    {
+        vpath_id i = id;
+        while (entries[i].depth > entries[tree_id].depth)
+            i = entries[i].parent;
+        return i == tree_id;
+    }
+
+    /**
+     * Removes all vpaths except the root. Ids held by the users become invalid.
+     */
+    void vpath_table::clear()
+    {
+        child_ids.clear();
+        free_ids.clear();
+        entries.clear();
+        entries.emplace_back(); // Root.
+    }
+
+    vpath_id vpath_table::add_child(const vpath_id parent, std::string_view name)
+    {
+        vpath_id id;
+        if (free_ids.empty())
+        {
+            id = entries.size();
+            entries.emplace_back();
+        }
+        else
+        {
+            id = free_ids.back();
+            free_ids.pop_back();
+        }
+
+        vpath_entry &entry = entries[id];
+        vpath_entry &parent_entry = entries[parent];
+        entry.name = name;
+        entry.parent = parent;
+        entry.depth = parent_entry.depth + 1;
+        entry.refs = 0;
+        entry.first_child = NO_VPATH_ID;
+        entry.prev_sibling = NO_VPATH_ID;
+        entry.next_sibling = parent_entry.first_child;
+        if (entry.next_sibling != NO_VPATH_ID)
+            entries[entry.next_sibling].prev_sibling = id;
+        parent_entry.first_child = id;
+        add_ref(parent);
+
+        child_ids.emplace(std::pair<vpath_id, std::string_view>(parent, entry.name), id);
+        return id;
+    }
+
+    void vpath_table::remove_entry(const vpath_id id)
+    {
+        vpath_entry &entry = entries[id];
+        child_ids.erase({entry.parent, entry.name});
+
+        if (entry.prev_sibling == NO_VPATH_ID)
+            entries[entry.parent].first_child = entry.next_sibling;
+        else
+            entries[entry.prev_sibling].next_sibling = entry.next_sibling;
+        if (entry.next_sibling != NO_VPATH_ID)
+            entries[entry.next_sibling].prev_sibling = entry.prev_sibling;
+
+        entry.name.clear();
+        entry.name.shrink_to_fit();
+        entry.parent = NO_VPATH_ID;
+        free_ids.push_back(id);
+    }
+
+} // namespace hpfs::vpaths
@@ -0,0 +1,74 @@
+#ifndef _HPFS_VPATHS_
+#define _HPFS_VPATHS_
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <stdint.h>
+
+namespace hpfs::vpaths
+{
+    typedef uint32_t vpath_id;
+    constexpr vpath_id ROOT_VPATH_ID = 0;       // Id of "/". Always interned.
+    constexpr vpath_id NO_VPATH_ID = UINT32_MAX; // Indicates a vpath which is not interned.
+
+    // An interned vpath component.
+    struct vpath_entry
+    {
+        std::string name;
+        vpath_id parent = NO_VPATH_ID;
+        uint32_t depth = 0;
+        uint32_t refs = 0;                     // No. of references held by the users plus the no. of child entries.
+        vpath_id first_child = NO_VPATH_ID;    // Child entries are kept in a doubly linked sibling list.
+        vpath_id prev_sibling = NO_VPATH_ID;
+        vpath_id next_sibling = NO_VPATH_ID;
+    };
+
+    struct child_key_hash
+    {
+        size_t operator()(const std::pair<vpath_id, std::string_view> &key) const;
+    };
+
+    /**
+     * Interns vpaths as trees of path components so vpaths can be referred to by small integer ids. Each entry only
+     * keeps its own name and its parent id. So the parent of a vpath is found without any string manipulation and
+     * the full vpath is only built when needed.
+     * Entries are reference counted. An entry (and the ancestors only kept for it) is removed when its last reference
+     * is released and its id gets reused.
+     * Lookups do not modify the table. So concurrent lookups are safe as long as modifications are guarded.
+     */
+    class vpath_table
+    {
+    private:
+        // Deque keeps the entries in place as it grows. So the lookup keys can refer to the entry names.
+        std::deque<vpath_entry> entries;
+        std::vector<vpath_id> free_ids;
+        std::unordered_map<std::pair<vpath_id, std::string_view>, vpath_id, child_key_hash> child_ids;
+
+        static std::string_view next_component(std::string_view path, size_t &pos);
+        vpath_id add_child(const vpath_id parent, std::string_view name);
+        void remove_entry(const vpath_id id);
+
+    public:
+        vpath_table();
+        vpath_id find(std::string_view vpath) const;
+        vpath_id find_child(const vpath_id parent, std::string_view name) const;
+        vpath_id acquire(std::string_view vpath);
+        vpath_id acquire_child(const vpath_id parent, std::string_view name);
+        void add_ref(const vpath_id id);
+        void release(const vpath_id id);
+        vpath_id get_parent(const vpath_id id) const;
+        uint32_t get_depth(const vpath_id id) const;
+        std::string_view get_name(const vpath_id id) const;
+        const std::string get_path(const vpath_id id) const;
+        vpath_id get_first_child(const vpath_id id) const;
+        vpath_id get_next_sibling(const vpath_id id) const;
+        bool is_in_tree(const vpath_id id, const vpath_id tree_id) const;
+        void clear();
+    };
+
+} // namespace hpfs::vpaths
+
+#endif
@@ -5,12 +5,15 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <string>
+#include <vector>
 #include <chrono>
 
 // Compile and run benchmark
 // g++ -std=c++17 -O3 -Wno-unused-result benchmark.cpp -o benchmark && ./benchmark
 
 constexpr uint64_t MAX_FILE_SIZE = 64 * 1024 * 1024;
+constexpr uint64_t LARGE_FILE_SIZE = 256 * 1024 * 1024;
+constexpr size_t LARGE_IO_SIZE = 1024 * 1024;
 constexpr mode_t DIR_PERMS = 0755;
 const std::string test_dir = "temp";
 const std::string hpfs_binary = "../build/hpfs";
@@ -19,6 +22,8 @@ bool op_hpfs = false;
 bool op_hmap_enabled = false;
 std::string op_dir;
 std::string op_title;
+std::string op_read_engine = "mmap";
+bool op_fuse_lowlevel = false;
 uint64_t op_start = 0;
 pid_t hpfs_pid = 0;
 
@@ -36,14 +41,17 @@ void start_hpfs(const char *mode, const bool hmap_enabled)
     if (pid == 0)
     {
         // Child (hpfs)
-        char *argv[] = {(char *)hpfs_binary.c_str(),
-                        (char *)"fs",
-                        (char *)test_dir.c_str(),
-                        (char *)mnt_dir.c_str(),
-                        (char *)"merge=true",
-                        (char *)"trace=none",
-                        NULL};
-        execv(hpfs_binary.c_str(), argv);
+        std::vector<const char *> argv = {hpfs_binary.c_str(),
+                                          "fs",
+                                          "-f", test_dir.c_str(),
+                                          "-m", mnt_dir.c_str(),
+                                          "--merge",
+                                          "--trace", "none",
+                                          "--read-engine", op_read_engine.c_str()};
+        if (op_fuse_lowlevel)
+            argv.push_back("--fuse-lowlevel");
+        argv.push_back(NULL);
+        execv(hpfs_binary.c_str(), (char **)argv.data());
     }
     else
     {
@@ -102,6 +110,8 @@ void finish_op()
     const uint64_t duration = op_end - op_start;
 
     std::cout << (op_hpfs ? (op_hmap_enabled ? "hpfs(hmap)" : "hpfs") : "raw")
+              << (op_hpfs && op_read_engine != "mmap" ? "(" + op_read_engine + ")" : "")
+              << (op_hpfs && op_fuse_lowlevel ? "(lowlevel)" : "")
               << ": " << duration << "ms\n";
 
     if (hpfs_pid > 0)
@@ -139,6 +149,35 @@ void benchmark_reads()
     close(fd);
 }
 
+void benchmark_large_file_writes()
+{
+    const std::string path = op_dir + "/largefile";
+    const int fd = open(path.c_str(), O_RDWR | O_CREAT, 0655);
+    std::string buf(LARGE_IO_SIZE, 'a');
+
+    for (uint64_t off = 0; off < LARGE_FILE_SIZE; off += LARGE_IO_SIZE)
+        pwrite(fd, buf.data(), buf.size(), off);
+    close(fd);
+}
+
+void benchmark_large_file_reads()
+{
+    const std::string path = op_dir + "/largefile";
+    const int fd = open(path.c_str(), O_RDONLY);
+    std::string buf(LARGE_IO_SIZE, 0);
+
+    // Sequential scan followed by random small reads all over the file.
+    for (uint64_t off = 0; off < LARGE_FILE_SIZE; off += LARGE_IO_SIZE)
+        pread(fd, buf.data(), buf.size(), off);
+
+    for (int i = 0; i < 5000; i++)
+    {
+        off_t off = rand() % LARGE_FILE_SIZE;
+        pread(fd, buf.data(), 4096, off);
+    }
+    close(fd);
+}
+
 void benchmark_file_creations()
 {
     const size_t fsize = 4096;
@@ -151,6 +190,34 @@ void benchmark_file_creations()
     }
 }
 
+void create_seed_files()
+{
+    // Files placed in the seed dir are what a completed merge leaves behind. So renaming them renames seed files.
+    init_test_dir();
+    const std::string seed_dir = test_dir + "/seed";
+    mkdir(seed_dir.c_str(), DIR_PERMS);
+
+    const size_t fsize = 4096;
+    for (int i = 0; i < 5000; i++)
+    {
+        const std::string path = seed_dir + "/file" + std::to_string(i);
+        const int fd = open(path.c_str(), O_RDWR | O_CREAT, 0655);
+        ftruncate(fd, fsize);
+        close(fd);
+    }
+}
+
+void benchmark_renames()
+{
+    // Every rename of a seed file makes hpfs resolve its seed path against all the renames done before it.
+    for (int i = 0; i < 5000; i++)
+    {
+        const std::string from = op_dir + "/file" + std::to_string(i);
+        const std::string to = op_dir + "/renamed" + std::to_string(i);
+        rename(from.c_str(), to.c_str());
+    }
+}
+
 int main(int argc, char **argv)
 {
     srand(1);
@@ -188,6 +255,35 @@ int main(int argc, char **argv)
     benchmark_reads();
     finish_op();
 
+    set_title("Large file reads");
+    for (const char *read_engine : {"mmap", "extent"})
+    {
+        op_read_engine = read_engine;
+        start_op(true, false);
+        benchmark_large_file_writes();
+        stop_hpfs();
+        start_op(true, false);
+        benchmark_large_file_reads();
+        finish_op();
+    }
+    op_read_engine = "mmap";
+
+    // Low-level frontend serves the reads by splicing the backing file segments.
+    op_fuse_lowlevel = true;
+    start_op(true, false);
+    benchmark_large_file_writes();
+    stop_hpfs();
+    start_op(true, false);
+    benchmark_large_file_reads();
+    finish_op();
+    op_fuse_lowlevel = false;
+
+    start_op(false, false);
+    benchmark_large_file_writes();
+    start_op(false, false);
+    benchmark_large_file_reads();
+    finish_op();
+
     set_title("File creations");
     start_op(true, false);
     benchmark_file_creations();
@@ -199,5 +295,17 @@ int main(int argc, char **argv)
     benchmark_file_creations();
     finish_op();
 
+    set_title("Seed file renames");
+    create_seed_files();
+    start_op(true, false);
+    benchmark_renames();
+    finish_op();
+
+    start_op(false, false);
+    benchmark_file_creations();
+    start_op(false, false);
+    benchmark_renames();
+    finish_op();
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,101 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include "../src/hmap/hasher.hpp"
+
+// Compile and run hashing micro benchmark
+// g++ -std=c++17 -O3 -Wno-unused-result hash_benchmark.cpp ../src/hmap/hasher.cpp -lblake3 -lpthread -o hash_benchmark && ./hash_benchmark
+
+using namespace hpfs::hmap;
+
+constexpr size_t SMALL_INPUT_COUNT = 1000000;
+constexpr size_t SMALL_INPUT_SIZE = 24; // Typical file name length.
+constexpr size_t BLOCK_COUNT = 64;
+constexpr size_t BLOCK_SIZE = 4 * 1024 * 1024; // Hash map file block size.
+
+int64_t get_epoch_microseconds()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void run(const std::string &title, const std::function<void()> &func)
+{
+    const int64_t start = get_epoch_microseconds();
+    func();
+    std::cout << title << ": " << (get_epoch_microseconds() - start) / 1000.0 << "ms\n";
+}
+
+void benchmark_inputs(const std::vector<uint8_t> &data, const size_t count, const size_t size)
+{
+    // Each input is an 8 byte prefix followed by the data, same as the file block hashes.
+    std::vector<uint8_t> prefixes(count * 8, 1);
+    std::vector<hasher::hash_input> inputs(count);
+    for (size_t i = 0; i < count; i++)
+        inputs[i] = hasher::hash_input{prefixes.data() + (i * 8), 8, data.data() + (i * size), size};
+
+    std::vector<hasher::h32> hashes(count), batch_hashes(count);
+    const size_t lanes = std::max(std::thread::hardware_concurrency(), 1U);
+
+    run("hash_buf", [&]() {
+        for (size_t i = 0; i < count; i++)
+            hasher::hash_buf(hashes[i], inputs[i].buf1, inputs[i].len1, inputs[i].buf2, inputs[i].len2);
+    });
+    run("hash_bufs(1 lane)", [&]() { hasher::hash_bufs(batch_hashes.data(), inputs.data(), count, 1); });
+    run("hash_bufs(" + std::to_string(lanes) + " lanes)", [&]() { hasher::hash_bufs(batch_hashes.data(), inputs.data(), count, lanes); });
+
+    if (hashes != batch_hashes)
+        std::cout << "Hash mismatch!\n";
+}
+
+void check_chunk_trees(std::vector<uint8_t> &data)
+{
+    // Block hash trees are hashed with our own blake3 tree hashing. So they are checked against the blake3 library hash
+    // after building a tree and after updating its last chunk.
+    uint8_t prefix[8] = {1, 1, 1, 1, 1, 1, 1, 1};
+    const size_t lens[] = {hasher::CHUNK_LEN + 1, 3 * hasher::CHUNK_LEN + 100, BLOCK_SIZE};
+    bool ok = true;
+
+    for (const size_t len : lens)
+    {
+        hasher::h32 tree_hash, lib_hash;
+        hasher::chunk_tree tree;
+        hasher::build_chunk_tree(tree_hash, tree, hasher::hash_input{prefix, sizeof(prefix), data.data(), len});
+        hasher::hash_buf(lib_hash, prefix, sizeof(prefix), data.data(), len);
+        ok &= (tree_hash == lib_hash);
+
+        // Change the bytes of the last chunk and update it. Chunks are counted over the prefixed input.
+        const size_t input_len = sizeof(prefix) + len;
+        const size_t first_chunk = (input_len - 1) / hasher::CHUNK_LEN;
+        const size_t offset = (first_chunk * hasher::CHUNK_LEN) - sizeof(prefix);
+        for (size_t i = offset; i < len; i++)
+            data[i]++;
+        hasher::update_chunk_tree(tree_hash, tree, first_chunk, data.data() + offset, len - offset);
+        hasher::hash_buf(lib_hash, prefix, sizeof(prefix), data.data(), len);
+        ok &= (tree_hash == lib_hash);
+    }
+
+    if (!ok)
+        std::cout << "Hash tree mismatch!\n";
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<uint8_t> data(std::max(SMALL_INPUT_COUNT * SMALL_INPUT_SIZE, BLOCK_COUNT * BLOCK_SIZE));
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = rand();
+
+    check_chunk_trees(data);
+
+    std::cout << "\nSmall inputs (" << SMALL_INPUT_COUNT << " x " << SMALL_INPUT_SIZE << " bytes)\n";
+    benchmark_inputs(data, SMALL_INPUT_COUNT, SMALL_INPUT_SIZE);
+
+    std::cout << "\nFile blocks (" << BLOCK_COUNT << " x " << BLOCK_SIZE << " bytes)\n";
+    benchmark_inputs(data, BLOCK_COUNT, BLOCK_SIZE);
+
+    return 0;
+}
@@ -16,7 +16,7 @@ echo "Create a seed text file with random text."
 tr -dc A-Za-z0-9 </dev/urandom | head -c 10240 > $fsdir/seed/sample.txt
 
 echo "Start hpfs process with merge support."
-./$hpfs fs $fsdir $mntdir merge=true trace=$trace &
+./$hpfs fs -f $fsdir -m $mntdir --merge --trace $trace &
 pid=$!
 sleep 1
 
@@ -70,5 +70,62 @@ echo "Reading seed/dir2_renamed/copied.txt"
 head -c 10 $fsdir/seed/dir2_renamed/copied.txt
 echo ""
 
+echo "Start hpfs process without merge support and with vfs snapshots."
+./$hpfs fs -f $fsdir -m $mntdir --trace dbg --vfs-snapshot-interval 1 > $fsdir/hpfs.log 2>&1 &
+pid=$!
+sleep 1
+
+echo "Perform some filesystem operations on a RW session and stop it."
+touch $mntdir/::hpfs.rw.hmap
+mkdir $rwdir/dir3
+head -c 10240 </dev/urandom > $rwdir/dir3/random.bin
+head -c 10240 </dev/urandom >> $rwdir/dir3/random.bin
+rm $mntdir/::hpfs.rw.hmap
+
+echo "Restart the RW session. It should be restored from the vfs snapshot."
+touch $mntdir/::hpfs.rw.hmap
+stat -c %s $rwdir/dir3/random.bin
+rm $mntdir/::hpfs.rw.hmap
+
+sleep 1
+kill $pid
+sleep 1
+
+if grep -q "VFS restored from snapshot" $fsdir/hpfs.log; then
+    echo "VFS snapshot was used."
+else
+    echo "VFS snapshot was NOT used."
+fi
+
+echo "Record a file which gets created and unlinked around a mkdir."
+./$hpfs fs -f $fsdir -m $mntdir --trace $trace &
+pid=$!
+sleep 1
+touch $mntdir/::hpfs.rw
+echo "data" > $rwdir/victim.txt
+mkdir $rwdir/blocker
+echo "more data" >> $rwdir/victim.txt
+rm $rwdir/victim.txt
+rm $mntdir/::hpfs.rw
+sleep 1
+kill $pid
+sleep 1
+
+echo "Make the mkdir fail to merge with a seed file at the same path. Then let it merge."
+touch $fsdir/seed/blocker
+./$hpfs fs -f $fsdir -m $mntdir --merge --trace $trace &
+pid=$!
+sleep 3
+rm $fsdir/seed/blocker
+sleep 3
+kill $pid
+sleep 1
+
+if [ -d $fsdir/seed/blocker ] && [ ! -e $fsdir/seed/victim.txt ]; then
+    echo "Log was merged after the merge failure."
+else
+    echo "Log was NOT merged after the merge failure."
+fi
+
 # Clean up test directory.
 rm -r ./testrun > /dev/null 2>&1
\ No newline at end of file